@@ -0,0 +1,76 @@
+#include "affinity.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Parses a CPU list in the format used by `taskset -c` and `/sys/devices/system/cpu/online`, e.g. "0-3,8,10-11".
+ * @param list
+ * @param cpus_ptr will point to a heap-allocated array of CPU numbers in the order they appear in the list
+ * @return the number of CPUs in the list; -1 if the list is malformed.
+ */
+int parse_cpu_list(const char* list, int** cpus_ptr) {
+  int* cpus = NULL;
+  int cpus_len = 0;
+
+  const char* cursor = list;
+  while (*cursor != '\0') {
+    char* endptr;
+    long first = strtol(cursor, &endptr, 10);
+    if (endptr == cursor || first < 0 || first >= CPU_SETSIZE) {
+      free(cpus);
+      return -1;
+    }
+
+    long last = first;
+    if (*endptr == '-') {
+      cursor = endptr + 1;
+      last = strtol(cursor, &endptr, 10);
+      if (endptr == cursor || last < first || last >= CPU_SETSIZE) {
+        free(cpus);
+        return -1;
+      }
+    }
+
+    cpus = realloc(cpus, (cpus_len + last - first + 1) * sizeof(int));
+    for (long cpu = first; cpu <= last; cpu++) {
+      cpus[cpus_len++] = (int)cpu;
+    }
+
+    if (*endptr == ',') {
+      endptr++;
+    } else if (*endptr != '\0') {
+      free(cpus);
+      return -1;
+    }
+    cursor = endptr;
+  }
+
+  if (cpus_len == 0) {
+    free(cpus);
+    return -1;
+  }
+
+  *cpus_ptr = cpus;
+  return cpus_len;
+}
+
+void cpu_list_to_set(const int* cpus, int cpus_len, cpu_set_t* set) {
+  CPU_ZERO(set);
+  for (int i = 0; i < cpus_len; i++) {
+    CPU_SET(cpus[i], set);
+  }
+}
+
+// Returns 0 on success, or an errno value on failure.
+int pin_current_thread(const cpu_set_t* set) {
+  return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), set);
+}
+
+// Returns 0 on success, or an errno value on failure.
+int pin_current_thread_to_cpu(int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pin_current_thread(&set);
+}
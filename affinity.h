@@ -0,0 +1,11 @@
+#ifndef HTTPS_PROXY_AFFINITY_H
+#define HTTPS_PROXY_AFFINITY_H
+
+#include <sched.h>
+
+int parse_cpu_list(const char* list, int** cpus_ptr);
+void cpu_list_to_set(const int* cpus, int cpus_len, cpu_set_t* set);
+int pin_current_thread(const cpu_set_t* set);
+int pin_current_thread_to_cpu(int cpu);
+
+#endif  // HTTPS_PROXY_AFFINITY_H
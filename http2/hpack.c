@@ -0,0 +1,476 @@
+#include "hpack.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_HEADERS_INITIAL_CAPACITY 16
+#define HPACK_ENTRIES_INITIAL_CAPACITY 16
+#define HUFFMAN_EOS 256
+#define HUFFMAN_MAX_CODE_LEN 30
+
+static const struct {
+  const char* name;
+  const char* value;
+} static_table[] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+#define STATIC_TABLE_LEN (sizeof(static_table) / sizeof(static_table[0]))
+
+/*
+ * The Huffman code of RFC 7541 Appendix B is canonical, so it is fully described by how many codes there are of
+ * each length and by the symbols ordered by code length (then by symbol).
+ */
+static const uint8_t huffman_code_len_counts[HUFFMAN_MAX_CODE_LEN + 1] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3, 0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4,
+};
+
+static const uint16_t huffman_symbols[] = {
+    48,  49,  50,  97,  99,  101, 105, 111, 115, 116, 32,  37,  45,  46,  47,  51,  52,  53,  54,  55,  56,  57,
+    61,  65,  95,  98,  100, 102, 103, 104, 108, 109, 110, 112, 114, 117, 58,  66,  67,  68,  69,  70,  71,  72,
+    73,  74,  75,  76,  77,  78,  79,  80,  81,  82,  83,  84,  85,  86,  87,  89,  106, 107, 113, 118, 119, 120,
+    121, 122, 38,  42,  44,  59,  88,  90,  33,  34,  40,  41,  63,  39,  43,  124, 35,  62,  0,   36,  64,  91,
+    93,  126, 94,  125, 60,  96,  123, 92,  195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172,
+    176, 177, 179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170,
+    173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232, 233, 1,   135, 137, 138, 139, 140, 141, 143, 147,
+    149, 150, 151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9,   142,
+    144, 145, 148, 159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193, 200, 201, 202, 205, 210, 213,
+    218, 219, 238, 240, 242, 243, 255, 203, 204, 211, 212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250,
+    251, 252, 253, 254, 2,   3,   4,   5,   6,   7,   8,   11,  12,  14,  15,  16,  17,  18,  19,  20,  21,  23,
+    24,  25,  26,  27,  28,  29,  30,  31,  127, 220, 249, 10,  13,  22,  256,
+};
+
+/**
+ * Decodes a Huffman-encoded string one bit at a time, walking the canonical code length by length.
+ * @param in
+ * @param len
+ * @param out
+ * @param out_capacity
+ * @return the length of the decoded string, or -1 if the string is invalid or doesn't fit
+ */
+ssize_t huffman_decode(const uint8_t* in, size_t len, char* out, size_t out_capacity) {
+  size_t n_decoded = 0;
+  // the bits of the current code read so far, and how many of them there are
+  unsigned int code = 0;
+  unsigned int code_len = 0;
+  // the first code of the current length, and the position of its symbol in `huffman_symbols`
+  unsigned int first = 0;
+  unsigned int index = 0;
+
+  for (size_t i = 0; i < len; i++) {
+    for (int bit = 7; bit >= 0; bit--) {
+      code = (code << 1) | ((in[i] >> bit) & 1);
+      code_len++;
+      first <<= 1;
+
+      unsigned int count = huffman_code_len_counts[code_len];
+      if (code - first < count) {
+        uint16_t symbol = huffman_symbols[index + code - first];
+        if (symbol == HUFFMAN_EOS || n_decoded >= out_capacity) {
+          return -1;
+        }
+        out[n_decoded++] = symbol;
+        code = code_len = first = index = 0;
+        continue;
+      }
+
+      first += count;
+      index += count;
+      if (code_len == HUFFMAN_MAX_CODE_LEN) {
+        return -1;
+      }
+    }
+  }
+
+  // the string must be padded with fewer than 8 bits of the EOS code, which are all ones
+  if (code_len > 7 || code != (1u << code_len) - 1) {
+    return -1;
+  }
+  return n_decoded;
+}
+
+void hpack_decoder_init(struct hpack_decoder* decoder, size_t max_size_limit) {
+  decoder->entries = NULL;
+  decoder->entries_capacity = 0;
+  decoder->first = 0;
+  decoder->len = 0;
+  decoder->size = 0;
+  decoder->max_size = max_size_limit;
+  decoder->max_size_limit = max_size_limit;
+
+  // only allocated once the peer sends headers
+  decoder->headers = NULL;
+  decoder->headers_capacity = 0;
+  decoder->strings = NULL;
+}
+
+void hpack_decoder_cleanup(struct hpack_decoder* decoder) {
+  for (size_t i = 0; i < decoder->len; i++) {
+    free(decoder->entries[(decoder->first + i) % decoder->entries_capacity].name);
+  }
+  free(decoder->entries);
+  free(decoder->headers);
+  free(decoder->strings);
+}
+
+// Returns the i-th newest entry of the dynamic table
+struct hpack_entry* dynamic_table_entry(struct hpack_decoder* decoder, size_t i) {
+  return &decoder->entries[(decoder->first + i) % decoder->entries_capacity];
+}
+
+void dynamic_table_evict(struct hpack_decoder* decoder, size_t max_size) {
+  while (decoder->size > max_size) {
+    struct hpack_entry* oldest = dynamic_table_entry(decoder, decoder->len - 1);
+    decoder->size -= oldest->name_len + oldest->value_len + HPACK_ENTRY_OVERHEAD;
+    free(oldest->name);
+    decoder->len--;
+  }
+}
+
+void dynamic_table_add(struct hpack_decoder* decoder, const struct hpack_header* header) {
+  size_t entry_size = header->name_len + header->value_len + HPACK_ENTRY_OVERHEAD;
+  if (entry_size > decoder->max_size) {
+    // an entry larger than the table empties it and isn't added
+    dynamic_table_evict(decoder, 0);
+    return;
+  }
+  dynamic_table_evict(decoder, decoder->max_size - entry_size);
+
+  if (decoder->len == decoder->entries_capacity) {
+    size_t new_capacity =
+        decoder->entries_capacity == 0 ? HPACK_ENTRIES_INITIAL_CAPACITY : decoder->entries_capacity * 2;
+    struct hpack_entry* new_entries = malloc(new_capacity * sizeof(struct hpack_entry));
+    for (size_t i = 0; i < decoder->len; i++) {
+      new_entries[i] = *dynamic_table_entry(decoder, i);
+    }
+    free(decoder->entries);
+    decoder->entries = new_entries;
+    decoder->entries_capacity = new_capacity;
+    decoder->first = 0;
+  }
+
+  decoder->first = (decoder->first + decoder->entries_capacity - 1) % decoder->entries_capacity;
+  decoder->len++;
+  decoder->size += entry_size;
+
+  struct hpack_entry* entry = dynamic_table_entry(decoder, 0);
+  entry->name = malloc(header->name_len + header->value_len + 1);
+  entry->name_len = header->name_len;
+  entry->value = entry->name + header->name_len;
+  entry->value_len = header->value_len;
+  memcpy(entry->name, header->name, header->name_len);
+  memcpy(entry->value, header->value, header->value_len);
+}
+
+// A read-only view into the header block
+struct hpack_cursor {
+  const uint8_t* pos;
+  const uint8_t* end;
+};
+
+// Decodes an integer whose first byte shares `prefix_bits` bits with the representation type (RFC 7541 Section 5.1)
+bool decode_integer(struct hpack_cursor* c, int prefix_bits, size_t* value) {
+  if (c->pos >= c->end) {
+    return false;
+  }
+
+  uint8_t max_prefix = (1 << prefix_bits) - 1;
+  *value = *c->pos++ & max_prefix;
+  if (*value < max_prefix) {
+    return true;
+  }
+
+  for (int shift = 0; c->pos < c->end; shift += 7) {
+    if (shift > 21) {
+      // nothing we accept is this large
+      return false;
+    }
+    uint8_t byte = *c->pos++;
+    *value += (size_t)(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Decodes a string literal into the decoder's `strings`.
+ * @param decoder
+ * @param c
+ * @param strings_len how much of `strings` is used, will be advanced past the string
+ * @param str will point to the string
+ * @param str_len
+ * @return whether the string is valid and fits into the header list limit
+ */
+bool decode_string(
+    struct hpack_decoder* decoder,
+    struct hpack_cursor* c,
+    size_t* strings_len,
+    const char** str,
+    size_t* str_len) {
+  if (c->pos >= c->end) {
+    return false;
+  }
+  bool huffman_encoded = (*c->pos & 0x80) != 0;
+
+  size_t len;
+  if (!decode_integer(c, 7, &len) || (size_t)(c->end - c->pos) < len) {
+    return false;
+  }
+
+  char* out = decoder->strings + *strings_len;
+  size_t out_capacity = HPACK_MAX_HEADER_LIST_SIZE - *strings_len;
+  if (huffman_encoded) {
+    ssize_t n_decoded = huffman_decode(c->pos, len, out, out_capacity);
+    if (n_decoded < 0) {
+      return false;
+    }
+    *str_len = n_decoded;
+  } else {
+    if (len > out_capacity) {
+      return false;
+    }
+    memcpy(out, c->pos, len);
+    *str_len = len;
+  }
+
+  c->pos += len;
+  *str = out;
+  *strings_len += *str_len;
+  return true;
+}
+
+/**
+ * Looks up an entry of the static or dynamic table, copying the name (and value) into the decoder's `strings`.
+ * @return whether the index is valid and the strings fit into the header list limit
+ */
+bool copy_indexed_header(
+    struct hpack_decoder* decoder,
+    size_t index,
+    bool with_value,
+    size_t* strings_len,
+    struct hpack_header* header) {
+  const char* name;
+  size_t name_len;
+  const char* value;
+  size_t value_len;
+
+  if (index == 0) {
+    return false;
+  } else if (index <= STATIC_TABLE_LEN) {
+    name = static_table[index - 1].name;
+    name_len = strlen(name);
+    value = static_table[index - 1].value;
+    value_len = strlen(value);
+  } else if (index - STATIC_TABLE_LEN <= decoder->len) {
+    struct hpack_entry* entry = dynamic_table_entry(decoder, index - STATIC_TABLE_LEN - 1);
+    name = entry->name;
+    name_len = entry->name_len;
+    value = entry->value;
+    value_len = entry->value_len;
+  } else {
+    return false;
+  }
+
+  if (!with_value) {
+    value_len = 0;
+  }
+  if (name_len + value_len > HPACK_MAX_HEADER_LIST_SIZE - *strings_len) {
+    return false;
+  }
+
+  // copy, since the entry may be evicted by a later representation of the same block
+  char* out = decoder->strings + *strings_len;
+  memcpy(out, name, name_len);
+  memcpy(out + name_len, value, value_len);
+  header->name = out;
+  header->name_len = name_len;
+  header->value = out + name_len;
+  header->value_len = value_len;
+  *strings_len += name_len + value_len;
+  return true;
+}
+
+/**
+ * Decodes a complete header block (RFC 7541 Section 6), updating the dynamic table.
+ * A failure leaves the dynamic table out of sync with the peer, so the connection can't be used anymore.
+ * @param decoder
+ * @param block
+ * @param len
+ * @param headers will point to the decoded header list, which is valid until the next call
+ * @return the number of headers, or -1 if the block is malformed or too large
+ */
+ssize_t hpack_decode(struct hpack_decoder* decoder, const uint8_t* block, size_t len, struct hpack_header** headers) {
+  if (decoder->strings == NULL) {
+    decoder->strings = malloc(HPACK_MAX_HEADER_LIST_SIZE);
+    decoder->headers_capacity = HPACK_HEADERS_INITIAL_CAPACITY;
+    decoder->headers = malloc(decoder->headers_capacity * sizeof(struct hpack_header));
+  }
+
+  struct hpack_cursor c = {.pos = block, .end = block + len};
+  size_t n_headers = 0;
+  size_t strings_len = 0;
+  size_t list_size = 0;
+
+  while (c.pos < c.end) {
+    uint8_t first_byte = *c.pos;
+
+    if ((first_byte & 0xe0) == 0x20) {
+      // dynamic table size update, only allowed at the start of a block
+      size_t max_size;
+      if (n_headers > 0 || !decode_integer(&c, 5, &max_size) || max_size > decoder->max_size_limit) {
+        return -1;
+      }
+      decoder->max_size = max_size;
+      dynamic_table_evict(decoder, max_size);
+      continue;
+    }
+
+    if (n_headers == decoder->headers_capacity) {
+      decoder->headers_capacity *= 2;
+      decoder->headers = realloc(decoder->headers, decoder->headers_capacity * sizeof(struct hpack_header));
+    }
+    struct hpack_header* header = &decoder->headers[n_headers];
+
+    size_t index;
+    if (first_byte & 0x80) {
+      // indexed header field
+      if (!decode_integer(&c, 7, &index) || !copy_indexed_header(decoder, index, true, &strings_len, header)) {
+        return -1;
+      }
+    } else {
+      // literal header field, with incremental indexing or not
+      bool add_to_table = (first_byte & 0xc0) == 0x40;
+      if (!decode_integer(&c, add_to_table ? 6 : 4, &index)) {
+        return -1;
+      }
+      if (index == 0) {
+        if (!decode_string(decoder, &c, &strings_len, &header->name, &header->name_len)) {
+          return -1;
+        }
+      } else if (!copy_indexed_header(decoder, index, false, &strings_len, header)) {
+        return -1;
+      }
+      if (!decode_string(decoder, &c, &strings_len, &header->value, &header->value_len)) {
+        return -1;
+      }
+      if (add_to_table) {
+        dynamic_table_add(decoder, header);
+      }
+    }
+
+    list_size += header->name_len + header->value_len + HPACK_ENTRY_OVERHEAD;
+    if (list_size > HPACK_MAX_HEADER_LIST_SIZE) {
+      return -1;
+    }
+    n_headers++;
+  }
+
+  *headers = decoder->headers;
+  return n_headers;
+}
+
+size_t hpack_max_encoded_len(const struct hpack_header* header) {
+  // the representation type, then each string with a length of at most 5 bytes
+  return 1 + 5 + header->name_len + 5 + header->value_len;
+}
+
+size_t encode_integer(uint8_t* out, uint8_t first_byte, int prefix_bits, size_t value) {
+  uint8_t max_prefix = (1 << prefix_bits) - 1;
+  if (value < max_prefix) {
+    out[0] = first_byte | value;
+    return 1;
+  }
+
+  out[0] = first_byte | max_prefix;
+  value -= max_prefix;
+  size_t n_bytes = 1;
+  for (; value >= 0x80; value >>= 7) {
+    out[n_bytes++] = 0x80 | (value & 0x7f);
+  }
+  out[n_bytes++] = value;
+  return n_bytes;
+}
+
+size_t encode_string(uint8_t* out, const char* str, size_t len) {
+  size_t n_bytes = encode_integer(out, 0x00, 7, len);
+  memcpy(out + n_bytes, str, len);
+  return n_bytes + len;
+}
+
+/**
+ * Encodes a header as a literal without indexing and without Huffman coding, so that the peer's decoder state never
+ * depends on ours. The few headers we send are not worth compressing.
+ * @param out must have room for `hpack_max_encoded_len(header)` bytes
+ * @param header
+ * @return the number of bytes written
+ */
+size_t hpack_encode(uint8_t* out, const struct hpack_header* header) {
+  size_t n_bytes = 0;
+  out[n_bytes++] = 0x00;
+  n_bytes += encode_string(out + n_bytes, header->name, header->name_len);
+  n_bytes += encode_string(out + n_bytes, header->value, header->value_len);
+  return n_bytes;
+}
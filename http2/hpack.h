@@ -0,0 +1,58 @@
+#ifndef HTTPS_PROXY_HPACK_H
+#define HTTPS_PROXY_HPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// the largest header list we are willing to decode, advertised as SETTINGS_MAX_HEADER_LIST_SIZE
+#define HPACK_MAX_HEADER_LIST_SIZE 16384
+// the size of the dynamic table we let the peer's encoder use, which is also the protocol's default
+#define HPACK_DEFAULT_TABLE_SIZE 4096
+
+// A decoded header field; the strings are not null-terminated
+struct hpack_header {
+  const char* name;
+  size_t name_len;
+  const char* value;
+  size_t value_len;
+};
+
+// An entry of the dynamic table, name and value share one allocation
+struct hpack_entry {
+  char* name;
+  size_t name_len;
+  char* value;
+  size_t value_len;
+};
+
+/**
+ * Decoding state of one direction of an HTTP/2 connection (RFC 7541).
+ * The dynamic table is a ring of entries with the newest entry at `first`.
+ */
+struct hpack_decoder {
+  struct hpack_entry* entries;
+  size_t entries_capacity;
+  size_t first;
+  size_t len;
+  // size of the table as defined by the RFC, i.e., including 32 bytes of overhead per entry
+  size_t size;
+  // the limit last chosen by the encoder, which may not exceed `max_size_limit`
+  size_t max_size;
+  size_t max_size_limit;
+
+  // the header list of the most recently decoded block, its strings are stored in `strings`
+  struct hpack_header* headers;
+  size_t headers_capacity;
+  char* strings;
+};
+
+void hpack_decoder_init(struct hpack_decoder* decoder, size_t max_size_limit);
+void hpack_decoder_cleanup(struct hpack_decoder* decoder);
+
+ssize_t hpack_decode(struct hpack_decoder* decoder, const uint8_t* block, size_t len, struct hpack_header** headers);
+
+size_t hpack_max_encoded_len(const struct hpack_header* header);
+size_t hpack_encode(uint8_t* out, const struct hpack_header* header);
+
+#endif  // HTTPS_PROXY_HPACK_H
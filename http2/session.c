@@ -0,0 +1,1041 @@
+#include "session.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "../log.h"
+#include "../poll.h"
+#include "../util.h"
+
+#define H2_MAX_STREAM_ID 0x7fffffff
+#define H2_SETTING_LEN 6
+// We give the connection as a whole a large window and replenish it as soon as data arrives:
+// the per-stream windows already bound how much each stream can buffer.
+#define H2_CONNECTION_WINDOW_SIZE (1024 * 1024)
+#define H2_IN_CAPACITY (H2_FRAME_HEADER_LEN + H2_DEFAULT_MAX_FRAME_SIZE)
+#define H2_STREAMS_INITIAL_CAPACITY 16
+// don't hold on to an output buffer that grew larger than this once it's flushed
+#define H2_OUT_KEEP_CAPACITY (64 * 1024)
+
+void put_uint32(char* out, uint32_t value) {
+  out[0] = value >> 24;
+  out[1] = value >> 16;
+  out[2] = value >> 8;
+  out[3] = value;
+}
+
+uint32_t get_uint32(const char* in) {
+  const uint8_t* bytes = (const uint8_t*)in;
+  return (uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 | (uint32_t)bytes[2] << 8 | bytes[3];
+}
+
+// Stream table
+
+size_t stream_slot(struct h2_session* s, uint32_t id) {
+  // stream ids of one side are either all odd or all even
+  return (id >> 1) & (s->streams_capacity - 1);
+}
+
+// Whether the stream was (or would be) opened by us rather than by the peer
+bool is_local_stream(struct h2_session* s, uint32_t id) {
+  // clients open odd-numbered streams, servers even-numbered ones
+  return (id % 2 == 1) != s->server;
+}
+
+struct h2_stream* find_stream(struct h2_session* s, uint32_t id) {
+  for (struct h2_stream* stream = s->streams[stream_slot(s, id)]; stream != NULL; stream = stream->next) {
+    if (stream->id == id) {
+      return stream;
+    }
+  }
+  return NULL;
+}
+
+void insert_stream(struct h2_session* s, struct h2_stream* stream) {
+  if (s->streams_len >= s->streams_capacity) {
+    struct h2_stream** old_streams = s->streams;
+    size_t old_capacity = s->streams_capacity;
+    s->streams_capacity *= 2;
+    s->streams = calloc(s->streams_capacity, sizeof(struct h2_stream*));
+    for (size_t i = 0; i < old_capacity; i++) {
+      struct h2_stream* entry = old_streams[i];
+      while (entry != NULL) {
+        struct h2_stream* next = entry->next;
+        size_t slot = stream_slot(s, entry->id);
+        entry->next = s->streams[slot];
+        s->streams[slot] = entry;
+        entry = next;
+      }
+    }
+    free(old_streams);
+  }
+
+  size_t slot = stream_slot(s, stream->id);
+  stream->next = s->streams[slot];
+  s->streams[slot] = stream;
+  s->streams_len++;
+}
+
+void remove_stream(struct h2_session* s, struct h2_stream* stream) {
+  for (struct h2_stream** link = &s->streams[stream_slot(s, stream->id)]; *link != NULL; link = &(*link)->next) {
+    if (*link == stream) {
+      *link = stream->next;
+      s->streams_len--;
+      return;
+    }
+  }
+}
+
+// Returns the ids of all open streams, so that callbacks may close streams while we go through them
+uint32_t* list_stream_ids(struct h2_session* s, size_t* n_ids) {
+  uint32_t* ids = malloc((s->streams_len + 1) * sizeof(uint32_t));
+  *n_ids = 0;
+  for (size_t i = 0; i < s->streams_capacity; i++) {
+    for (struct h2_stream* stream = s->streams[i]; stream != NULL; stream = stream->next) {
+      ids[(*n_ids)++] = stream->id;
+    }
+  }
+  return ids;
+}
+
+// Output
+
+void handle_session_writability(struct poll* p, struct h2_session* s);
+void teardown_session(struct poll* p, struct h2_session* s, uint32_t error_code, const char* reason);
+
+void abort_session(struct poll* p, struct h2_session* s) {
+  teardown_session(p, s, H2_INTERNAL_ERROR, "failed to wait for writability");
+}
+
+void schedule_flush(struct poll* p, struct h2_session* s) {
+  if (s->writing || s->closed) {
+    return;
+  }
+
+  if (poll_wait_for_writability(
+          p, s->socket_dup, s, true, false, POLL_PRIORITY_SETUP, (poll_callback)handle_session_writability) < 0) {
+    char* error_desc = errno2s(errno);
+    LOG("failed to wait on HTTP/2 session with %s for writability: %s", s->peer_hostport, error_desc);
+    free(error_desc);
+
+    // Our callers may be in the middle of using the session's streams, tear it down once they're done
+    if (poll_add_timer(p, 0, s, (poll_callback)abort_session) == NULL) {
+      die("failed to add timer to tear down HTTP/2 session");
+    }
+  }
+  s->writing = true;
+}
+
+// Appends `len` bytes to `out` and returns where they go
+char* reserve_out(struct h2_session* s, size_t len) {
+  if (s->out_len + len > s->out_capacity) {
+    while (s->out_len + len > s->out_capacity) {
+      s->out_capacity = s->out_capacity == 0 ? H2_OUT_KEEP_CAPACITY : s->out_capacity * 2;
+    }
+    s->out = realloc(s->out, s->out_capacity);
+  }
+
+  char* reserved = s->out + s->out_len;
+  s->out_len += len;
+  return reserved;
+}
+
+// Appends a frame to `out` and returns where its payload goes
+char* queue_frame(struct poll* p, struct h2_session* s, uint8_t type, uint8_t flags, uint32_t stream_id, size_t len) {
+  char* header = reserve_out(s, H2_FRAME_HEADER_LEN + len);
+  header[0] = len >> 16;
+  header[1] = len >> 8;
+  header[2] = len;
+  header[3] = type;
+  header[4] = flags;
+  put_uint32(header + 5, stream_id);
+
+  schedule_flush(p, s);
+  return header + H2_FRAME_HEADER_LEN;
+}
+
+void queue_rst_stream(struct poll* p, struct h2_session* s, uint32_t stream_id, uint32_t error_code) {
+  put_uint32(queue_frame(p, s, H2_RST_STREAM, 0, stream_id, 4), error_code);
+}
+
+void queue_window_update(struct poll* p, struct h2_session* s, uint32_t stream_id, uint32_t increment) {
+  put_uint32(queue_frame(p, s, H2_WINDOW_UPDATE, 0, stream_id, 4), increment);
+}
+
+void queue_goaway(struct poll* p, struct h2_session* s, uint32_t error_code) {
+  char* payload = queue_frame(p, s, H2_GOAWAY, 0, 0, 8);
+  put_uint32(payload, s->last_peer_stream_id);
+  put_uint32(payload + 4, error_code);
+}
+
+void put_setting(char* out, uint16_t id, uint32_t value) {
+  out[0] = id >> 8;
+  out[1] = id;
+  put_uint32(out + 2, value);
+}
+
+// Splits a header block into a HEADERS frame and as many CONTINUATION frames as needed
+void queue_header_block(
+    struct poll* p,
+    struct h2_session* s,
+    uint32_t stream_id,
+    const uint8_t* block,
+    size_t len,
+    bool end_stream) {
+  uint8_t type = H2_HEADERS;
+  uint8_t flags = end_stream ? H2_FLAG_END_STREAM : 0;
+  do {
+    size_t n_bytes = len < s->peer_max_frame_size ? len : s->peer_max_frame_size;
+    if (n_bytes == len) {
+      flags |= H2_FLAG_END_HEADERS;
+    }
+    memcpy(queue_frame(p, s, type, flags, stream_id, n_bytes), block, n_bytes);
+    block += n_bytes;
+    len -= n_bytes;
+    type = H2_CONTINUATION;
+    flags = 0;
+  } while (len > 0);
+}
+
+void queue_headers(
+    struct poll* p,
+    struct h2_session* s,
+    uint32_t stream_id,
+    const struct hpack_header* headers,
+    size_t n_headers,
+    bool end_stream) {
+  size_t block_capacity = 0;
+  for (size_t i = 0; i < n_headers; i++) {
+    block_capacity += hpack_max_encoded_len(&headers[i]);
+  }
+  uint8_t* block = malloc(block_capacity);
+  size_t block_len = 0;
+  for (size_t i = 0; i < n_headers; i++) {
+    block_len += hpack_encode(block + block_len, &headers[i]);
+  }
+  queue_header_block(p, s, stream_id, block, block_len, end_stream);
+  free(block);
+}
+
+void flush_session(struct poll* p, struct h2_session* s) {
+  while (s->out_sent < s->out_len) {
+    ssize_t n_bytes_sent = send(s->socket_dup, s->out + s->out_sent, s->out_len - s->out_sent, MSG_NOSIGNAL);
+    if (n_bytes_sent < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        schedule_flush(p, s);
+        return;
+      }
+
+      char* error_desc = errno2s(errno);
+      char* reason = hsprintf("write error: %s", error_desc);
+      teardown_session(p, s, H2_NO_ERROR, reason);
+      free(reason);
+      free(error_desc);
+      return;
+    }
+    s->out_sent += n_bytes_sent;
+  }
+
+  DEBUG_LOG("flushed %zu bytes to HTTP/2 peer %s", s->out_sent, s->peer_hostport);
+  s->out_len = s->out_sent = 0;
+  if (s->out_capacity > H2_OUT_KEEP_CAPACITY) {
+    free(s->out);
+    s->out = NULL;
+    s->out_capacity = 0;
+  }
+}
+
+void handle_session_writability(struct poll* p, struct h2_session* s) {
+  s->writing = false;
+  if (s->closed) {
+    return;
+  }
+
+  if (s->connecting) {
+    int err;
+    socklen_t err_len = sizeof(err);
+    if (getsockopt(s->socket, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0) {
+      err = errno;
+    }
+    if (err != 0) {
+      char* error_desc = errno2s(err);
+      char* reason = hsprintf("failed to connect: %s", error_desc);
+      teardown_session(p, s, H2_NO_ERROR, reason);
+      free(reason);
+      free(error_desc);
+      return;
+    }
+
+    s->connecting = false;
+    LOG("connected to HTTP/2 peer %s", s->peer_hostport);
+  }
+
+  flush_session(p, s);
+}
+
+// Teardown
+
+void free_session(struct poll* p, struct h2_session* s) {
+  (void)p;
+  hpack_decoder_cleanup(&s->decoder);
+  free(s->in);
+  free(s->out);
+  free(s->header_block);
+  free(s->streams);
+  free(s->peer_hostport);
+  free(s);
+}
+
+/**
+ * Resets all streams and closes the connection.
+ * The session is only freed after the current round of events, since other events of this round may refer to it.
+ */
+void teardown_session(struct poll* p, struct h2_session* s, uint32_t error_code, const char* reason) {
+  if (s->closed) {
+    return;
+  }
+
+  (void)reason;  // only logged
+  LOG("HTTP/2 session with %s closed: %s", s->peer_hostport, reason);
+
+  if (!s->connecting) {
+    // let the peer know why, and get out what's still queued, if it's willing to read it right away
+    if (error_code != H2_NO_ERROR) {
+      queue_goaway(p, s, error_code);
+    }
+    send(s->socket_dup, s->out + s->out_sent, s->out_len - s->out_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+  }
+  s->closed = true;
+
+  for (size_t i = 0; i < s->streams_capacity; i++) {
+    while (s->streams[i] != NULL) {
+      struct h2_stream* stream = s->streams[i];
+      remove_stream(s, stream);
+      s->callbacks->on_reset(p, stream, H2_CANCEL);
+      free(stream);
+    }
+  }
+  s->callbacks->on_closed(p, s);
+
+  shutdown(s->socket, SHUT_RDWR);
+  close(s->socket_dup);
+  close(s->socket);
+
+  if (poll_add_timer(p, 0, s, (poll_callback)free_session) == NULL) {
+    LOG("failed to add timer to free HTTP/2 session with %s, leaking it", s->peer_hostport);
+  }
+}
+
+void reset_stream(struct poll* p, struct h2_stream* stream, uint32_t error_code) {
+  struct h2_session* s = stream->session;
+  queue_rst_stream(p, s, stream->id, error_code);
+  remove_stream(s, stream);
+  s->callbacks->on_reset(p, stream, error_code);
+  free(stream);
+}
+
+void notify_send_window(struct poll* p, struct h2_session* s, uint32_t stream_id) {
+  struct h2_stream* stream = find_stream(s, stream_id);
+  if (stream != NULL && h2_stream_send_capacity(stream) > 0) {
+    s->callbacks->on_send_window(p, stream);
+  }
+}
+
+void notify_send_window_all(struct poll* p, struct h2_session* s) {
+  size_t n_ids;
+  uint32_t* ids = list_stream_ids(s, &n_ids);
+  for (size_t i = 0; i < n_ids && !s->closed; i++) {
+    notify_send_window(p, s, ids[i]);
+  }
+  free(ids);
+}
+
+// Input
+
+void handle_data_frame(
+    struct poll* p,
+    struct h2_session* s,
+    uint8_t flags,
+    uint32_t stream_id,
+    const char* payload,
+    size_t len) {
+  if (stream_id == 0) {
+    teardown_session(p, s, H2_PROTOCOL_ERROR, "DATA frame on stream 0");
+    return;
+  }
+
+  s->recv_window -= len;
+  if (s->recv_window < 0) {
+    teardown_session(p, s, H2_FLOW_CONTROL_ERROR, "connection receive window exceeded");
+    return;
+  }
+  if (s->recv_window <= H2_CONNECTION_WINDOW_SIZE / 2) {
+    queue_window_update(p, s, 0, H2_CONNECTION_WINDOW_SIZE - s->recv_window);
+    s->recv_window = H2_CONNECTION_WINDOW_SIZE;
+  }
+
+  const char* data = payload;
+  size_t data_len = len;
+  size_t padding_len = 0;
+  if (flags & H2_FLAG_PADDED) {
+    if (len < 1 || (uint8_t)payload[0] >= len) {
+      teardown_session(p, s, H2_PROTOCOL_ERROR, "invalid padding");
+      return;
+    }
+    padding_len = 1 + (uint8_t)payload[0];
+    data++;
+    data_len -= padding_len;
+  }
+
+  struct h2_stream* stream = find_stream(s, stream_id);
+  if (stream == NULL || stream->end_stream_received) {
+    // the stream was closed by us, the peer may not have noticed yet
+    return;
+  }
+
+  stream->recv_window -= len;
+  if (stream->recv_window < 0) {
+    reset_stream(p, stream, H2_FLOW_CONTROL_ERROR);
+    return;
+  }
+  // padding never reaches the user, so it's consumed right away
+  h2_stream_consumed(p, stream, padding_len);
+
+  bool end_stream = flags & H2_FLAG_END_STREAM;
+  if (end_stream) {
+    stream->end_stream_received = true;
+  }
+  s->callbacks->on_data(p, stream, data, data_len, end_stream);
+}
+
+struct h2_stream* create_stream(struct h2_session* s, uint32_t id, void* data) {
+  struct h2_stream* stream = calloc(1, sizeof(struct h2_stream));
+  stream->id = id;
+  stream->session = s;
+  stream->data = data;
+  stream->send_window = s->peer_initial_window;
+  stream->recv_window = s->stream_window;
+  insert_stream(s, stream);
+  return stream;
+}
+
+// Opens a stream the peer started with its HEADERS, or refuses it; the user picks it up in `on_headers`
+struct h2_stream* accept_stream(struct poll* p, struct h2_session* s, uint32_t id) {
+  if (!s->server) {
+    // servers may only open streams with PUSH_PROMISE, which we disabled
+    return NULL;
+  }
+
+  // streams the peer skipped over are implicitly closed (RFC 9113 Section 5.1.1)
+  s->last_peer_stream_id = id;
+  if (s->going_away || s->streams_len >= s->max_concurrent_streams) {
+    queue_rst_stream(p, s, id, H2_REFUSED_STREAM);
+    return NULL;
+  }
+  return create_stream(s, id, NULL);
+}
+
+void finish_header_block(struct poll* p, struct h2_session* s) {
+  uint32_t stream_id = s->header_stream_id;
+  s->header_stream_id = 0;
+
+  // decode even if the stream is gone, to keep the dynamic table in sync
+  struct hpack_header* headers;
+  ssize_t n_headers = hpack_decode(&s->decoder, (uint8_t*)s->header_block, s->header_block_len, &headers);
+  if (n_headers < 0) {
+    teardown_session(p, s, H2_COMPRESSION_ERROR, "malformed header block");
+    return;
+  }
+
+  struct h2_stream* stream = find_stream(s, stream_id);
+  if (stream == NULL && !is_local_stream(s, stream_id) && stream_id > s->last_peer_stream_id) {
+    stream = accept_stream(p, s, stream_id);
+  }
+  if (stream == NULL || stream->end_stream_received) {
+    return;
+  }
+
+  if (s->header_end_stream) {
+    stream->end_stream_received = true;
+  }
+  s->callbacks->on_headers(p, stream, headers, n_headers, s->header_end_stream);
+}
+
+void append_header_fragment(struct poll* p, struct h2_session* s, uint8_t flags, const char* fragment, size_t len) {
+  if (s->header_block_len + len > HPACK_MAX_HEADER_LIST_SIZE) {
+    teardown_session(p, s, H2_PROTOCOL_ERROR, "header block too large");
+    return;
+  }
+  if (s->header_block_len + len > s->header_block_capacity) {
+    s->header_block_capacity = HPACK_MAX_HEADER_LIST_SIZE;
+    s->header_block = realloc(s->header_block, s->header_block_capacity);
+  }
+  memcpy(s->header_block + s->header_block_len, fragment, len);
+  s->header_block_len += len;
+
+  if (flags & H2_FLAG_END_HEADERS) {
+    finish_header_block(p, s);
+  }
+}
+
+void handle_headers_frame(
+    struct poll* p,
+    struct h2_session* s,
+    uint8_t flags,
+    uint32_t stream_id,
+    const char* payload,
+    size_t len) {
+  if (stream_id == 0) {
+    teardown_session(p, s, H2_PROTOCOL_ERROR, "HEADERS frame on stream 0");
+    return;
+  }
+
+  const char* fragment = payload;
+  size_t fragment_len = len;
+  if (flags & H2_FLAG_PADDED) {
+    if (len < 1 || (uint8_t)payload[0] > len - 1) {
+      teardown_session(p, s, H2_PROTOCOL_ERROR, "invalid padding");
+      return;
+    }
+    fragment++;
+    fragment_len -= 1 + (uint8_t)payload[0];
+  }
+  if (flags & H2_FLAG_PRIORITY) {
+    // stream dependency and weight, which we ignore
+    if (fragment_len < 5) {
+      teardown_session(p, s, H2_PROTOCOL_ERROR, "HEADERS frame too short");
+      return;
+    }
+    fragment += 5;
+    fragment_len -= 5;
+  }
+
+  s->header_stream_id = stream_id;
+  s->header_end_stream = flags & H2_FLAG_END_STREAM;
+  s->header_block_len = 0;
+  append_header_fragment(p, s, flags, fragment, fragment_len);
+}
+
+void handle_settings_frame(struct poll* p, struct h2_session* s, uint8_t flags, const char* payload, size_t len) {
+  if (flags & H2_FLAG_ACK) {
+    return;
+  }
+  if (len % H2_SETTING_LEN != 0) {
+    teardown_session(p, s, H2_FRAME_SIZE_ERROR, "invalid SETTINGS frame length");
+    return;
+  }
+
+  bool window_grew = false;
+  for (size_t i = 0; i < len; i += H2_SETTING_LEN) {
+    uint16_t id = (uint8_t)payload[i] << 8 | (uint8_t)payload[i + 1];
+    uint32_t value = get_uint32(payload + i + 2);
+
+    switch (id) {
+      case H2_SETTINGS_MAX_CONCURRENT_STREAMS:
+        s->peer_max_concurrent_streams = value;
+        break;
+      case H2_SETTINGS_INITIAL_WINDOW_SIZE: {
+        if (value > H2_MAX_WINDOW_SIZE) {
+          teardown_session(p, s, H2_FLOW_CONTROL_ERROR, "initial window size too large");
+          return;
+        }
+        // the change applies to the windows of all open streams
+        int64_t delta = (int64_t)value - s->peer_initial_window;
+        for (size_t slot = 0; slot < s->streams_capacity; slot++) {
+          for (struct h2_stream* stream = s->streams[slot]; stream != NULL; stream = stream->next) {
+            stream->send_window += delta;
+          }
+        }
+        s->peer_initial_window = value;
+        window_grew = window_grew || delta > 0;
+        break;
+      }
+      case H2_SETTINGS_MAX_FRAME_SIZE:
+        if (value < H2_DEFAULT_MAX_FRAME_SIZE || value > H2_MAX_MAX_FRAME_SIZE) {
+          teardown_session(p, s, H2_PROTOCOL_ERROR, "invalid max frame size");
+          return;
+        }
+        s->peer_max_frame_size = value;
+        break;
+      default:
+        // our encoder doesn't use the dynamic table, and the rest doesn't concern us
+        break;
+    }
+  }
+
+  queue_frame(p, s, H2_SETTINGS, H2_FLAG_ACK, 0, 0);
+  if (window_grew) {
+    notify_send_window_all(p, s);
+  }
+}
+
+void handle_goaway_frame(struct poll* p, struct h2_session* s, const char* payload, size_t len) {
+  if (len < 8) {
+    teardown_session(p, s, H2_FRAME_SIZE_ERROR, "GOAWAY frame too short");
+    return;
+  }
+
+  uint32_t last_stream_id = get_uint32(payload) & H2_MAX_STREAM_ID;
+  uint32_t error_code = get_uint32(payload + 4);
+  (void)error_code;  // only logged
+  LOG("HTTP/2 peer %s is going away (error code %u, last stream %u)", s->peer_hostport, error_code, last_stream_id);
+  s->going_away = true;
+
+  // the peer will never process streams after the last one, let their users know
+  size_t n_ids;
+  uint32_t* ids = list_stream_ids(s, &n_ids);
+  for (size_t i = 0; i < n_ids; i++) {
+    struct h2_stream* stream = find_stream(s, ids[i]);
+    if (stream != NULL && is_local_stream(s, stream->id) && stream->id > last_stream_id) {
+      remove_stream(s, stream);
+      s->callbacks->on_reset(p, stream, H2_REFUSED_STREAM);
+      free(stream);
+    }
+  }
+  free(ids);
+
+  if (s->streams_len == 0) {
+    teardown_session(p, s, H2_NO_ERROR, "went away");
+  }
+}
+
+void handle_window_update_frame(
+    struct poll* p,
+    struct h2_session* s,
+    uint32_t stream_id,
+    const char* payload,
+    size_t len) {
+  if (len != 4) {
+    teardown_session(p, s, H2_FRAME_SIZE_ERROR, "invalid WINDOW_UPDATE frame length");
+    return;
+  }
+  uint32_t increment = get_uint32(payload) & H2_MAX_WINDOW_SIZE;
+
+  if (stream_id == 0) {
+    s->send_window += increment;
+    if (increment == 0 || s->send_window > H2_MAX_WINDOW_SIZE) {
+      teardown_session(p, s, H2_FLOW_CONTROL_ERROR, "invalid connection window update");
+      return;
+    }
+    notify_send_window_all(p, s);
+    return;
+  }
+
+  struct h2_stream* stream = find_stream(s, stream_id);
+  if (stream == NULL) {
+    return;
+  }
+  stream->send_window += increment;
+  if (increment == 0 || stream->send_window > H2_MAX_WINDOW_SIZE) {
+    reset_stream(p, stream, H2_FLOW_CONTROL_ERROR);
+    return;
+  }
+  notify_send_window(p, s, stream_id);
+}
+
+void handle_frame(
+    struct poll* p,
+    struct h2_session* s,
+    uint8_t type,
+    uint8_t flags,
+    uint32_t stream_id,
+    const char* payload,
+    size_t len) {
+  if (s->header_stream_id != 0 && (type != H2_CONTINUATION || stream_id != s->header_stream_id)) {
+    teardown_session(p, s, H2_PROTOCOL_ERROR, "expected CONTINUATION frame");
+    return;
+  }
+
+  switch (type) {
+    case H2_DATA:
+      handle_data_frame(p, s, flags, stream_id, payload, len);
+      break;
+    case H2_HEADERS:
+      handle_headers_frame(p, s, flags, stream_id, payload, len);
+      break;
+    case H2_CONTINUATION:
+      if (s->header_stream_id == 0) {
+        teardown_session(p, s, H2_PROTOCOL_ERROR, "unexpected CONTINUATION frame");
+        return;
+      }
+      append_header_fragment(p, s, flags, payload, len);
+      break;
+    case H2_RST_STREAM: {
+      if (len != 4) {
+        teardown_session(p, s, H2_FRAME_SIZE_ERROR, "invalid RST_STREAM frame length");
+        return;
+      }
+      struct h2_stream* stream = find_stream(s, stream_id);
+      if (stream != NULL) {
+        remove_stream(s, stream);
+        s->callbacks->on_reset(p, stream, get_uint32(payload));
+        free(stream);
+      }
+      break;
+    }
+    case H2_SETTINGS:
+      if (stream_id != 0) {
+        teardown_session(p, s, H2_PROTOCOL_ERROR, "SETTINGS frame on a stream");
+        return;
+      }
+      handle_settings_frame(p, s, flags, payload, len);
+      break;
+    case H2_PUSH_PROMISE:
+      teardown_session(p, s, H2_PROTOCOL_ERROR, "push is disabled");
+      break;
+    case H2_PING:
+      if (len != 8) {
+        teardown_session(p, s, H2_FRAME_SIZE_ERROR, "invalid PING frame length");
+        return;
+      }
+      if (!(flags & H2_FLAG_ACK)) {
+        memcpy(queue_frame(p, s, H2_PING, H2_FLAG_ACK, 0, len), payload, len);
+      }
+      break;
+    case H2_GOAWAY:
+      handle_goaway_frame(p, s, payload, len);
+      break;
+    case H2_WINDOW_UPDATE:
+      handle_window_update_frame(p, s, stream_id, payload, len);
+      break;
+    default:
+      // PRIORITY and unknown frame types are ignored
+      break;
+  }
+}
+
+// Handles all the whole frames in `in`
+void process_input(struct poll* p, struct h2_session* s) {
+  size_t pos = 0;
+  if (s->awaiting_preface) {
+    size_t n_bytes = s->in_len < H2_CLIENT_PREFACE_LEN ? s->in_len : H2_CLIENT_PREFACE_LEN;
+    if (memcmp(s->in, H2_CLIENT_PREFACE, n_bytes) != 0) {
+      teardown_session(p, s, H2_PROTOCOL_ERROR, "invalid client preface");
+      return;
+    }
+    if (n_bytes < H2_CLIENT_PREFACE_LEN) {
+      return;
+    }
+    s->awaiting_preface = false;
+    pos = H2_CLIENT_PREFACE_LEN;
+  }
+
+  while (!s->closed && s->in_len - pos >= H2_FRAME_HEADER_LEN) {
+    const uint8_t* header = (const uint8_t*)s->in + pos;
+    size_t len = header[0] << 16 | header[1] << 8 | header[2];
+    if (len > H2_DEFAULT_MAX_FRAME_SIZE) {
+      teardown_session(p, s, H2_FRAME_SIZE_ERROR, "frame too large");
+      return;
+    }
+    if (s->in_len - pos - H2_FRAME_HEADER_LEN < len) {
+      break;
+    }
+
+    uint32_t stream_id = get_uint32((const char*)header + 5) & H2_MAX_STREAM_ID;
+    handle_frame(p, s, header[3], header[4], stream_id, s->in + pos + H2_FRAME_HEADER_LEN, len);
+    pos += H2_FRAME_HEADER_LEN + len;
+  }
+
+  if (!s->closed) {
+    // keep the partial frame for the next read
+    memmove(s->in, s->in + pos, s->in_len - pos);
+    s->in_len -= pos;
+  }
+}
+
+void handle_session_readability(struct poll* p, struct h2_session* s) {
+  if (s->closed) {
+    return;
+  }
+
+  ssize_t n_bytes_read = read(s->socket, s->in + s->in_len, H2_IN_CAPACITY - s->in_len);
+  if (n_bytes_read == 0) {
+    teardown_session(p, s, H2_NO_ERROR, "closed by peer");
+    return;
+  } else if (n_bytes_read < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return;
+    }
+
+    char* error_desc = errno2s(errno);
+    char* reason = hsprintf("read error: %s", error_desc);
+    teardown_session(p, s, H2_NO_ERROR, reason);
+    free(reason);
+    free(error_desc);
+    return;
+  }
+  s->in_len += n_bytes_read;
+  process_input(p, s);
+}
+
+// Sets up what client and server sessions have in common, or returns NULL if the socket can't be dupped
+struct h2_session* create_session(
+    int socket,
+    const char* peer_hostport,
+    uint32_t stream_window,
+    const struct h2_session_callbacks* callbacks,
+    void* data) {
+  int socket_dup = dup(socket);
+  if (socket_dup < 0) {
+    return NULL;
+  }
+
+  struct h2_session* s = calloc(1, sizeof(struct h2_session));
+  s->socket = socket;
+  s->socket_dup = socket_dup;
+  s->peer_hostport = strdup(peer_hostport);
+  s->callbacks = callbacks;
+  s->data = data;
+
+  // we wait for writability in `start_session`, to learn when the connection is established or to send our settings
+  s->writing = true;
+
+  s->in = malloc(H2_IN_CAPACITY);
+  hpack_decoder_init(&s->decoder, HPACK_DEFAULT_TABLE_SIZE);
+
+  s->stream_window = stream_window;
+  s->peer_max_frame_size = H2_DEFAULT_MAX_FRAME_SIZE;
+  s->peer_initial_window = H2_DEFAULT_WINDOW_SIZE;
+  // unlimited until the peer's settings arrive
+  s->peer_max_concurrent_streams = UINT32_MAX;
+  s->send_window = H2_DEFAULT_WINDOW_SIZE;
+  s->recv_window = H2_CONNECTION_WINDOW_SIZE;
+
+  s->streams_capacity = H2_STREAMS_INITIAL_CAPACITY;
+  s->streams = calloc(s->streams_capacity, sizeof(struct h2_stream*));
+  return s;
+}
+
+// Starts waiting on the session's socket; frees the session (but leaves `socket` open) if that fails
+bool start_session(struct poll* p, struct h2_session* s) {
+  // the connection window is larger than the default that applies until then
+  queue_window_update(p, s, 0, H2_CONNECTION_WINDOW_SIZE - H2_DEFAULT_WINDOW_SIZE);
+
+  if (poll_wait_for_readability(
+          p, s->socket, s, false, false, POLL_PRIORITY_SETUP, (poll_callback)handle_session_readability) < 0 ||
+      poll_wait_for_writability(
+          p, s->socket_dup, s, true, false, POLL_PRIORITY_SETUP, (poll_callback)handle_session_writability) < 0) {
+    close(s->socket_dup);
+    free_session(p, s);
+    return false;
+  }
+  return true;
+}
+
+// Public interface
+
+/**
+ * Starts an HTTP/2 session over a socket that is connecting to a server (with prior knowledge, RFC 9113 Section 3.3).
+ * The preface and our settings are sent once the connection is established.
+ * @param p
+ * @param socket a non-blocking socket on which `connect` is in progress or done; owned by the session on success
+ * @param peer_hostport for logging
+ * @param stream_window the receive window of each stream, i.e., how much data we can buffer per stream
+ * @param callbacks
+ * @param data
+ * @return the session, or NULL if it could not be set up
+ */
+struct h2_session* h2_session_create_client(
+    struct poll* p,
+    int socket,
+    const char* peer_hostport,
+    uint32_t stream_window,
+    const struct h2_session_callbacks* callbacks,
+    void* data) {
+  struct h2_session* s = create_session(socket, peer_hostport, stream_window, callbacks, data);
+  if (s == NULL) {
+    return NULL;
+  }
+  s->connecting = true;
+  s->next_stream_id = 1;
+
+  memcpy(reserve_out(s, H2_CLIENT_PREFACE_LEN), H2_CLIENT_PREFACE, H2_CLIENT_PREFACE_LEN);
+
+  char* settings = queue_frame(p, s, H2_SETTINGS, 0, 0, 3 * H2_SETTING_LEN);
+  put_setting(settings, H2_SETTINGS_ENABLE_PUSH, 0);
+  put_setting(settings + H2_SETTING_LEN, H2_SETTINGS_INITIAL_WINDOW_SIZE, stream_window);
+  put_setting(settings + 2 * H2_SETTING_LEN, H2_SETTINGS_MAX_HEADER_LIST_SIZE, HPACK_MAX_HEADER_LIST_SIZE);
+
+  return start_session(p, s) ? s : NULL;
+}
+
+/**
+ * Starts an HTTP/2 session over an accepted socket whose client started with the preface (prior knowledge).
+ * The bytes received so far are handled right away, so callbacks may be called before this returns.
+ * @param p
+ * @param socket a connected non-blocking socket; owned by the session on success
+ * @param peer_hostport for logging
+ * @param stream_window the receive window of each stream, i.e., how much data we can buffer per stream
+ * @param max_concurrent_streams how many streams the client may open at once
+ * @param callbacks
+ * @param data
+ * @param received what was read from the socket so far, starting with (a part of) the client preface
+ * @param received_len
+ * @return the session, or NULL if it could not be set up
+ */
+struct h2_session* h2_session_create_server(
+    struct poll* p,
+    int socket,
+    const char* peer_hostport,
+    uint32_t stream_window,
+    uint32_t max_concurrent_streams,
+    const struct h2_session_callbacks* callbacks,
+    void* data,
+    const char* received,
+    size_t received_len) {
+  if (received_len > H2_IN_CAPACITY) {
+    errno = EMSGSIZE;
+    return NULL;
+  }
+
+  struct h2_session* s = create_session(socket, peer_hostport, stream_window, callbacks, data);
+  if (s == NULL) {
+    return NULL;
+  }
+  s->server = true;
+  s->awaiting_preface = true;
+  s->next_stream_id = 2;
+  s->max_concurrent_streams = max_concurrent_streams;
+
+  char* settings = queue_frame(p, s, H2_SETTINGS, 0, 0, 3 * H2_SETTING_LEN);
+  put_setting(settings, H2_SETTINGS_MAX_CONCURRENT_STREAMS, max_concurrent_streams);
+  put_setting(settings + H2_SETTING_LEN, H2_SETTINGS_INITIAL_WINDOW_SIZE, stream_window);
+  put_setting(settings + 2 * H2_SETTING_LEN, H2_SETTINGS_MAX_HEADER_LIST_SIZE, HPACK_MAX_HEADER_LIST_SIZE);
+
+  if (!start_session(p, s)) {
+    return NULL;
+  }
+
+  memcpy(s->in, received, received_len);
+  s->in_len = received_len;
+  process_input(p, s);
+  return s;
+}
+
+bool h2_session_can_open_stream(struct h2_session* s) {
+  return !s->closed && !s->going_away && s->streams_len < s->peer_max_concurrent_streams &&
+         s->next_stream_id <= H2_MAX_STREAM_ID;
+}
+
+/**
+ * Sends a request on a new stream.
+ * @return the stream, or NULL if the session can't take any more streams
+ */
+struct h2_stream* h2_session_open_stream(
+    struct poll* p,
+    struct h2_session* s,
+    const struct hpack_header* headers,
+    size_t n_headers,
+    void* data) {
+  if (!h2_session_can_open_stream(s)) {
+    return NULL;
+  }
+
+  struct h2_stream* stream = create_stream(s, s->next_stream_id, data);
+  s->next_stream_id += 2;
+  queue_headers(p, s, stream->id, headers, n_headers, false);
+
+  return stream;
+}
+
+/**
+ * Sends headers on the stream, e.g., the response to a request the peer sent on it.
+ * @param p
+ * @param stream
+ * @param headers
+ * @param n_headers
+ * @param end_stream whether the stream ends with them, i.e., no data follows
+ */
+void h2_stream_send_headers(
+    struct poll* p,
+    struct h2_stream* stream,
+    const struct hpack_header* headers,
+    size_t n_headers,
+    bool end_stream) {
+  queue_headers(p, stream->session, stream->id, headers, n_headers, end_stream);
+  if (end_stream) {
+    stream->end_stream_sent = true;
+  }
+}
+
+// Returns how many bytes may be sent on the stream right now
+size_t h2_stream_send_capacity(struct h2_stream* stream) {
+  struct h2_session* s = stream->session;
+  if (s->closed || stream->end_stream_sent) {
+    return 0;
+  }
+
+  int64_t capacity = stream->send_window < s->send_window ? stream->send_window : s->send_window;
+  return capacity > 0 ? capacity : 0;
+}
+
+/**
+ * Queues data on the stream, splitting it into frames as needed.
+ * @param p
+ * @param stream
+ * @param data
+ * @param len must not exceed `h2_stream_send_capacity`
+ * @param end_stream whether this is the last data on the stream
+ */
+void h2_stream_send_data(struct poll* p, struct h2_stream* stream, const char* data, size_t len, bool end_stream) {
+  struct h2_session* s = stream->session;
+  do {
+    size_t n_bytes = len < s->peer_max_frame_size ? len : s->peer_max_frame_size;
+    uint8_t flags = n_bytes == len && end_stream ? H2_FLAG_END_STREAM : 0;
+    char* payload = queue_frame(p, s, H2_DATA, flags, stream->id, n_bytes);
+    if (n_bytes > 0) {
+      memcpy(payload, data, n_bytes);
+    }
+    data += n_bytes;
+    len -= n_bytes;
+    stream->send_window -= n_bytes;
+    s->send_window -= n_bytes;
+  } while (len > 0);
+
+  if (end_stream) {
+    stream->end_stream_sent = true;
+  }
+}
+
+// Gives `len` bytes of receive window back to the peer, once the received data no longer takes up buffer space
+void h2_stream_consumed(struct poll* p, struct h2_stream* stream, size_t len) {
+  if (len == 0 || stream->end_stream_received || stream->session->closed) {
+    return;
+  }
+  stream->recv_window += len;
+  queue_window_update(p, stream->session, stream->id, len);
+}
+
+/**
+ * Tells the peer that no more streams will be opened, in either direction, and closes the connection as soon as the
+ * open streams are done.
+ */
+void h2_session_go_away(struct poll* p, struct h2_session* s) {
+  if (s->closed) {
+    return;
+  }
+
+  s->going_away = true;
+  if (!s->connecting) {
+    queue_goaway(p, s, H2_NO_ERROR);
+  }
+  if (s->streams_len == 0) {
+    teardown_session(p, s, H2_NO_ERROR, "going away");
+  }
+}
+
+// Frees the stream, resetting it unless it ended normally in both directions
+void h2_stream_close(struct poll* p, struct h2_stream* stream) {
+  struct h2_session* s = stream->session;
+  if (!s->closed && !(stream->end_stream_sent && stream->end_stream_received)) {
+    // once we've said all we have to say, the peer may simply stop sending (RFC 9113 Section 8.1)
+    queue_rst_stream(p, s, stream->id, stream->end_stream_sent ? H2_NO_ERROR : H2_CANCEL);
+  }
+  remove_stream(s, stream);
+  free(stream);
+
+  if (s->going_away && s->streams_len == 0) {
+    teardown_session(p, s, H2_NO_ERROR, "went away");
+  }
+}
@@ -0,0 +1,210 @@
+#ifndef HTTPS_PROXY_HTTP2_SESSION_H
+#define HTTPS_PROXY_HTTP2_SESSION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "hpack.h"
+
+#define H2_CLIENT_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_CLIENT_PREFACE_LEN (sizeof(H2_CLIENT_PREFACE) - 1)
+#define H2_FRAME_HEADER_LEN 9
+#define H2_DEFAULT_WINDOW_SIZE 65535
+#define H2_MAX_WINDOW_SIZE 0x7fffffff
+#define H2_DEFAULT_MAX_FRAME_SIZE 16384
+#define H2_MAX_MAX_FRAME_SIZE 16777215
+
+enum h2_frame_type {
+  H2_DATA = 0x0,
+  H2_HEADERS = 0x1,
+  H2_PRIORITY = 0x2,
+  H2_RST_STREAM = 0x3,
+  H2_SETTINGS = 0x4,
+  H2_PUSH_PROMISE = 0x5,
+  H2_PING = 0x6,
+  H2_GOAWAY = 0x7,
+  H2_WINDOW_UPDATE = 0x8,
+  H2_CONTINUATION = 0x9,
+};
+
+enum h2_frame_flag {
+  H2_FLAG_END_STREAM = 0x1,
+  H2_FLAG_ACK = 0x1,
+  H2_FLAG_END_HEADERS = 0x4,
+  H2_FLAG_PADDED = 0x8,
+  H2_FLAG_PRIORITY = 0x20,
+};
+
+enum h2_setting {
+  H2_SETTINGS_HEADER_TABLE_SIZE = 0x1,
+  H2_SETTINGS_ENABLE_PUSH = 0x2,
+  H2_SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+  H2_SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+  H2_SETTINGS_MAX_FRAME_SIZE = 0x5,
+  H2_SETTINGS_MAX_HEADER_LIST_SIZE = 0x6,
+};
+
+enum h2_error_code {
+  H2_NO_ERROR = 0x0,
+  H2_PROTOCOL_ERROR = 0x1,
+  H2_INTERNAL_ERROR = 0x2,
+  H2_FLOW_CONTROL_ERROR = 0x3,
+  H2_STREAM_CLOSED = 0x5,
+  H2_FRAME_SIZE_ERROR = 0x6,
+  H2_REFUSED_STREAM = 0x7,
+  H2_CANCEL = 0x8,
+  H2_COMPRESSION_ERROR = 0x9,
+};
+
+struct poll;
+struct h2_session;
+
+struct h2_stream {
+  uint32_t id;
+  struct h2_session* session;
+  // owned by the user of the session
+  void* data;
+
+  // how many bytes we may still send, i.e., the peer's receive window for this stream
+  int64_t send_window;
+  // how many bytes the peer may still send us
+  int64_t recv_window;
+
+  bool end_stream_sent;
+  bool end_stream_received;
+
+  // next stream in the same slot of the session's stream table
+  struct h2_stream* next;
+};
+
+/**
+ * How a session reports events to its user.
+ * On a server session, `on_headers` also announces streams opened by the peer: their `data` is NULL on that first call,
+ * and the user either sets it or closes the stream right away.
+ * A stream is freed by the session right after `on_reset`, and every stream is reset before `on_closed` is called,
+ * so the user must drop its references to them there.
+ * Otherwise, streams live until the user closes them with `h2_stream_close`.
+ */
+struct h2_session_callbacks {
+  void (*on_headers)(
+      struct poll* p,
+      struct h2_stream* stream,
+      const struct hpack_header* headers,
+      size_t n_headers,
+      bool end_stream);
+  // Data received on the stream, which never exceeds the receive window given to the peer
+  void (*on_data)(struct poll* p, struct h2_stream* stream, const char* data, size_t len, bool end_stream);
+  // More data may be sent on the stream
+  void (*on_send_window)(struct poll* p, struct h2_stream* stream);
+  void (*on_reset)(struct poll* p, struct h2_stream* stream, uint32_t error_code);
+  void (*on_closed)(struct poll* p, struct h2_session* session);
+};
+
+/**
+ * An HTTP/2 connection (RFC 9113) and its streams.
+ * Like a tunnel, it reads from `socket` and writes to `socket_dup`, so that both can be waited for separately.
+ * Frames are queued in `out` and written once the socket is writable, which batches all the frames that are queued
+ * while handling one round of events.
+ */
+struct h2_session {
+  int socket;
+  int socket_dup;
+  // for logging
+  char* peer_hostport;
+  const struct h2_session_callbacks* callbacks;
+  void* data;
+
+  // accepts streams from the peer instead of opening them
+  bool server;
+  // a server session that hasn't received the whole client preface yet
+  bool awaiting_preface;
+  // waiting for a non-blocking connect to complete
+  bool connecting;
+  // waiting for writability to flush `out`
+  bool writing;
+  // no new streams, since either side sent GOAWAY
+  bool going_away;
+  // torn down, waiting to be freed
+  bool closed;
+
+  // received bytes that don't make up a whole frame yet
+  char* in;
+  size_t in_len;
+
+  // a header block that continues in CONTINUATION frames, `header_stream_id` is 0 if there is none
+  char* header_block;
+  size_t header_block_len;
+  size_t header_block_capacity;
+  uint32_t header_stream_id;
+  bool header_end_stream;
+  struct hpack_decoder decoder;
+
+  // frames to be sent
+  char* out;
+  size_t out_len;
+  size_t out_sent;
+  size_t out_capacity;
+
+  // the receive window we give each stream
+  uint32_t stream_window;
+
+  // the peer's settings
+  uint32_t peer_max_frame_size;
+  uint32_t peer_initial_window;
+  uint32_t peer_max_concurrent_streams;
+
+  // connection-level flow control
+  int64_t send_window;
+  int64_t recv_window;
+
+  // open streams, hashed by id
+  struct h2_stream** streams;
+  size_t streams_capacity;
+  size_t streams_len;
+  uint32_t next_stream_id;
+  // the highest id of a stream opened by the peer
+  uint32_t last_peer_stream_id;
+  // how many streams the peer may open at once
+  uint32_t max_concurrent_streams;
+};
+
+struct h2_session* h2_session_create_client(
+    struct poll* p,
+    int socket,
+    const char* peer_hostport,
+    uint32_t stream_window,
+    const struct h2_session_callbacks* callbacks,
+    void* data);
+
+struct h2_session* h2_session_create_server(
+    struct poll* p,
+    int socket,
+    const char* peer_hostport,
+    uint32_t stream_window,
+    uint32_t max_concurrent_streams,
+    const struct h2_session_callbacks* callbacks,
+    void* data,
+    const char* received,
+    size_t received_len);
+
+bool h2_session_can_open_stream(struct h2_session* session);
+void h2_session_go_away(struct poll* p, struct h2_session* session);
+
+struct h2_stream* h2_session_open_stream(
+    struct poll* p,
+    struct h2_session* session,
+    const struct hpack_header* headers,
+    size_t n_headers,
+    void* data);
+
+void h2_stream_send_headers(
+    struct poll* p,
+    struct h2_stream* stream,
+    const struct hpack_header* headers,
+    size_t n_headers,
+    bool end_stream);
+size_t h2_stream_send_capacity(struct h2_stream* stream);
+void h2_stream_send_data(struct poll* p, struct h2_stream* stream, const char* data, size_t len, bool end_stream);
+void h2_stream_consumed(struct poll* p, struct h2_stream* stream, size_t len);
+void h2_stream_close(struct poll* p, struct h2_stream* stream);
+
+#endif  // HTTPS_PROXY_HTTP2_SESSION_H
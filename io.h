@@ -0,0 +1,59 @@
+#ifndef HTTPS_PROXY_IO_H
+#define HTTPS_PROXY_IO_H
+
+/**
+ * The system calls the event loop and the connection state machine make, so that a benchmark can swap them for an
+ * in-memory fake by building with -DFAKE_IO and linking its own definitions. Otherwise, they are the calls themselves.
+ */
+
+#ifdef FAKE_IO
+
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+
+int io_accept4(int listening_socket, struct sockaddr* addr, socklen_t* addrlen, int flags);
+int io_socket(int domain, int type, int protocol);
+int io_connect(int sock, const struct sockaddr* addr, socklen_t addrlen);
+int io_getpeername(int sock, struct sockaddr* addr, socklen_t* addrlen);
+ssize_t io_read(int fd, void* buf, size_t len);
+ssize_t io_send(int sock, const void* buf, size_t len, int flags);
+int io_recvmmsg(int sock, struct mmsghdr* msgs, unsigned int vlen, int flags, struct timespec* timeout);
+int io_sendmmsg(int sock, struct mmsghdr* msgs, unsigned int vlen, int flags);
+int io_shutdown(int sock, int how);
+int io_dup(int fd);
+int io_close(int fd);
+
+int io_epoll_create1(int flags);
+int io_epoll_ctl(int epoll_fd, int op, int fd, struct epoll_event* event);
+int io_epoll_wait(int epoll_fd, struct epoll_event* events, int max_events, int timeout_ms);
+
+int io_resolve(const char* node, const char* service, const struct addrinfo* hints);
+int io_resolve_result(int fd, struct addrinfo** addrs);
+
+#else
+
+#define io_accept4 accept4
+#define io_socket socket
+#define io_connect connect
+#define io_getpeername getpeername
+#define io_read read
+#define io_send send
+#define io_recvmmsg recvmmsg
+#define io_sendmmsg sendmmsg
+#define io_shutdown shutdown
+#define io_dup dup
+#define io_close close
+
+#define io_epoll_create1 epoll_create1
+#define io_epoll_ctl epoll_ctl
+#define io_epoll_wait epoll_wait
+
+#define io_resolve asyncaddrinfo_resolve
+#define io_resolve_result asyncaddrinfo_result
+
+#endif
+
+#endif  // HTTPS_PROXY_IO_H
@@ -87,7 +87,10 @@ void asyncaddrinfo_cleanup() {
 
 int asyncaddrinfo_resolve(const char *node, const char *service, const struct addrinfo *hints) {
   int fds[2];
-  assert(!socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds));
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds)) {
+    // e.g., out of file descriptors
+    return -1;
+  }
 
   struct asyncaddrinfo_resolution* res = malloc(sizeof(*res));
   assert(res);
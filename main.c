@@ -1,27 +1,61 @@
 #include <arpa/inet.h>
 #include <errno.h>
-#include <pthread.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/epoll.h>
 #include <unistd.h>
+#include "affinity.h"
 #include "lib/asyncaddrinfo/asyncaddrinfo.h"
 #include "log.h"
 #include "poll.h"
+#include "proxy/loop_stats.h"
 #include "proxy/proxy_server.h"
 #include "util.h"
 
 #define CONNECT_BACKLOG 512
+// how long the kernel holds on to a new connection until the client sends something
+#define DEFER_ACCEPT_SECONDS 5
 #define DEFAULT_THREAD_COUNT 8
 #define MAX_BLOCKLIST_LEN 100
-
-int create_bind_listen(unsigned short port) {
+#define DEFAULT_PARENT_CONNECTIONS 2
+#define DEFAULT_DRAIN_TIMEOUT_SECONDS 60
+
+/**
+ * @param port
+ * @param incoming_cpu if non-negative, the socket joins an SO_REUSEPORT group and the kernel will prefer it for
+ * connections whose packets are processed on this CPU
+ * @return the listening socket
+ */
+int create_bind_listen(unsigned short port, int incoming_cpu) {
   int listening_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
   if (listening_socket < 0) {
     die(hsprintf("failed to create listening socket: %s", errno2s(errno)));
   }
 
+  if (incoming_cpu >= 0) {
+    int enable = 1;
+    if (setsockopt(listening_socket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0) {
+      die(hsprintf("failed to set SO_REUSEPORT on listening socket: %s", errno2s(errno)));
+    }
+    if (setsockopt(listening_socket, SOL_SOCKET, SO_INCOMING_CPU, &incoming_cpu, sizeof(incoming_cpu)) < 0) {
+      die(hsprintf("failed to set SO_INCOMING_CPU on listening socket: %s", errno2s(errno)));
+    }
+  }
+
+  // Clients speak first, so hold connections back until their CONNECT request or ClientHello arrives.
+  // The first read then rarely has to wait. Best effort, as it only saves a wakeup.
+  int defer_accept_seconds = DEFER_ACCEPT_SECONDS;
+  if (setsockopt(
+          listening_socket, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept_seconds, sizeof(defer_accept_seconds)) < 0) {
+    char* error_desc = errno2s(errno);
+    LOG("failed to set TCP_DEFER_ACCEPT on listening socket: %s", error_desc);
+    free(error_desc);
+  }
+
   struct sockaddr_in listen_addr;
   listen_addr.sin_family = AF_INET;
   listen_addr.sin_addr.s_addr = INADDR_ANY;
@@ -38,37 +72,198 @@ int create_bind_listen(unsigned short port) {
   return listening_socket;
 }
 
-struct connection_thread_args {
-  unsigned short thread_id;
-  struct proxy_server* server;
-};
+/**
+ * When threads are pinned, each of them gets its own listening socket, so that the kernel can hand a connection
+ * to the thread running on the CPU that processes its packets. Otherwise, all threads share one listening socket.
+ * With dedicated acceptors, only the acceptors listen.
+ * @return the listening socket for the thread, or -1 if it should not listen
+ */
+int thread_listening_socket(struct connection_thread* thread, unsigned short port, int shared_listening_socket) {
+  struct proxy_server* server = thread->server;
+  if (server->acceptors_len > 0 && thread->id >= server->acceptors_len) {
+    return -1;
+  }
+  return thread->cpu >= 0 ? create_bind_listen(port, thread->cpu) : shared_listening_socket;
+}
 
-void handle_connections(struct proxy_server* server) {
+void close_listening_socket(int listening_socket) {
+  if (listening_socket >= 0 && close(listening_socket) < 0) {
+    die(hsprintf("failed to close listening socket: %s", errno2s(errno)));
+  }
+}
+
+// Closes the listening sockets of the thread, unless they are shared with the other threads
+void close_thread_listening_sockets(struct connection_thread* thread) {
+  struct proxy_server* server = thread->server;
+  if (thread->listening_socket != server->listening_socket) {
+    close_listening_socket(thread->listening_socket);
+  }
+  if (thread->transparent_listening_socket != server->transparent_listening_socket) {
+    close_listening_socket(thread->transparent_listening_socket);
+  }
+  thread->listening_socket = -1;
+  thread->transparent_listening_socket = -1;
+}
+
+void handle_connections(struct connection_thread* thread) {
+  if (thread->cpu >= 0) {
+    // Pin before allocating anything so that the pages this thread touches first
+    // (its poll instance, connections and buffers) are placed on the NUMA node of its CPU.
+    int err = pin_current_thread_to_cpu(thread->cpu);
+    if (err != 0) {
+      die(hsprintf("failed to pin thread %hu to CPU %d: %s", thread->id, thread->cpu, errno2s(err)));
+    }
+  }
+
+  struct proxy_server* server = thread->server;
   struct poll* p = poll_create();
   if (p == NULL) {
     die(hsprintf("failed to create poll instance: %s", errno2s(errno)));
   }
+  thread->poll = p;
+
+  // a thread started later, once the load went up, opens its own listening sockets just like the first ones
+  thread->listening_socket = thread_listening_socket(thread, server->listening_port, server->listening_socket);
+  thread->transparent_listening_socket =
+      server->transparent_port == 0
+          ? -1
+          : thread_listening_socket(thread, server->transparent_port, server->transparent_listening_socket);
+  if (server->upgrade != NULL) {
+    notify_thread_listening(thread);
+  }
+
+  thread->hostnames = create_host_table();
+  thread->client_rate_limits = create_rate_limit_table(server->client_rate);
+  thread->target_rate_limits = create_rate_limit_table(server->target_rate);
+  thread->breakers = create_breaker_table(server->breaker_threshold);
+
+  if (server->parent_hostport != NULL) {
+    thread->upstream_sessions = calloc(server->parent_connections, sizeof(struct h2_session*));
+  }
+  thread->h2_clients = NULL;
+  // a restarted thread carries on with the segment it left off with
+  if (thread->access_log == NULL) {
+    thread->access_log = open_access_log(server->access_log_dir, thread->id);
+  }
+
+  if (thread->id == 0 && server->stats_enabled && server->memory_budget != NULL) {
+    report_memory_usage(p, thread);
+  }
+  if (thread->id == 0 && server->stats_enabled) {
+    report_send_queues(p, thread);
+  }
+  if (server->busy_poll_us > 0 && poll_enable_busy_polling(p, server->busy_poll_us) < 0) {
+    char* error_desc = errno2s(errno);
+    LOG("the kernel won't busy poll for the event loop of thread %hu, it will only spin by itself: %s",
+        thread->id,
+        error_desc);
+    free(error_desc);
+  }
+  if (server->loop_stats_interval_us > 0) {
+    start_reporting_loop_stats(p, thread);
+  }
+  if (thread->migrations.eventfd >= 0) {
+    start_rebalancing_tunnels(p, thread);
+  }
+  if (server->target_stats != NULL) {
+    start_reporting_target_stats(p, thread);
+  }
+  if (server->sockmap != NULL) {
+    start_syncing_offloaded_tunnels(p, thread);
+  }
+  // threads retire when the thread count shrinks, or all at once when the next process takes over
+  if (server->scaler != NULL || server->upgrade != NULL) {
+    watch_thread_state(p, thread);
+  }
+  if (server->scaler != NULL && thread->id == 0) {
+    scale_connection_threads(p, thread);
+  }
+  if (server->upgrade != NULL && thread->id == 0) {
+    start_serving_upgrades(p, thread);
+  }
+
+  prepare_accepting(thread);
 
   // Since we will call `accept4` until there are no more incoming connections,
   // we can register edge-triggered notification for read events on the listening socket.
   // Edge-triggered is more efficient than level-triggered.
-  if (poll_wait_for_readability(
-          p, server->listening_socket, server, false, true, (poll_callback)accept_incoming_connections) < 0) {
+  if (thread->listening_socket >= 0 &&
+      poll_wait_for_readability(
+          p,
+          thread->listening_socket,
+          thread,
+          false,
+          true,
+          POLL_PRIORITY_SETUP,
+          (poll_callback)accept_incoming_connections) < 0) {
     die(hsprintf("failed to register readability notification for listening socket: %s", errno2s(errno)));
   }
+  if (thread->transparent_listening_socket >= 0 &&
+      poll_wait_for_readability(
+          p,
+          thread->transparent_listening_socket,
+          thread,
+          false,
+          true,
+          POLL_PRIORITY_SETUP,
+          (poll_callback)accept_incoming_transparent_connections) < 0) {
+    die(hsprintf("failed to register readability notification for transparent listening socket: %s", errno2s(errno)));
+  }
 
-  // start the event loop and run until termination
+  // threads that don't accept connections themselves receive them from the acceptors
+  if (thread->inbox.eventfd >= 0 &&
+      poll_wait_for_readability(
+          p,
+          thread->inbox.eventfd,
+          thread,
+          false,
+          false,
+          POLL_PRIORITY_SETUP,
+          (poll_callback)handle_handoff_inbox_readability) < 0) {
+    die(hsprintf("failed to register readability notification for handoff eventfd: %s", errno2s(errno)));
+  }
+  // tunnels moved here by busier threads
+  if (thread->migrations.eventfd >= 0 &&
+      poll_wait_for_readability(
+          p,
+          thread->migrations.eventfd,
+          thread,
+          false,
+          false,
+          POLL_PRIORITY_SETUP,
+          (poll_callback)handle_migration_inbox_readability) < 0) {
+    die(hsprintf("failed to register readability notification for migration eventfd: %s", errno2s(errno)));
+  }
+
+  // start the event loop and run until termination, or until the thread retired
   if (poll_run(p) < 0) {
     die(hsprintf("poll_run returned error: %s", errno2s(errno)));
   }
 
+  close_thread_listening_sockets(thread);
+  close(thread->spare_fd);
+  destroy_rate_limit_table(thread->client_rate_limits);
+  destroy_rate_limit_table(thread->target_rate_limits);
+  destroy_host_table(thread->hostnames);
+  thread->hostnames = NULL;
+  destroy_breaker_table(thread->breakers);
+  thread->breakers = NULL;
+  free(thread->upstream_sessions);
+  thread->upstream_sessions = NULL;
+  give_back_all_memory(thread);
+  // what the thread counted still makes it into the next report
+  hand_over_target_stats(thread);
   poll_destroy(p);
+  thread->poll = NULL;
+
+  // the slot may be started again from here on
+  atomic_store(&thread->state, THREAD_STOPPED);
 }
 
 void* handle_connections_pthread_wrapper(void* raw_args) {
-  struct connection_thread_args* args = raw_args;
-  thread_id__ = args->thread_id;  // to identify the current thread in logging
-  handle_connections(args->server);
+  struct connection_thread* thread = raw_args;
+  thread_id__ = thread->id;  // to identify the current thread in logging
+  handle_connections(thread);
   return NULL;
 }
 
@@ -108,106 +303,532 @@ int read_blocklist(const char* blocklist_path, char*** blocklist_ptr) {
   return blocklist_len;
 }
 
+unsigned long parse_number(const char* what, const char* arg) {
+  char* endptr;
+  unsigned long value = strtoul(arg, &endptr, 10);
+  if (*arg == '\0' || *endptr != '\0') {
+    die(hsprintf("failed to parse %s '%s'", what, arg));
+  }
+  return value;
+}
+
+// Resolves the parent proxy's HOST:PORT once at startup, it's not expected to move
+void resolve_parent(const char* parent_hostport, struct sockaddr_in* parent_addr) {
+  const char* colon = strrchr(parent_hostport, ':');
+  if (colon == NULL || colon == parent_hostport || colon[1] == '\0') {
+    die(hsprintf("expected the parent proxy as HOST:PORT, got '%s'", parent_hostport));
+  }
+  char* host = strndup(parent_hostport, colon - parent_hostport);
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+
+  struct addrinfo* addrs;
+  int gai_errno = getaddrinfo(host, colon + 1, &hints, &addrs);
+  if (gai_errno != 0) {
+    die(hsprintf("failed to resolve parent proxy '%s': %s", parent_hostport, gai_strerror(gai_errno)));
+  }
+  *parent_addr = *(struct sockaddr_in*)addrs->ai_addr;
+
+  freeaddrinfo(addrs);
+  free(host);
+}
+
+enum {
+  OPT_CPUS = 256,
+  OPT_ACCEPTORS,
+  OPT_MAX_TUNNELS,
+  OPT_MAX_TUNNELS_PER_THREAD,
+  OPT_CLIENT_RATE,
+  OPT_TARGET_RATE,
+  OPT_GLOBAL_RATE,
+  OPT_MEMORY_BUDGET,
+  OPT_TRANSPARENT_PORT,
+  OPT_PARENT,
+  OPT_PARENT_CONNECTIONS,
+  OPT_ACCESS_LOG,
+  OPT_MAX_THREADS,
+  OPT_DNS_THREADS,
+  OPT_LOOP_STATS,
+  OPT_BUSY_POLL,
+  OPT_REBALANCE,
+  OPT_TARGET_STATS,
+  OPT_EGRESS_ADDRS,
+  OPT_SOCKMAP,
+  OPT_BREAKER,
+  OPT_UPGRADE_SOCKET,
+  OPT_DRAIN_TIMEOUT,
+  OPT_NOTSENT_LOWAT,
+};
+
+static const struct option long_options[] = {
+    {"cpus", required_argument, NULL, OPT_CPUS},
+    {"acceptors", required_argument, NULL, OPT_ACCEPTORS},
+    {"max-tunnels", required_argument, NULL, OPT_MAX_TUNNELS},
+    {"max-tunnels-per-thread", required_argument, NULL, OPT_MAX_TUNNELS_PER_THREAD},
+    {"client-rate", required_argument, NULL, OPT_CLIENT_RATE},
+    {"target-rate", required_argument, NULL, OPT_TARGET_RATE},
+    {"global-rate", required_argument, NULL, OPT_GLOBAL_RATE},
+    {"memory-budget", required_argument, NULL, OPT_MEMORY_BUDGET},
+    {"transparent-port", required_argument, NULL, OPT_TRANSPARENT_PORT},
+    {"parent", required_argument, NULL, OPT_PARENT},
+    {"parent-connections", required_argument, NULL, OPT_PARENT_CONNECTIONS},
+    {"access-log", required_argument, NULL, OPT_ACCESS_LOG},
+    {"max-threads", required_argument, NULL, OPT_MAX_THREADS},
+    {"dns-threads", required_argument, NULL, OPT_DNS_THREADS},
+    {"loop-stats", required_argument, NULL, OPT_LOOP_STATS},
+    {"busy-poll", required_argument, NULL, OPT_BUSY_POLL},
+    {"rebalance", required_argument, NULL, OPT_REBALANCE},
+    {"target-stats", required_argument, NULL, OPT_TARGET_STATS},
+    {"egress-addrs", required_argument, NULL, OPT_EGRESS_ADDRS},
+    {"sockmap", no_argument, NULL, OPT_SOCKMAP},
+    {"breaker", required_argument, NULL, OPT_BREAKER},
+    {"upgrade-socket", required_argument, NULL, OPT_UPGRADE_SOCKET},
+    {"drain-timeout", required_argument, NULL, OPT_DRAIN_TIMEOUT},
+    {"notsent-lowat", required_argument, NULL, OPT_NOTSENT_LOWAT},
+    {NULL, 0, NULL, 0},
+};
+
+__attribute__((noreturn)) void die_usage(const char* program) {
+  die(hsprintf(
+      "Usage: %s [options] port flag_stats path_to_blocklist [thread_count]\n"
+      "Options:\n"
+      "  --cpus=LIST      pin connection threads to the CPUs in LIST (e.g. 0-3,8-11), round-robin\n"
+      "  --acceptors=N    dedicate N connection threads to accepting and handing off connections\n"
+      "  --max-tunnels=N  stop accepting connections while N tunnels are active\n"
+      "  --max-tunnels-per-thread=N\n"
+      "                   stop accepting connections on a thread while it has N active tunnels\n"
+      "  --client-rate=N  limit the tunnels of each client IP on a thread to N bytes per second\n"
+      "  --target-rate=N  limit the tunnels to each target host on a thread to N bytes per second\n"
+      "  --global-rate=N  limit all tunnels together to N bytes per second\n"
+      "  --memory-budget=N\n"
+      "                   limit the memory held by tunnel buffers to about N bytes\n"
+      "  --transparent-port=PORT\n"
+      "                   also accept redirected TLS connections on PORT, routed by their SNI\n"
+      "  --parent=HOST:PORT\n"
+      "                   tunnel through the HTTP/2 (cleartext) parent proxy at HOST:PORT\n"
+      "  --parent-connections=N\n"
+      "                   keep up to N connections to the parent proxy per connection thread (default 2)\n"
+      "  --access-log=DIR write a binary record of every connection to segment files in DIR,\n"
+      "                   instead of printing stats for it\n"
+      "  --max-threads=N  start up to N connection threads in total while they are busy, and retire them again\n"
+      "                   once they are idle\n"
+      "  --dns-threads=N  run N async addrinfo (DNS) threads, in addition to thread_count connection threads\n"
+      "  --loop-stats=SECONDS\n"
+      "                   print how busy each thread's event loop is, and which callbacks it spends its time on,\n"
+      "                   every SECONDS seconds\n"
+      "  --busy-poll=MICROSECONDS\n"
+      "                   have event loops and sockets poll for up to MICROSECONDS before going to sleep,\n"
+      "                   burning CPU time to pick up events sooner\n"
+      "  --rebalance=PERCENT\n"
+      "                   move heavy tunnels off threads whose event loops are at least PERCENT busy\n"
+      "                   to the least busy thread\n"
+      "  --target-stats=FILE\n"
+      "                   count connections and bytes per target host, and write the top targets to FILE\n"
+      "                   every 10 seconds\n"
+      "  --egress-addrs=LIST\n"
+      "                   connect to targets from the local IPv4 addresses in LIST (e.g. 10.0.0.1,10.0.0.2),\n"
+      "                   each connection from the one with the fewest connections to its target\n"
+      "  --sockmap        relay established tunnels in the kernel with a BPF sockmap, if BPF is available\n"
+      "  --breaker=N      after N failures in a row to connect to a target (or one of its addresses), fail\n"
+      "                   requests to it right away for a while, probing it with one connection at a time\n"
+      "  --upgrade-socket=PATH\n"
+      "                   take over the listening sockets of the process listening on the Unix socket PATH, if any,\n"
+      "                   and then listen on PATH to hand them over to the next process in turn\n"
+      "  --drain-timeout=SECONDS\n"
+      "                   once handed over, wait up to SECONDS for the tunnels to finish before exiting (default 60)\n"
+      "  --notsent-lowat=LIST\n"
+      "                   keep the bytes waiting unsent in the sockets of tunnels near the low-water marks in LIST,\n"
+      "                   in bytes for all tunnels or for a class (connect, transparent), e.g. 16384,transparent:65536",
+      program));
+}
+
 int main(int argc, char** argv) {
-  if (argc < 4 || argc > 5) {
-    die(hsprintf("Usage: %s port flag_stats path_to_blocklist [thread_count]", argv[0]));
+  const char* cpu_list = NULL;
+  unsigned short acceptors_len = 0;
+  unsigned int max_tunnels = 0;
+  unsigned int max_tunnels_per_thread = 0;
+  unsigned long long client_rate = 0;
+  unsigned long long target_rate = 0;
+  unsigned long long global_rate = 0;
+  unsigned long long memory_budget = 0;
+  unsigned short transparent_port = 0;
+  const char* parent_hostport = NULL;
+  unsigned short parent_connections = DEFAULT_PARENT_CONNECTIONS;
+  const char* access_log_dir = NULL;
+  unsigned short max_threads = 0;
+  unsigned short dns_threads = 0;
+  unsigned long loop_stats_interval = 0;
+  unsigned int busy_poll_us = 0;
+  unsigned long rebalance_percent = 0;
+  const char* target_stats_path = NULL;
+  const char* egress_addr_list = NULL;
+  bool sockmap_enabled = false;
+  unsigned int breaker_threshold = 0;
+  const char* upgrade_path = NULL;
+  unsigned long drain_timeout = DEFAULT_DRAIN_TIMEOUT_SECONDS;
+  unsigned int notsent_lowats[TUNNEL_CLASS_COUNT] = {0};
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+    switch (opt) {
+      case OPT_CPUS:
+        cpu_list = optarg;
+        break;
+      case OPT_ACCEPTORS:
+        acceptors_len = parse_number("acceptor count", optarg);
+        break;
+      case OPT_MAX_TUNNELS:
+        max_tunnels = parse_number("tunnel limit", optarg);
+        break;
+      case OPT_MAX_TUNNELS_PER_THREAD:
+        max_tunnels_per_thread = parse_number("per-thread tunnel limit", optarg);
+        break;
+      case OPT_CLIENT_RATE:
+        client_rate = parse_number("client rate", optarg);
+        break;
+      case OPT_TARGET_RATE:
+        target_rate = parse_number("target rate", optarg);
+        break;
+      case OPT_GLOBAL_RATE:
+        global_rate = parse_number("global rate", optarg);
+        break;
+      case OPT_MEMORY_BUDGET:
+        memory_budget = parse_number("memory budget", optarg);
+        break;
+      case OPT_TRANSPARENT_PORT:
+        transparent_port = parse_number("transparent port", optarg);
+        break;
+      case OPT_PARENT:
+        parent_hostport = optarg;
+        break;
+      case OPT_PARENT_CONNECTIONS:
+        parent_connections = parse_number("parent connection count", optarg);
+        if (parent_connections < 1) {
+          die("at least 1 connection to the parent proxy is required");
+        }
+        break;
+      case OPT_ACCESS_LOG:
+        access_log_dir = optarg;
+        if (access(access_log_dir, W_OK | X_OK) < 0) {
+          die(hsprintf("can't write access log to '%s': %s", access_log_dir, errno2s(errno)));
+        }
+        break;
+      case OPT_MAX_THREADS:
+        max_threads = parse_number("maximum thread count", optarg);
+        break;
+      case OPT_DNS_THREADS:
+        dns_threads = parse_number("DNS thread count", optarg);
+        if (dns_threads < 1) {
+          die("at least 1 DNS thread is required");
+        }
+        break;
+      case OPT_LOOP_STATS:
+        loop_stats_interval = parse_number("event loop report interval", optarg);
+        if (loop_stats_interval < 1) {
+          die("the event loop report interval must be at least 1 second");
+        }
+        break;
+      case OPT_BUSY_POLL:
+        busy_poll_us = parse_number("busy poll time", optarg);
+        break;
+      case OPT_REBALANCE:
+        rebalance_percent = parse_number("rebalancing threshold", optarg);
+        if (rebalance_percent < 1 || rebalance_percent > 100) {
+          die("the rebalancing threshold must be between 1 and 100 percent");
+        }
+        break;
+      case OPT_TARGET_STATS:
+        target_stats_path = optarg;
+        break;
+      case OPT_EGRESS_ADDRS:
+        egress_addr_list = optarg;
+        break;
+      case OPT_SOCKMAP:
+        sockmap_enabled = true;
+        break;
+      case OPT_BREAKER:
+        breaker_threshold = parse_number("circuit breaker threshold", optarg);
+        break;
+      case OPT_UPGRADE_SOCKET:
+        upgrade_path = optarg;
+        break;
+      case OPT_DRAIN_TIMEOUT:
+        drain_timeout = parse_number("drain timeout", optarg);
+        break;
+      case OPT_NOTSENT_LOWAT:
+        if (parse_notsent_lowats(optarg, notsent_lowats) < 0) {
+          die(hsprintf("failed to parse low-water marks '%s'", optarg));
+        }
+        break;
+      default:
+        die_usage(argv[0]);
+    }
+  }
+
+  int n_positional_args = argc - optind;
+  if (n_positional_args < 3 || n_positional_args > 4) {
+    die_usage(argv[0]);
   }
+  char** args = argv + optind;
 
   char* endptr;
 
-  unsigned short listening_port = strtol(argv[1], &endptr, 10);
-  if (*argv[1] == '\0'    // empty argument
+  unsigned short listening_port = strtol(args[0], &endptr, 10);
+  if (*args[0] == '\0'    // empty argument
       || *endptr != '\0'  // unrecognized characters
   ) {
-    die(hsprintf("failed to parse port number '%s'", argv[1]));
+    die(hsprintf("failed to parse port number '%s'", args[0]));
   }
 
   bool stats_enabled;
-  if (strcmp(argv[2], "0") == 0) {
+  if (strcmp(args[1], "0") == 0) {
     stats_enabled = false;
-  } else if (strcmp(argv[2], "1") == 0) {
+  } else if (strcmp(args[1], "1") == 0) {
     stats_enabled = true;
   } else {
-    die(hsprintf("expected flag_stats to be either 0 or 1, got '%s'", argv[2]));
+    die(hsprintf("expected flag_stats to be either 0 or 1, got '%s'", args[1]));
   }
 
-  const char* blocklist_path = argv[3];
+  const char* blocklist_path = args[2];
   char** blocklist;
   int blocklist_len = read_blocklist(blocklist_path, &blocklist);
 
   unsigned short thread_count = DEFAULT_THREAD_COUNT;
-  if (argc == 5) {
-    thread_count = strtol(argv[4], &endptr, 10);
-    if (*argv[4] == '\0' || *endptr != '\0') {
-      die(hsprintf("failed to parse thread count '%s'", argv[4]));
+  if (n_positional_args == 4) {
+    thread_count = strtol(args[3], &endptr, 10);
+    if (*args[3] == '\0' || *endptr != '\0') {
+      die(hsprintf("failed to parse thread count '%s'", args[3]));
     }
-    if (thread_count < 2) {
-      die("at least 2 threads are required");
+    if (thread_count < (dns_threads == 0 ? 2 : 1)) {
+      die(dns_threads == 0 ? "at least 2 threads are required" : "at least 1 connection thread is required");
     }
   }
 
-  // use a quarter of the threads (or minimally 1) for async getaddrinfo
+  // unless told otherwise, use a quarter of the threads (or minimally 1) for async getaddrinfo
   // use the rest (including the main thread) to run event loops and handle connections
-  unsigned short asyncaddrinfo_threads = thread_count / 4;
-  if (asyncaddrinfo_threads < 1) {
-    asyncaddrinfo_threads = 1;
+  unsigned short asyncaddrinfo_threads = dns_threads;
+  unsigned short connection_threads = thread_count;
+  if (dns_threads == 0) {
+    asyncaddrinfo_threads = thread_count / 4;
+    if (asyncaddrinfo_threads < 1) {
+      asyncaddrinfo_threads = 1;
+    }
+    connection_threads = thread_count - asyncaddrinfo_threads;
+  }
+  if (acceptors_len >= connection_threads) {
+    die(hsprintf("%hu acceptors leave no thread to handle connections", acceptors_len));
+  }
+  // connection threads start at the number above, which is also the least there will be
+  if (max_threads == 0) {
+    max_threads = connection_threads;
+  } else if (max_threads < connection_threads) {
+    die(hsprintf(
+        "--max-threads=%hu is less than the %hu connection threads to start with", max_threads, connection_threads));
+  }
+
+  struct sockaddr_in parent_addr = {0};
+  if (parent_hostport != NULL) {
+    resolve_parent(parent_hostport, &parent_addr);
+  }
+
+  int* cpus = NULL;
+  int cpus_len = 0;
+  if (cpu_list != NULL) {
+    cpus_len = parse_cpu_list(cpu_list, &cpus);
+    if (cpus_len < 0) {
+      die(hsprintf("failed to parse CPU list '%s'", cpu_list));
+    }
+  }
+
+  struct sockaddr_in* egress_addrs = NULL;
+  int egress_addrs_len = 0;
+  if (egress_addr_list != NULL) {
+    egress_addrs_len = parse_egress_addrs(egress_addr_list, &egress_addrs);
+    if (egress_addrs_len < 0) {
+      die(hsprintf(
+          "failed to parse egress address list '%s' of at most %d addresses", egress_addr_list, MAX_EGRESS_ADDRS));
+    }
+    int unbindable = find_unbindable_egress_addr(egress_addrs, egress_addrs_len);
+    if (unbindable >= 0) {
+      char ip[INET_ADDRSTRLEN];
+      inet_ntop(AF_INET, &egress_addrs[unbindable].sin_addr, ip, sizeof(ip));
+      die(hsprintf("can't connect from egress address %s: %s", ip, errno2s(errno)));
+    }
+  }
+
+  struct sockmap* sockmap = NULL;
+  if (sockmap_enabled) {
+    sockmap = create_sockmap(max_tunnels > 0 ? 2 * max_tunnels : SOCKMAP_DEFAULT_MAX_SOCKETS);
+    if (sockmap == NULL) {
+      printf("BPF is unavailable, tunnels will be relayed in user space\n");
+    }
   }
-  unsigned short connection_threads = thread_count - asyncaddrinfo_threads;
 
   printf("- listening port:                          %hu\n", listening_port);
   printf("- stats enabled:                           %s\n", stats_enabled ? "yes" : "no");
   printf("- path to blocklist file:                  %s\n", blocklist_path);
   printf("- number of entries in the blocklist file: %d\n", blocklist_len);
   printf("- number of connection threads:            %hu\n", connection_threads);
+  printf("- max number of connection threads:        %hu\n", max_threads);
   printf("- number of async addrinfo (DNS) threads:  %hu\n", asyncaddrinfo_threads);
+  printf("- CPUs to pin connection threads to:       %s\n", cpu_list != NULL ? cpu_list : "none");
+  printf("- number of dedicated acceptor threads:    %hu\n", acceptors_len);
+  printf("- max active tunnels (0 = unlimited):      %u\n", max_tunnels);
+  printf("- max active tunnels per thread:           %u\n", max_tunnels_per_thread);
+  printf("- rate limit per client IP (bytes/s):      %llu\n", client_rate);
+  printf("- rate limit per target host (bytes/s):    %llu\n", target_rate);
+  printf("- global rate limit (bytes/s):             %llu\n", global_rate);
+  printf("- buffer memory budget (bytes):            %llu\n", memory_budget);
+  printf("- transparent TLS port (0 = disabled):     %hu\n", transparent_port);
+  printf("- parent proxy:                            %s\n", parent_hostport != NULL ? parent_hostport : "none");
+  printf("- connections to parent proxy per thread:  %hu\n", parent_connections);
+  printf("- access log directory:                    %s\n", access_log_dir != NULL ? access_log_dir : "none");
+  printf("- event loop report interval (0 = off, s): %lu\n", loop_stats_interval);
+  printf("- busy poll time (0 = off, us):            %u\n", busy_poll_us);
+  printf("- rebalance tunnels above (0 = off, %%):     %lu\n", rebalance_percent);
+  printf("- target stats report:                     %s\n", target_stats_path != NULL ? target_stats_path : "none");
+  printf("- relay tunnels in the kernel (sockmap):   %s\n", sockmap != NULL ? "yes" : "no");
+  printf("- egress source addresses:                 %s\n", egress_addr_list != NULL ? egress_addr_list : "default");
+  printf("- circuit breaker failures (0 = off):      %u\n", breaker_threshold);
+  printf("- upgrade socket:                          %s\n", upgrade_path != NULL ? upgrade_path : "none");
+  printf("- drain timeout after upgrade (s):         %lu\n", drain_timeout);
+  for (int i = 0; i < TUNNEL_CLASS_COUNT; i++) {
+    char label[64];
+    snprintf(label, sizeof(label), "- unsent lowat, %s (bytes):", tunnel_class_name(i));
+    printf("%-43s%u\n", label, notsent_lowats[i]);
+  }
+
+  if (cpus_len > 0) {
+    // Threads inherit the affinity of their creator, so the asyncaddrinfo threads and
+    // the connection threads (until they pin themselves) will stay within the given CPUs.
+    cpu_set_t cpu_set;
+    cpu_list_to_set(cpus, cpus_len, &cpu_set);
+    int err = pin_current_thread(&cpu_set);
+    if (err != 0) {
+      die(hsprintf("failed to restrict threads to CPUs '%s': %s", cpu_list, errno2s(err)));
+    }
+  }
 
   // start the addr info lookup threads
   asyncaddrinfo_init(asyncaddrinfo_threads);
 
-  // start the connection threads
-  int listening_socket = create_bind_listen(listening_port);
+  // start the connection threads, on the listening sockets of the old process if there is one
+  int listening_socket = -1;
+  int transparent_listening_socket = -1;
+  struct upgrade* upgrade = NULL;
+  if (upgrade_path != NULL) {
+    int predecessor = take_over_listening_sockets(
+        upgrade_path,
+        listening_port,
+        transparent_port,
+        cpus_len == 0,
+        &listening_socket,
+        &transparent_listening_socket);
+    upgrade = create_upgrade(upgrade_path, predecessor, drain_timeout * 1000000ULL);
+  }
+  if (listening_socket < 0 && cpus_len == 0) {
+    listening_socket = create_bind_listen(listening_port, -1);
+  }
+  if (transparent_listening_socket < 0 && cpus_len == 0 && transparent_port != 0) {
+    transparent_listening_socket = create_bind_listen(transparent_port, -1);
+  }
+  struct connection_thread* threads = calloc(max_threads, sizeof(struct connection_thread));
   struct proxy_server server = {
       .listening_socket = listening_socket,
+      .transparent_listening_socket = transparent_listening_socket,
+      .listening_port = listening_port,
+      .transparent_port = transparent_port,
       .stats_enabled = stats_enabled,
       .blocklist = blocklist,
       .blocklist_len = blocklist_len,
+      .threads = threads,
+      .threads_len = max_threads,
+      .acceptors_len = acceptors_len,
+      .max_tunnels = max_tunnels,
+      .max_tunnels_per_thread = max_tunnels_per_thread,
+      .client_rate = client_rate,
+      .target_rate = target_rate,
+      .global_rate_limit = create_shared_token_bucket(global_rate),
+      .memory_budget = create_memory_budget(memory_budget, max_threads),
+      .parent_hostport = parent_hostport,
+      .parent_addr = parent_addr,
+      .parent_connections = parent_connections,
+      .breaker_threshold = breaker_threshold,
+      .egress = create_egress_pool(egress_addrs, egress_addrs_len),
+      .sockmap = sockmap,
+      .access_log_dir = access_log_dir,
+      .loop_stats_interval_us = loop_stats_interval * 1000000ULL,
+      .target_stats = create_target_stats_report(target_stats_path),
+      .busy_poll_us = busy_poll_us,
+      .rebalance_utilisation = rebalance_percent / 100.0,
+      .upgrade = upgrade,
+      .scaler = create_elastic_scaler(connection_threads, max_threads),
+      .run_thread = handle_connections_pthread_wrapper,
   };
 
-  struct connection_thread_args args_list[connection_threads];
-  for (int i = 0; i < connection_threads; i++) {
-    args_list[i].thread_id = i;
-    args_list[i].server = &server;
+  // the slots of threads that may be started later stay stopped for now
+  for (int i = 0; i < max_threads; i++) {
+    threads[i].id = i;
+    threads[i].server = &server;
+    threads[i].cpu = cpus_len > 0 ? cpus[i % cpus_len] : -1;
+    threads[i].listening_socket = -1;
+    threads[i].transparent_listening_socket = -1;
+    atomic_init(&threads[i].state, THREAD_STOPPED);
   }
+  memcpy(server.notsent_lowat, notsent_lowats, sizeof(notsent_lowats));
+  handoff_init(&server);
+  migration_init(&server);
 
-  pthread_t workers[connection_threads - 1];
-  for (int i = 0; i < connection_threads - 1; i++) {
+  for (int i = 1; i < connection_threads; i++) {
     // child threads will have id from 1 onwards
     // the main thread will be thread 0
-    if (0 != pthread_create(&workers[i], NULL, handle_connections_pthread_wrapper, &args_list[i + 1])) {
-      die(hsprintf("error creating thread %d: %s", i + 1, errno2s(errno)));
+    if (!start_connection_thread(&threads[i])) {
+      die(hsprintf("error creating thread %d", i));
     }
   }
 
   printf("Accepting requests\n");
-  // run another event loop on the main thread
-  handle_connections_pthread_wrapper(&args_list[0]);
+  // run another event loop on the main thread, which is only retired once the next process takes over
+  atomic_store(&threads[0].state, THREAD_RUNNING);
+  handle_connections_pthread_wrapper(&threads[0]);
 
-  // We will never reach here, the cleanup code below is just for completeness' sake
+  // We only get here once the next process took over and all threads are done
 
-  if (close(listening_socket) < 0) {
-    die(hsprintf("failed to close listening socket: %s", errno2s(errno)));
-  }
-
-  for (int i = 0; i < connection_threads; i++) {
-    if (0 != pthread_join(workers[i], NULL)) {
-      die(hsprintf("error joining thread %d: %s", i + 1, errno2s(errno)));
-    }
+  close_listening_socket(listening_socket);
+  close_listening_socket(transparent_listening_socket);
+  for (int i = 0; i < max_threads; i++) {
+    close_access_log(threads[i].access_log);
   }
 
   for (int i = 0; i < blocklist_len; i++) {
     free(blocklist[i]);
   }
   free(blocklist);
+  free(cpus);
+  free(threads);
+  free(server.global_rate_limit);
+  free(server.memory_budget);
+  if (server.target_stats != NULL) {
+    destroy_target_stats_table(server.target_stats->totals);
+    free(server.target_stats);
+  }
+  if (server.egress != NULL) {
+    free(server.egress->n_connections);
+    free(server.egress);
+  }
+  free(egress_addrs);
+  if (server.sockmap != NULL) {
+    destroy_sockmap(server.sockmap);
+  }
+  if (server.scaler != NULL) {
+    free(server.scaler->last_busy_us);
+    free(server.scaler);
+  }
+  free(server.upgrade);
 
   asyncaddrinfo_cleanup();
 
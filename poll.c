@@ -1,36 +1,133 @@
 #include "poll.h"
 #include <errno.h>
 #include <malloc.h>
+#include <stdint.h>
+#include <string.h>
 #include <sys/epoll.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
+#include "io.h"
+#include "trace.h"
+#include "util.h"
 
-#define EPOLL_MAX_EVENTS 64
+#define TIMER_HEAP_INITIAL_CAPACITY 16
+
+#ifndef EPIOCSPARAMS
+// the busy poll parameters of an epoll instance, as in <linux/eventpoll.h> since Linux 6.9
+struct epoll_params {
+  uint32_t busy_poll_usecs;
+  uint16_t busy_poll_budget;
+  uint8_t prefer_busy_poll;
+  uint8_t __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+struct poll_timer {
+  unsigned long long deadline_us;
+  void* data;
+  poll_callback callback;
+  // position in the timer heap
+  size_t heap_index;
+};
 
 struct poll {
   int epoll_fd;
+
+  // binary min-heap of pending timers, ordered by deadline
+  struct poll_timer** timers;
+  size_t timers_len;
+  size_t timers_capacity;
+
+  // set to leave the loop once the current round of events is handled
+  bool stopped;
+  // time spent outside of `epoll_wait` since it was last taken
+  unsigned long long busy_us;
+  // how long to keep polling without blocking before going to sleep in `epoll_wait`, 0 to block right away
+  unsigned int busy_poll_us;
+  // NULL unless enabled, since timing each callback isn't free
+  struct poll_stats* stats;
+
+  // the armed one-shot task of each fd, indexed by fd, so that `poll_remove` and `poll_cancel` can cancel it
+  struct poll_task** one_shot_tasks;
+  size_t one_shot_tasks_len;
+  // tasks cancelled by `poll_cancel` during the current round of events, freed once it's over
+  struct poll_task* cancelled_tasks;
+};
+
+struct poll_task {
+  int fd;
+  void* data;
+  bool one_shot;
+  enum poll_priority priority;
+  poll_callback callback;  // NULL once cancelled
+  // links the tasks cancelled during the current round
+  struct poll_task* next_cancelled;
 };
 
+void free_cancelled_tasks(struct poll* p) {
+  while (p->cancelled_tasks != NULL) {
+    struct poll_task* task = p->cancelled_tasks;
+    p->cancelled_tasks = task->next_cancelled;
+    free(task);
+  }
+}
+
 struct poll* poll_create() {
-  int epoll_fd = epoll_create1(0);
+  int epoll_fd = io_epoll_create1(0);
   if (epoll_fd < 0) {
     return NULL;
   }
 
   struct poll* p = malloc(sizeof(struct poll));
   p->epoll_fd = epoll_fd;
+  p->timers = NULL;
+  p->timers_len = 0;
+  p->timers_capacity = 0;
+  p->stopped = false;
+  p->busy_us = 0;
+  p->busy_poll_us = 0;
+  p->stats = NULL;
+  p->one_shot_tasks = NULL;
+  p->one_shot_tasks_len = 0;
+  p->cancelled_tasks = NULL;
   return p;
 }
 
 void poll_destroy(struct poll* p) {
-  close(p->epoll_fd);
+  io_close(p->epoll_fd);
+  for (size_t i = 0; i < p->timers_len; i++) {
+    free(p->timers[i]);
+  }
+  free(p->timers);
+  free(p->stats);
+  for (size_t i = 0; i < p->one_shot_tasks_len; i++) {
+    free(p->one_shot_tasks[i]);
+  }
+  free(p->one_shot_tasks);
+  free_cancelled_tasks(p);
   free(p);
 }
 
-struct poll_task {
-  void* data;
-  bool one_shot;
-  poll_callback callback;
-};
+void track_one_shot_task(struct poll* p, struct poll_task* task) {
+  if ((size_t)task->fd >= p->one_shot_tasks_len) {
+    size_t len = p->one_shot_tasks_len == 0 ? 64 : p->one_shot_tasks_len;
+    while (len <= (size_t)task->fd) {
+      len *= 2;
+    }
+    p->one_shot_tasks = realloc(p->one_shot_tasks, len * sizeof(struct poll_task*));
+    memset(p->one_shot_tasks + p->one_shot_tasks_len, 0, (len - p->one_shot_tasks_len) * sizeof(struct poll_task*));
+    p->one_shot_tasks_len = len;
+  }
+  p->one_shot_tasks[task->fd] = task;
+}
+
+// Called when the task fires, which disarms it; the fd may have been closed and armed with another task since
+void untrack_one_shot_task(struct poll* p, struct poll_task* task) {
+  if ((size_t)task->fd < p->one_shot_tasks_len && p->one_shot_tasks[task->fd] == task) {
+    p->one_shot_tasks[task->fd] = NULL;
+  }
+}
 
 int poll_submit_event(
     struct poll* p,
@@ -39,6 +136,7 @@ int poll_submit_event(
     uint32_t base_events,
     bool one_shot,
     bool edge_triggered,
+    enum poll_priority priority,
     poll_callback callback) {
   /*
    * FIXME:
@@ -46,9 +144,12 @@ int poll_submit_event(
    * on the same fd results in `task` being leaked.
    */
   struct poll_task* task = malloc(sizeof(struct poll_task));
+  task->fd = fd;
   task->data = data;
   task->one_shot = one_shot;
+  task->priority = priority;
   task->callback = callback;
+  task->next_cancelled = NULL;
 
   struct epoll_event event;
   event.data.ptr = task;
@@ -61,29 +162,66 @@ int poll_submit_event(
   }
 
   // try `mod` first, then `add` if `mod` fails
-  if (epoll_ctl(p->epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0) {
+  if (io_epoll_ctl(p->epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0) {
     if (errno != ENOENT) {
       free(task);
       return -1;
     }
 
-    if (epoll_ctl(p->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+    if (io_epoll_ctl(p->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
       free(task);
       return -1;
     }
   }
 
+  if (one_shot) {
+    track_one_shot_task(p, task);
+  }
+  return 0;
+}
+
+/**
+ * Stops watching the fd, and frees its armed one-shot task if there is one, e.g. to hand the fd over to the poll of
+ * another thread. Only call it from a timer: the events of the current round have all been handled by then, so none of
+ * them can still refer to the task.
+ * @return 0 on success; -1 on failure (ENOENT if the fd isn't watched), with errno set
+ */
+int poll_remove(struct poll* p, int fd) {
+  if (io_epoll_ctl(p->epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0) {
+    return -1;
+  }
+  if ((size_t)fd < p->one_shot_tasks_len) {
+    free(p->one_shot_tasks[fd]);
+    p->one_shot_tasks[fd] = NULL;
+  }
   return 0;
 }
 
+/**
+ * Cancels the armed one-shot task of an fd that's about to be closed, which takes it off the epoll instance. Unlike
+ * `poll_remove`, it may be called from any callback: an event of the current round that's still to be handled for the
+ * task is skipped, so e.g. a tunnel can be torn down while an event for its other socket is pending.
+ */
+void poll_cancel(struct poll* p, int fd) {
+  if ((size_t)fd >= p->one_shot_tasks_len || p->one_shot_tasks[fd] == NULL) {
+    return;
+  }
+  struct poll_task* task = p->one_shot_tasks[fd];
+  p->one_shot_tasks[fd] = NULL;
+  task->callback = NULL;
+  task->next_cancelled = p->cancelled_tasks;
+  p->cancelled_tasks = task;
+}
+
 int poll_wait_for_readability(
     struct poll* p,
     int fd,
     void* data,
     bool one_shot,
     bool edge_triggered,
+    enum poll_priority priority,
     poll_callback callback) {
-  return poll_submit_event(p, fd, data, EPOLLIN, one_shot, edge_triggered, callback);
+  return poll_submit_event(p, fd, data, EPOLLIN, one_shot, edge_triggered, priority, callback);
 }
 
 int poll_wait_for_writability(
@@ -92,26 +230,344 @@ int poll_wait_for_writability(
     void* data,
     bool one_shot,
     bool edge_triggered,
+    enum poll_priority priority,
     poll_callback callback) {
-  return poll_submit_event(p, fd, data, EPOLLOUT, one_shot, edge_triggered, callback);
+  return poll_submit_event(p, fd, data, EPOLLOUT, one_shot, edge_triggered, priority, callback);
+}
+
+void timer_heap_swap(struct poll* p, size_t i, size_t j) {
+  struct poll_timer* tmp = p->timers[i];
+  p->timers[i] = p->timers[j];
+  p->timers[j] = tmp;
+  p->timers[i]->heap_index = i;
+  p->timers[j]->heap_index = j;
+}
+
+void timer_heap_sift_up(struct poll* p, size_t i) {
+  while (i > 0) {
+    size_t parent = (i - 1) / 2;
+    if (p->timers[parent]->deadline_us <= p->timers[i]->deadline_us) {
+      return;
+    }
+    timer_heap_swap(p, i, parent);
+    i = parent;
+  }
+}
+
+void timer_heap_sift_down(struct poll* p, size_t i) {
+  while (1) {
+    size_t smallest = i;
+    size_t left = 2 * i + 1;
+    size_t right = 2 * i + 2;
+    if (left < p->timers_len && p->timers[left]->deadline_us < p->timers[smallest]->deadline_us) {
+      smallest = left;
+    }
+    if (right < p->timers_len && p->timers[right]->deadline_us < p->timers[smallest]->deadline_us) {
+      smallest = right;
+    }
+    if (smallest == i) {
+      return;
+    }
+    timer_heap_swap(p, i, smallest);
+    i = smallest;
+  }
+}
+
+void timer_heap_remove(struct poll* p, struct poll_timer* timer) {
+  size_t i = timer->heap_index;
+  p->timers_len--;
+  if (i == p->timers_len) {
+    return;
+  }
+
+  p->timers[i] = p->timers[p->timers_len];
+  p->timers[i]->heap_index = i;
+  timer_heap_sift_up(p, i);
+  timer_heap_sift_down(p, i);
 }
 
+/**
+ * Runs `callback` once, after at least `delay_us` microseconds.
+ * The timer is freed once the callback returns, so it must not be cancelled from within or after its callback.
+ * @return a handle to cancel the timer, or NULL if it could not be allocated
+ */
+struct poll_timer* poll_add_timer(struct poll* p, unsigned long long delay_us, void* data, poll_callback callback) {
+  if (p->timers_len == p->timers_capacity) {
+    size_t new_capacity = p->timers_capacity == 0 ? TIMER_HEAP_INITIAL_CAPACITY : 2 * p->timers_capacity;
+    struct poll_timer** new_timers = realloc(p->timers, new_capacity * sizeof(struct poll_timer*));
+    if (new_timers == NULL) {
+      return NULL;
+    }
+    p->timers = new_timers;
+    p->timers_capacity = new_capacity;
+  }
+
+  struct poll_timer* timer = malloc(sizeof(struct poll_timer));
+  if (timer == NULL) {
+    return NULL;
+  }
+  timer->deadline_us = monotonic_time_us() + delay_us;
+  timer->data = data;
+  timer->callback = callback;
+  timer->heap_index = p->timers_len;
+
+  p->timers[p->timers_len++] = timer;
+  timer_heap_sift_up(p, timer->heap_index);
+
+  return timer;
+}
+
+// Returns the data the timer was added with, so that the caller can release it.
+void* poll_cancel_timer(struct poll* p, struct poll_timer* timer) {
+  void* data = timer->data;
+  timer_heap_remove(p, timer);
+  free(timer);
+  return data;
+}
+
+// Returns the timeout to pass to `epoll_wait` so that we wake up in time for the earliest timer.
+int next_timer_timeout_ms(struct poll* p) {
+  if (p->timers_len == 0) {
+    return -1;
+  }
+
+  unsigned long long now_us = monotonic_time_us();
+  unsigned long long deadline_us = p->timers[0]->deadline_us;
+  if (deadline_us <= now_us) {
+    return 0;
+  }
+
+  // round up, waking up early would only make us spin until the deadline
+  return (deadline_us - now_us + 999) / 1000;
+}
+
+// Finds the stats of a callback, claiming a slot for it on its first run
+struct poll_callback_stats* find_callback_stats(struct poll_stats* stats, poll_callback callback) {
+  size_t i = ((uintptr_t)callback >> 4) % POLL_MAX_CALLBACK_TYPES;
+  for (size_t n_probed = 0; n_probed < POLL_MAX_CALLBACK_TYPES; n_probed++) {
+    struct poll_callback_stats* slot = &stats->callbacks[i];
+    if (slot->callback == callback) {
+      return slot;
+    }
+    if (slot->callback == NULL) {
+      slot->callback = callback;
+      return slot;
+    }
+    i = (i + 1) % POLL_MAX_CALLBACK_TYPES;
+  }
+  return NULL;
+}
+
+void record_callback_run(struct poll_stats* stats, poll_callback callback, unsigned long long ns) {
+  if (ns > stats->slowest_ns) {
+    stats->slowest_callback = callback;
+    stats->slowest_ns = ns;
+  }
+
+  struct poll_callback_stats* callback_stats = find_callback_stats(stats, callback);
+  if (callback_stats == NULL) {
+    return;
+  }
+  callback_stats->n_runs++;
+  callback_stats->total_ns += ns;
+  if (ns > callback_stats->max_ns) {
+    callback_stats->max_ns = ns;
+  }
+  if (ns >= stats->slow_callback_ns) {
+    callback_stats->n_slow++;
+    TRACE2(slow_callback, callback, ns);
+  }
+
+  unsigned long long us = ns / 1000;
+  int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+  callback_stats->time_histogram[bucket < POLL_TIME_BUCKETS ? bucket : POLL_TIME_BUCKETS - 1]++;
+}
+
+void run_callback(struct poll* p, poll_callback callback, void* data) {
+  if (p->stats == NULL) {
+    callback(p, data);
+    return;
+  }
+
+  unsigned long long started_at_ns = monotonic_time_ns();
+  callback(p, data);
+  // the callback may have reset the stats, but not disabled them
+  record_callback_run(p->stats, callback, monotonic_time_ns() - started_at_ns);
+}
+
+void record_wakeup(
+    struct poll_stats* stats,
+    int num_events,
+    unsigned long long spun_us,
+    unsigned long long waited_us,
+    bool caught_spinning) {
+  stats->n_wakeups++;
+  stats->n_events += num_events;
+  stats->spinning_us += spun_us;
+  stats->waiting_us += waited_us;
+  if (caught_spinning) {
+    stats->n_spin_wakeups++;
+  }
+  int bucket = num_events == 0 ? 0 : 32 - __builtin_clz(num_events);
+  stats->batch_histogram[bucket < POLL_BATCH_BUCKETS ? bucket : POLL_BATCH_BUCKETS - 1]++;
+}
+
+void run_expired_timers(struct poll* p) {
+  unsigned long long now_us = monotonic_time_us();
+  while (p->timers_len > 0 && p->timers[0]->deadline_us <= now_us) {
+    struct poll_timer* timer = p->timers[0];
+    timer_heap_remove(p, timer);
+    if (p->stats != NULL) {
+      unsigned long long lag_us = now_us - timer->deadline_us;
+      p->stats->n_timers++;
+      p->stats->total_timer_lag_us += lag_us;
+      if (lag_us > p->stats->max_timer_lag_us) {
+        p->stats->max_timer_lag_us = lag_us;
+      }
+    }
+    run_callback(p, timer->callback, timer->data);
+    free(timer);
+  }
+}
+
+/**
+ * Polls for events without blocking until some arrive, the busy poll budget runs out, or a timer is due.
+ * Events arriving meanwhile are handled without paying for going to sleep and being woken up again.
+ * @return the number of events; 0 if none arrived; -1 on failure, with errno set
+ */
+int spin_for_events(struct poll* p, struct epoll_event* events) {
+  unsigned long long spin_until_us = monotonic_time_us() + p->busy_poll_us;
+  if (p->timers_len > 0 && p->timers[0]->deadline_us < spin_until_us) {
+    spin_until_us = p->timers[0]->deadline_us;
+  }
+  while (true) {
+    int num_events = io_epoll_wait(p->epoll_fd, events, EPOLL_MAX_EVENTS, 0);
+    if (num_events != 0 || monotonic_time_us() >= spin_until_us) {
+      return num_events;
+    }
+  }
+}
+
+/**
+ * Runs the event loop until `poll_stop` is called.
+ * @return 0 once stopped; -1 on failure, with errno set
+ */
 int poll_run(struct poll* p) {
   struct epoll_event events[EPOLL_MAX_EVENTS];
-  while (1) {
-    int num_events = epoll_wait(p->epoll_fd, events, EPOLL_MAX_EVENTS, -1);
+  unsigned long long woke_up_at_us = monotonic_time_us();
+  while (!p->stopped) {
+    int timeout_ms = next_timer_timeout_ms(p);
+    unsigned long long waiting_since_us = monotonic_time_us();
+    p->busy_us += waiting_since_us - woke_up_at_us;
+    if (p->stats != NULL) {
+      p->stats->busy_us += waiting_since_us - woke_up_at_us;
+    }
+
+    // spinning only pays off when we would otherwise go to sleep
+    int num_events = 0;
+    bool caught_spinning = false;
+    unsigned long long blocking_since_us = waiting_since_us;
+    if (p->busy_poll_us > 0 && timeout_ms != 0) {
+      num_events = spin_for_events(p, events);
+      caught_spinning = num_events > 0;
+      blocking_since_us = monotonic_time_us();
+      timeout_ms = next_timer_timeout_ms(p);
+    }
+    if (num_events == 0) {
+      num_events = io_epoll_wait(p->epoll_fd, events, EPOLL_MAX_EVENTS, timeout_ms);
+    }
+    woke_up_at_us = monotonic_time_us();
     if (num_events < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
       return num_events;
     }
+    if (p->stats != NULL) {
+      record_wakeup(
+          p->stats,
+          num_events,
+          blocking_since_us - waiting_since_us,
+          woke_up_at_us - blocking_since_us,
+          caught_spinning);
+    }
 
-    for (int i = 0; i < num_events; i++) {
-      struct poll_task* task = events[i].data.ptr;
-      task->callback(p, task->data);
-      // If it's one-shot, this task will not be used again.
-      // Otherwise, subsequent notifications will return the same task pointer.
-      if (task->one_shot) {
-        free(task);
+    // class by class, see `enum poll_priority`, and within a class in the order the events arrived
+    int n_events_left = num_events;
+    for (enum poll_priority priority = POLL_PRIORITY_SETUP; n_events_left > 0; priority++) {
+      for (int i = 0; i < num_events; i++) {
+        struct poll_task* task = events[i].data.ptr;
+        if (task == NULL || task->priority != priority) {
+          continue;
+        }
+        events[i].data.ptr = NULL;
+        n_events_left--;
+        if (task->callback == NULL) {
+          // cancelled, and freed below
+          continue;
+        }
+        if (task->one_shot) {
+          untrack_one_shot_task(p, task);
+        }
+        run_callback(p, task->callback, task->data);
+        // If it's one-shot, this task will not be used again.
+        // Otherwise, subsequent notifications will return the same task pointer.
+        if (task->one_shot) {
+          free(task);
+        }
       }
     }
+    free_cancelled_tasks(p);
+
+    run_expired_timers(p);
   }
+  return 0;
+}
+
+// Makes `poll_run` return once it's done with the current round of events, including the timers that are due
+void poll_stop(struct poll* p) {
+  p->stopped = true;
+}
+
+// Returns how long the loop has been busy handling events and timers since the last call, in microseconds
+unsigned long long poll_take_busy_us(struct poll* p) {
+  unsigned long long busy_us = p->busy_us;
+  p->busy_us = 0;
+  return busy_us;
+}
+
+/**
+ * Makes `poll_run` poll without blocking for up to `busy_poll_us` before it goes to sleep in `epoll_wait`, trading CPU
+ * time for the latency of being woken up. Also asks the kernel to busy poll the device queues of the sockets while
+ * `epoll_wait` blocks, preferring that over interrupts.
+ * @return 0 on success; -1 if the kernel doesn't busy poll for epoll (before Linux 6.9) or it isn't allowed to, with
+ * errno set, in which case `poll_run` still spins by itself
+ */
+int poll_enable_busy_polling(struct poll* p, unsigned int busy_poll_us) {
+  p->busy_poll_us = busy_poll_us;
+  // a budget of 0 is the kernel's default of packets per poll
+  struct epoll_params params = {.busy_poll_usecs = busy_poll_us, .busy_poll_budget = 0, .prefer_busy_poll = 1};
+  return ioctl(p->epoll_fd, EPIOCSPARAMS, &params);
+}
+
+/**
+ * Starts keeping `poll_stats`, at the cost of reading the clock around every callback.
+ * @param slow_callback_ns callbacks running at least this long are counted as slow, and hit the `slow_callback` probe
+ */
+void poll_enable_stats(struct poll* p, unsigned long long slow_callback_ns) {
+  if (p->stats == NULL) {
+    p->stats = malloc(sizeof(struct poll_stats));
+  }
+  memset(p->stats, 0, sizeof(struct poll_stats));
+  p->stats->since_us = monotonic_time_us();
+  p->stats->slow_callback_ns = slow_callback_ns;
+}
+
+// Returns NULL if stats aren't enabled
+struct poll_stats* poll_get_stats(struct poll* p) {
+  return p->stats;
+}
+
+void poll_reset_stats(struct poll* p) {
+  poll_enable_stats(p, p->stats->slow_callback_ns);
 }
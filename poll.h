@@ -4,12 +4,79 @@
 #include <stdbool.h>
 
 struct poll;
+struct poll_timer;
+
+typedef void (*poll_callback)(struct poll* p, void* data);
+
+// Within a round of events, the classes run in this order, so that new tunnels don't queue up behind the bulk of relaying
+enum poll_priority {
+  // accepting connections, reading requests, resolving and connecting: what a new tunnel waits on for its first byte
+  POLL_PRIORITY_SETUP,
+  // relaying the bytes of established tunnels
+  POLL_PRIORITY_RELAY,
+};
+
+// the most events a single `epoll_wait` returns
+#define EPOLL_MAX_EVENTS 64
+
+// Bucket 0 counts callbacks that ran for less than 1 us, bucket i up to 2^i us, and the last one everything longer
+#define POLL_TIME_BUCKETS 16
+// Bucket 0 counts wakeups with no events (i.e. for timers), bucket i with up to 2^i - 1 events, the last a full batch
+#define POLL_BATCH_BUCKETS 8
+// how many distinct callbacks are timed separately; more than this are only counted for the loop as a whole
+#define POLL_MAX_CALLBACK_TYPES 64
+
+// How long one kind of callback, i.e. one state handler, ran
+struct poll_callback_stats {
+  // NULL for an unused slot
+  poll_callback callback;
+  unsigned long long n_runs;
+  unsigned long long total_ns;
+  unsigned long long max_ns;
+  // runs that took at least the slow callback threshold
+  unsigned long long n_slow;
+  unsigned long long time_histogram[POLL_TIME_BUCKETS];
+};
+
+// What the event loop did since the stats were last reset
+struct poll_stats {
+  unsigned long long since_us;
+  // runs longer than this are counted as slow, and traced
+  unsigned long long slow_callback_ns;
+
+  // time spent handling events and timers, polling for events without blocking, and blocked in `epoll_wait`
+  unsigned long long busy_us;
+  unsigned long long spinning_us;
+  unsigned long long waiting_us;
+
+  unsigned long long n_wakeups;
+  // wakeups whose events were found while polling without blocking, i.e. without going to sleep
+  unsigned long long n_spin_wakeups;
+  unsigned long long n_events;
+  unsigned long long batch_histogram[POLL_BATCH_BUCKETS];
+
+  // how late timers ran after their deadline
+  unsigned long long n_timers;
+  unsigned long long total_timer_lag_us;
+  unsigned long long max_timer_lag_us;
+
+  // the longest callback run
+  poll_callback slowest_callback;
+  unsigned long long slowest_ns;
+
+  // open addressing on the callback's address
+  struct poll_callback_stats callbacks[POLL_MAX_CALLBACK_TYPES];
+};
 
 struct poll* poll_create();
 void poll_destroy(struct poll* p);
 int poll_run(struct poll* p);
-
-typedef void (*poll_callback)(struct poll* p, void* data);
+void poll_stop(struct poll* p);
+unsigned long long poll_take_busy_us(struct poll* p);
+int poll_enable_busy_polling(struct poll* p, unsigned int busy_poll_us);
+void poll_enable_stats(struct poll* p, unsigned long long slow_callback_ns);
+struct poll_stats* poll_get_stats(struct poll* p);
+void poll_reset_stats(struct poll* p);
 
 int poll_wait_for_readability(
     struct poll* p,
@@ -17,6 +84,7 @@ int poll_wait_for_readability(
     void* data,
     bool one_shot,
     bool edge_triggered,
+    enum poll_priority priority,
     poll_callback callback);
 
 int poll_wait_for_writability(
@@ -25,6 +93,15 @@ int poll_wait_for_writability(
     void* data,
     bool one_shot,
     bool edge_triggered,
+    enum poll_priority priority,
     poll_callback callback);
 
+int poll_remove(struct poll* p, int fd);
+
+void poll_cancel(struct poll* p, int fd);
+
+struct poll_timer* poll_add_timer(struct poll* p, unsigned long long delay_us, void* data, poll_callback callback);
+
+void* poll_cancel_timer(struct poll* p, struct poll_timer* timer);
+
 #endif  // HTTPS_PROXY_POLL_H
@@ -1,54 +1,281 @@
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include "../http2/session.h"
+#include "../io.h"
 #include "../log.h"
 #include "../poll.h"
+#include "../trace.h"
 #include "../util.h"
 #include "proxy_server.h"
+#include "sni.h"
+#include "udp_tunnel.h"
 
-#define DEFAULT_TARGET_PORT "443"
+#ifndef SO_ORIGINAL_DST
+#define SO_ORIGINAL_DST 80  // from linux/netfilter_ipv4.h
+#endif
 
 void handle_client_connect_request_readability(struct poll* p, struct tunnel_conn* conn);
+void handle_client_hello_readability(struct poll* p, struct tunnel_conn* conn);
+
+// bounds of the delay before we try accepting again after pausing
+#define ACCEPT_BACKOFF_MIN_US 10000
+#define ACCEPT_BACKOFF_MAX_US 1000000
+
+#define OVERLOADED_RESPONSE "HTTP/1.1 503 Service Unavailable\r\n\r\n"
+
+void prepare_accepting(struct connection_thread* thread) {
+  thread->draining = false;
+  thread->accept_paused = false;
+  thread->accept_level_triggered = false;
+  thread->accept_backoff_us = ACCEPT_BACKOFF_MIN_US;
+  thread->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+bool under_limit(atomic_uint* counter, unsigned int limit) {
+  return limit == 0 || atomic_load_explicit(counter, memory_order_relaxed) < limit;
+}
+
+// Whether the thread may take on another tunnel
+bool thread_has_capacity(struct connection_thread* thread) {
+  return under_limit(&thread->load.active_tunnels, thread->server->max_tunnels_per_thread);
+}
+
+// Whether the server as a whole may take on another tunnel
+bool server_has_capacity(struct proxy_server* server) {
+  return under_limit(&server->active_tunnels, server->max_tunnels);
+}
+
+// Whether the thread should accept another connection
+bool can_accept(struct connection_thread* thread) {
+  struct proxy_server* server = thread->server;
+  if (!server_has_capacity(server)) {
+    LOG("too many active tunnels");
+    return false;
+  }
+
+  if (memory_budget_exhausted(server->memory_budget)) {
+    LOG("out of buffer memory");
+    return false;
+  }
+
+  if (server->acceptors_len == 0) {
+    if (!thread_has_capacity(thread)) {
+      LOG("too many active tunnels on this thread");
+      return false;
+    }
+    return true;
+  }
+
+  // acceptors need at least one thread to hand the connection off to
+  for (int i = server->acceptors_len; i < server->threads_len; i++) {
+    if (thread_is_running(&server->threads[i]) && thread_has_capacity(&server->threads[i])) {
+      return true;
+    }
+  }
+  LOG("too many active tunnels on every thread");
+  return false;
+}
+
+void resume_accepting(struct poll* p, struct connection_thread* thread) {
+  DEBUG_LOG("resume accepting connections");
+  thread->accept_paused = false;
+  if (thread->listening_socket >= 0) {
+    accept_incoming_connections(p, thread);
+  }
+  if (thread->transparent_listening_socket >= 0) {
+    accept_incoming_transparent_connections(p, thread);
+  }
+}
+
+/**
+ * Switches the listening sockets of the thread between edge- and level-triggered notifications.
+ * @return 0 on success; -1 on failure, with errno set
+ */
+int rearm_listening_sockets(struct poll* p, struct connection_thread* thread, bool edge_triggered) {
+  if (thread->listening_socket >= 0 &&
+      poll_wait_for_readability(
+          p,
+          thread->listening_socket,
+          thread,
+          false,
+          edge_triggered,
+          POLL_PRIORITY_SETUP,
+          (poll_callback)accept_incoming_connections) < 0) {
+    return -1;
+  }
+  if (thread->transparent_listening_socket >= 0 &&
+      poll_wait_for_readability(
+          p,
+          thread->transparent_listening_socket,
+          thread,
+          false,
+          edge_triggered,
+          POLL_PRIORITY_SETUP,
+          (poll_callback)accept_incoming_transparent_connections) < 0) {
+    return -1;
+  }
+  thread->accept_level_triggered = !edge_triggered;
+  return 0;
+}
+
+// Goes back to edge-triggered notifications, once something else makes sure that pending connections are picked up
+void restore_edge_triggered_accepting(struct poll* p, struct connection_thread* thread) {
+  if (!thread->accept_level_triggered) {
+    return;
+  }
+  if (rearm_listening_sockets(p, thread, true) < 0) {
+    char* error_desc = errno2s(errno);
+    LOG("failed to make the listening sockets edge-triggered again: %s", error_desc);
+    free(error_desc);
+  }
+}
+
+/**
+ * Stops accepting connections for a while. Pending connections wait in the listen backlog meanwhile.
+ * Since the listening socket is edge-triggered, we cannot rely on another notification to resume, so a timer
+ * will try again later, backing off exponentially for as long as we stay overloaded.
+ * Without the timer, the listening sockets become level-triggered instead, so that epoll keeps reporting the
+ * connections left in the backlog until it's empty; that costs a wakeup per round for as long as we stay overloaded.
+ */
+void pause_accepting(struct poll* p, struct connection_thread* thread) {
+  if (poll_add_timer(p, thread->accept_backoff_us, thread, (poll_callback)resume_accepting) == NULL) {
+    if (thread->accept_level_triggered) {
+      return;
+    }
+    LOG("failed to schedule resuming to accept connections, retrying on every round instead");
+    if (rearm_listening_sockets(p, thread, false) < 0) {
+      char* error_desc = errno2s(errno);
+      LOG("failed to make the listening sockets level-triggered, pending connections may stall: %s", error_desc);
+      free(error_desc);
+    }
+    return;
+  }
+
+  // the timer resumes accepting, so spare us the wakeups of level-triggered sockets meanwhile
+  restore_edge_triggered_accepting(p, thread);
+  LOG("pause accepting connections for %llu ms", thread->accept_backoff_us / 1000);
+  thread->accept_paused = true;
+  thread->accept_backoff_us *= 2;
+  if (thread->accept_backoff_us > ACCEPT_BACKOFF_MAX_US) {
+    thread->accept_backoff_us = ACCEPT_BACKOFF_MAX_US;
+  }
+}
+
+/**
+ * We ran out of file descriptors. Release the spare one to accept the oldest pending connection and tell the client
+ * that we are overloaded, instead of leaving it hanging in the backlog.
+ */
+void shed_connection_with_spare_fd(struct connection_thread* thread, int listening_socket, bool transparent) {
+  if (thread->spare_fd >= 0) {
+    close(thread->spare_fd);
+  }
+
+  int client_socket = io_accept4(listening_socket, NULL, NULL, SOCK_NONBLOCK);
+  if (client_socket >= 0) {
+    if (!transparent) {
+      io_send(client_socket, OVERLOADED_RESPONSE, strlen(OVERLOADED_RESPONSE), MSG_NOSIGNAL);
+    }
+    io_close(client_socket);
+  }
+
+  thread->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+void accept_from_listener(struct poll* p, struct connection_thread* thread, int listening_socket, bool transparent) {
+  struct proxy_server* server = thread->server;
+
+  if (thread->accept_paused || thread->draining) {
+    // the back-off timer will resume accepting, unless the thread is on its way out
+    return;
+  }
 
-void accept_incoming_connections(struct poll* p, struct proxy_server* server) {
   // accept all pending connections
   while (1) {
+    if (!can_accept(thread)) {
+      pause_accepting(p, thread);
+      return;
+    }
+
     struct sockaddr_in client_addr;
     socklen_t addrlen = sizeof(struct sockaddr_in);
 
-    int client_socket = accept4(server->listening_socket, (struct sockaddr*)&client_addr, &addrlen, SOCK_NONBLOCK);
+    int client_socket = io_accept4(listening_socket, (struct sockaddr*)&client_addr, &addrlen, SOCK_NONBLOCK);
     if (client_socket < 0) {
       if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        // finished processing all incoming connections
+        // finished processing all incoming connections, so the next one comes with an edge again
+        restore_edge_triggered_accepting(p, thread);
+        return;
+      } else if (errno == EINTR || errno == ECONNABORTED) {
+        // only this connection is affected, move on to the next one
+        continue;
+      } else if (errno == EMFILE || errno == ENFILE) {
+        LOG("out of file descriptors, shedding a connection");
+        shed_connection_with_spare_fd(thread, listening_socket, transparent);
+        pause_accepting(p, thread);
         return;
       } else {
         // unexpected error in accepting the connection
         char* error_desc = errno2s(errno);
         DEBUG_LOG("accept failed: %s", error_desc);
         free(error_desc);
+        pause_accepting(p, thread);
         return;
       }
     }
 
-    struct tunnel_conn* conn = create_tunnel_conn(server->stats_enabled, server->blocklist, server->blocklist_len);
-    conn->client_socket = client_socket;
-    set_client_hostport(conn, &client_addr);
+    thread->accept_backoff_us = ACCEPT_BACKOFF_MIN_US;
 
-    LOG("Received connection from %s", conn->client_hostport);
+    if (server->acceptors_len > 0) {
+      hand_off_client_socket(thread, client_socket, &client_addr, transparent);
+    } else {
+      adopt_client_socket(p, thread, client_socket, &client_addr, transparent);
+    }
+  }
+}
 
-    // wait for client socket readability so we can read its CONNECT HTTP request
-    if (poll_wait_for_readability(
-            p, client_socket, conn, true, false, (poll_callback)handle_client_connect_request_readability) < 0) {
-      char* error_desc = errno2s(errno);
-      DEBUG_LOG(
-          "failed to add accepted client socket from %s into poll instance: %s", conn->client_hostport, error_desc);
-      free(error_desc);
+void accept_incoming_connections(struct poll* p, struct connection_thread* thread) {
+  accept_from_listener(p, thread, thread->listening_socket, false);
+}
 
-      destroy_tunnel_conn(conn);
-    }
+void accept_incoming_transparent_connections(struct poll* p, struct connection_thread* thread) {
+  accept_from_listener(p, thread, thread->transparent_listening_socket, true);
+}
+
+// Takes ownership of an accepted client socket and starts serving it on the current thread.
+void adopt_client_socket(
+    struct poll* p,
+    struct connection_thread* thread,
+    int client_socket,
+    const struct sockaddr_in* client_addr,
+    bool transparent) {
+  struct tunnel_conn* conn = create_tunnel_conn(thread);
+  conn->client_socket = client_socket;
+  conn->transparent = transparent;
+  conn->client_addr = *client_addr;
+  TRACE3(accept, conn->id, client_addr->sin_addr.s_addr, ntohs(client_addr->sin_port));
+
+  // best effort, it only lowers latency
+  if (thread->server->busy_poll_us > 0) {
+    enable_socket_busy_polling(client_socket, thread->server->busy_poll_us);
+  }
+
+  // the memory budget was checked before accepting the connection
+  acquire_buffer(conn, &conn->to_target_buffer, true);
+
+  LOG("Received connection from %s", client_hostport(conn));
+
+  // With TCP_DEFER_ACCEPT on the listener, the CONNECT request or the ClientHello has usually arrived already, so
+  // read it right away; we wait for readability only if it hasn't.
+  if (transparent) {
+    handle_client_hello_readability(p, conn);
+  } else {
+    handle_client_connect_request_readability(p, conn);
   }
 }
 
@@ -69,7 +296,7 @@ ssize_t read_into_buffer(int read_fd, struct tunnel_buffer* buf) {
     return -2;
   }
 
-  ssize_t n_bytes_read = read(read_fd, buf->write_ptr, remaining_capacity);
+  ssize_t n_bytes_read = io_read(read_fd, buf->write_ptr, remaining_capacity);
 
   if (n_bytes_read <= 0) {
     return n_bytes_read;
@@ -80,11 +307,64 @@ ssize_t read_into_buffer(int read_fd, struct tunnel_buffer* buf) {
   return n_bytes_read;
 }
 
-int parse_http_connect_message(char* message, char** host_parsed, char** port_parsed, char** http_version_parsed) {
+// Whether the request asks to upgrade the connection to a UDP tunnel, with an `Upgrade: connect-udp` header
+bool has_connect_udp_upgrade(const char* message) {
+  const char* header = strcasestr(message, "\r\nUpgrade:");
+  if (header == NULL) {
+    return false;
+  }
+  header += strlen("\r\nUpgrade:");
+  header += strspn(header, " \t");
+  return strncasecmp(header, "connect-udp", strlen("connect-udp")) == 0 &&
+         strchr("\r \t", header[strlen("connect-udp")]) != NULL;
+}
+
+/**
+ * Parses the target out of the request line of a CONNECT-UDP request (RFC 9298), whose path follows the default
+ * template: /.well-known/masque/udp/{target_host}/{target_port}/
+ * @return 0 on success; -1 if the path doesn't follow it
+ */
+int parse_connect_udp_path(char* path, char** host_parsed, unsigned short* port_parsed) {
+  const char* prefix = "/.well-known/masque/udp/";
+  if (strncmp(path, prefix, strlen(prefix)) != 0) {
+    return -1;
+  }
+
+  char* host = path + strlen(prefix);
+  char* host_end = strchr(host, '/');
+  if (host_end == NULL || host_end == host || host_end - host >= MAX_HOST_LEN) {
+    return -1;
+  }
+  char* port = host_end + 1;
+  char* port_end = strchr(port, '/');
+  if (port_end == NULL || port_end[1] != '\0' || parse_target_port(port, port_end - port, port_parsed) < 0) {
+    return -1;
+  }
+
+  *host_end = '\0';
+  *host_parsed = host;
+  return 0;
+}
+
+/**
+ * Parses a CONNECT request, or a CONNECT-UDP request, which comes as an upgrade of a GET request over HTTP/1.1.
+ * @param udp_parsed set to whether it's a CONNECT-UDP request
+ * @return 0 on success; -1 if the message is neither
+ */
+int parse_http_connect_message(
+    char* message,
+    char** host_parsed,
+    unsigned short* port_parsed,
+    enum http_version* http_version_parsed,
+    bool* udp_parsed) {
+  // the headers are looked at before the request line is split up
+  *udp_parsed = has_connect_udp_upgrade(message);
+
   // CONNECT google.com:443 HTTP/1.0
+  // GET /.well-known/masque/udp/192.0.2.6/443/ HTTP/1.1
   char* saveptr;
   char* connect_token = strtok_r(message, " ", &saveptr);
-  if (connect_token == NULL || strcmp(connect_token, "CONNECT") != 0) {
+  if (connect_token == NULL || strcmp(connect_token, *udp_parsed ? "GET" : "CONNECT") != 0) {
     return -1;
   }
 
@@ -92,22 +372,36 @@ int parse_http_connect_message(char* message, char** host_parsed, char** port_pa
   if (host_port_token == NULL) {
     return -1;
   }
-  char* host_port_saveptr;
-  char* host = strtok_r(host_port_token, ":", &host_port_saveptr);
-  char* port = strtok_r(NULL, ":", &host_port_saveptr);
-  if (port == NULL) {
-    port = DEFAULT_TARGET_PORT;
+  char* host;
+  if (*udp_parsed) {
+    if (parse_connect_udp_path(host_port_token, &host, port_parsed) < 0) {
+      return -1;
+    }
+  } else {
+    char* host_port_saveptr;
+    host = strtok_r(host_port_token, ":", &host_port_saveptr);
+    if (host == NULL || strlen(host) >= MAX_HOST_LEN) {
+      return -1;
+    }
+    char* port = strtok_r(NULL, ":", &host_port_saveptr);
+    if (port == NULL) {
+      *port_parsed = DEFAULT_TARGET_PORT;
+    } else if (parse_target_port(port, strlen(port), port_parsed) < 0) {
+      return -1;
+    }
   }
 
-  // HTTP/1.1 or HTTP/1.0
+  // HTTP/1.1 or HTTP/1.0, which has no upgrades
   char* http_version = strtok_r(NULL, " \r\n", &saveptr);
-  if (http_version == NULL || (strcmp(http_version, "HTTP/1.0") != 0 && strcmp(http_version, "HTTP/1.1") != 0)) {
+  if (http_version != NULL && strcmp(http_version, "HTTP/1.1") == 0) {
+    *http_version_parsed = HTTP_VERSION_1_1;
+  } else if (http_version != NULL && strcmp(http_version, "HTTP/1.0") == 0 && !*udp_parsed) {
+    *http_version_parsed = HTTP_VERSION_1_0;
+  } else {
     return -1;
   }
 
   *host_parsed = host;
-  *port_parsed = port;
-  *http_version_parsed = http_version;
 
   return 0;
 }
@@ -116,16 +410,22 @@ int parse_http_connect_message(char* message, char** host_parsed, char** port_pa
  * @param conn
  * @return -1 if an error occurred and conn should be closed;
  * 0 if CONNECT was found and parsed;
- * 1 if we need to read more bytes.
+ * 1 if we need to read more bytes;
+ * 2 if the client speaks HTTP/2 instead, having sent the whole client preface.
  */
 int read_connect_request(struct tunnel_conn* conn) {
   struct tunnel_buffer* buf = &conn->to_target_buffer;
   ssize_t n_bytes_read = read_into_buffer(conn->client_socket, buf);
 
+  if (n_bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    // nothing to read yet
+    return 1;
+  }
+
   if (n_bytes_read < 0) {
     char* errno_desc = errno2s(errno);
     LOG("reading for CONNECT from %s failed: %s, received %d bytes",
-        conn->client_hostport,
+        client_hostport(conn),
         errno_desc,
         buf->write_ptr - buf->start);
     free(errno_desc);
@@ -134,31 +434,43 @@ int read_connect_request(struct tunnel_conn* conn) {
 
   if (n_bytes_read == 0) {
     LOG("client %s closed the connection before sending full http CONNECT message, received %d bytes: %s",
-        conn->client_hostport,
+        client_hostport(conn),
         buf->write_ptr - buf->start,
         buf->start);
     return -1;
   }
 
+  size_t n_bytes_received = buf->write_ptr - buf->start;
+  size_t n_preface_bytes = n_bytes_received < H2_CLIENT_PREFACE_LEN ? n_bytes_received : H2_CLIENT_PREFACE_LEN;
+  if (memcmp(buf->start, H2_CLIENT_PREFACE, n_preface_bytes) == 0) {
+    // HTTP/2 with prior knowledge, which carries any number of CONNECT requests
+    return n_preface_bytes == H2_CLIENT_PREFACE_LEN ? 2 : 1;
+  }
+
   char* double_crlf = strstr(buf->start, "\r\n\r\n");
   if (double_crlf != NULL) {
-    // received full CONNECT message
-    char *host, *port, *http_version;
-    if (parse_http_connect_message(buf->start, &host, &port, &http_version) < 0) {
+    // received full CONNECT message, which ends with the last header line for parsing, rather than at whatever the
+    // client sent along with it
+    double_crlf[2] = '\0';
+    char* host;
+    unsigned short port;
+    bool udp;
+    if (parse_http_connect_message(buf->start, &host, &port, &conn->http_version, &udp) < 0) {
       // malformed CONNECT
       LOG("couldn't parse CONNECT message: %s", buf->start);
       return -1;
     }
 
-    strncpy(conn->target_host, host, MAX_HOST_LEN);
-    strncpy(conn->target_port, port, MAX_PORT_LEN);
-    strncpy(conn->http_version, http_version, HTTP_VERSION_LEN);
-
-    set_target_hostport(conn);
+    set_target(conn, host, strlen(host), port);
 
     buf->read_ptr = double_crlf + 4;  // skip over the double crlf
 
-    LOG("received CONNECT request: %s %s:%s", conn->http_version, conn->target_host, conn->target_port);
+    if (udp) {
+      conn->udp_tunnel = create_udp_tunnel(conn);
+      LOG("received CONNECT-UDP request: %s", target_hostport(conn));
+    } else {
+      LOG("received CONNECT request: %s %s", http_version_name(conn->http_version), target_hostport(conn));
+    }
 
     return 0;
   }
@@ -167,7 +479,7 @@ int read_connect_request(struct tunnel_conn* conn) {
 
   if (buf->write_ptr >= buf->start + BUFFER_SIZE - 1) {
     // no, the buffer is full
-    LOG("no CONNECT message from %s until buffer is full", conn->client_hostport);
+    LOG("no CONNECT message from %s until buffer is full", client_hostport(conn));
     return -1;
   }
 
@@ -182,12 +494,139 @@ void handle_client_connect_request_readability(struct poll* p, struct tunnel_con
   } else if (result == 0) {
     // we have the full CONNECT message, let's connect to the target
     start_connecting_to_target(p, conn);
+  } else if (result == 2) {
+    serve_h2_client(p, conn);
+  } else {
+    // need to read more bytes, wait for readability again
+    if (poll_wait_for_readability(
+            p,
+            conn->client_socket,
+            conn,
+            true,
+            false,
+            POLL_PRIORITY_SETUP,
+            (poll_callback)handle_client_connect_request_readability) < 0) {
+      char* error_desc = errno2s(errno);
+      DEBUG_LOG("failed to re-add client socket from %s for reading CONNECT: %s", client_hostport(conn), error_desc);
+      free(error_desc);
+
+      destroy_tunnel_conn(conn);
+    }
+  }
+}
+
+/**
+ * Gets the destination the client originally connected to before its connection was redirected to us,
+ * e.g., with `iptables -t nat -j REDIRECT`.
+ * @return 0 on success; -1 if the connection was not redirected.
+ */
+int get_original_dst(int client_socket, struct sockaddr_in* original_dst) {
+  socklen_t addrlen = sizeof(struct sockaddr_in);
+  if (getsockopt(client_socket, SOL_IP, SO_ORIGINAL_DST, original_dst, &addrlen) < 0) {
+    return -1;
+  }
+
+  // without NAT, the original destination is just our own address
+  struct sockaddr_in local_addr;
+  addrlen = sizeof(struct sockaddr_in);
+  if (getsockname(client_socket, (struct sockaddr*)&local_addr, &addrlen) < 0 ||
+      (local_addr.sin_addr.s_addr == original_dst->sin_addr.s_addr && local_addr.sin_port == original_dst->sin_port)) {
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Reads the TLS ClientHello of a transparently redirected connection and determines the target from its server name,
+ * or from the original destination of the connection if there is no server name.
+ * @param conn
+ * @return -1 if an error occurred and conn should be closed;
+ * 0 if the target was determined;
+ * 1 if we need to read more bytes.
+ */
+int read_client_hello(struct tunnel_conn* conn) {
+  struct tunnel_buffer* buf = &conn->to_target_buffer;
+  ssize_t n_bytes_read = read_into_buffer(conn->client_socket, buf);
+
+  if (n_bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    // nothing to read yet
+    return 1;
+  }
+
+  if (n_bytes_read < 0) {
+    char* errno_desc = errno2s(errno);
+    LOG("reading for ClientHello from %s failed: %s, received %d bytes",
+        client_hostport(conn),
+        errno_desc,
+        buf->write_ptr - buf->start);
+    free(errno_desc);
+    return -1;
+  }
+
+  if (n_bytes_read == 0) {
+    LOG("client %s closed the connection before sending a full ClientHello, received %d bytes",
+        client_hostport(conn),
+        buf->write_ptr - buf->start);
+    return -1;
+  }
+
+  const char* host;
+  size_t host_len;
+  enum sni_parse_result result = parse_sni(buf->start, buf->write_ptr - buf->start, &host, &host_len);
+
+  if (result == SNI_NEED_MORE && buf->write_ptr < buf->start + BUFFER_SIZE - 1) {
+    return 1;
+  }
+
+  if (result == SNI_MALFORMED) {
+    LOG("client %s did not send a TLS ClientHello", client_hostport(conn));
+    return -1;
+  }
+
+  struct sockaddr_in original_dst;
+  bool has_original_dst = get_original_dst(conn->client_socket, &original_dst) == 0;
+
+  unsigned short port = has_original_dst ? ntohs(original_dst.sin_port) : DEFAULT_TARGET_PORT;
+  char original_dst_ip[INET_ADDRSTRLEN];
+  if (result == SNI_FOUND && host_len < MAX_HOST_LEN) {
+    set_target(conn, host, host_len, port);
+  } else if (has_original_dst) {
+    // e.g., the client connects by IP address
+    inet_ntop(AF_INET, &original_dst.sin_addr, original_dst_ip, sizeof(original_dst_ip));
+    set_target(conn, original_dst_ip, strlen(original_dst_ip), port);
+  } else {
+    LOG("no server name in the ClientHello from %s, and its connection was not redirected", client_hostport(conn));
+    return -1;
+  }
+
+  // the ClientHello will be forwarded to the target as is
+  buf->read_ptr = buf->start;
+
+  LOG("received ClientHello for %s", target_hostport(conn));
+
+  return 0;
+}
+
+void handle_client_hello_readability(struct poll* p, struct tunnel_conn* conn) {
+  int result = read_client_hello(conn);
+  if (result < 0) {
+    destroy_tunnel_conn(conn);
+  } else if (result == 0) {
+    start_connecting_to_target(p, conn);
   } else {
     // need to read more bytes, wait for readability again
     if (poll_wait_for_readability(
-            p, conn->client_socket, conn, true, false, (poll_callback)handle_client_connect_request_readability) < 0) {
+            p,
+            conn->client_socket,
+            conn,
+            true,
+            false,
+            POLL_PRIORITY_SETUP,
+            (poll_callback)handle_client_hello_readability) < 0) {
       char* error_desc = errno2s(errno);
-      DEBUG_LOG("failed to re-add client socket from %s for reading CONNECT: %s", conn->client_hostport, error_desc);
+      DEBUG_LOG(
+          "failed to re-add client socket from %s for reading ClientHello: %s", client_hostport(conn), error_desc);
       free(error_desc);
 
       destroy_tunnel_conn(conn);
@@ -0,0 +1,110 @@
+#include "access_log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "../log.h"
+#include "../util.h"
+
+#define RECORDS_PER_SEGMENT (ACCESS_LOG_SEGMENT_SIZE / ACCESS_LOG_RECORD_SIZE - 1)
+
+/**
+ * Maps a new segment file into memory.
+ * Its pages are populated right away, so that appending records doesn't fault on each new page.
+ * @return 0 on success; -1 on failure, with errno set
+ */
+int open_segment(struct access_log* log) {
+  char* path = hsprintf("%s/access-%d-%hu-%u.bin", log->dir, getpid(), log->thread_id, log->n_segments);
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  free(path);
+  if (fd < 0) {
+    return -1;
+  }
+
+  void* segment = MAP_FAILED;
+  if (ftruncate(fd, ACCESS_LOG_SEGMENT_SIZE) == 0) {
+    segment = mmap(NULL, ACCESS_LOG_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+  }
+  if (segment == MAP_FAILED) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+
+  log->fd = fd;
+  log->segment = segment;
+  log->n_records = 0;
+  log->n_segments++;
+
+  memcpy(log->segment->magic, ACCESS_LOG_MAGIC, sizeof(log->segment->magic));
+  log->segment->record_size = ACCESS_LOG_RECORD_SIZE;
+  log->segment->thread_id = log->thread_id;
+  log->segment->n_records = 0;
+  return 0;
+}
+
+// Unmaps the current segment and cuts its file down to the records that were written
+void close_segment(struct access_log* log) {
+  munmap(log->segment, ACCESS_LOG_SEGMENT_SIZE);
+  if (ftruncate(log->fd, (log->n_records + 1) * ACCESS_LOG_RECORD_SIZE) < 0) {
+    char* error_desc = errno2s(errno);
+    LOG("failed to truncate access log segment: %s", error_desc);
+    free(error_desc);
+  }
+  close(log->fd);
+  log->fd = -1;
+  log->segment = NULL;
+}
+
+/**
+ * @param dir where to put the segment files, or NULL if access logging is disabled
+ * @param thread_id
+ * @return the access log of the thread, or NULL if disabled
+ */
+struct access_log* open_access_log(const char* dir, unsigned short thread_id) {
+  if (dir == NULL) {
+    return NULL;
+  }
+
+  struct access_log* log = calloc(1, sizeof(struct access_log));
+  log->dir = dir;
+  log->thread_id = thread_id;
+  log->fd = -1;
+  return log;
+}
+
+void close_access_log(struct access_log* log) {
+  if (log == NULL) {
+    return;
+  }
+  if (log->fd >= 0) {
+    close_segment(log);
+  }
+  if (log->n_dropped > 0) {
+    LOG("%llu access log records were dropped", log->n_dropped);
+  }
+  free(log);
+}
+
+void access_log_append(struct access_log* log, const struct access_log_record* record) {
+  if (log->fd >= 0 && log->n_records == RECORDS_PER_SEGMENT) {
+    close_segment(log);
+  }
+
+  if (log->fd < 0 && open_segment(log) < 0) {
+    // try again with the next record
+    char* error_desc = errno2s(errno);
+    LOG("failed to open access log segment in %s: %s", log->dir, error_desc);
+    free(error_desc);
+    log->n_dropped++;
+    return;
+  }
+
+  struct access_log_record* records = (struct access_log_record*)(log->segment + 1);
+  records[log->n_records++] = *record;
+  // readers of a live segment only look at records that are complete
+  __atomic_store_n(&log->segment->n_records, log->n_records, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,99 @@
+#ifndef HTTPS_PROXY_ACCESS_LOG_H
+#define HTTPS_PROXY_ACCESS_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Binary access log, one fixed-width record per connection.
+ *
+ * Each connection thread appends to its own segment files `access-<pid>-<thread>-<n>.bin` in the access log directory,
+ * which are mapped into memory, so that writing a record is a plain memory copy without locks or system calls.
+ * A segment starts with a header of the same size as a record, followed by the records.
+ * All integers are in host byte order, except for the client address.
+ * Use `out/decode_access_log` to print the records as text or CSV.
+ */
+
+#define ACCESS_LOG_MAGIC "PXYALOG1"
+#define ACCESS_LOG_RECORD_SIZE 128
+#define ACCESS_LOG_HOST_LEN 76
+#define ACCESS_LOG_SEGMENT_SIZE (4 * 1024 * 1024)
+
+enum access_log_outcome {
+  // the client went away before telling us the target
+  ACCESS_LOG_NO_REQUEST = 0,
+  // blocked, or the target could not be reached
+  ACCESS_LOG_REJECTED = 1,
+  ACCESS_LOG_TUNNELED = 2,
+  // the client spoke HTTP/2, and each of its tunnels has a record of its own
+  ACCESS_LOG_HTTP2_CONNECTION = 3,
+};
+
+enum access_log_flag {
+  ACCESS_LOG_BLOCKED = 0x1,
+  ACCESS_LOG_TRANSPARENT = 0x2,
+  // the client sent its CONNECT request on an HTTP/2 stream
+  ACCESS_LOG_CLIENT_HTTP2 = 0x4,
+  // the tunnel went through the parent proxy
+  ACCESS_LOG_PARENT = 0x8,
+  // the target host didn't fit into the record
+  ACCESS_LOG_HOST_TRUNCATED = 0x10,
+  // the client asked for a UDP tunnel with a CONNECT-UDP request
+  ACCESS_LOG_UDP = 0x20,
+};
+
+struct access_log_segment_header {
+  char magic[8];
+  uint32_t record_size;
+  uint16_t thread_id;
+  uint16_t reserved;
+  // records written so far, updated after each record
+  uint64_t n_records;
+  char padding[ACCESS_LOG_RECORD_SIZE - 24];
+};
+
+struct access_log_record {
+  // wall clock time when the client connected, in microseconds since the epoch
+  uint64_t started_at_us;
+  uint64_t duration_us;
+  uint64_t n_bytes_to_target;
+  uint64_t n_bytes_to_client;
+  // from accepting the connection until we knew the target
+  uint32_t request_us;
+  // from then until we answered the client, i.e., connected to the target or rejected the request
+  uint32_t connect_us;
+  // IPv4 address in network byte order
+  uint32_t client_addr;
+  uint16_t client_port;
+  uint16_t target_port;
+  uint8_t outcome;
+  uint8_t flags;
+  uint8_t target_host_len;
+  uint8_t reserved;
+  // not null-terminated
+  char target_host[ACCESS_LOG_HOST_LEN];
+};
+
+_Static_assert(sizeof(struct access_log_segment_header) == ACCESS_LOG_RECORD_SIZE, "header size");
+_Static_assert(sizeof(struct access_log_record) == ACCESS_LOG_RECORD_SIZE, "record size");
+
+// The access log of one connection thread
+struct access_log {
+  const char* dir;
+  unsigned short thread_id;
+
+  // the current segment, `fd` is -1 if there is none
+  int fd;
+  struct access_log_segment_header* segment;
+  size_t n_records;
+  unsigned int n_segments;
+
+  // records lost because no segment could be opened
+  unsigned long long n_dropped;
+};
+
+struct access_log* open_access_log(const char* dir, unsigned short thread_id);
+void close_access_log(struct access_log* log);
+void access_log_append(struct access_log* log, const struct access_log_record* record);
+
+#endif  // HTTPS_PROXY_ACCESS_LOG_H
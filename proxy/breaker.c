@@ -0,0 +1,225 @@
+#include "breaker.h"
+#include <stdlib.h>
+#include <string.h>
+#include "../util.h"
+
+#define BREAKER_TABLE_INITIAL_CAPACITY 64
+// how long an open breaker first stays open, doubled with every failed probe up to the maximum
+#define BREAKER_INITIAL_BACKOFF_US 1000000ULL
+#define BREAKER_MAX_BACKOFF_US 60000000ULL
+// A probe that hasn't reported back by then (e.g., because it's still waiting out SYN retransmissions) no longer holds
+// off the next one
+#define BREAKER_PROBE_TIMEOUT_US 30000000ULL
+// failures this long ago, or breakers no one tried for this long after they could be probed, are forgotten
+#define BREAKER_FORGET_US 300000000ULL
+
+struct breaker_table* create_breaker_table(unsigned int threshold) {
+  if (threshold == 0) {
+    return NULL;
+  }
+
+  struct breaker_table* table = malloc(sizeof(struct breaker_table));
+  table->threshold = threshold;
+  table->capacity = BREAKER_TABLE_INITIAL_CAPACITY;
+  table->slots = calloc(table->capacity, sizeof(struct breaker*));
+  table->len = 0;
+  return table;
+}
+
+void destroy_breaker_table(struct breaker_table* table) {
+  if (table == NULL) {
+    return;
+  }
+
+  for (size_t i = 0; i < table->capacity; i++) {
+    struct breaker* breaker = table->slots[i];
+    while (breaker != NULL) {
+      struct breaker* next = breaker->next;
+      free(breaker);
+      breaker = next;
+    }
+  }
+  free(table->slots);
+  free(table);
+}
+
+size_t hash_breaker(const char* host, in_addr_t addr, unsigned short port) {
+  if (host[0] != '\0') {
+    return hash_key(host) * 31 + port;
+  }
+  unsigned long long key = (unsigned long long)addr << 16 | port;
+  return hash_bytes((const char*)&key, sizeof(key));
+}
+
+bool breaker_forgotten(struct breaker* breaker, unsigned long long now_us) {
+  unsigned long long last_seen_us = breaker->backoff_us > 0 ? breaker->open_until_us : breaker->last_failure_us;
+  return now_us >= last_seen_us + BREAKER_FORGET_US;
+}
+
+// Drops the breakers that are forgotten, so that the table only holds targets that failed recently
+void prune_breakers(struct breaker_table* table, unsigned long long now_us) {
+  for (size_t i = 0; i < table->capacity; i++) {
+    struct breaker** link = &table->slots[i];
+    while (*link != NULL) {
+      struct breaker* breaker = *link;
+      if (breaker_forgotten(breaker, now_us)) {
+        *link = breaker->next;
+        free(breaker);
+        table->len--;
+      } else {
+        link = &breaker->next;
+      }
+    }
+  }
+}
+
+void breaker_table_grow(struct breaker_table* table) {
+  size_t new_capacity = table->capacity * 2;
+  struct breaker** new_slots = calloc(new_capacity, sizeof(struct breaker*));
+  for (size_t i = 0; i < table->capacity; i++) {
+    struct breaker* breaker = table->slots[i];
+    while (breaker != NULL) {
+      struct breaker* next = breaker->next;
+      size_t slot = hash_breaker(breaker->host, breaker->addr, breaker->port) & (new_capacity - 1);
+      breaker->next = new_slots[slot];
+      new_slots[slot] = breaker;
+      breaker = next;
+    }
+  }
+  free(table->slots);
+  table->slots = new_slots;
+  table->capacity = new_capacity;
+}
+
+/**
+ * @param host empty for the breaker of an address
+ * @return the link pointing to the breaker, which points to NULL if there is none
+ */
+struct breaker** find_breaker(struct breaker_table* table, const char* host, in_addr_t addr, unsigned short port) {
+  struct breaker** link = &table->slots[hash_breaker(host, addr, port) & (table->capacity - 1)];
+  for (; *link != NULL; link = &(*link)->next) {
+    struct breaker* breaker = *link;
+    if (breaker->port == port && breaker->addr == addr && strcmp(breaker->host, host) == 0) {
+      break;
+    }
+  }
+  return link;
+}
+
+struct breaker* add_breaker(
+    struct breaker_table* table,
+    const char* host,
+    in_addr_t addr,
+    unsigned short port,
+    unsigned long long now_us) {
+  if (table->len >= table->capacity) {
+    // only grow if the table is full of breakers that still matter
+    prune_breakers(table, now_us);
+    if (table->len >= table->capacity / 2) {
+      breaker_table_grow(table);
+    }
+  }
+
+  size_t host_len = strlen(host);
+  struct breaker* breaker = malloc(sizeof(struct breaker) + host_len + 1);
+  memcpy(breaker->host, host, host_len + 1);
+  breaker->addr = addr;
+  breaker->port = port;
+  breaker->n_failures = 0;
+  breaker->backoff_us = 0;
+  breaker->open_until_us = 0;
+  breaker->last_failure_us = now_us;
+
+  size_t slot = hash_breaker(host, addr, port) & (table->capacity - 1);
+  breaker->next = table->slots[slot];
+  table->slots[slot] = breaker;
+  table->len++;
+  return breaker;
+}
+
+enum breaker_verdict check_breaker(struct breaker_table* table, const char* host, in_addr_t addr, unsigned short port) {
+  struct breaker* breaker = *find_breaker(table, host, addr, port);
+  if (breaker == NULL || breaker->backoff_us == 0) {
+    return BREAKER_CLOSED;
+  }
+
+  unsigned long long now_us = monotonic_time_us();
+  if (now_us < breaker->open_until_us) {
+    return BREAKER_OPEN;
+  }
+  // half-open: let this connection through, and hold off the others until it reports back
+  breaker->open_until_us = now_us + BREAKER_PROBE_TIMEOUT_US;
+  return BREAKER_PROBE;
+}
+
+/**
+ * @param succeeded whether the connection was established
+ * @param probe whether the connection was let through as a probe; others that fail while the breaker is open, having
+ * started before it opened, tell nothing new
+ */
+void record_result(
+    struct breaker_table* table,
+    const char* host,
+    in_addr_t addr,
+    unsigned short port,
+    bool succeeded,
+    bool probe) {
+  struct breaker** link = find_breaker(table, host, addr, port);
+  struct breaker* breaker = *link;
+  if (succeeded) {
+    if (breaker != NULL) {
+      *link = breaker->next;
+      free(breaker);
+      table->len--;
+    }
+    return;
+  }
+
+  unsigned long long now_us = monotonic_time_us();
+  if (breaker == NULL) {
+    breaker = add_breaker(table, host, addr, port, now_us);
+  }
+
+  if (breaker->backoff_us > 0) {
+    if (probe) {
+      breaker->backoff_us *= 2;
+      if (breaker->backoff_us > BREAKER_MAX_BACKOFF_US) {
+        breaker->backoff_us = BREAKER_MAX_BACKOFF_US;
+      }
+      breaker->open_until_us = now_us + breaker->backoff_us;
+      breaker->last_failure_us = now_us;
+    }
+    return;
+  }
+
+  // failures only count while they come in a row
+  if (now_us - breaker->last_failure_us >= BREAKER_FORGET_US) {
+    breaker->n_failures = 0;
+  }
+  breaker->last_failure_us = now_us;
+  if (++breaker->n_failures >= table->threshold) {
+    breaker->backoff_us = BREAKER_INITIAL_BACKOFF_US;
+    breaker->open_until_us = now_us + breaker->backoff_us;
+  }
+}
+
+enum breaker_verdict check_target_breaker(struct breaker_table* table, const char* host, unsigned short port) {
+  return check_breaker(table, host, 0, port);
+}
+
+void record_target_result(
+    struct breaker_table* table,
+    const char* host,
+    unsigned short port,
+    bool succeeded,
+    bool probe) {
+  record_result(table, host, 0, port, succeeded, probe);
+}
+
+enum breaker_verdict check_addr_breaker(struct breaker_table* table, const struct sockaddr_in* addr) {
+  return check_breaker(table, "", addr->sin_addr.s_addr, ntohs(addr->sin_port));
+}
+
+void record_addr_result(struct breaker_table* table, const struct sockaddr_in* addr, bool succeeded, bool probe) {
+  record_result(table, "", addr->sin_addr.s_addr, ntohs(addr->sin_port), succeeded, probe);
+}
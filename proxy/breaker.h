@@ -0,0 +1,62 @@
+#ifndef HTTPS_PROXY_BREAKER_H
+#define HTTPS_PROXY_BREAKER_H
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Consecutive failures to connect to a target host, or to one of its addresses.
+ * Once there are `threshold` of them the breaker opens, and connections to it fail right away until its back-off
+ * passes. Then a single connection may probe it: success closes the breaker, failure opens it for twice as long.
+ */
+struct breaker {
+  struct breaker* next;
+  unsigned short port;
+  // the address for breakers of an address, which have an empty host
+  in_addr_t addr;
+  unsigned int n_failures;
+  // 0 while the breaker is closed
+  unsigned long long backoff_us;
+  // connections fail right away until then, also while a probe is under way
+  unsigned long long open_until_us;
+  unsigned long long last_failure_us;
+  char host[];
+};
+
+/**
+ * A chained hash table of the breakers of the targets and addresses that failed recently; the others have none.
+ * Each thread has its own table, so no synchronisation is needed.
+ */
+struct breaker_table {
+  // failures in a row that open a breaker
+  unsigned int threshold;
+  struct breaker** slots;
+  size_t capacity;
+  size_t len;
+};
+
+enum breaker_verdict {
+  // connect as usual
+  BREAKER_CLOSED,
+  // connect as the probe of an open breaker, and report back whether that worked
+  BREAKER_PROBE,
+  // fail right away
+  BREAKER_OPEN,
+};
+
+struct breaker_table* create_breaker_table(unsigned int threshold);
+void destroy_breaker_table(struct breaker_table* table);
+
+enum breaker_verdict check_target_breaker(struct breaker_table* table, const char* host, unsigned short port);
+void record_target_result(
+    struct breaker_table* table,
+    const char* host,
+    unsigned short port,
+    bool succeeded,
+    bool probe);
+
+enum breaker_verdict check_addr_breaker(struct breaker_table* table, const struct sockaddr_in* addr);
+void record_addr_result(struct breaker_table* table, const struct sockaddr_in* addr, bool succeeded, bool probe);
+
+#endif  // HTTPS_PROXY_BREAKER_H
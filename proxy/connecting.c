@@ -6,10 +6,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include "../io.h"
 #include "../lib/asyncaddrinfo/asyncaddrinfo.h"
 #include "../log.h"
 #include "../poll.h"
+#include "../trace.h"
 #include "../util.h"
+#include "h2_tunnel.h"
 #include "proxy_server.h"
 
 // Information for a connection that is in the process of connecting to the target
@@ -19,22 +22,39 @@ struct connecting_data_block {
   struct addrinfo* host_addrs;
   struct addrinfo* next_addr;
   int target_sock;
+  // the address target_sock connects to
+  const struct sockaddr_in* target_addr;
+  // the count of connections from target_sock's egress address to the target, NULL without egress addresses
+  atomic_uint* egress_count;
+  // whether the tunnel probes the open circuit breaker of its target, or of the address target_sock connects to
+  bool probing_target;
+  bool probing_addr;
 };
 
 void send_rejection_response_to_client(struct poll* p, struct tunnel_conn* conn);
 
 void prepare_rejection_response(struct tunnel_conn* conn) {
-  int n_bytes = sprintf(conn->to_client_buffer.start, "%s 400 Bad Request \r\n\r\n", conn->http_version);
+  // the response is small and gets the connection closed soon, so it may exceed the memory budget
+  acquire_buffer(conn, &conn->to_client_buffer, true);
+  TRACE2(respond, conn->id, 400);
+  int n_bytes =
+      sprintf(conn->to_client_buffer.start, "%s 400 Bad Request \r\n\r\n", http_version_name(conn->http_version));
   conn->to_client_buffer.write_ptr += n_bytes;
 }
 
 void wait_to_send_rejection_response_to_client(struct poll* p, struct tunnel_conn* conn) {
   if (poll_wait_for_writability(
-          p, conn->client_socket, conn, true, false, (poll_callback)send_rejection_response_to_client) < 0) {
+          p,
+          conn->client_socket,
+          conn,
+          true,
+          false,
+          POLL_PRIORITY_SETUP,
+          (poll_callback)send_rejection_response_to_client) < 0) {
     char* error_desc = errno2s(errno);
     DEBUG_LOG(
         "failed to add client_socket of %s to poll instance for writing 4xx response: %s",
-        conn->client_hostport,
+        client_hostport(conn),
         error_desc);
     free(error_desc);
 
@@ -49,16 +69,19 @@ void send_rejection_response_to_client(struct poll* p, struct tunnel_conn* conn)
   if (n_bytes_to_send <= 0) {
     die(hsprintf(
         "going to send 4xx response for tunnel (%s) -> (%s), but the buf is empty; this should not happen",
-        conn->client_hostport,
-        conn->target_hostport));
+        client_hostport(conn),
+        target_hostport(conn)));
   }
 
-  ssize_t n_bytes_sent = send(conn->client_socket, buf->read_ptr, n_bytes_to_send, MSG_NOSIGNAL);
+  ssize_t n_bytes_sent = io_send(conn->client_socket, buf->read_ptr, n_bytes_to_send, MSG_NOSIGNAL);
 
-  if (n_bytes_sent < 0) {
+  if (n_bytes_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    wait_to_send_rejection_response_to_client(p, conn);
+    return;
+  } else if (n_bytes_sent < 0) {
     // teardown the entire connection
     char* error_desc = errno2s(errno);
-    LOG("failed to write 4xx response for (%s) -> (%s): %s", conn->client_hostport, conn->target_hostport, error_desc);
+    LOG("failed to write 4xx response for (%s) -> (%s): %s", client_hostport(conn), target_hostport(conn), error_desc);
     free(error_desc);
 
     destroy_tunnel_conn(conn);
@@ -68,8 +91,8 @@ void send_rejection_response_to_client(struct poll* p, struct tunnel_conn* conn)
   DEBUG_LOG(
       "sent %d bytes of 4xx response to client of (%s) -> (%s)",
       n_bytes_sent,
-      conn->client_hostport,
-      conn->target_hostport);
+      client_hostport(conn),
+      target_hostport(conn));
 
   buf->read_ptr += n_bytes_sent;
 
@@ -83,37 +106,134 @@ void send_rejection_response_to_client(struct poll* p, struct tunnel_conn* conn)
 }
 
 void reject_client_request(struct poll* p, struct tunnel_conn* conn) {
+  answer_client(conn, ACCESS_LOG_REJECTED);
+
+  if (conn->h2_tunnel != NULL && conn->h2_tunnel->client_on_stream) {
+    reject_h2_tunnel(p, conn->h2_tunnel);
+    return;
+  }
+
+  if (conn->transparent) {
+    // the client is speaking TLS to the target, there's nothing sensible for us to respond
+    destroy_tunnel_conn(conn);
+    return;
+  }
+
   prepare_rejection_response(conn);
-  wait_to_send_rejection_response_to_client(p, conn);
+  // the client has been waiting for our response, so its socket buffer has room for it
+  send_rejection_response_to_client(p, conn);
 }
 
 void handle_connection_completed(struct poll* p, struct connecting_data_block* data_block);
 
+/**
+ * Opens a socket and starts connecting it to the address, from one egress address after another if there are any,
+ * until one of them still has a port left for the address.
+ * @return the socket; -1 if connecting failed right away
+ */
+int start_connecting_to_addr(struct connecting_data_block* data_block, const struct sockaddr_in* addr) {
+  struct proxy_server* server = data_block->conn->thread->server;
+  unsigned long long tried_egress_addrs = 0;
+  while (1) {
+    // a UDP socket is connected right away, and like a TCP one, it's writable once it is
+    bool udp = data_block->conn->udp_tunnel != NULL;
+    int sock = io_socket(AF_INET, (udp ? SOCK_DGRAM : SOCK_STREAM) | SOCK_NONBLOCK, udp ? IPPROTO_UDP : IPPROTO_TCP);
+    if (sock < 0) {
+      return -1;
+    }
+    if (server->busy_poll_us > 0) {
+      enable_socket_busy_polling(sock, server->busy_poll_us);
+    }
+
+    if (server->egress != NULL) {
+      data_block->egress_count = bind_egress_addr(server->egress, sock, addr, &tried_egress_addrs);
+      if (data_block->egress_count == NULL) {
+        io_close(sock);
+        return -1;
+      }
+    }
+
+    TRACE3(connect_start, data_block->conn->id, addr->sin_addr.s_addr, ntohs(addr->sin_port));
+    if (io_connect(sock, (const struct sockaddr*)addr, sizeof(struct sockaddr_in)) == 0 || errno == EAGAIN ||
+        errno == EINPROGRESS) {
+      return sock;
+    }
+
+    // connect failed
+    int connect_errno = errno;
+    TRACE2(connect_done, data_block->conn->id, false);
+    io_close(sock);
+    release_egress_addr(data_block->egress_count);
+    data_block->egress_count = NULL;
+    if (connect_errno != EADDRNOTAVAIL || server->egress == NULL) {
+      errno = connect_errno;
+      return -1;
+    }
+    // the egress address ran out of ports for this target, another one may have some left
+    DEBUG_LOG("out of ports to connect to %s, trying another egress address", target_hostport(data_block->conn));
+  }
+}
+
+// Whether connecting failed because of the target (or the way there), rather than because we ran out of something
+bool is_target_unreachable(int connect_errno) {
+  return connect_errno == ECONNREFUSED || connect_errno == ENETUNREACH || connect_errno == EHOSTUNREACH ||
+         connect_errno == ETIMEDOUT;
+}
+
+/**
+ * The circuit breakers that connecting to the target goes by; NULL if there are none, or for a UDP tunnel, whose
+ * socket connects without hearing from the target.
+ */
+struct breaker_table* target_breakers(struct tunnel_conn* conn) {
+  return conn->udp_tunnel == NULL ? conn->thread->breakers : NULL;
+}
+
+// Reports whether connecting to the target worked to its circuit breaker, if there is one
+void record_connect_result(struct connecting_data_block* data_block, bool succeeded) {
+  struct tunnel_conn* conn = data_block->conn;
+  struct breaker_table* breakers = target_breakers(conn);
+  if (breakers != NULL) {
+    record_target_result(breakers, conn->target_host, conn->target_port, succeeded, data_block->probing_target);
+  }
+}
+
 void connect_to_target(struct poll* p, struct connecting_data_block* data_block) {
+  struct breaker_table* breakers = target_breakers(data_block->conn);
   // try all addresses
   for (; data_block->next_addr != NULL; data_block->next_addr = data_block->next_addr->ai_next) {
-    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
-    if (sock < 0) {
-      continue;
+    struct sockaddr_in* addr = (struct sockaddr_in*)data_block->next_addr->ai_addr;
+    data_block->probing_addr = false;
+    if (breakers != NULL) {
+      enum breaker_verdict verdict = check_addr_breaker(breakers, addr);
+      if (verdict == BREAKER_OPEN) {
+        DEBUG_LOG("skipping an address of %s, its circuit breaker is open", target_hostport(data_block->conn));
+        continue;
+      }
+      data_block->probing_addr = verdict == BREAKER_PROBE;
     }
 
-    if (connect(sock, data_block->next_addr->ai_addr, sizeof(struct sockaddr_in)) != 0 && errno != EAGAIN &&
-        errno != EINPROGRESS) {
-      // connect failed
-      close(sock);
+    int sock = start_connecting_to_addr(data_block, addr);
+    if (sock < 0) {
+      if (breakers != NULL && is_target_unreachable(errno)) {
+        record_addr_result(breakers, addr, false, data_block->probing_addr);
+      }
       continue;
     }
 
     data_block->target_sock = sock;
+    data_block->target_addr = addr;
 
     // wait until the connection is successful by waiting for writability on the socket
-    if (poll_wait_for_writability(p, sock, data_block, true, false, (poll_callback)handle_connection_completed) < 0) {
+    if (poll_wait_for_writability(
+            p, sock, data_block, true, false, POLL_PRIORITY_SETUP, (poll_callback)handle_connection_completed) < 0) {
       // cannot add the socket to the poll instance for some reason
       char* error_desc = errno2s(errno);
       DEBUG_LOG("failed to add target socket into epoll: %s", error_desc);
       free(error_desc);
 
-      close(sock);
+      io_close(sock);
+      release_egress_addr(data_block->egress_count);
+      data_block->egress_count = NULL;
       continue;
     }
 
@@ -123,7 +243,8 @@ void connect_to_target(struct poll* p, struct connecting_data_block* data_block)
   }
 
   // none of the addresses work
-  LOG("failed to connect to target %s: no more addresses to try", data_block->conn->target_hostport);
+  LOG("failed to connect to target %s: no more addresses to try", target_hostport(data_block->conn));
+  record_connect_result(data_block, false);
   freeaddrinfo(data_block->host_addrs);
   reject_client_request(p, data_block->conn);
   free(data_block);
@@ -133,15 +254,27 @@ void handle_connection_completed(struct poll* p, struct connecting_data_block* d
   // connection succeeded or failed
   struct sockaddr_in addr;
   socklen_t addrlen = sizeof(addr);
-  if (getpeername(data_block->target_sock, &addr, &addrlen) < 0) {
+  bool connected = io_getpeername(data_block->target_sock, (struct sockaddr*)&addr, &addrlen) == 0;
+  struct breaker_table* breakers = target_breakers(data_block->conn);
+  if (breakers != NULL) {
+    record_addr_result(breakers, data_block->target_addr, connected, data_block->probing_addr);
+  }
+
+  if (!connected) {
     // connection failed; try connecting with another address
-    shutdown(data_block->target_sock, SHUT_RDWR);
-    close(data_block->target_sock);
+    TRACE2(connect_done, data_block->conn->id, false);
+    io_shutdown(data_block->target_sock, SHUT_RDWR);
+    io_close(data_block->target_sock);
+    release_egress_addr(data_block->egress_count);
+    data_block->egress_count = NULL;
     connect_to_target(p, data_block);
   } else {
     // connection succeeded
+    TRACE2(connect_done, data_block->conn->id, true);
     data_block->conn->target_socket = data_block->target_sock;
-    LOG("connected to %s", data_block->conn->target_hostport);
+    data_block->conn->egress_count = data_block->egress_count;
+    LOG("connected to %s", target_hostport(data_block->conn));
+    record_connect_result(data_block, true);
 
     freeaddrinfo(data_block->host_addrs);
     start_tunneling(p, data_block->conn);
@@ -150,12 +283,14 @@ void handle_connection_completed(struct poll* p, struct connecting_data_block* d
 }
 
 void handle_asyncaddrinfo_resolve_readability(struct poll* p, struct connecting_data_block* data_block) {
-  int gai_errno = asyncaddrinfo_result(data_block->asyncaddrinfo_fd, &data_block->host_addrs);
+  int gai_errno = io_resolve_result(data_block->asyncaddrinfo_fd, &data_block->host_addrs);
+  TRACE2(dns_done, data_block->conn->id, gai_errno);
   if (gai_errno != 0) {
     LOG("host resolution for (%s) -> (%s) failed: %s",
-        data_block->conn->client_hostport,
-        data_block->conn->target_hostport,
+        client_hostport(data_block->conn),
+        target_hostport(data_block->conn),
         gai_strerror(gai_errno));
+    record_connect_result(data_block, false);
     reject_client_request(p, data_block->conn);
     free(data_block);
     return;
@@ -163,8 +298,8 @@ void handle_asyncaddrinfo_resolve_readability(struct poll* p, struct connecting_
 
   data_block->asyncaddrinfo_fd = -1;
   LOG("host resolution succeeded for (%s) -> (%s)",
-      data_block->conn->client_hostport,
-      data_block->conn->target_hostport);
+      client_hostport(data_block->conn),
+      target_hostport(data_block->conn));
 
   // start connecting
   data_block->next_addr = data_block->host_addrs;
@@ -179,10 +314,21 @@ int submit_hostname_lookup(
   struct addrinfo hints;
   memset(&hints, 0, sizeof(struct addrinfo));
   hints.ai_family = AF_INET;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_protocol = IPPROTO_TCP;
+  bool udp = data_block->conn->udp_tunnel != NULL;
+  hints.ai_socktype = udp ? SOCK_DGRAM : SOCK_STREAM;
+  hints.ai_protocol = udp ? IPPROTO_UDP : IPPROTO_TCP;
 
-  data_block->asyncaddrinfo_fd = asyncaddrinfo_resolve(hostname, port, &hints);
+  TRACE1(dns_start, data_block->conn->id);
+  data_block->asyncaddrinfo_fd = io_resolve(hostname, port, &hints);
+  if (data_block->asyncaddrinfo_fd < 0) {
+    char* error_desc = errno2s(errno);
+    LOG("failed to submit host resolution for (%s) -> (%s): %s",
+        client_hostport(data_block->conn),
+        target_hostport(data_block->conn),
+        error_desc);
+    free(error_desc);
+    return -1;
+  }
 
   if (poll_wait_for_readability(
           p,
@@ -190,15 +336,16 @@ int submit_hostname_lookup(
           data_block,
           true,
           false,
+          POLL_PRIORITY_SETUP,
           (poll_callback)handle_asyncaddrinfo_resolve_readability) < 0) {
     char* error_desc = errno2s(errno);
     DEBUG_LOG(
         "failed to add asyncaddrinfo_fd for (%s) -> (%s) into epoll: %s",
-        data_block->conn->client_hostport,
-        data_block->conn->target_hostport,
+        client_hostport(data_block->conn),
+        target_hostport(data_block->conn),
         error_desc);
     free(error_desc);
-    close(data_block->asyncaddrinfo_fd);
+    io_close(data_block->asyncaddrinfo_fd);
     return -1;
   }
 
@@ -208,14 +355,18 @@ int submit_hostname_lookup(
 void start_connecting_to_target(struct poll* p, struct tunnel_conn* conn) {
   struct connecting_data_block* data_block = malloc(sizeof(struct connecting_data_block));
   data_block->conn = conn;
+  data_block->egress_count = NULL;
+  data_block->probing_target = false;
+  data_block->probing_addr = false;
 
   // Check blocklist
   // To handle large blocklists, we should use a specialised string matching algorithm e.g. Aho-Corasick
-  char** blocklist = conn->blocklist;
-  int blocklist_len = conn->blocklist_len;
+  char** blocklist = conn->thread->server->blocklist;
+  int blocklist_len = conn->thread->server->blocklist_len;
   for (int i = 0; i < blocklist_len; i++) {
     if (strstr(conn->target_host, blocklist[i]) != NULL) {
       conn->is_blocked = true;
+      TRACE1(blocked, conn->id);
       LOG("block target: '%s' as it matches '%s'", data_block->conn->target_host, blocklist[i]);
       reject_client_request(p, data_block->conn);
       free(data_block);
@@ -223,7 +374,37 @@ void start_connecting_to_target(struct poll* p, struct tunnel_conn* conn) {
     }
   }
 
-  if (submit_hostname_lookup(p, data_block, conn->target_host, conn->target_port) < 0) {
+  if (conn->thread->server->parent_hostport != NULL) {
+    if (conn->udp_tunnel != NULL) {
+      // we only ask the parent proxy for TCP tunnels
+      LOG("rejecting CONNECT-UDP request for %s, which can't go through the parent proxy", target_hostport(conn));
+      reject_client_request(p, conn);
+      free(data_block);
+      return;
+    }
+    // the parent proxy resolves and connects to the target
+    free(data_block);
+    start_upstream_tunnel(p, conn);
+    return;
+  }
+
+  struct breaker_table* breakers = target_breakers(conn);
+  if (breakers != NULL) {
+    enum breaker_verdict verdict = check_target_breaker(breakers, conn->target_host, conn->target_port);
+    if (verdict == BREAKER_OPEN) {
+      // don't tie up a socket waiting for a target that failed every time lately
+      TRACE1(fast_fail, conn->id);
+      LOG("failing %s right away as its circuit breaker is open", target_hostport(conn));
+      reject_client_request(p, conn);
+      free(data_block);
+      return;
+    }
+    data_block->probing_target = verdict == BREAKER_PROBE;
+  }
+
+  char port[MAX_PORT_LEN];
+  snprintf(port, sizeof(port), "%hu", conn->target_port);
+  if (submit_hostname_lookup(p, data_block, conn->target_host, port) < 0) {
     reject_client_request(p, conn);
     free(data_block);
     return;
@@ -0,0 +1,243 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../http2/session.h"
+#include "../log.h"
+#include "../trace.h"
+#include "../util.h"
+#include "h2_tunnel.h"
+#include "proxy_server.h"
+
+// how many tunnels a client may have open at once on one HTTP/2 connection
+#define H2_CLIENT_MAX_STREAMS 256
+
+// The HTTP/2 connection of a client, which its tunnels share
+struct h2_client {
+  struct connection_thread* thread;
+  struct sockaddr_in addr;
+  // NULL until the session is set up
+  struct h2_session* session;
+  // in the list of the thread's clients
+  struct h2_client* prev;
+  struct h2_client* next;
+};
+
+void unlink_h2_client(struct h2_client* client) {
+  if (client->prev != NULL) {
+    client->prev->next = client->next;
+  } else {
+    client->thread->h2_clients = client->next;
+  }
+  if (client->next != NULL) {
+    client->next->prev = client->prev;
+  }
+}
+
+bool header_is(const struct hpack_header* header, const char* name) {
+  return header->name_len == strlen(name) && memcmp(header->name, name, header->name_len) == 0;
+}
+
+bool header_value_is(const struct hpack_header* header, const char* value) {
+  return header->value_len == strlen(value) && memcmp(header->value, value, header->value_len) == 0;
+}
+
+/**
+ * Splits the `:authority` of a CONNECT request into the target host and port of the connection.
+ * @return 0 on success; -1 if the authority is malformed or too long
+ */
+int parse_connect_authority(struct tunnel_conn* conn, const char* authority, size_t authority_len) {
+  const char* colon = memchr(authority, ':', authority_len);
+  size_t host_len = colon != NULL ? (size_t)(colon - authority) : authority_len;
+  if (host_len == 0 || host_len >= MAX_HOST_LEN) {
+    return -1;
+  }
+
+  unsigned short port = DEFAULT_TARGET_PORT;
+  if (colon != NULL && parse_target_port(colon + 1, authority_len - host_len - 1, &port) < 0) {
+    return -1;
+  }
+
+  set_target(conn, authority, host_len, port);
+  return 0;
+}
+
+// Sets up a tunnel for a CONNECT request (RFC 9113 Section 8.5) the client sent on a new stream
+void accept_h2_tunnel(
+    struct poll* p,
+    struct h2_stream* stream,
+    const struct hpack_header* headers,
+    size_t n_headers,
+    bool end_stream) {
+  struct h2_client* client = stream->session->data;
+  struct connection_thread* thread = client->thread;
+
+  const struct hpack_header* method = NULL;
+  const struct hpack_header* authority = NULL;
+  bool has_protocol = false;
+  for (size_t i = 0; i < n_headers; i++) {
+    if (header_is(&headers[i], ":method")) {
+      method = &headers[i];
+    } else if (header_is(&headers[i], ":authority")) {
+      authority = &headers[i];
+    } else if (header_is(&headers[i], ":protocol")) {
+      has_protocol = true;
+    }
+  }
+
+  if (method == NULL || !header_value_is(method, "CONNECT") || has_protocol) {
+    LOG("client %s sent a request other than CONNECT on stream %u", stream->session->peer_hostport, stream->id);
+    respond_on_stream(p, stream, "405", true);
+    h2_stream_close(p, stream);
+    return;
+  }
+
+  if (!thread_has_capacity(thread) || !server_has_capacity(thread->server)) {
+    LOG("too many active tunnels, refusing stream %u of %s", stream->id, stream->session->peer_hostport);
+    respond_on_stream(p, stream, "503", true);
+    h2_stream_close(p, stream);
+    return;
+  }
+
+  struct tunnel_conn* conn = create_tunnel_conn(thread);
+  conn->client_addr = client->addr;
+  TRACE3(accept, conn->id, client->addr.sin_addr.s_addr, ntohs(client->addr.sin_port));
+  conn->http_version = HTTP_VERSION_2;
+  if (authority == NULL || parse_connect_authority(conn, authority->value, authority->value_len) < 0) {
+    LOG("client %s sent a CONNECT request without a valid authority on stream %u",
+        client_hostport(conn),
+        stream->id);
+    TRACE2(respond, conn->id, 400);
+    respond_on_stream(p, stream, "400", true);
+    h2_stream_close(p, stream);
+    destroy_tunnel_conn(conn);
+    return;
+  }
+
+  conn->h2_tunnel = create_target_side_h2_tunnel(conn, stream);
+  conn->h2_tunnel->stream_eof = end_stream;
+  stream->data = conn->h2_tunnel;
+
+  LOG("received CONNECT request on stream: %s %s", client_hostport(conn), target_hostport(conn));
+  start_connecting_to_target(p, conn);
+}
+
+void handle_downstream_headers(
+    struct poll* p,
+    struct h2_stream* stream,
+    const struct hpack_header* headers,
+    size_t n_headers,
+    bool end_stream) {
+  if (stream->data == NULL) {
+    accept_h2_tunnel(p, stream, headers, n_headers, end_stream);
+    return;
+  }
+
+  // trailers carry nothing for us, but they may end the stream
+  if (end_stream) {
+    handle_h2_tunnel_data(p, stream, NULL, 0, true);
+  }
+}
+
+void handle_downstream_reset(struct poll* p, struct h2_stream* stream, uint32_t error_code) {
+  (void)p;
+  struct h2_tunnel* tunnel = stream->data;
+  struct tunnel_conn* conn = tunnel->conn;
+  (void)error_code;  // only logged
+  LOG("client reset stream of tunnel (%s) -> (%s) (error code %u)",
+      client_hostport(conn),
+      target_hostport(conn),
+      error_code);
+
+  tunnel->stream = NULL;
+  if (tunnel->started) {
+    destroy_tunnel_conn(conn);
+  }
+  // otherwise, we're still connecting to the target, and the tunnel is closed once that's done
+}
+
+void handle_downstream_closed(struct poll* p, struct h2_session* session) {
+  (void)p;
+  // every tunnel was closed along with its stream
+  struct h2_client* client = session->data;
+  unlink_h2_client(client);
+  free(client);
+}
+
+static const struct h2_session_callbacks downstream_callbacks = {
+    .on_headers = handle_downstream_headers,
+    .on_data = handle_h2_tunnel_data,
+    .on_send_window = handle_h2_tunnel_send_window,
+    .on_reset = handle_downstream_reset,
+    .on_closed = handle_downstream_closed,
+};
+
+/**
+ * Takes over a client connection that started with the HTTP/2 client preface instead of a CONNECT request.
+ * Each stream of it carries one tunnel with its own `tunnel_conn`; the connection we read the preface with is done.
+ */
+void serve_h2_client(struct poll* p, struct tunnel_conn* conn) {
+  if (conn->thread->server->parent_hostport != NULL) {
+    LOG("client %s speaks HTTP/2, which isn't supported with a parent proxy", client_hostport(conn));
+    destroy_tunnel_conn(conn);
+    return;
+  }
+
+  struct connection_thread* thread = conn->thread;
+  struct h2_client* client = malloc(sizeof(struct h2_client));
+  client->thread = thread;
+  client->addr = conn->client_addr;
+  client->session = NULL;
+  client->prev = NULL;
+  client->next = thread->h2_clients;
+  if (client->next != NULL) {
+    client->next->prev = client;
+  }
+  thread->h2_clients = client;
+
+  struct tunnel_buffer* buf = &conn->to_target_buffer;
+  struct h2_session* session = h2_session_create_server(
+      p,
+      conn->client_socket,
+      client_hostport(conn),
+      H2_TUNNEL_STREAM_WINDOW,
+      H2_CLIENT_MAX_STREAMS,
+      &downstream_callbacks,
+      client,
+      buf->start,
+      buf->write_ptr - buf->start);
+  if (session == NULL) {
+    char* error_desc = errno2s(errno);
+    LOG("failed to set up HTTP/2 session with client %s: %s", client_hostport(conn), error_desc);
+    free(error_desc);
+    unlink_h2_client(client);
+    free(client);
+    destroy_tunnel_conn(conn);
+    return;
+  }
+
+  if (!session->closed) {
+    // otherwise, the client is gone already: the session was torn down by what it received along with the preface
+    client->session = session;
+    if (thread->draining) {
+      h2_session_go_away(p, session);
+    }
+  }
+
+  LOG("client %s speaks HTTP/2", client_hostport(conn));
+  answer_client(conn, ACCESS_LOG_HTTP2_CONNECTION);
+  // the session owns the socket now
+  conn->client_socket = -1;
+  destroy_tunnel_conn(conn);
+}
+
+// Asks the HTTP/2 clients of the thread to go away once their open tunnels are done, e.g., since the thread is retiring
+void stop_serving_h2_clients(struct poll* p, struct connection_thread* thread) {
+  struct h2_client* client = thread->h2_clients;
+  while (client != NULL) {
+    // the session may be torn down right away, taking the client with it
+    struct h2_client* next = client->next;
+    h2_session_go_away(p, client->session);
+    client = next;
+  }
+}
@@ -0,0 +1,158 @@
+#include "egress.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "../log.h"
+#include "../util.h"
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24  // from linux/in.h
+#endif
+
+#define EGRESS_TARGET_BUCKETS 4096
+
+/**
+ * @param list comma-separated IPv4 addresses, e.g., 10.0.0.1,10.0.0.2
+ * @param addrs_ptr will point to a heap-allocated array of the addresses, with port 0
+ * @return the number of addresses in the list; -1 if the list is malformed or too long.
+ */
+int parse_egress_addrs(const char* list, struct sockaddr_in** addrs_ptr) {
+  struct sockaddr_in* addrs = NULL;
+  int addrs_len = 0;
+
+  const char* cursor = list;
+  while (*cursor != '\0') {
+    const char* end = strchr(cursor, ',');
+    size_t len = end != NULL ? (size_t)(end - cursor) : strlen(cursor);
+    char ip[INET_ADDRSTRLEN];
+    if (len == 0 || len >= sizeof(ip) || addrs_len >= MAX_EGRESS_ADDRS) {
+      free(addrs);
+      return -1;
+    }
+    memcpy(ip, cursor, len);
+    ip[len] = '\0';
+
+    addrs = realloc(addrs, (addrs_len + 1) * sizeof(struct sockaddr_in));
+    struct sockaddr_in* addr = &addrs[addrs_len++];
+    memset(addr, 0, sizeof(struct sockaddr_in));
+    addr->sin_family = AF_INET;
+    if (inet_pton(AF_INET, ip, &addr->sin_addr) != 1) {
+      free(addrs);
+      return -1;
+    }
+
+    cursor += len;
+    if (*cursor == ',') {
+      cursor++;
+    }
+  }
+
+  if (addrs_len == 0) {
+    free(addrs);
+    return -1;
+  }
+
+  *addrs_ptr = addrs;
+  return addrs_len;
+}
+
+/**
+ * Checks that the addresses are local, by binding a socket to each of them.
+ * @return the index of the first address that can't be bound to, with errno set; -1 if all of them can
+ */
+int find_unbindable_egress_addr(const struct sockaddr_in* addrs, int addrs_len) {
+  for (int i = 0; i < addrs_len; i++) {
+    int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock < 0) {
+      return i;
+    }
+    int enable = 1;
+    if (setsockopt(sock, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &enable, sizeof(enable)) < 0 ||
+        bind(sock, (const struct sockaddr*)&addrs[i], sizeof(struct sockaddr_in)) < 0) {
+      int bind_errno = errno;
+      close(sock);
+      errno = bind_errno;
+      return i;
+    }
+    close(sock);
+  }
+  return -1;
+}
+
+struct egress_pool* create_egress_pool(struct sockaddr_in* addrs, int addrs_len) {
+  if (addrs_len == 0) {
+    return NULL;
+  }
+
+  struct egress_pool* pool = malloc(sizeof(struct egress_pool));
+  pool->addrs = addrs;
+  pool->addrs_len = addrs_len;
+  pool->n_connections = malloc(EGRESS_TARGET_BUCKETS * addrs_len * sizeof(atomic_uint));
+  for (size_t i = 0; i < EGRESS_TARGET_BUCKETS * (size_t)addrs_len; i++) {
+    atomic_init(&pool->n_connections[i], 0);
+  }
+  return pool;
+}
+
+// The counters of the bucket of the target's address and port
+atomic_uint* egress_target_counters(struct egress_pool* pool, const struct sockaddr_in* target_addr) {
+  uint64_t key = (uint64_t)target_addr->sin_addr.s_addr << 16 | target_addr->sin_port;
+  size_t bucket = hash_bytes((const char*)&key, sizeof(key)) & (EGRESS_TARGET_BUCKETS - 1);
+  return &pool->n_connections[bucket * pool->addrs_len];
+}
+
+/**
+ * Binds the socket to the egress address with the fewest connections to the target, among those not tried yet.
+ * @param tried_addrs a mask of the addresses tried for this target so far, updated with the one bound to
+ * @return the counter of the address for the target, already including the connection;
+ * NULL if no address is left to try.
+ */
+atomic_uint* bind_egress_addr(
+    struct egress_pool* pool,
+    int sock,
+    const struct sockaddr_in* target_addr,
+    unsigned long long* tried_addrs) {
+  // leave picking the port to connect(), which can reuse ports that are taken for other targets
+  int enable = 1;
+  if (setsockopt(sock, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &enable, sizeof(enable)) < 0) {
+    return NULL;
+  }
+
+  atomic_uint* counters = egress_target_counters(pool, target_addr);
+  while (1) {
+    int least_used = -1;
+    unsigned int least_connections = 0;
+    for (int i = 0; i < pool->addrs_len; i++) {
+      unsigned int n_connections = atomic_load_explicit(&counters[i], memory_order_relaxed);
+      if ((*tried_addrs & 1ULL << i) == 0 && (least_used < 0 || n_connections < least_connections)) {
+        least_used = i;
+        least_connections = n_connections;
+      }
+    }
+    if (least_used < 0) {
+      return NULL;
+    }
+
+    *tried_addrs |= 1ULL << least_used;
+    if (bind(sock, (struct sockaddr*)&pool->addrs[least_used], sizeof(struct sockaddr_in)) < 0) {
+      char* error_desc = errno2s(errno);
+      LOG("failed to bind to egress address %s: %s", inet_ntoa(pool->addrs[least_used].sin_addr), error_desc);
+      free(error_desc);
+      continue;
+    }
+
+    atomic_fetch_add_explicit(&counters[least_used], 1, memory_order_relaxed);
+    return &counters[least_used];
+  }
+}
+
+// Counts a connection returned by `bind_egress_addr` as closed, if it has an egress address at all
+void release_egress_addr(atomic_uint* n_connections) {
+  if (n_connections != NULL) {
+    atomic_fetch_sub_explicit(n_connections, 1, memory_order_relaxed);
+  }
+}
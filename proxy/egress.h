@@ -0,0 +1,39 @@
+#ifndef HTTPS_PROXY_EGRESS_H
+#define HTTPS_PROXY_EGRESS_H
+
+#include <netinet/in.h>
+#include <stdatomic.h>
+
+// each address is tracked in a bit of a mask while connecting
+#define MAX_EGRESS_ADDRS 64
+
+/**
+ * Local addresses that connections to targets are made from, so that more than the ephemeral ports of a single
+ * address are available to each target.
+ * A socket gets its port only once it connects (IP_BIND_ADDRESS_NO_PORT), so a port is used up only for the target it
+ * connects to. New connections go out from the address with the fewest connections to their target.
+ * Connections are counted per address for buckets of targets, shared by all threads, and a target shares its bucket
+ * with others now and then, which only makes the spread a little less even.
+ */
+struct egress_pool {
+  struct sockaddr_in* addrs;
+  unsigned short addrs_len;
+  // addrs_len counters for each bucket of targets
+  atomic_uint* n_connections;
+};
+
+int parse_egress_addrs(const char* list, struct sockaddr_in** addrs_ptr);
+
+int find_unbindable_egress_addr(const struct sockaddr_in* addrs, int addrs_len);
+
+struct egress_pool* create_egress_pool(struct sockaddr_in* addrs, int addrs_len);
+
+atomic_uint* bind_egress_addr(
+    struct egress_pool* pool,
+    int sock,
+    const struct sockaddr_in* target_addr,
+    unsigned long long* tried_addrs);
+
+void release_egress_addr(atomic_uint* n_connections);
+
+#endif  // HTTPS_PROXY_EGRESS_H
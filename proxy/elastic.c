@@ -0,0 +1,235 @@
+#include "elastic.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "../log.h"
+#include "../poll.h"
+#include "../util.h"
+#include "proxy_server.h"
+
+// how often each thread publishes its busy time and checks whether it should drain
+#define ELASTIC_WATCH_INTERVAL_US 250000
+// how often thread 0 looks at the utilisation of all threads
+#define ELASTIC_SAMPLE_INTERVAL_US 1000000
+
+// Start a thread once the average utilisation stayed at least this high for this many samples in a row
+#define ELASTIC_BUSY_UTILISATION 0.75
+#define ELASTIC_BUSY_SAMPLES 5
+// Retire a thread once the others would have stayed at most this busy without it for this many samples in a row.
+// Retiring takes a while and starting is cheap, so we are a lot more patient with the former.
+#define ELASTIC_IDLE_UTILISATION 0.5
+#define ELASTIC_IDLE_SAMPLES 30
+
+struct elastic_scaler* create_elastic_scaler(unsigned short min_threads_len, unsigned short max_threads_len) {
+  if (max_threads_len <= min_threads_len) {
+    return NULL;
+  }
+
+  struct elastic_scaler* scaler = malloc(sizeof(struct elastic_scaler));
+  scaler->min_threads_len = min_threads_len;
+  scaler->sampled_at_us = monotonic_time_us();
+  scaler->last_busy_us = calloc(max_threads_len, sizeof(unsigned long long));
+  scaler->n_busy_samples = 0;
+  scaler->n_idle_samples = 0;
+  return scaler;
+}
+
+// Whether the thread takes new connections
+bool thread_is_running(struct connection_thread* thread) {
+  return atomic_load(&thread->state) == THREAD_RUNNING;
+}
+
+/**
+ * Runs the connection thread on a new, detached pthread.
+ * @return whether the thread was started
+ */
+bool start_connection_thread(struct connection_thread* thread) {
+  atomic_store(&thread->state, THREAD_RUNNING);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_t pthread;
+  int err = pthread_create(&pthread, &attr, thread->server->run_thread, thread);
+  pthread_attr_destroy(&attr);
+  if (err != 0) {
+    char* error_desc = errno2s(err);
+    printf("Failed to start connection thread %hu: %s\n", thread->id, error_desc);
+    free(error_desc);
+    atomic_store(&thread->state, THREAD_STOPPED);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Stops taking new connections, and asks the clients and the parent proxy on long-lived HTTP/2 connections to go away
+ * once their tunnels are done.
+ */
+void start_draining(struct poll* p, struct connection_thread* thread) {
+  struct proxy_server* server = thread->server;
+  LOG("draining connection thread");
+
+  // Closing a listening socket of its own resets the connections waiting in it, so pick those up first.
+  // A shared listening socket stays open for the other threads (or the process taking over), but no longer wakes this
+  // thread up.
+  if (thread->listening_socket >= 0 && thread->listening_socket != server->listening_socket) {
+    accept_incoming_connections(p, thread);
+    close(thread->listening_socket);
+    thread->listening_socket = -1;
+  } else if (thread->listening_socket >= 0) {
+    poll_remove(p, thread->listening_socket);
+  }
+  if (thread->transparent_listening_socket >= 0 &&
+      thread->transparent_listening_socket != server->transparent_listening_socket) {
+    accept_incoming_transparent_connections(p, thread);
+    close(thread->transparent_listening_socket);
+    thread->transparent_listening_socket = -1;
+  } else if (thread->transparent_listening_socket >= 0) {
+    poll_remove(p, thread->transparent_listening_socket);
+  }
+  thread->draining = true;
+
+  stop_serving_h2_clients(p, thread);
+  disconnect_from_parent(p, thread);
+}
+
+/**
+ * Whether the thread has nothing left to do.
+ * Connections to the parent proxy only go away once no tunnel uses them, so they are closed here once the last one is
+ * done, and the thread is drained the next time we look.
+ */
+bool thread_drained(struct poll* p, struct connection_thread* thread) {
+  if (atomic_load_explicit(&thread->load.active_tunnels, memory_order_relaxed) > 0 || thread->h2_clients != NULL ||
+      !handoff_inbox_settled(thread) || !migration_inbox_settled(thread)) {
+    return false;
+  }
+
+  if (thread->upstream_sessions != NULL) {
+    for (unsigned short i = 0; i < thread->server->parent_connections; i++) {
+      if (thread->upstream_sessions[i] != NULL) {
+        disconnect_from_parent(p, thread);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/**
+ * Runs periodically on every connection thread while the thread count is elastic.
+ * It publishes how busy the thread's event loop was for thread 0 to decide on, and once thread 0 asks it to retire,
+ * drains the thread and stops its event loop.
+ */
+void watch_thread_state(struct poll* p, struct connection_thread* thread) {
+  atomic_fetch_add_explicit(&thread->load.busy_us, poll_take_busy_us(p), memory_order_relaxed);
+
+  if (atomic_load(&thread->state) == THREAD_DRAINING) {
+    if (!thread->draining) {
+      start_draining(p, thread);
+    }
+    if (thread_drained(p, thread)) {
+      LOG("connection thread drained");
+      poll_stop(p);
+      return;
+    }
+  }
+
+  if (poll_add_timer(p, ELASTIC_WATCH_INTERVAL_US, thread, (poll_callback)watch_thread_state) == NULL) {
+    LOG("failed to schedule the next check of the thread's state");
+  }
+}
+
+/**
+ * Picks the thread to retire: the one started last, other than thread 0 which runs this.
+ * Acceptors are never retired, since they make up a fixed share of the threads.
+ * @return the thread, or NULL if there is none
+ */
+struct connection_thread* pick_thread_to_retire(struct proxy_server* server) {
+  unsigned short first = server->acceptors_len > 0 ? server->acceptors_len : 1;
+  for (int i = server->threads_len - 1; i >= first; i--) {
+    if (thread_is_running(&server->threads[i])) {
+      return &server->threads[i];
+    }
+  }
+  return NULL;
+}
+
+struct connection_thread* pick_thread_to_start(struct proxy_server* server) {
+  for (int i = server->acceptors_len; i < server->threads_len; i++) {
+    if (atomic_load(&server->threads[i].state) == THREAD_STOPPED) {
+      return &server->threads[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Runs periodically on thread 0. Samples the utilisation of the threads that handle connections, and starts another
+ * thread once they stay busy, or retires one once they stay idle.
+ * Dedicated acceptors are left out of the average, since more threads wouldn't help them.
+ */
+void scale_connection_threads(struct poll* p, struct connection_thread* thread) {
+  struct proxy_server* server = thread->server;
+  struct elastic_scaler* scaler = server->scaler;
+  if (server->upgrade != NULL && upgrade_handed_over(server->upgrade)) {
+    // all threads are on their way out
+    return;
+  }
+
+  unsigned long long now_us = monotonic_time_us();
+  unsigned long long elapsed_us = now_us - scaler->sampled_at_us;
+  scaler->sampled_at_us = now_us;
+
+  double utilisation = 0;
+  unsigned short n_workers = 0;
+  unsigned short n_running = 0;
+  for (int i = 0; i < server->threads_len; i++) {
+    unsigned long long busy_us = atomic_load_explicit(&server->threads[i].load.busy_us, memory_order_relaxed);
+    if (thread_is_running(&server->threads[i])) {
+      n_running++;
+      if (i >= server->acceptors_len) {
+        utilisation += (double)(busy_us - scaler->last_busy_us[i]) / elapsed_us;
+        n_workers++;
+      }
+    }
+    scaler->last_busy_us[i] = busy_us;
+  }
+  utilisation /= n_workers;
+
+  if (utilisation >= ELASTIC_BUSY_UTILISATION) {
+    scaler->n_busy_samples++;
+    scaler->n_idle_samples = 0;
+  } else if (n_workers > 1 && utilisation * n_workers / (n_workers - 1) <= ELASTIC_IDLE_UTILISATION) {
+    scaler->n_idle_samples++;
+    scaler->n_busy_samples = 0;
+  } else {
+    scaler->n_busy_samples = 0;
+    scaler->n_idle_samples = 0;
+  }
+
+  struct connection_thread* target = NULL;
+  if (scaler->n_busy_samples >= ELASTIC_BUSY_SAMPLES && (target = pick_thread_to_start(server)) != NULL) {
+    if (start_connection_thread(target)) {
+      printf("Started connection thread %hu, %hu running (utilisation %.0f%%)\n",
+             target->id,
+             n_running + 1,
+             utilisation * 100);
+    }
+    scaler->n_busy_samples = 0;
+  } else if (scaler->n_idle_samples >= ELASTIC_IDLE_SAMPLES && n_running > scaler->min_threads_len &&
+             (target = pick_thread_to_retire(server)) != NULL) {
+    // the thread notices this within one watch interval
+    atomic_store(&target->state, THREAD_DRAINING);
+    printf("Retiring connection thread %hu, %hu running (utilisation %.0f%%)\n",
+           target->id,
+           n_running - 1,
+           utilisation * 100);
+    scaler->n_idle_samples = 0;
+  }
+
+  if (poll_add_timer(p, ELASTIC_SAMPLE_INTERVAL_US, thread, (poll_callback)scale_connection_threads) == NULL) {
+    LOG("failed to schedule the next sample of thread utilisation");
+  }
+}
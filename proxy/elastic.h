@@ -0,0 +1,48 @@
+#ifndef HTTPS_PROXY_ELASTIC_H
+#define HTTPS_PROXY_ELASTIC_H
+
+#include <stdbool.h>
+
+struct poll;
+struct proxy_server;
+struct connection_thread;
+
+enum connection_thread_state {
+  // not started yet, or retired; the slot can be (re)started
+  THREAD_STOPPED = 0,
+  THREAD_RUNNING,
+  // retiring: no new connections, and stops once its tunnels are done
+  THREAD_DRAINING,
+};
+
+/**
+ * Grows and shrinks the number of connection threads with their utilisation, i.e., the share of time their event loops
+ * spend handling events rather than waiting for them.
+ * Only thread 0 looks at this, so it needs no synchronisation.
+ */
+struct elastic_scaler {
+  // never retire threads below this number
+  unsigned short min_threads_len;
+  unsigned long long sampled_at_us;
+  // busy time of each thread at the last sample, indexed by thread id
+  unsigned long long* last_busy_us;
+  // how many samples in a row were above or below the thresholds
+  unsigned int n_busy_samples;
+  unsigned int n_idle_samples;
+};
+
+struct elastic_scaler* create_elastic_scaler(unsigned short min_threads_len, unsigned short max_threads_len);
+
+bool thread_is_running(struct connection_thread* thread);
+
+bool start_connection_thread(struct connection_thread* thread);
+
+void start_draining(struct poll* p, struct connection_thread* thread);
+
+bool thread_drained(struct poll* p, struct connection_thread* thread);
+
+void watch_thread_state(struct poll* p, struct connection_thread* thread);
+
+void scale_connection_threads(struct poll* p, struct connection_thread* thread);
+
+#endif  // HTTPS_PROXY_ELASTIC_H
@@ -0,0 +1,64 @@
+#ifndef HTTPS_PROXY_H2_TUNNEL_H
+#define HTTPS_PROXY_H2_TUNNEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "tunnel_conn.h"
+
+// room in the buffer towards the socket for our HTTP response, which doesn't count against the stream's window
+#define H2_TUNNEL_RESPONSE_RESERVE 64
+// The receive window of a tunnel's stream, so that everything the peer may send fits into the tunnel's buffer.
+// The window is only replenished once that buffer has been written out to the socket.
+#define H2_TUNNEL_STREAM_WINDOW (BUFFER_SIZE - H2_TUNNEL_RESPONSE_RESERVE)
+
+struct poll;
+struct h2_stream;
+
+/**
+ * Relays a tunnel between a socket and an HTTP/2 stream that carries the other side of the tunnel.
+ * Like a tunneling link, it reads from `read_fd` and writes to `write_fd`, which are dups of the same socket.
+ * Either the client is on the socket and the stream goes to the parent proxy,
+ * or the client is on the stream (one of many on its HTTP/2 connection to us) and the socket goes to the target.
+ */
+struct h2_tunnel {
+  struct tunnel_conn* conn;
+  // NULL once the stream is closed or reset
+  struct h2_stream* stream;
+  // the client sent its CONNECT request on the stream
+  bool client_on_stream;
+
+  int read_fd;
+  int write_fd;
+  // data read from the socket, to be sent on the stream
+  struct tunnel_buffer* to_stream;
+  // data received on the stream, to be written to the socket
+  struct tunnel_buffer* to_socket;
+  // count the bytes relayed in each direction
+  unsigned long long* n_bytes_to_stream;
+  unsigned long long* n_bytes_to_socket;
+
+  // relaying, as opposed to waiting for the other side of the stream to accept the tunnel
+  bool started;
+  bool reading;
+  bool writing;
+  // the socket sent FIN, and we sent END_STREAM
+  bool socket_eof;
+  // we received END_STREAM
+  bool stream_eof;
+  // bytes received on the stream since its window was last replenished
+  size_t n_bytes_unacked;
+};
+
+struct h2_tunnel* create_client_side_h2_tunnel(struct tunnel_conn* conn);
+struct h2_tunnel* create_target_side_h2_tunnel(struct tunnel_conn* conn, struct h2_stream* stream);
+void destroy_h2_tunnel(struct tunnel_conn* conn);
+
+void start_h2_tunneling(struct poll* p, struct h2_tunnel* tunnel);
+void reject_h2_tunnel(struct poll* p, struct h2_tunnel* tunnel);
+void respond_on_stream(struct poll* p, struct h2_stream* stream, const char* status, bool end_stream);
+
+void handle_h2_tunnel_data(struct poll* p, struct h2_stream* stream, const char* data, size_t len, bool end_stream);
+void handle_h2_tunnel_send_window(struct poll* p, struct h2_stream* stream);
+
+#endif  // HTTPS_PROXY_H2_TUNNEL_H
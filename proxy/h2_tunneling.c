@@ -0,0 +1,369 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "../http2/session.h"
+#include "../io.h"
+#include "../log.h"
+#include "../poll.h"
+#include "../trace.h"
+#include "../util.h"
+#include "h2_tunnel.h"
+#include "proxy_server.h"
+
+// A tunnel whose client is on a socket, and whose target is reached through a stream
+struct h2_tunnel* create_client_side_h2_tunnel(struct tunnel_conn* conn) {
+  struct h2_tunnel* tunnel = calloc(1, sizeof(struct h2_tunnel));
+  tunnel->conn = conn;
+  tunnel->stream = NULL;
+  tunnel->read_fd = conn->client_socket;
+  tunnel->write_fd = -1;  // dupped once the tunnel starts
+  tunnel->to_stream = &conn->to_target_buffer;
+  tunnel->to_socket = &conn->to_client_buffer;
+  tunnel->n_bytes_to_stream = &conn->n_bytes_to_target;
+  tunnel->n_bytes_to_socket = &conn->n_bytes_to_client;
+  return tunnel;
+}
+
+// A tunnel whose client is on a stream, and whose target is reached through a socket
+struct h2_tunnel* create_target_side_h2_tunnel(struct tunnel_conn* conn, struct h2_stream* stream) {
+  struct h2_tunnel* tunnel = calloc(1, sizeof(struct h2_tunnel));
+  tunnel->conn = conn;
+  tunnel->stream = stream;
+  tunnel->client_on_stream = true;
+  tunnel->read_fd = -1;  // the target socket once connected
+  tunnel->write_fd = -1;
+  tunnel->to_stream = &conn->to_client_buffer;
+  tunnel->to_socket = &conn->to_target_buffer;
+  tunnel->n_bytes_to_stream = &conn->n_bytes_to_client;
+  tunnel->n_bytes_to_socket = &conn->n_bytes_to_target;
+
+  // the client may send data right after its request, which we hold on to while connecting to the target
+  acquire_buffer(conn, tunnel->to_socket, true);
+  return tunnel;
+}
+
+void destroy_h2_tunnel(struct tunnel_conn* conn) {
+  struct h2_tunnel* tunnel = conn->h2_tunnel;
+  if (tunnel->stream != NULL) {
+    h2_stream_close(conn->thread->poll, tunnel->stream);
+  }
+  free(tunnel);
+  conn->h2_tunnel = NULL;
+}
+
+// The end of the tunnel on the socket, for logging
+const char* socket_hostport(struct h2_tunnel* tunnel) {
+  return tunnel->client_on_stream ? target_hostport(tunnel->conn) : client_hostport(tunnel->conn);
+}
+
+// The end of the tunnel on the stream, for logging
+const char* stream_hostport(struct h2_tunnel* tunnel) {
+  return tunnel->client_on_stream ? client_hostport(tunnel->conn) : target_hostport(tunnel->conn);
+}
+
+void handle_h2_tunnel_readability(struct poll* p, struct h2_tunnel* tunnel);
+void handle_h2_tunnel_writability(struct poll* p, struct h2_tunnel* tunnel);
+
+void h2_tunnel_wait_to_read(struct poll* p, struct h2_tunnel* tunnel) {
+  if (tunnel->reading || tunnel->socket_eof) {
+    return;
+  }
+
+  if (poll_wait_for_readability(
+          p,
+          tunnel->read_fd,
+          tunnel,
+          true,
+          false,
+          POLL_PRIORITY_RELAY,
+          (poll_callback)handle_h2_tunnel_readability) < 0) {
+    char* error_desc = errno2s(errno);
+    DEBUG_LOG(
+        "failed to wait on read_fd of (%s) -> (%s) for readability: %s",
+        socket_hostport(tunnel),
+        stream_hostport(tunnel),
+        error_desc);
+    free(error_desc);
+
+    destroy_tunnel_conn(tunnel->conn);
+    return;
+  }
+  tunnel->reading = true;
+}
+
+// Returns false if the tunnel was destroyed instead
+bool h2_tunnel_wait_to_write(struct poll* p, struct h2_tunnel* tunnel) {
+  if (tunnel->writing) {
+    return true;
+  }
+
+  if (poll_wait_for_writability(
+          p,
+          tunnel->write_fd,
+          tunnel,
+          true,
+          false,
+          POLL_PRIORITY_RELAY,
+          (poll_callback)handle_h2_tunnel_writability) < 0) {
+    char* error_desc = errno2s(errno);
+    DEBUG_LOG(
+        "failed to wait on write_fd of (%s) -> (%s) for writability: %s",
+        stream_hostport(tunnel),
+        socket_hostport(tunnel),
+        error_desc);
+    free(error_desc);
+
+    destroy_tunnel_conn(tunnel->conn);
+    return false;
+  }
+  tunnel->writing = true;
+  return true;
+}
+
+// Tears down the tunnel once both directions have ended and everything has been written out
+void h2_tunnel_maybe_finish(struct tunnel_conn* conn) {
+  struct h2_tunnel* tunnel = conn->h2_tunnel;
+  if (tunnel->socket_eof && tunnel->stream_eof && tunnel->to_socket->read_ptr >= tunnel->to_socket->write_ptr) {
+    LOG("tunnel (%s) -> (%s) closed", client_hostport(conn), target_hostport(conn));
+    destroy_tunnel_conn(conn);
+  }
+}
+
+void h2_tunnel_end_writing(struct h2_tunnel* tunnel) {
+  LOG("peer (%s) -> (%s) closed connection", stream_hostport(tunnel), socket_hostport(tunnel));
+  TRACE2(half_close, tunnel->conn->id, tunnel->client_on_stream);
+  io_shutdown(tunnel->write_fd, SHUT_WR);
+  h2_tunnel_maybe_finish(tunnel->conn);
+}
+
+// Sends as much of the data read from the socket as the stream's window allows
+void h2_tunnel_send_to_stream(struct poll* p, struct h2_tunnel* tunnel) {
+  struct tunnel_buffer* buf = tunnel->to_stream;
+  size_t n_bytes_to_send = buf->write_ptr - buf->read_ptr;
+  size_t capacity = h2_stream_send_capacity(tunnel->stream);
+  if (n_bytes_to_send > capacity) {
+    n_bytes_to_send = capacity;
+  }
+
+  if (n_bytes_to_send > 0) {
+    TRACE3(send, tunnel->conn->id, !tunnel->client_on_stream, n_bytes_to_send);
+    h2_stream_send_data(p, tunnel->stream, buf->read_ptr, n_bytes_to_send, false);
+    buf->read_ptr += n_bytes_to_send;
+  }
+
+  if (buf->read_ptr >= buf->write_ptr) {
+    buf->read_ptr = buf->write_ptr = buf->start;
+    h2_tunnel_wait_to_read(p, tunnel);
+  }
+  // otherwise, the rest is sent once the peer opens the window further
+}
+
+void handle_h2_tunnel_readability(struct poll* p, struct h2_tunnel* tunnel) {
+  tunnel->reading = false;
+
+  size_t capacity = h2_stream_send_capacity(tunnel->stream);
+  if (capacity == 0) {
+    // reading resumes once the peer opens the window
+    return;
+  }
+  if (capacity > BUFFER_SIZE) {
+    capacity = BUFFER_SIZE;
+  }
+
+  struct tunnel_buffer* buf = tunnel->to_stream;
+  ssize_t n_bytes_read = io_read(tunnel->read_fd, buf->write_ptr, capacity);
+
+  if (n_bytes_read == 0) {
+    // peer stopped sending
+    LOG("peer (%s) -> (%s) closed connection", socket_hostport(tunnel), stream_hostport(tunnel));
+    TRACE2(half_close, tunnel->conn->id, !tunnel->client_on_stream);
+    io_shutdown(tunnel->read_fd, SHUT_RD);
+    tunnel->socket_eof = true;
+    h2_stream_send_data(p, tunnel->stream, NULL, 0, true);
+    h2_tunnel_maybe_finish(tunnel->conn);
+    return;
+  } else if (n_bytes_read < 0) {
+    char* error_desc = errno2s(errno);
+    LOG("read error from (%s) -> (%s): %s", socket_hostport(tunnel), stream_hostport(tunnel), error_desc);
+    free(error_desc);
+
+    destroy_tunnel_conn(tunnel->conn);
+    return;
+  }
+
+  DEBUG_LOG("received %zu bytes (%s) -> (%s)", n_bytes_read, socket_hostport(tunnel), stream_hostport(tunnel));
+  TRACE3(read, tunnel->conn->id, !tunnel->client_on_stream, n_bytes_read);
+  buf->write_ptr += n_bytes_read;
+  *tunnel->n_bytes_to_stream += n_bytes_read;
+  atomic_fetch_add_explicit(&tunnel->conn->thread->load.n_bytes_transferred, n_bytes_read, memory_order_relaxed);
+
+  h2_tunnel_send_to_stream(p, tunnel);
+}
+
+void handle_h2_tunnel_writability(struct poll* p, struct h2_tunnel* tunnel) {
+  tunnel->writing = false;
+
+  struct tunnel_buffer* buf = tunnel->to_socket;
+  size_t n_bytes_to_send = buf->write_ptr - buf->read_ptr;
+
+  if (n_bytes_to_send <= 0) {
+    die(hsprintf(
+        "going to write for tunnel (%s) -> (%s), but the buf is empty; this should not happen",
+        stream_hostport(tunnel),
+        socket_hostport(tunnel)));
+  }
+
+  ssize_t n_bytes_sent = io_send(tunnel->write_fd, buf->read_ptr, n_bytes_to_send, MSG_NOSIGNAL);
+
+  if (n_bytes_sent < 0) {
+    char* error_desc = errno2s(errno);
+    LOG("write error from (%s) -> (%s): %s", stream_hostport(tunnel), socket_hostport(tunnel), error_desc);
+    free(error_desc);
+
+    destroy_tunnel_conn(tunnel->conn);
+    return;
+  }
+
+  DEBUG_LOG("wrote %zu bytes (%s) -> (%s)", n_bytes_sent, stream_hostport(tunnel), socket_hostport(tunnel));
+  TRACE3(send, tunnel->conn->id, tunnel->client_on_stream, n_bytes_sent);
+  buf->read_ptr += n_bytes_sent;
+
+  if (buf->read_ptr < buf->write_ptr) {
+    // slow receiver, wait for writability to send the rest later
+    h2_tunnel_wait_to_write(p, tunnel);
+    return;
+  }
+
+  // the buffer is empty again, so the peer may fill it again
+  buf->read_ptr = buf->write_ptr = buf->start;
+  if (tunnel->stream != NULL) {
+    h2_stream_consumed(p, tunnel->stream, tunnel->n_bytes_unacked);
+  }
+  tunnel->n_bytes_unacked = 0;
+
+  if (tunnel->stream_eof) {
+    h2_tunnel_end_writing(tunnel);
+  }
+}
+
+// Sends a response with just a status on a stream the client opened
+void respond_on_stream(struct poll* p, struct h2_stream* stream, const char* status, bool end_stream) {
+  struct hpack_header headers[] = {
+      {.name = ":status", .name_len = strlen(":status"), .value = status, .value_len = strlen(status)},
+  };
+  h2_stream_send_headers(p, stream, headers, sizeof(headers) / sizeof(headers[0]), end_stream);
+}
+
+/**
+ * Starts relaying once the other side of the tunnel is connected: either the parent proxy accepted the stream,
+ * or we connected to the target for a client on a stream.
+ * Unless the tunnel is transparent, the client is told so first.
+ */
+void start_h2_tunneling(struct poll* p, struct h2_tunnel* tunnel) {
+  struct tunnel_conn* conn = tunnel->conn;
+  if (tunnel->stream == NULL) {
+    LOG("client of (%s) -> (%s) went away while connecting", client_hostport(conn), target_hostport(conn));
+    destroy_tunnel_conn(conn);
+    return;
+  }
+  tunnel->started = true;
+  answer_client(conn, ACCESS_LOG_TUNNELED);
+
+  // the socket is read from and written to independently, see `start_tunneling`
+  if (tunnel->client_on_stream) {
+    conn->target_socket_dup = io_dup(conn->target_socket);
+    tunnel->read_fd = conn->target_socket;
+    tunnel->write_fd = conn->target_socket_dup;
+  } else {
+    conn->client_socket_dup = io_dup(conn->client_socket);
+    tunnel->write_fd = conn->client_socket_dup;
+  }
+
+  // Everything the peer sends must fit into the buffer, so it's allocated up front even if that exceeds the budget
+  acquire_buffer(conn, tunnel->to_socket, true);
+  acquire_buffer(conn, tunnel->to_stream, true);
+
+  if (tunnel->client_on_stream) {
+    TRACE2(respond, conn->id, 200);
+    respond_on_stream(p, tunnel->stream, "200", false);
+  } else if (!conn->transparent) {
+    TRACE2(respond, conn->id, 200);
+    int n_bytes = sprintf(
+        tunnel->to_socket->start, "%s 200 Connection Established \r\n\r\n", http_version_name(conn->http_version));
+    tunnel->to_socket->write_ptr += n_bytes;
+  }
+
+  // write out what the other side has sent so far, i.e., our response or what the client sent while we connected
+  if (tunnel->to_socket->read_ptr < tunnel->to_socket->write_ptr) {
+    if (!h2_tunnel_wait_to_write(p, tunnel)) {
+      return;
+    }
+  } else if (tunnel->stream_eof) {
+    h2_tunnel_end_writing(tunnel);
+  }
+
+  // if we received more than just the CONNECT message from the client, this sends the rest of the bytes first
+  h2_tunnel_send_to_stream(p, tunnel);
+}
+
+// Tells a client on a stream that its tunnel couldn't be set up, and closes the tunnel
+void reject_h2_tunnel(struct poll* p, struct h2_tunnel* tunnel) {
+  if (tunnel->stream != NULL) {
+    TRACE2(respond, tunnel->conn->id, 400);
+    respond_on_stream(p, tunnel->stream, "400", true);
+  }
+  destroy_tunnel_conn(tunnel->conn);
+}
+
+// Writes data received on the stream to the socket; `h2_session_callbacks.on_data` for streams of tunnels
+void handle_h2_tunnel_data(struct poll* p, struct h2_stream* stream, const char* data, size_t len, bool end_stream) {
+  struct h2_tunnel* tunnel = stream->data;
+  struct tunnel_buffer* buf = tunnel->to_socket;
+  if (buf->start == NULL) {
+    // nothing to relay yet, just keep the stream's window open
+    h2_stream_consumed(p, stream, len);
+    return;
+  }
+
+  if (len > (size_t)(BUFFER_SIZE - (buf->write_ptr - buf->start))) {
+    die(hsprintf(
+        "received %zu bytes for tunnel (%s) -> (%s), but they don't fit into the buf; this should not happen",
+        len,
+        stream_hostport(tunnel),
+        socket_hostport(tunnel)));
+  }
+
+  if (len > 0) {
+    DEBUG_LOG("received %zu bytes (%s) -> (%s)", len, stream_hostport(tunnel), socket_hostport(tunnel));
+    TRACE3(read, tunnel->conn->id, tunnel->client_on_stream, len);
+    memcpy(buf->write_ptr, data, len);
+    buf->write_ptr += len;
+    tunnel->n_bytes_unacked += len;
+    *tunnel->n_bytes_to_socket += len;
+    atomic_fetch_add_explicit(&tunnel->conn->thread->load.n_bytes_transferred, len, memory_order_relaxed);
+  }
+  if (end_stream) {
+    tunnel->stream_eof = true;
+  }
+
+  if (!tunnel->started) {
+    // written out once the tunnel starts
+    return;
+  }
+  if (buf->read_ptr < buf->write_ptr) {
+    h2_tunnel_wait_to_write(p, tunnel);
+  } else if (tunnel->stream_eof) {
+    h2_tunnel_end_writing(tunnel);
+  }
+}
+
+// Resumes sending on the stream; `h2_session_callbacks.on_send_window` for streams of tunnels
+void handle_h2_tunnel_send_window(struct poll* p, struct h2_stream* stream) {
+  struct h2_tunnel* tunnel = stream->data;
+  if (tunnel->started && !tunnel->socket_eof) {
+    h2_tunnel_send_to_stream(p, tunnel);
+  }
+}
@@ -0,0 +1,255 @@
+#include "handoff.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "../log.h"
+#include "../poll.h"
+#include "../util.h"
+#include "proxy_server.h"
+
+// how often an acceptor recomputes the throughput of each thread
+#define HANDOFF_RATE_SAMPLE_INTERVAL_US 100000
+// lag samples older than this are considered stale and ignored
+#define HANDOFF_LAG_MAX_AGE_US 1000000
+
+// When comparing the load of threads, this much throughput or lag weighs as much as one additional tunnel
+#define HANDOFF_BYTES_PER_SEC_PER_TUNNEL (64.0 * 1024)
+#define HANDOFF_LAG_US_PER_TUNNEL 100.0
+
+void handoff_init(struct proxy_server* server) {
+  for (int i = 0; i < server->threads_len; i++) {
+    struct connection_thread* thread = &server->threads[i];
+    thread->inbox.eventfd = -1;
+    atomic_init(&thread->inbox.wakeup_pending, false);
+    atomic_init(&thread->inbox.n_pushing, 0);
+    thread->inbox.rings = NULL;
+
+    thread->placement.sampled_at_us = monotonic_time_us();
+    thread->placement.last_n_bytes_transferred = NULL;
+    thread->placement.bytes_per_sec = NULL;
+    thread->placement.next_start = 0;
+
+    if (server->acceptors_len == 0) {
+      continue;
+    }
+
+    if (i < server->acceptors_len) {
+      thread->placement.last_n_bytes_transferred = calloc(server->threads_len, sizeof(unsigned long long));
+      thread->placement.bytes_per_sec = calloc(server->threads_len, sizeof(double));
+    } else {
+      thread->inbox.eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (thread->inbox.eventfd < 0) {
+        die(hsprintf("failed to create eventfd for thread %d: %s", i, errno2s(errno)));
+      }
+
+      thread->inbox.rings =
+          aligned_alloc(alignof(struct handoff_ring), server->acceptors_len * sizeof(struct handoff_ring));
+      for (int j = 0; j < server->acceptors_len; j++) {
+        atomic_init(&thread->inbox.rings[j].head, 0);
+        atomic_init(&thread->inbox.rings[j].tail, 0);
+      }
+    }
+  }
+}
+
+bool handoff_ring_push(struct handoff_ring* ring, const struct handoff_entry* entry) {
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  if (tail - head >= HANDOFF_RING_CAPACITY) {
+    return false;
+  }
+
+  ring->entries[tail & (HANDOFF_RING_CAPACITY - 1)] = *entry;
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+  return true;
+}
+
+bool handoff_ring_pop(struct handoff_ring* ring, struct handoff_entry* entry) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if (head == tail) {
+    return false;
+  }
+
+  *entry = ring->entries[head & (HANDOFF_RING_CAPACITY - 1)];
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+  return true;
+}
+
+size_t handoff_ring_len(struct handoff_ring* ring) {
+  return atomic_load_explicit(&ring->tail, memory_order_relaxed) -
+         atomic_load_explicit(&ring->head, memory_order_relaxed);
+}
+
+void update_throughput_samples(struct connection_thread* acceptor, unsigned long long now_us) {
+  struct proxy_server* server = acceptor->server;
+  struct handoff_placement* placement = &acceptor->placement;
+
+  unsigned long long elapsed_us = now_us - placement->sampled_at_us;
+  if (elapsed_us < HANDOFF_RATE_SAMPLE_INTERVAL_US) {
+    return;
+  }
+
+  for (int i = server->acceptors_len; i < server->threads_len; i++) {
+    unsigned long long n_bytes =
+        atomic_load_explicit(&server->threads[i].load.n_bytes_transferred, memory_order_relaxed);
+    placement->bytes_per_sec[i] = (n_bytes - placement->last_n_bytes_transferred[i]) * 1e6 / elapsed_us;
+    placement->last_n_bytes_transferred[i] = n_bytes;
+  }
+  placement->sampled_at_us = now_us;
+}
+
+// A lower score means a less loaded thread
+double thread_load_score(
+    struct connection_thread* acceptor,
+    struct connection_thread* thread,
+    unsigned long long now_us) {
+  struct thread_load* load = &thread->load;
+
+  double score = atomic_load_explicit(&load->active_tunnels, memory_order_relaxed);
+
+  // connections that were handed off but not yet picked up will soon be active tunnels as well
+  for (int i = 0; i < acceptor->server->acceptors_len; i++) {
+    score += handoff_ring_len(&thread->inbox.rings[i]);
+  }
+
+  score += acceptor->placement.bytes_per_sec[thread->id] / HANDOFF_BYTES_PER_SEC_PER_TUNNEL;
+
+  unsigned long long lag_sampled_at_us = atomic_load_explicit(&load->handoff_lag_sampled_at_us, memory_order_relaxed);
+  if (now_us - lag_sampled_at_us < HANDOFF_LAG_MAX_AGE_US) {
+    score += atomic_load_explicit(&load->handoff_lag_us, memory_order_relaxed) / HANDOFF_LAG_US_PER_TUNNEL;
+  }
+
+  return score;
+}
+
+bool hand_off_to(
+    struct connection_thread* acceptor,
+    struct connection_thread* thread,
+    const struct handoff_entry* entry) {
+  // Announce the push before checking the state, and the draining thread checks for pushes after changing the state,
+  // so that either we see that it's draining, or it sees our push (both sides are sequentially consistent).
+  atomic_fetch_add(&thread->inbox.n_pushing, 1);
+  if (!thread_is_running(thread) || !handoff_ring_push(&thread->inbox.rings[acceptor->id], entry)) {
+    atomic_fetch_sub(&thread->inbox.n_pushing, 1);
+    return false;
+  }
+
+  // only the first handoff since the thread last drained its inbox needs to wake it up
+  if (!atomic_exchange(&thread->inbox.wakeup_pending, true)) {
+    uint64_t one = 1;
+    if (write(thread->inbox.eventfd, &one, sizeof(one)) < 0) {
+      // The counter cannot overflow in practice, so this should not happen. If it does, let the next handoff signal
+      // again, so that the thread is not left waiting for a wakeup that no one sends.
+      atomic_store(&thread->inbox.wakeup_pending, false);
+      char* error_desc = errno2s(errno);
+      DEBUG_LOG("failed to signal thread %hu: %s", thread->id, error_desc);
+      free(error_desc);
+    }
+  }
+
+  atomic_fetch_sub(&thread->inbox.n_pushing, 1);
+  return true;
+}
+
+void hand_off_client_socket(
+    struct connection_thread* acceptor,
+    int client_socket,
+    const struct sockaddr_in* client_addr,
+    bool transparent) {
+  struct proxy_server* server = acceptor->server;
+  struct handoff_placement* placement = &acceptor->placement;
+
+  unsigned long long now_us = monotonic_time_us();
+  update_throughput_samples(acceptor, now_us);
+
+  struct handoff_entry entry = {
+      .client_socket = client_socket,
+      .client_addr = *client_addr,
+      .transparent = transparent,
+      .enqueued_at_us = now_us,
+  };
+
+  int n_workers = server->threads_len - server->acceptors_len;
+  struct connection_thread* best = NULL;
+  double best_score = 0;
+  for (int i = 0; i < n_workers; i++) {
+    struct connection_thread* thread =
+        &server->threads[server->acceptors_len + (placement->next_start + i) % n_workers];
+    if (!thread_is_running(thread) || !thread_has_capacity(thread)) {
+      continue;
+    }
+    double score = thread_load_score(acceptor, thread, now_us);
+    if (best == NULL || score < best_score) {
+      best = thread;
+      best_score = score;
+    }
+  }
+  placement->next_start = (placement->next_start + 1) % n_workers;
+
+  if (best != NULL && hand_off_to(acceptor, best, &entry)) {
+    DEBUG_LOG("handed off client socket %d to thread %hu (load score %.2f)", client_socket, best->id, best_score);
+    return;
+  }
+
+  // the least loaded thread is not keeping up with its inbox (or every thread just reached its limit),
+  // try anyone who has space
+  for (int i = server->acceptors_len; i < server->threads_len; i++) {
+    if (hand_off_to(acceptor, &server->threads[i], &entry)) {
+      DEBUG_LOG("handed off client socket %d to thread %d as a fallback", client_socket, i);
+      return;
+    }
+  }
+
+  LOG("all handoff queues are full, dropping client socket %d", client_socket);
+  close(client_socket);
+}
+
+void handle_handoff_inbox_readability(struct poll* p, struct connection_thread* thread) {
+  struct handoff_inbox* inbox = &thread->inbox;
+
+  // Consume the signal, then clear the flag, then drain the rings. A handoff pushed after the flag was cleared signals
+  // the eventfd again, whether or not we pick it up below; clearing the flag first would let the read consume that
+  // signal and leave the flag set, so that no handoff ever wakes the thread again.
+  uint64_t counter;
+  if (read(inbox->eventfd, &counter, sizeof(counter)) < 0 && errno != EAGAIN) {
+    char* error_desc = errno2s(errno);
+    DEBUG_LOG("failed to read from handoff eventfd: %s", error_desc);
+    free(error_desc);
+  }
+  atomic_store(&inbox->wakeup_pending, false);
+
+  struct handoff_entry entry;
+  for (int i = 0; i < thread->server->acceptors_len; i++) {
+    while (handoff_ring_pop(&inbox->rings[i], &entry)) {
+      unsigned long long now_us = monotonic_time_us();
+      atomic_store_explicit(&thread->load.handoff_lag_us, now_us - entry.enqueued_at_us, memory_order_relaxed);
+      atomic_store_explicit(&thread->load.handoff_lag_sampled_at_us, now_us, memory_order_relaxed);
+
+      adopt_client_socket(p, thread, entry.client_socket, &entry.client_addr, entry.transparent);
+    }
+  }
+}
+
+/**
+ * Whether every connection handed off to the thread has been picked up, and no acceptor is about to hand off another.
+ * Once the thread is draining, this stays true.
+ */
+bool handoff_inbox_settled(struct connection_thread* thread) {
+  struct handoff_inbox* inbox = &thread->inbox;
+  if (inbox->eventfd < 0) {
+    return true;
+  }
+
+  if (atomic_load(&inbox->n_pushing) > 0) {
+    return false;
+  }
+  for (int i = 0; i < thread->server->acceptors_len; i++) {
+    if (handoff_ring_len(&inbox->rings[i]) > 0) {
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,70 @@
+#ifndef HTTPS_PROXY_HANDOFF_H
+#define HTTPS_PROXY_HANDOFF_H
+
+#include <netinet/in.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// must be a power of two
+#define HANDOFF_RING_CAPACITY 1024
+
+struct poll;
+struct proxy_server;
+struct connection_thread;
+
+// An accepted client socket on its way from an acceptor to the thread that will own it
+struct handoff_entry {
+  int client_socket;
+  struct sockaddr_in client_addr;
+  bool transparent;
+  unsigned long long enqueued_at_us;
+};
+
+/**
+ * A bounded, lock-free, single-producer single-consumer queue of accepted client sockets.
+ * Each (acceptor, thread) pair has its own ring, so the acceptor is the only producer and the thread is the only
+ * consumer. `head` and `tail` are free-running counters on separate cache lines to avoid false sharing.
+ */
+struct handoff_ring {
+  alignas(64) atomic_size_t head;  // next entry to consume, only advanced by the consumer
+  alignas(64) atomic_size_t tail;  // next free slot, only advanced by the producer
+  alignas(64) struct handoff_entry entries[HANDOFF_RING_CAPACITY];
+};
+
+// The receiving end of the handoff, owned by a thread that does not accept connections itself
+struct handoff_inbox {
+  // becomes readable when any of the rings has new entries; -1 if the thread does not receive handoffs
+  int eventfd;
+  // set by acceptors when they signal the eventfd, so that a burst of handoffs costs a single wakeup
+  atomic_bool wakeup_pending;
+  // acceptors in the middle of handing a connection off to this thread, so that a draining thread knows when no more
+  // connections can arrive
+  atomic_uint n_pushing;
+  // one ring per acceptor, indexed by the acceptor's thread id
+  struct handoff_ring* rings;
+};
+
+// Placement state owned by an acceptor thread
+struct handoff_placement {
+  unsigned long long sampled_at_us;
+  // indexed by thread id
+  unsigned long long* last_n_bytes_transferred;
+  double* bytes_per_sec;
+  // where to start scanning so that equally loaded threads are picked in a round-robin manner
+  unsigned short next_start;
+};
+
+void handoff_init(struct proxy_server* server);
+
+void hand_off_client_socket(
+    struct connection_thread* acceptor,
+    int client_socket,
+    const struct sockaddr_in* client_addr,
+    bool transparent);
+
+void handle_handoff_inbox_readability(struct poll* p, struct connection_thread* thread);
+
+bool handoff_inbox_settled(struct connection_thread* thread);
+
+#endif  // HTTPS_PROXY_HANDOFF_H
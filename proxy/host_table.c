@@ -0,0 +1,95 @@
+#include "host_table.h"
+#include <stdlib.h>
+#include <string.h>
+#include "../util.h"
+
+#define HOST_TABLE_INITIAL_CAPACITY 64
+
+struct host_table* create_host_table(void) {
+  struct host_table* table = malloc(sizeof(struct host_table));
+  table->capacity = HOST_TABLE_INITIAL_CAPACITY;
+  table->slots = calloc(table->capacity, sizeof(struct interned_host*));
+  table->len = 0;
+  return table;
+}
+
+void destroy_host_table(struct host_table* table) {
+  if (table == NULL) {
+    return;
+  }
+
+  for (size_t i = 0; i < table->capacity; i++) {
+    struct interned_host* entry = table->slots[i];
+    while (entry != NULL) {
+      struct interned_host* next = entry->next;
+      free(entry);
+      entry = next;
+    }
+  }
+  free(table->slots);
+  free(table);
+}
+
+void host_table_grow(struct host_table* table) {
+  size_t new_capacity = table->capacity * 2;
+  struct interned_host** new_slots = calloc(new_capacity, sizeof(struct interned_host*));
+  for (size_t i = 0; i < table->capacity; i++) {
+    struct interned_host* entry = table->slots[i];
+    while (entry != NULL) {
+      struct interned_host* next = entry->next;
+      size_t slot = hash_key(entry->name) & (new_capacity - 1);
+      entry->next = new_slots[slot];
+      new_slots[slot] = entry;
+      entry = next;
+    }
+  }
+  free(table->slots);
+  table->slots = new_slots;
+  table->capacity = new_capacity;
+}
+
+/**
+ * @param host not necessarily null-terminated
+ * @return the table's copy of the host, valid until it's released as many times as it was interned
+ */
+const char* intern_host(struct host_table* table, const char* host, size_t host_len) {
+  size_t slot = hash_bytes(host, host_len) & (table->capacity - 1);
+  for (struct interned_host* entry = table->slots[slot]; entry != NULL; entry = entry->next) {
+    if (strncmp(entry->name, host, host_len) == 0 && entry->name[host_len] == '\0') {
+      entry->refcount++;
+      return entry->name;
+    }
+  }
+
+  if (table->len >= table->capacity) {
+    host_table_grow(table);
+    slot = hash_bytes(host, host_len) & (table->capacity - 1);
+  }
+
+  struct interned_host* entry = malloc(sizeof(struct interned_host) + host_len + 1);
+  memcpy(entry->name, host, host_len);
+  entry->name[host_len] = '\0';
+  entry->refcount = 1;
+  entry->next = table->slots[slot];
+  table->slots[slot] = entry;
+  table->len++;
+  return entry->name;
+}
+
+// Gives back a host returned by `intern_host`
+void release_host(struct host_table* table, const char* host) {
+  struct interned_host* released = (struct interned_host*)(host - offsetof(struct interned_host, name));
+  if (--released->refcount > 0) {
+    return;
+  }
+
+  struct interned_host** link = &table->slots[hash_key(host) & (table->capacity - 1)];
+  for (; *link != NULL; link = &(*link)->next) {
+    if (*link == released) {
+      *link = released->next;
+      free(released);
+      table->len--;
+      return;
+    }
+  }
+}
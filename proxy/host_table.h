@@ -0,0 +1,30 @@
+#ifndef HTTPS_PROXY_HOST_TABLE_H
+#define HTTPS_PROXY_HOST_TABLE_H
+
+#include <stddef.h>
+
+struct interned_host {
+  struct interned_host* next;
+  // number of tunnels with this target host; the entry is removed once it drops to 0
+  unsigned int refcount;
+  char name[];
+};
+
+/**
+ * A chained hash table of the target hosts of a thread's tunnels, so that tunnels to the same host share one copy of
+ * its name, sized to fit, instead of each holding a buffer for the longest name there may be.
+ * Each thread has its own table, so no synchronisation is needed.
+ */
+struct host_table {
+  struct interned_host** slots;
+  size_t capacity;
+  size_t len;
+};
+
+struct host_table* create_host_table(void);
+void destroy_host_table(struct host_table* table);
+
+const char* intern_host(struct host_table* table, const char* host, size_t host_len);
+void release_host(struct host_table* table, const char* host);
+
+#endif  // HTTPS_PROXY_HOST_TABLE_H
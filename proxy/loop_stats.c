@@ -0,0 +1,137 @@
+#include "loop_stats.h"
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "../log.h"
+#include "../poll.h"
+#include "../util.h"
+#include "proxy_server.h"
+
+// A callback holding up the loop this long delays every other connection of the thread by as much
+#define SLOW_CALLBACK_NS 1000000
+
+/**
+ * Writes the name of the function, which needs the binary to be linked with -rdynamic.
+ * Otherwise, it's the offset into the binary for addr2line.
+ */
+void print_callback_name(poll_callback callback) {
+  Dl_info info;
+  if (dladdr((void*)callback, &info) == 0) {
+    printf("%p", (void*)callback);
+  } else if (info.dli_sname != NULL) {
+    fputs(info.dli_sname, stdout);
+  } else {
+    printf("%s+%#lx", info.dli_fname, (unsigned long)((char*)callback - (char*)info.dli_fbase));
+  }
+}
+
+// Writes the non-empty buckets of a histogram of run times, e.g. " <1us: 90 <2us: 10"
+void print_time_histogram(const unsigned long long* histogram) {
+  for (int i = 0; i < POLL_TIME_BUCKETS; i++) {
+    if (histogram[i] == 0) {
+      continue;
+    }
+    if (i < POLL_TIME_BUCKETS - 1) {
+      printf(" <%lluus: %llu", 1ULL << i, histogram[i]);
+    } else {
+      printf(" >=%lluus: %llu", 1ULL << (i - 1), histogram[i]);
+    }
+  }
+}
+
+// Writes the non-empty buckets of the events per wakeup, e.g. " 0: 5 2-3: 20 64 (full): 1"
+void print_batch_histogram(const unsigned long long* histogram) {
+  for (int i = 0; i < POLL_BATCH_BUCKETS; i++) {
+    if (histogram[i] == 0) {
+      continue;
+    }
+    if (i == 0 || i == 1) {
+      printf(" %d: %llu", i, histogram[i]);
+    } else if (i < POLL_BATCH_BUCKETS - 1) {
+      printf(" %d-%d: %llu", 1 << (i - 1), (1 << i) - 1, histogram[i]);
+    } else {
+      printf(" %d (full): %llu", EPOLL_MAX_EVENTS, histogram[i]);
+    }
+  }
+}
+
+int compare_total_time_desc(const void* a, const void* b) {
+  const struct poll_callback_stats* x = *(const struct poll_callback_stats* const*)a;
+  const struct poll_callback_stats* y = *(const struct poll_callback_stats* const*)b;
+  return x->total_ns < y->total_ns ? 1 : x->total_ns > y->total_ns ? -1 : 0;
+}
+
+// Starts timing the thread's event loop and reporting on it periodically
+void start_reporting_loop_stats(struct poll* p, struct connection_thread* thread) {
+  poll_enable_stats(p, SLOW_CALLBACK_NS);
+  if (poll_add_timer(p, thread->server->loop_stats_interval_us, thread, (poll_callback)report_loop_stats) == NULL) {
+    LOG("failed to schedule the first event loop report");
+  }
+}
+
+/**
+ * Prints how busy the thread's event loop was since the last report: how much of the time it spent handling events
+ * rather than polling or waiting for them, how many events each wakeup brought and how many of them busy polling
+ * caught before going to sleep, how late timers ran, and how long each kind of callback took, the most expensive first.
+ * The report is printed in one go, so that the reports of different threads don't interleave.
+ */
+void report_loop_stats(struct poll* p, struct connection_thread* thread) {
+  struct poll_stats* stats = poll_get_stats(p);
+  unsigned long long elapsed_us = monotonic_time_us() - stats->since_us;
+
+  struct poll_callback_stats* callbacks[POLL_MAX_CALLBACK_TYPES];
+  size_t callbacks_len = 0;
+  for (int i = 0; i < POLL_MAX_CALLBACK_TYPES; i++) {
+    if (stats->callbacks[i].n_runs > 0) {
+      callbacks[callbacks_len++] = &stats->callbacks[i];
+    }
+  }
+  qsort(callbacks, callbacks_len, sizeof(callbacks[0]), compare_total_time_desc);
+
+  flockfile(stdout);
+  printf("Event loop of thread %hu over %.1f s: busy %.1f%%, spinning %.1f%%, waiting %.1f%%, "
+         "%llu wakeups with %.1f events each (%.1f%% without sleeping), "
+         "%llu timers late by %.3f ms on average and %.3f ms at most\n",
+         thread->id,
+         elapsed_us / 1000000.0,
+         elapsed_us > 0 ? 100.0 * stats->busy_us / elapsed_us : 0,
+         elapsed_us > 0 ? 100.0 * stats->spinning_us / elapsed_us : 0,
+         elapsed_us > 0 ? 100.0 * stats->waiting_us / elapsed_us : 0,
+         stats->n_wakeups,
+         stats->n_wakeups > 0 ? (double)stats->n_events / stats->n_wakeups : 0,
+         stats->n_wakeups > 0 ? 100.0 * stats->n_spin_wakeups / stats->n_wakeups : 0,
+         stats->n_timers,
+         stats->n_timers > 0 ? stats->total_timer_lag_us / 1000.0 / stats->n_timers : 0,
+         stats->max_timer_lag_us / 1000.0);
+
+  // wakeups with a full batch (64 events) mean that more events may have been waiting
+  fputs("  events per wakeup:", stdout);
+  print_batch_histogram(stats->batch_histogram);
+  putchar('\n');
+
+  for (size_t i = 0; i < callbacks_len; i++) {
+    struct poll_callback_stats* callback = callbacks[i];
+    fputs("  ", stdout);
+    print_callback_name(callback->callback);
+    printf(": %llu runs, %.3f ms in total, %.1f us on average, %.1f us at most, %llu slow;",
+           callback->n_runs,
+           callback->total_ns / 1000000.0,
+           callback->total_ns / 1000.0 / callback->n_runs,
+           callback->max_ns / 1000.0,
+           callback->n_slow);
+    print_time_histogram(callback->time_histogram);
+    putchar('\n');
+  }
+
+  if (stats->slowest_callback != NULL) {
+    fputs("  slowest callback: ", stdout);
+    print_callback_name(stats->slowest_callback);
+    printf(", %.3f ms\n", stats->slowest_ns / 1000000.0);
+  }
+  funlockfile(stdout);
+
+  poll_reset_stats(p);
+  if (poll_add_timer(p, thread->server->loop_stats_interval_us, thread, (poll_callback)report_loop_stats) == NULL) {
+    LOG("failed to schedule the next event loop report");
+  }
+}
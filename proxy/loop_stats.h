@@ -0,0 +1,14 @@
+#ifndef HTTPS_PROXY_LOOP_STATS_H
+#define HTTPS_PROXY_LOOP_STATS_H
+
+#include "../poll.h"
+
+struct connection_thread;
+
+void start_reporting_loop_stats(struct poll* p, struct connection_thread* thread);
+
+void report_loop_stats(struct poll* p, struct connection_thread* thread);
+
+void print_callback_name(poll_callback callback);
+
+#endif  // HTTPS_PROXY_LOOP_STATS_H
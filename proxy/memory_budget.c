@@ -0,0 +1,174 @@
+#include "memory_budget.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "../log.h"
+#include "../poll.h"
+#include "proxy_server.h"
+
+// the most a thread reserves from the global budget at once
+#define MEMORY_MAX_CHUNK_SIZE (256 * 1024)
+#define MEMORY_REPORT_INTERVAL_US 10000000
+
+struct memory_budget* create_memory_budget(unsigned long long limit, unsigned short threads_len) {
+  if (limit == 0) {
+    return NULL;
+  }
+
+  struct memory_budget* budget = malloc(sizeof(struct memory_budget));
+  budget->limit = limit;
+
+  // make sure that every thread gets a few chunks before the budget runs out
+  budget->chunk_size = limit / (4 * threads_len);
+  if (budget->chunk_size > MEMORY_MAX_CHUNK_SIZE) {
+    budget->chunk_size = MEMORY_MAX_CHUNK_SIZE;
+  }
+  if (budget->chunk_size < BUFFER_SIZE) {
+    budget->chunk_size = BUFFER_SIZE;
+  }
+
+  atomic_init(&budget->reserved, 0);
+  atomic_init(&budget->peak_reserved, 0);
+  return budget;
+}
+
+bool memory_budget_exhausted(struct memory_budget* budget) {
+  return budget != NULL &&
+         atomic_load_explicit(&budget->reserved, memory_order_relaxed) + budget->chunk_size > budget->limit;
+}
+
+void update_peak(struct memory_budget* budget, unsigned long long reserved) {
+  unsigned long long peak = atomic_load_explicit(&budget->peak_reserved, memory_order_relaxed);
+  while (reserved > peak && !atomic_compare_exchange_weak(&budget->peak_reserved, &peak, reserved)) {
+  }
+}
+
+/**
+ * Takes `size` bytes from the thread's reservation, reserving another chunk from the global budget if needed.
+ * @param force take the memory even if that exceeds the budget
+ * @return whether the memory was taken
+ */
+bool take_memory(struct connection_thread* thread, unsigned long long size, bool force) {
+  struct memory_budget* budget = thread->server->memory_budget;
+
+  if (thread->memory_reserved < size) {
+    unsigned long long chunk_size = budget->chunk_size;
+    unsigned long long reserved = atomic_load_explicit(&budget->reserved, memory_order_relaxed);
+    do {
+      if (reserved + chunk_size > budget->limit) {
+        if (!force) {
+          return false;
+        }
+        // take only what we need right now
+        chunk_size = size;
+      }
+    } while (!atomic_compare_exchange_weak(&budget->reserved, &reserved, reserved + chunk_size));
+
+    update_peak(budget, reserved + chunk_size);
+    thread->memory_reserved += chunk_size;
+  }
+
+  thread->memory_reserved -= size;
+  return true;
+}
+
+void give_back_memory(struct connection_thread* thread, unsigned long long size) {
+  struct memory_budget* budget = thread->server->memory_budget;
+
+  thread->memory_reserved += size;
+
+  // keep one chunk around for the next buffers, and return the rest so that other threads can use it
+  if (thread->memory_reserved > 2 * budget->chunk_size) {
+    unsigned long long excess = thread->memory_reserved - budget->chunk_size;
+    atomic_fetch_sub_explicit(&budget->reserved, excess, memory_order_relaxed);
+    thread->memory_reserved -= excess;
+  }
+}
+
+// Returns everything the thread reserved to the budget, once it stopped
+void give_back_all_memory(struct connection_thread* thread) {
+  struct memory_budget* budget = thread->server->memory_budget;
+  if (budget != NULL) {
+    atomic_fetch_sub_explicit(&budget->reserved, thread->memory_reserved, memory_order_relaxed);
+    thread->memory_reserved = 0;
+  }
+}
+
+/**
+ * Allocates the buffer unless it's already allocated.
+ * @param conn
+ * @param buf
+ * @param force allocate the buffer even if that exceeds the memory budget
+ * @return whether the buffer is allocated
+ */
+bool acquire_buffer(struct tunnel_conn* conn, struct tunnel_buffer* buf, bool force) {
+  if (buf->start != NULL) {
+    return true;
+  }
+
+  struct connection_thread* thread = conn->thread;
+  if (thread->server->memory_budget != NULL) {
+    if (!take_memory(thread, BUFFER_SIZE, force)) {
+      atomic_fetch_add_explicit(&thread->load.n_memory_waits, 1, memory_order_relaxed);
+      return false;
+    }
+    atomic_fetch_add_explicit(&thread->load.buffer_bytes, BUFFER_SIZE, memory_order_relaxed);
+  }
+
+  buf->start = buf->read_ptr = buf->write_ptr = malloc(BUFFER_SIZE * sizeof(char));
+  return true;
+}
+
+void release_buffer(struct tunnel_conn* conn, struct tunnel_buffer* buf) {
+  if (buf->start == NULL) {
+    return;
+  }
+
+  free(buf->start);
+  buf->start = buf->read_ptr = buf->write_ptr = NULL;
+
+  struct connection_thread* thread = conn->thread;
+  if (thread->server->memory_budget != NULL) {
+    atomic_fetch_sub_explicit(&thread->load.buffer_bytes, BUFFER_SIZE, memory_order_relaxed);
+    give_back_memory(thread, BUFFER_SIZE);
+  }
+}
+
+// Releases an empty buffer while the link waits for more data, but only if memory is scarce enough to be budgeted
+void release_idle_buffer(struct tunnel_conn* conn, struct tunnel_buffer* buf) {
+  if (conn->thread->server->memory_budget != NULL) {
+    release_buffer(conn, buf);
+  }
+}
+
+// The memory the tunnel's buffers take from the budget, which moves along with the tunnel to another thread
+unsigned long long budgeted_buffer_bytes(struct tunnel_conn* conn) {
+  if (conn->thread->server->memory_budget == NULL) {
+    return 0;
+  }
+  return ((conn->to_target_buffer.start != NULL) + (conn->to_client_buffer.start != NULL)) * BUFFER_SIZE;
+}
+
+// Prints the buffer memory usage periodically, for monitoring
+void report_memory_usage(struct poll* p, struct connection_thread* thread) {
+  struct proxy_server* server = thread->server;
+  struct memory_budget* budget = server->memory_budget;
+
+  unsigned long long buffer_bytes = 0;
+  unsigned long long n_memory_waits = 0;
+  for (int i = 0; i < server->threads_len; i++) {
+    buffer_bytes += atomic_load_explicit(&server->threads[i].load.buffer_bytes, memory_order_relaxed);
+    n_memory_waits += atomic_load_explicit(&server->threads[i].load.n_memory_waits, memory_order_relaxed);
+  }
+
+  printf(
+      "Buffer memory: %llu bytes in use, %llu bytes reserved (peak %llu), budget %llu bytes, %llu waits for memory\n",
+      buffer_bytes,
+      atomic_load_explicit(&budget->reserved, memory_order_relaxed),
+      atomic_load_explicit(&budget->peak_reserved, memory_order_relaxed),
+      budget->limit,
+      n_memory_waits);
+
+  if (poll_add_timer(p, MEMORY_REPORT_INTERVAL_US, thread, (poll_callback)report_memory_usage) == NULL) {
+    LOG("failed to schedule the next memory usage report");
+  }
+}
@@ -0,0 +1,37 @@
+#ifndef HTTPS_PROXY_MEMORY_BUDGET_H
+#define HTTPS_PROXY_MEMORY_BUDGET_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+struct poll;
+struct tunnel_conn;
+struct tunnel_buffer;
+struct connection_thread;
+
+/**
+ * A global limit on the memory held by tunnel buffers.
+ * To keep threads from contending on `reserved`, each thread reserves memory in chunks and hands out buffers from its
+ * own reservation, only going back to the global budget when it runs out or holds too much unused memory.
+ */
+struct memory_budget {
+  unsigned long long limit;
+  unsigned long long chunk_size;
+  // memory reserved by all threads together, whether or not it's used by buffers yet
+  atomic_ullong reserved;
+  atomic_ullong peak_reserved;
+};
+
+struct memory_budget* create_memory_budget(unsigned long long limit, unsigned short threads_len);
+
+bool memory_budget_exhausted(struct memory_budget* budget);
+
+bool acquire_buffer(struct tunnel_conn* conn, struct tunnel_buffer* buf, bool force);
+void release_buffer(struct tunnel_conn* conn, struct tunnel_buffer* buf);
+void release_idle_buffer(struct tunnel_conn* conn, struct tunnel_buffer* buf);
+unsigned long long budgeted_buffer_bytes(struct tunnel_conn* conn);
+void give_back_all_memory(struct connection_thread* thread);
+
+void report_memory_usage(struct poll* p, struct connection_thread* thread);
+
+#endif  // HTTPS_PROXY_MEMORY_BUDGET_H
@@ -0,0 +1,266 @@
+#include "migration.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "../log.h"
+#include "../poll.h"
+#include "../trace.h"
+#include "../util.h"
+#include "proxy_server.h"
+
+// how often each thread samples its load and that of its tunnels
+#define REBALANCE_INTERVAL_US 500000
+// only move tunnels to a thread that is this much less busy, so that two similarly loaded threads don't trade them
+#define REBALANCE_MIN_GAP 0.2
+// a tunnel stays on a thread at least this long, so that it doesn't bounce between threads
+#define REBALANCE_MIN_RESIDENCE_US 2000000
+// the most tunnels a thread gives away per interval
+#define REBALANCE_MAX_MIGRATIONS 16
+
+// How many bytes a tunnel relayed over the last interval
+struct tunnel_sample {
+  struct tunnel_conn* conn;
+  unsigned long long n_bytes;
+};
+
+void migration_init(struct proxy_server* server) {
+  for (int i = 0; i < server->threads_len; i++) {
+    struct connection_thread* thread = &server->threads[i];
+    thread->relaying_tunnels = NULL;
+    thread->migrations.eventfd = -1;
+    atomic_init(&thread->migrations.wakeup_pending, false);
+    atomic_init(&thread->migrations.n_pushing, 0);
+    atomic_init(&thread->migrations.head, NULL);
+    atomic_init(&thread->load.busy_permille, 0);
+
+    // acceptors have no tunnels to give or take
+    if (server->rebalance_utilisation == 0 || i < server->acceptors_len) {
+      continue;
+    }
+    thread->migrations.eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (thread->migrations.eventfd < 0) {
+      die(hsprintf("failed to create migration eventfd for thread %d: %s", i, errno2s(errno)));
+    }
+  }
+}
+
+// The running thread that is the least busy other than `thread`, or NULL if there's none with room for more tunnels
+struct connection_thread* find_idlest_thread(struct connection_thread* thread) {
+  struct proxy_server* server = thread->server;
+  struct connection_thread* idlest = NULL;
+  unsigned int idlest_permille = 0;
+  for (int i = server->acceptors_len; i < server->threads_len; i++) {
+    struct connection_thread* candidate = &server->threads[i];
+    if (candidate == thread || !thread_is_running(candidate) || !thread_has_capacity(candidate)) {
+      continue;
+    }
+    unsigned int permille = atomic_load_explicit(&candidate->load.busy_permille, memory_order_relaxed);
+    if (idlest == NULL || permille < idlest_permille) {
+      idlest = candidate;
+      idlest_permille = permille;
+    }
+  }
+  return idlest;
+}
+
+/**
+ * Takes the tunnel off this thread and pushes it to the inbox of `to`, where it carries on from where it left off.
+ * It runs between callbacks, from a timer, so that no event of the tunnel is pending on this thread's poll.
+ * @return false if `to` stopped running in the meantime, in which case the tunnel stays
+ */
+bool migrate_tunnel(struct poll* p, struct tunnel_conn* conn, struct connection_thread* to) {
+  struct connection_thread* from = conn->thread;
+  struct migration_inbox* inbox = &to->migrations;
+
+  // Announce the push before checking the state, and the draining thread checks for pushes after changing the state,
+  // so that either we see that it's draining, or it sees our push (both sides are sequentially consistent).
+  atomic_fetch_add(&inbox->n_pushing, 1);
+  if (!thread_is_running(to)) {
+    atomic_fetch_sub(&inbox->n_pushing, 1);
+    return false;
+  }
+
+  TRACE3(migrate, conn->id, from->id, to->id);
+  LOG("moving tunnel (%s) -> (%s) to thread %hu", client_hostport(conn), target_hostport(conn), to->id);
+  detach_tunneling_links(p, conn);
+  detach_rate_limits(conn);
+  detach_target_host(conn);
+  remove_relaying_tunnel(conn);
+  atomic_fetch_sub_explicit(&from->load.buffer_bytes, budgeted_buffer_bytes(conn), memory_order_relaxed);
+  atomic_fetch_sub_explicit(&from->load.active_tunnels, 1, memory_order_relaxed);
+  conn->thread = to;
+
+  // the release publishes everything about the tunnel to the thread taking it
+  struct tunnel_conn* head = atomic_load_explicit(&inbox->head, memory_order_relaxed);
+  do {
+    conn->next_migrating = head;
+  } while (!atomic_compare_exchange_weak_explicit(
+      &inbox->head, &head, conn, memory_order_release, memory_order_relaxed));
+
+  // only the first tunnel since the thread last emptied its inbox needs to wake it up
+  if (!atomic_exchange(&inbox->wakeup_pending, true)) {
+    uint64_t one = 1;
+    if (write(inbox->eventfd, &one, sizeof(one)) < 0) {
+      // let the next push signal again, so that the thread is not left waiting for a wakeup that no one sends
+      atomic_store(&inbox->wakeup_pending, false);
+      char* error_desc = errno2s(errno);
+      DEBUG_LOG("failed to signal thread %hu: %s", to->id, error_desc);
+      free(error_desc);
+    }
+  }
+
+  atomic_fetch_sub(&inbox->n_pushing, 1);
+  return true;
+}
+
+int compare_n_bytes_desc(const void* a, const void* b) {
+  const struct tunnel_sample* x = a;
+  const struct tunnel_sample* y = b;
+  return x->n_bytes < y->n_bytes ? 1 : x->n_bytes > y->n_bytes ? -1 : 0;
+}
+
+/**
+ * Samples how many bytes each tunnel of the thread relayed since the last interval and, if `to` is given, moves the
+ * heaviest ones there until they add up to `share` of the thread's bytes. Tunnels heavier than that stay, since they
+ * would only make `to` as busy as this thread.
+ */
+void sample_and_move_tunnels(
+    struct poll* p,
+    struct connection_thread* thread,
+    struct connection_thread* to,
+    double share,
+    unsigned long long now_us) {
+  size_t n_tunnels = 0;
+  for (struct tunnel_conn* conn = thread->relaying_tunnels; conn != NULL; conn = conn->next_relaying) {
+    n_tunnels++;
+  }
+  struct tunnel_sample* samples = to != NULL ? malloc(n_tunnels * sizeof(struct tunnel_sample)) : NULL;
+
+  size_t samples_len = 0;
+  unsigned long long total_n_bytes = 0;
+  for (struct tunnel_conn* conn = thread->relaying_tunnels; conn != NULL; conn = conn->next_relaying) {
+    unsigned long long n_bytes = conn->n_bytes_to_target + conn->n_bytes_to_client;
+    unsigned long long n_bytes_sampled = n_bytes - conn->n_bytes_sampled;
+    conn->n_bytes_sampled = n_bytes;
+    total_n_bytes += n_bytes_sampled;
+
+    // A tunnel with a closed half has a link that no longer waits on anything.
+    // An offloaded tunnel costs its thread nothing.
+    if (samples != NULL && n_bytes_sampled > 0 && conn->halves_closed == 0 && !conn->offloaded &&
+        now_us - conn->relaying_since_us >= REBALANCE_MIN_RESIDENCE_US) {
+      samples[samples_len].conn = conn;
+      samples[samples_len].n_bytes = n_bytes_sampled;
+      samples_len++;
+    }
+  }
+  if (samples == NULL) {
+    return;
+  }
+
+  qsort(samples, samples_len, sizeof(struct tunnel_sample), compare_n_bytes_desc);
+  unsigned long long n_bytes_to_move = total_n_bytes * share;
+  unsigned long long n_bytes_moved = 0;
+  int n_moved = 0;
+  for (size_t i = 0; i < samples_len && n_moved < REBALANCE_MAX_MIGRATIONS; i++) {
+    if (n_bytes_moved + samples[i].n_bytes > n_bytes_to_move) {
+      continue;
+    }
+    if (!migrate_tunnel(p, samples[i].conn, to)) {
+      break;
+    }
+    n_bytes_moved += samples[i].n_bytes;
+    n_moved++;
+  }
+  if (n_moved > 0) {
+    LOG("moved %d tunnels relaying %llu of %llu bytes to thread %hu", n_moved, n_bytes_moved, total_n_bytes, to->id);
+  }
+  free(samples);
+}
+
+/**
+ * Runs periodically on every thread that handles connections while tunnels are rebalanced.
+ * It publishes how busy the thread's event loop was, and if it's busier than the threshold and than the least busy
+ * thread by a margin, moves some of its heaviest tunnels there, enough to even out their load if busy time is
+ * proportional to the bytes relayed.
+ */
+void rebalance_tunnels(struct poll* p, struct connection_thread* thread) {
+  struct proxy_server* server = thread->server;
+  atomic_fetch_add_explicit(&thread->load.busy_us, poll_take_busy_us(p), memory_order_relaxed);
+
+  unsigned long long now_us = monotonic_time_us();
+  unsigned long long busy_us = atomic_load_explicit(&thread->load.busy_us, memory_order_relaxed);
+  double utilisation = (double)(busy_us - thread->rebalanced_busy_us) / (now_us - thread->rebalanced_at_us);
+  if (utilisation > 1) {
+    utilisation = 1;
+  }
+  thread->rebalanced_at_us = now_us;
+  thread->rebalanced_busy_us = busy_us;
+  atomic_store_explicit(&thread->load.busy_permille, utilisation * 1000, memory_order_relaxed);
+
+  struct connection_thread* idlest = NULL;
+  double share = 0;
+  if (utilisation >= server->rebalance_utilisation && (idlest = find_idlest_thread(thread)) != NULL) {
+    double idlest_utilisation = atomic_load_explicit(&idlest->load.busy_permille, memory_order_relaxed) / 1000.0;
+    if (utilisation - idlest_utilisation >= REBALANCE_MIN_GAP) {
+      share = (utilisation - idlest_utilisation) / 2 / utilisation;
+    } else {
+      idlest = NULL;
+    }
+  }
+  sample_and_move_tunnels(p, thread, idlest, share, now_us);
+
+  if (poll_add_timer(p, REBALANCE_INTERVAL_US, thread, (poll_callback)rebalance_tunnels) == NULL) {
+    LOG("failed to schedule the next rebalancing of tunnels");
+  }
+}
+
+// Starts sampling the thread's load, and moving tunnels off it while it's much busier than others
+void start_rebalancing_tunnels(struct poll* p, struct connection_thread* thread) {
+  thread->rebalanced_at_us = monotonic_time_us();
+  thread->rebalanced_busy_us = atomic_load_explicit(&thread->load.busy_us, memory_order_relaxed);
+  if (poll_add_timer(p, REBALANCE_INTERVAL_US, thread, (poll_callback)rebalance_tunnels) == NULL) {
+    LOG("failed to schedule the first rebalancing of tunnels");
+  }
+}
+
+// Takes a tunnel moved here by another thread, which left it as if between two callbacks
+void adopt_migrated_tunnel(struct poll* p, struct connection_thread* thread, struct tunnel_conn* conn) {
+  atomic_fetch_add_explicit(&thread->load.active_tunnels, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&thread->load.buffer_bytes, budgeted_buffer_bytes(conn), memory_order_relaxed);
+  attach_target_host(conn);
+  attach_rate_limits(conn);
+  add_relaying_tunnel(conn);
+  attach_tunneling_links(p, conn);
+}
+
+void handle_migration_inbox_readability(struct poll* p, struct connection_thread* thread) {
+  struct migration_inbox* inbox = &thread->migrations;
+
+  // Consume the signal, then clear the flag, then take the tunnels, so that a tunnel pushed after the flag was cleared
+  // signals the eventfd again; the other way round, the read could consume its signal and leave the flag set for good.
+  uint64_t counter;
+  if (read(inbox->eventfd, &counter, sizeof(counter)) < 0 && errno != EAGAIN) {
+    char* error_desc = errno2s(errno);
+    DEBUG_LOG("failed to read from migration eventfd: %s", error_desc);
+    free(error_desc);
+  }
+  atomic_store(&inbox->wakeup_pending, false);
+
+  struct tunnel_conn* conn = atomic_exchange_explicit(&inbox->head, NULL, memory_order_acquire);
+  while (conn != NULL) {
+    struct tunnel_conn* next = conn->next_migrating;
+    adopt_migrated_tunnel(p, thread, conn);
+    conn = next;
+  }
+}
+
+/**
+ * Whether every tunnel moved to the thread has been picked up, and no thread is about to move another.
+ * Once the thread is draining, this stays true.
+ */
+bool migration_inbox_settled(struct connection_thread* thread) {
+  struct migration_inbox* inbox = &thread->migrations;
+  return inbox->eventfd < 0 || (atomic_load(&inbox->n_pushing) == 0 && atomic_load(&inbox->head) == NULL);
+}
@@ -0,0 +1,38 @@
+#ifndef HTTPS_PROXY_MIGRATION_H
+#define HTTPS_PROXY_MIGRATION_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+struct poll;
+struct proxy_server;
+struct connection_thread;
+struct tunnel_conn;
+
+/**
+ * Tunnels on their way to this thread from busier ones.
+ * Any thread may push, so the tunnels form a lock-free stack that only the owner takes from, all at once, which
+ * leaves no room for ABA problems.
+ */
+struct migration_inbox {
+  // becomes readable when tunnels were pushed; -1 unless tunnels are rebalanced
+  int eventfd;
+  // set by pushing threads when they signal the eventfd, so that a burst of tunnels costs a single wakeup
+  atomic_bool wakeup_pending;
+  // threads in the middle of pushing a tunnel, so that a draining thread knows when no more tunnels can arrive
+  atomic_uint n_pushing;
+  // linked through `next_migrating`
+  _Atomic(struct tunnel_conn*) head;
+};
+
+void migration_init(struct proxy_server* server);
+
+void start_rebalancing_tunnels(struct poll* p, struct connection_thread* thread);
+
+void rebalance_tunnels(struct poll* p, struct connection_thread* thread);
+
+void handle_migration_inbox_readability(struct poll* p, struct connection_thread* thread);
+
+bool migration_inbox_settled(struct connection_thread* thread);
+
+#endif  // HTTPS_PROXY_MIGRATION_H
@@ -1,19 +1,227 @@
 #ifndef HTTPS_PROXY_PROXY_SERVER_H
 #define HTTPS_PROXY_PROXY_SERVER_H
 
+#include <netinet/in.h>
+#include <stdatomic.h>
+#include "access_log.h"
+#include "breaker.h"
+#include "egress.h"
+#include "elastic.h"
+#include "handoff.h"
+#include "host_table.h"
+#include "memory_budget.h"
+#include "migration.h"
+#include "rate_limit.h"
+#include "send_queue.h"
+#include "sockmap.h"
+#include "target_stats.h"
 #include "tunnel_conn.h"
+#include "upgrade.h"
+
+struct h2_session;
+struct h2_client;
 
 struct proxy_server {
+  // shared by all threads unless they have their own, -1 if not
   int listening_socket;
+  int transparent_listening_socket;
+  unsigned short listening_port;
+  // 0 if transparent mode is disabled
+  unsigned short transparent_port;
   bool stats_enabled;
   char** blocklist;
   int blocklist_len;
+
+  // threads_len is the most threads there can be, each of which may be stopped, see `state`
+  struct connection_thread* threads;
+  unsigned short threads_len;
+  // When non-zero, threads[0, acceptors_len) only accept connections and hand them off to the other threads.
+  // Otherwise, every thread accepts its own connections.
+  unsigned short acceptors_len;
+
+  // admission control, 0 means unlimited
+  unsigned int max_tunnels;
+  unsigned int max_tunnels_per_thread;
+  atomic_uint active_tunnels;
+
+  // rate limiting in bytes per second, 0 means unlimited
+  unsigned long long client_rate;
+  unsigned long long target_rate;
+  struct shared_token_bucket* global_rate_limit;
+
+  // limit on the memory held by tunnel buffers; NULL if unlimited
+  struct memory_budget* memory_budget;
+
+  // Parent proxy that all tunnels go through, over HTTP/2 connections shared by the tunnels of each thread;
+  // parent_hostport is NULL if tunnels connect to their targets directly
+  const char* parent_hostport;
+  struct sockaddr_in parent_addr;
+  // the most connections each thread keeps to the parent
+  unsigned short parent_connections;
+
+  // consecutive connect failures that open the circuit breaker of a target or address, 0 if there are no breakers
+  unsigned int breaker_threshold;
+
+  // local addresses that connections to targets are made from; NULL if the kernel picks one
+  struct egress_pool* egress;
+
+  // relays established tunnels in the kernel; NULL if they are relayed in user space
+  struct sockmap* sockmap;
+
+  // the TCP_NOTSENT_LOWAT of the sockets of each class of tunnels, 0 if the kernel queues as much as it takes
+  unsigned int notsent_lowat[TUNNEL_CLASS_COUNT];
+
+  // directory of the binary access log, NULL if disabled
+  const char* access_log_dir;
+
+  // how often each thread reports on its event loop; 0 if disabled
+  unsigned long long loop_stats_interval_us;
+
+  // traffic per target host, merged from all threads into a top list; NULL if disabled
+  struct target_stats_report* target_stats;
+
+  // how long event loops and sockets poll for events before they go to sleep; 0 if they go to sleep right away
+  unsigned int busy_poll_us;
+
+  // threads at least this busy (0 to 1) move some of their heaviest tunnels to the least busy thread; 0 if disabled
+  double rebalance_utilisation;
+
+  // hands the listening sockets over to the next process of the proxy; NULL if disabled
+  struct upgrade* upgrade;
+
+  // starts and retires threads with their load; NULL if the number of threads is fixed
+  struct elastic_scaler* scaler;
+  // the pthread start routine of a connection thread
+  void* (*run_thread)(void* thread);
+};
+
+/**
+ * Live load of a connection thread.
+ * Only the owning thread writes these, other threads (e.g., acceptors) may read them at any time.
+ */
+struct thread_load {
+  atomic_uint active_tunnels;
+  atomic_ullong n_bytes_transferred;
+  // how long the most recent handed-off connection waited in the queue before the thread picked it up
+  atomic_uint handoff_lag_us;
+  atomic_ullong handoff_lag_sampled_at_us;
+  // memory held by tunnel buffers, only tracked with a memory budget
+  atomic_ullong buffer_bytes;
+  // how many times a buffer could not be allocated because the memory budget ran out
+  atomic_ullong n_memory_waits;
+  // time the event loop spent handling events, only tracked while the number of threads is elastic or tunnels are
+  // rebalanced
+  atomic_ullong busy_us;
+  // the share of time the event loop spent handling events over the last rebalancing interval, in thousandths
+  atomic_uint busy_permille;
+  // the send queues links waited on, by the class of their tunnel, only sampled if stats are enabled
+  struct send_queue_samples send_queues[TUNNEL_CLASS_COUNT];
 };
 
-void accept_incoming_connections(struct poll* p, struct proxy_server* server);
+// State owned by one connection thread, i.e., one event loop
+struct connection_thread {
+  unsigned short id;
+  struct proxy_server* server;
+  // an `enum connection_thread_state`, changed by thread 0 to start or retire the thread
+  atomic_int state;
+  // the CPU this thread is pinned to, or -1 if it can run anywhere
+  int cpu;
+  // either the listening socket shared by all threads,
+  // or an SO_REUSEPORT socket owned by this thread when threads are pinned,
+  // or -1 for a thread that only receives connections from acceptors
+  int listening_socket;
+  // same as above, for transparently redirected TLS connections; -1 if disabled
+  int transparent_listening_socket;
+
+  struct poll* poll;
+  struct thread_load load;
+
+  // Reserved so that we can still accept (and shed) a connection when we run out of file descriptors
+  int spare_fd;
+  // Whether we stopped accepting connections until the back-off timer fires
+  bool accept_paused;
+  // Whether the listening sockets are level-triggered for now, because pausing failed to schedule the timer to resume
+  bool accept_level_triggered;
+  // Whether the thread noticed that it's retiring, and stopped accepting connections for good
+  bool draining;
+  unsigned long long accept_backoff_us;
+
+  // token buckets of the tunnels on this thread keyed by client IP and target host; NULL if not rate limited
+  struct rate_limit_table* client_rate_limits;
+  struct rate_limit_table* target_rate_limits;
+
+  // memory reserved from the memory budget but not used by any buffer yet
+  unsigned long long memory_reserved;
+
+  // the target hosts of the tunnels on this thread, which they share
+  struct host_table* hostnames;
+
+  // targets and addresses that failed to connect recently; NULL without circuit breakers
+  struct breaker_table* breakers;
+
+  // how many tunnel_conns the thread created, to give each an id
+  unsigned long long n_conns_created;
+
+  // for threads receiving connections from acceptors
+  struct handoff_inbox inbox;
+  // for acceptor threads
+  struct handoff_placement placement;
+
+  // tunnels relaying between two sockets, which may be moved to another thread, in a linked list
+  struct tunnel_conn* relaying_tunnels;
+  // tunnels moved to this thread by others, and when this thread last sampled its own load
+  struct migration_inbox migrations;
+  unsigned long long rebalanced_at_us;
+  unsigned long long rebalanced_busy_us;
+
+  // HTTP/2 connections to the parent proxy, parent_connections of them (NULL where not connected)
+  struct h2_session** upstream_sessions;
+  // HTTP/2 connections of clients, in a linked list
+  struct h2_client* h2_clients;
+
+  // NULL if access logging is disabled
+  struct access_log* access_log;
+  // traffic per target host since the thread last handed it over; NULL if disabled
+  struct target_stats_table* target_stats;
+};
+
+void prepare_accepting(struct connection_thread* thread);
+
+void accept_incoming_connections(struct poll* p, struct connection_thread* thread);
+
+void accept_incoming_transparent_connections(struct poll* p, struct connection_thread* thread);
+
+bool thread_has_capacity(struct connection_thread* thread);
+
+bool server_has_capacity(struct proxy_server* server);
+
+void adopt_client_socket(
+    struct poll* p,
+    struct connection_thread* thread,
+    int client_socket,
+    const struct sockaddr_in* client_addr,
+    bool transparent);
 
 void start_connecting_to_target(struct poll* p, struct tunnel_conn* conn);
 
+void reject_client_request(struct poll* p, struct tunnel_conn* conn);
+
+void start_upstream_tunnel(struct poll* p, struct tunnel_conn* conn);
+
+void serve_h2_client(struct poll* p, struct tunnel_conn* conn);
+
+void stop_serving_h2_clients(struct poll* p, struct connection_thread* thread);
+
+void disconnect_from_parent(struct poll* p, struct connection_thread* thread);
+
 void start_tunneling(struct poll* p, struct tunnel_conn* conn);
 
+void detach_tunneling_links(struct poll* p, struct tunnel_conn* conn);
+
+bool attach_tunneling_links(struct poll* p, struct tunnel_conn* conn);
+
+void sync_offloaded_bytes(struct tunnel_conn* conn);
+
+void release_offloaded_tunnel(struct tunnel_conn* conn);
+
 #endif  // HTTPS_PROXY_PROXY_SERVER_H
@@ -0,0 +1,254 @@
+#include "rate_limit.h"
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../log.h"
+#include "../util.h"
+#include "proxy_server.h"
+
+#define RATE_LIMIT_TABLE_INITIAL_CAPACITY 64
+// Don't bother reading fewer bytes than this; wait for more tokens instead
+#define RATE_LIMIT_MIN_READ 1024
+
+struct rate_limit_table* create_rate_limit_table(unsigned long long rate) {
+  if (rate == 0) {
+    return NULL;
+  }
+
+  struct rate_limit_table* table = malloc(sizeof(struct rate_limit_table));
+  table->rate = rate;
+  table->capacity = RATE_LIMIT_TABLE_INITIAL_CAPACITY;
+  table->slots = calloc(table->capacity, sizeof(struct rate_limit_entry*));
+  table->len = 0;
+  return table;
+}
+
+void destroy_rate_limit_table(struct rate_limit_table* table) {
+  if (table == NULL) {
+    return;
+  }
+
+  for (size_t i = 0; i < table->capacity; i++) {
+    struct rate_limit_entry* entry = table->slots[i];
+    while (entry != NULL) {
+      struct rate_limit_entry* next = entry->next;
+      free(entry->key);
+      free(entry);
+      entry = next;
+    }
+  }
+  free(table->slots);
+  free(table);
+}
+
+struct shared_token_bucket* create_shared_token_bucket(unsigned long long rate) {
+  if (rate == 0) {
+    return NULL;
+  }
+
+  struct shared_token_bucket* bucket = malloc(sizeof(struct shared_token_bucket));
+  bucket->rate = rate;
+  atomic_init(&bucket->tokens, rate);
+  atomic_init(&bucket->refilled_at_us, monotonic_time_us());
+  return bucket;
+}
+
+void rate_limit_table_grow(struct rate_limit_table* table) {
+  size_t new_capacity = table->capacity * 2;
+  struct rate_limit_entry** new_slots = calloc(new_capacity, sizeof(struct rate_limit_entry*));
+  for (size_t i = 0; i < table->capacity; i++) {
+    struct rate_limit_entry* entry = table->slots[i];
+    while (entry != NULL) {
+      struct rate_limit_entry* next = entry->next;
+      size_t slot = hash_key(entry->key) & (new_capacity - 1);
+      entry->next = new_slots[slot];
+      new_slots[slot] = entry;
+      entry = next;
+    }
+  }
+  free(table->slots);
+  table->slots = new_slots;
+  table->capacity = new_capacity;
+}
+
+// Returns the bucket for the key, creating a full one if there is none yet
+struct token_bucket* acquire_bucket(struct rate_limit_table* table, const char* key) {
+  size_t slot = hash_key(key) & (table->capacity - 1);
+  for (struct rate_limit_entry* entry = table->slots[slot]; entry != NULL; entry = entry->next) {
+    if (strcmp(entry->key, key) == 0) {
+      entry->refcount++;
+      return &entry->bucket;
+    }
+  }
+
+  if (table->len >= table->capacity) {
+    rate_limit_table_grow(table);
+    slot = hash_key(key) & (table->capacity - 1);
+  }
+
+  struct rate_limit_entry* entry = malloc(sizeof(struct rate_limit_entry));
+  entry->key = strdup(key);
+  entry->refcount = 1;
+  entry->bucket.rate = table->rate;
+  entry->bucket.tokens = table->rate;
+  entry->bucket.refilled_at_us = monotonic_time_us();
+  entry->next = table->slots[slot];
+  table->slots[slot] = entry;
+  table->len++;
+  return &entry->bucket;
+}
+
+void release_bucket(struct rate_limit_table* table, const char* key) {
+  struct rate_limit_entry** link = &table->slots[hash_key(key) & (table->capacity - 1)];
+  for (; *link != NULL; link = &(*link)->next) {
+    struct rate_limit_entry* entry = *link;
+    if (strcmp(entry->key, key) == 0) {
+      if (--entry->refcount == 0) {
+        *link = entry->next;
+        free(entry->key);
+        free(entry);
+        table->len--;
+      }
+      return;
+    }
+  }
+}
+
+void refill_bucket(struct token_bucket* bucket, unsigned long long now_us) {
+  bucket->tokens += (now_us - bucket->refilled_at_us) * bucket->rate / 1e6;
+  if (bucket->tokens > bucket->rate) {
+    bucket->tokens = bucket->rate;
+  }
+  bucket->refilled_at_us = now_us;
+}
+
+void refill_shared_bucket(struct shared_token_bucket* bucket, unsigned long long now_us) {
+  unsigned long long refilled_at_us = atomic_load_explicit(&bucket->refilled_at_us, memory_order_relaxed);
+  unsigned long long n_tokens = (now_us - refilled_at_us) * bucket->rate / 1000000;
+  if (n_tokens == 0) {
+    return;
+  }
+
+  // whoever moves the timestamp forward gets to add the tokens for that period
+  unsigned long long new_refilled_at_us = refilled_at_us + n_tokens * 1000000 / bucket->rate;
+  if (!atomic_compare_exchange_strong(&bucket->refilled_at_us, &refilled_at_us, new_refilled_at_us)) {
+    return;
+  }
+
+  long long tokens = atomic_load_explicit(&bucket->tokens, memory_order_relaxed);
+  long long new_tokens;
+  do {
+    new_tokens = tokens + n_tokens;
+    if (new_tokens > (long long)bucket->rate) {
+      new_tokens = bucket->rate;
+    }
+  } while (!atomic_compare_exchange_weak(&bucket->tokens, &tokens, new_tokens));
+}
+
+// Returns how long it takes until the bucket holds `n_tokens` tokens
+unsigned long long time_until_tokens(double tokens, double rate, double n_tokens) {
+  if (tokens >= n_tokens) {
+    return 0;
+  }
+  return (n_tokens - tokens) * 1e6 / rate + 1;
+}
+
+double min_read(double rate) {
+  return rate < RATE_LIMIT_MIN_READ ? rate : RATE_LIMIT_MIN_READ;
+}
+
+void attach_rate_limits(struct tunnel_conn* conn) {
+  struct connection_thread* thread = conn->thread;
+
+  if (thread->client_rate_limits != NULL) {
+    char client_ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &conn->client_addr.sin_addr, client_ip, sizeof(client_ip));
+    conn->client_bucket = acquire_bucket(thread->client_rate_limits, client_ip);
+  }
+
+  if (thread->target_rate_limits != NULL) {
+    conn->target_bucket = acquire_bucket(thread->target_rate_limits, conn->target_host);
+  }
+}
+
+void detach_rate_limits(struct tunnel_conn* conn) {
+  struct connection_thread* thread = conn->thread;
+
+  if (conn->client_bucket != NULL) {
+    char client_ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &conn->client_addr.sin_addr, client_ip, sizeof(client_ip));
+    release_bucket(thread->client_rate_limits, client_ip);
+    conn->client_bucket = NULL;
+  }
+
+  if (conn->target_bucket != NULL) {
+    release_bucket(thread->target_rate_limits, conn->target_host);
+    conn->target_bucket = NULL;
+  }
+}
+
+/**
+ * @param conn
+ * @param delay_us if nothing may be read now, will be set to how long to wait before trying again
+ * @return how many bytes the tunnel may read now; SIZE_MAX if it is not rate limited
+ */
+size_t rate_limit_allowance(struct tunnel_conn* conn, unsigned long long* delay_us) {
+  struct shared_token_bucket* global_bucket = conn->thread->server->global_rate_limit;
+  if (conn->client_bucket == NULL && conn->target_bucket == NULL && global_bucket == NULL) {
+    return SIZE_MAX;
+  }
+
+  unsigned long long now_us = monotonic_time_us();
+  double allowance = SIZE_MAX;
+  unsigned long long delay = 0;
+
+  struct token_bucket* buckets[] = {conn->client_bucket, conn->target_bucket};
+  for (size_t i = 0; i < sizeof(buckets) / sizeof(buckets[0]); i++) {
+    struct token_bucket* bucket = buckets[i];
+    if (bucket == NULL) {
+      continue;
+    }
+
+    refill_bucket(bucket, now_us);
+    if (bucket->tokens < allowance) {
+      allowance = bucket->tokens;
+    }
+    unsigned long long bucket_delay = time_until_tokens(bucket->tokens, bucket->rate, min_read(bucket->rate));
+    if (bucket_delay > delay) {
+      delay = bucket_delay;
+    }
+  }
+
+  if (global_bucket != NULL) {
+    refill_shared_bucket(global_bucket, now_us);
+    double tokens = atomic_load_explicit(&global_bucket->tokens, memory_order_relaxed);
+    if (tokens < allowance) {
+      allowance = tokens;
+    }
+    unsigned long long bucket_delay = time_until_tokens(tokens, global_bucket->rate, min_read(global_bucket->rate));
+    if (bucket_delay > delay) {
+      delay = bucket_delay;
+    }
+  }
+
+  if (delay > 0) {
+    *delay_us = delay;
+    return 0;
+  }
+  return allowance;
+}
+
+void rate_limit_consume(struct tunnel_conn* conn, size_t n_bytes) {
+  if (conn->client_bucket != NULL) {
+    conn->client_bucket->tokens -= n_bytes;
+  }
+  if (conn->target_bucket != NULL) {
+    conn->target_bucket->tokens -= n_bytes;
+  }
+
+  // other threads may have taken tokens meanwhile, so the shared bucket can briefly go negative
+  struct shared_token_bucket* global_bucket = conn->thread->server->global_rate_limit;
+  if (global_bucket != NULL) {
+    atomic_fetch_sub_explicit(&global_bucket->tokens, n_bytes, memory_order_relaxed);
+  }
+}
@@ -0,0 +1,55 @@
+#ifndef HTTPS_PROXY_RATE_LIMIT_H
+#define HTTPS_PROXY_RATE_LIMIT_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+struct tunnel_conn;
+
+/**
+ * A token bucket holding up to one second worth of bytes.
+ * Tokens are refilled lazily whenever the bucket is looked at.
+ */
+struct token_bucket {
+  double rate;  // bytes per second
+  double tokens;
+  unsigned long long refilled_at_us;
+};
+
+// A token bucket shared by all threads; tokens are kept in whole bytes so that they can be updated atomically
+struct shared_token_bucket {
+  unsigned long long rate;  // bytes per second
+  atomic_llong tokens;
+  atomic_ullong refilled_at_us;
+};
+
+struct rate_limit_entry {
+  char* key;
+  // number of tunnels using this bucket; the entry is removed once it drops to 0
+  unsigned int refcount;
+  struct token_bucket bucket;
+  struct rate_limit_entry* next;
+};
+
+/**
+ * A chained hash table of token buckets, e.g., one per client IP.
+ * Each thread has its own tables, so no synchronisation is needed.
+ */
+struct rate_limit_table {
+  unsigned long long rate;  // bytes per second for every bucket in this table
+  struct rate_limit_entry** slots;
+  size_t capacity;
+  size_t len;
+};
+
+struct rate_limit_table* create_rate_limit_table(unsigned long long rate);
+void destroy_rate_limit_table(struct rate_limit_table* table);
+
+struct shared_token_bucket* create_shared_token_bucket(unsigned long long rate);
+
+void attach_rate_limits(struct tunnel_conn* conn);
+void detach_rate_limits(struct tunnel_conn* conn);
+size_t rate_limit_allowance(struct tunnel_conn* conn, unsigned long long* delay_us);
+void rate_limit_consume(struct tunnel_conn* conn, size_t n_bytes);
+
+#endif  // HTTPS_PROXY_RATE_LIMIT_H
@@ -0,0 +1,163 @@
+#include "send_queue.h"
+#include <errno.h>
+#include <linux/sockios.h>
+#include <linux/tcp.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include "../log.h"
+#include "../poll.h"
+#include "../util.h"
+#include "proxy_server.h"
+
+#define SEND_QUEUE_REPORT_INTERVAL_US 10000000
+
+static const char* tunnel_class_names[TUNNEL_CLASS_COUNT] = {
+    [TUNNEL_CLASS_CONNECT] = "connect",
+    [TUNNEL_CLASS_TRANSPARENT] = "transparent",
+};
+
+const char* tunnel_class_name(enum tunnel_class class) {
+  return tunnel_class_names[class];
+}
+
+/**
+ * @param list comma-separated low-water marks in bytes, each for the class it's prefixed with, or for all of them
+ * without a prefix, e.g., 16384,transparent:131072
+ * @param lowats the low-water mark of each class, indexed by `enum tunnel_class`
+ * @return 0 on success; -1 if the list is malformed
+ */
+int parse_notsent_lowats(const char* list, unsigned int* lowats) {
+  const char* cursor = list;
+  while (*cursor != '\0') {
+    const char* end = strchr(cursor, ',');
+    size_t len = end != NULL ? (size_t)(end - cursor) : strlen(cursor);
+
+    int class = -1;
+    const char* colon = memchr(cursor, ':', len);
+    if (colon != NULL) {
+      for (int i = 0; i < TUNNEL_CLASS_COUNT; i++) {
+        size_t name_len = strlen(tunnel_class_names[i]);
+        if ((size_t)(colon - cursor) == name_len && strncmp(cursor, tunnel_class_names[i], name_len) == 0) {
+          class = i;
+        }
+      }
+      if (class < 0) {
+        return -1;
+      }
+      len -= colon + 1 - cursor;
+      cursor = colon + 1;
+    }
+
+    char* number_end;
+    unsigned long lowat = strtoul(cursor, &number_end, 10);
+    if (len == 0 || number_end != cursor + len || lowat > INT32_MAX) {
+      return -1;
+    }
+    for (int i = 0; i < TUNNEL_CLASS_COUNT; i++) {
+      if (class < 0 || class == i) {
+        lowats[i] = lowat;
+      }
+    }
+
+    cursor += len;
+    if (*cursor == ',') {
+      cursor++;
+    }
+  }
+  return 0;
+}
+
+enum tunnel_class tunnel_class_of(const struct tunnel_conn* conn) {
+  return conn->transparent ? TUNNEL_CLASS_TRANSPARENT : TUNNEL_CLASS_CONNECT;
+}
+
+// The low-water mark for the unsent bytes in the sockets of the tunnel, 0 if there is none
+unsigned int notsent_lowat_of(const struct tunnel_conn* conn) {
+  return conn->thread->server->notsent_lowat[tunnel_class_of(conn)];
+}
+
+/**
+ * Sets the low-water mark of the tunnel's class on both of its sockets, if there is one. Epoll then only reports a
+ * socket writable once fewer bytes than that wait in it to be sent, which the links wait for before reading on.
+ */
+void set_notsent_lowat(struct tunnel_conn* conn) {
+  int lowat = notsent_lowat_of(conn);
+  if (lowat == 0) {
+    return;
+  }
+
+  int socks[2] = {conn->client_socket, conn->target_socket};
+  for (int i = 0; i < 2; i++) {
+    if (setsockopt(socks[i], IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) < 0) {
+      // the links still wait for writability, which comes with a full send buffer's worth of room instead
+      char* error_desc = errno2s(errno);
+      DEBUG_LOG(
+          "failed to set TCP_NOTSENT_LOWAT for (%s) -> (%s): %s",
+          client_hostport(conn),
+          target_hostport(conn),
+          error_desc);
+      free(error_desc);
+    }
+  }
+}
+
+// Adds the state of the send queue of the socket, which a link of the tunnel is about to wait on, to the stats
+void sample_send_queue(struct tunnel_conn* conn, int sock) {
+  struct tcp_info info;
+  socklen_t len = sizeof(info);
+  int n_bytes_queued;
+  if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) < 0 || ioctl(sock, SIOCOUTQ, &n_bytes_queued) < 0) {
+    return;
+  }
+
+  struct send_queue_samples* samples = &conn->thread->load.send_queues[tunnel_class_of(conn)];
+  atomic_fetch_add_explicit(&samples->n_samples, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&samples->n_unsent_bytes, info.tcpi_notsent_bytes, memory_order_relaxed);
+  atomic_fetch_add_explicit(&samples->n_queued_bytes, n_bytes_queued, memory_order_relaxed);
+  if (info.tcpi_notsent_bytes > atomic_load_explicit(&samples->max_unsent_bytes, memory_order_relaxed)) {
+    atomic_store_explicit(&samples->max_unsent_bytes, info.tcpi_notsent_bytes, memory_order_relaxed);
+  }
+}
+
+void report_send_queues(struct poll* p, struct connection_thread* thread) {
+  struct proxy_server* server = thread->server;
+
+  for (int class = 0; class < TUNNEL_CLASS_COUNT; class++) {
+    unsigned long long n_samples = 0;
+    unsigned long long n_unsent_bytes = 0;
+    unsigned long long n_queued_bytes = 0;
+    unsigned long long max_unsent_bytes = 0;
+    for (int i = 0; i < server->threads_len; i++) {
+      struct send_queue_samples* samples = &server->threads[i].load.send_queues[class];
+      n_samples += atomic_load_explicit(&samples->n_samples, memory_order_relaxed);
+      n_unsent_bytes += atomic_load_explicit(&samples->n_unsent_bytes, memory_order_relaxed);
+      n_queued_bytes += atomic_load_explicit(&samples->n_queued_bytes, memory_order_relaxed);
+      unsigned long long max = atomic_load_explicit(&samples->max_unsent_bytes, memory_order_relaxed);
+      if (max > max_unsent_bytes) {
+        max_unsent_bytes = max;
+      }
+    }
+    if (n_samples == 0) {
+      continue;
+    }
+
+    printf(
+        "Send queues of %s tunnels: %llu bytes unsent on average (at most %llu), %llu bytes queued on average "
+        "with the unacknowledged ones, over %llu waits to write, low-water mark %u bytes\n",
+        tunnel_class_names[class],
+        n_unsent_bytes / n_samples,
+        max_unsent_bytes,
+        n_queued_bytes / n_samples,
+        n_samples,
+        server->notsent_lowat[class]);
+  }
+
+  if (poll_add_timer(p, SEND_QUEUE_REPORT_INTERVAL_US, thread, (poll_callback)report_send_queues) == NULL) {
+    LOG("failed to schedule the next send queue report");
+  }
+}
@@ -0,0 +1,41 @@
+#ifndef HTTPS_PROXY_SEND_QUEUE_H
+#define HTTPS_PROXY_SEND_QUEUE_H
+
+#include <stdatomic.h>
+
+struct poll;
+struct connection_thread;
+struct tunnel_conn;
+
+// Tunnels between two sockets, by how the client reached us. Each class may have its own low-water mark.
+enum tunnel_class {
+  // tunnels of CONNECT requests
+  TUNNEL_CLASS_CONNECT,
+  // tunnels of transparently redirected TLS connections
+  TUNNEL_CLASS_TRANSPARENT,
+  TUNNEL_CLASS_COUNT,
+};
+
+/**
+ * The send queues of the sockets the tunnels of a class write to, sampled whenever a link has to wait to write more.
+ * Only the owning thread writes these, thread 0 reads them for the stats.
+ */
+struct send_queue_samples {
+  atomic_ullong n_samples;
+  // bytes the kernel hasn't sent yet, and those it sent but the peer hasn't acknowledged yet on top
+  atomic_ullong n_unsent_bytes;
+  atomic_ullong n_queued_bytes;
+  atomic_ullong max_unsent_bytes;
+};
+
+int parse_notsent_lowats(const char* list, unsigned int* lowats);
+const char* tunnel_class_name(enum tunnel_class class);
+
+enum tunnel_class tunnel_class_of(const struct tunnel_conn* conn);
+unsigned int notsent_lowat_of(const struct tunnel_conn* conn);
+void set_notsent_lowat(struct tunnel_conn* conn);
+
+void sample_send_queue(struct tunnel_conn* conn, int sock);
+void report_send_queues(struct poll* p, struct connection_thread* thread);
+
+#endif  // HTTPS_PROXY_SEND_QUEUE_H
@@ -0,0 +1,145 @@
+#include "sni.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TLS_RECORD_HEADER_LEN 5
+#define TLS_MAX_RECORD_LEN (16384 + 2048)
+#define TLS_CONTENT_TYPE_HANDSHAKE 0x16
+#define TLS_HANDSHAKE_HEADER_LEN 4
+#define TLS_HANDSHAKE_CLIENT_HELLO 0x01
+#define TLS_RANDOM_LEN 32
+#define TLS_EXTENSION_SERVER_NAME 0x0000
+#define TLS_SERVER_NAME_TYPE_HOST_NAME 0x00
+
+// A read-only view into the buffer, so that parsing never copies anything
+struct cursor {
+  const unsigned char* pos;
+  const unsigned char* end;
+};
+
+bool cursor_skip(struct cursor* c, size_t n) {
+  if ((size_t)(c->end - c->pos) < n) {
+    return false;
+  }
+  c->pos += n;
+  return true;
+}
+
+bool cursor_read_uint(struct cursor* c, size_t n_bytes, uint32_t* value) {
+  if ((size_t)(c->end - c->pos) < n_bytes) {
+    return false;
+  }
+  *value = 0;
+  for (size_t i = 0; i < n_bytes; i++) {
+    *value = (*value << 8) | c->pos[i];
+  }
+  c->pos += n_bytes;
+  return true;
+}
+
+// Reads a vector prefixed with its length in `n_len_bytes` bytes into `vector`
+bool cursor_read_vector(struct cursor* c, size_t n_len_bytes, struct cursor* vector) {
+  uint32_t len;
+  if (!cursor_read_uint(c, n_len_bytes, &len) || (size_t)(c->end - c->pos) < len) {
+    return false;
+  }
+  vector->pos = c->pos;
+  vector->end = c->pos + len;
+  c->pos += len;
+  return true;
+}
+
+enum sni_parse_result parse_server_name_extension(struct cursor* extension, const char** host, size_t* host_len) {
+  struct cursor server_names;
+  if (!cursor_read_vector(extension, 2, &server_names)) {
+    return SNI_MALFORMED;
+  }
+
+  while (server_names.pos < server_names.end) {
+    uint32_t name_type;
+    struct cursor name;
+    if (!cursor_read_uint(&server_names, 1, &name_type) || !cursor_read_vector(&server_names, 2, &name)) {
+      return SNI_MALFORMED;
+    }
+    if (name_type == TLS_SERVER_NAME_TYPE_HOST_NAME && name.end > name.pos) {
+      *host = (const char*)name.pos;
+      *host_len = name.end - name.pos;
+      return SNI_FOUND;
+    }
+  }
+
+  return SNI_NOT_FOUND;
+}
+
+/**
+ * Finds the server name (SNI) in a TLS ClientHello without copying it.
+ * This can be called again with more data every time more bytes of the ClientHello arrive.
+ * Only ClientHellos that fit in a single TLS record are supported, which is the case for all common clients.
+ * @param data the bytes received from the client so far
+ * @param len
+ * @param host will point into `data` if the server name was found; it is not null-terminated
+ * @param host_len
+ * @return the result of the parse
+ */
+enum sni_parse_result parse_sni(const char* data, size_t len, const char** host, size_t* host_len) {
+  struct cursor c = {.pos = (const unsigned char*)data, .end = (const unsigned char*)data + len};
+
+  // reject anything that isn't TLS as soon as possible
+  if (len >= 1 && c.pos[0] != TLS_CONTENT_TYPE_HANDSHAKE) {
+    return SNI_MALFORMED;
+  }
+  if (len < TLS_RECORD_HEADER_LEN + TLS_HANDSHAKE_HEADER_LEN) {
+    return SNI_NEED_MORE;
+  }
+
+  uint32_t record_len = 0;
+  cursor_skip(&c, 3);  // content type and legacy record version
+  cursor_read_uint(&c, 2, &record_len);
+  if (record_len > TLS_MAX_RECORD_LEN) {
+    return SNI_MALFORMED;
+  }
+
+  // the length check above guarantees these are read, but the compiler can't tell
+  uint32_t handshake_type = 0, handshake_len = 0;
+  cursor_read_uint(&c, 1, &handshake_type);
+  cursor_read_uint(&c, 3, &handshake_len);
+  if (handshake_type != TLS_HANDSHAKE_CLIENT_HELLO) {
+    return SNI_MALFORMED;
+  }
+  if (TLS_HANDSHAKE_HEADER_LEN + handshake_len > record_len) {
+    // the ClientHello is fragmented across records
+    return SNI_NOT_FOUND;
+  }
+  if ((size_t)(c.end - c.pos) < handshake_len) {
+    return SNI_NEED_MORE;
+  }
+  c.end = c.pos + handshake_len;
+
+  struct cursor ignored, extensions;
+  if (!cursor_skip(&c, 2 + TLS_RANDOM_LEN)       // legacy version and random
+      || !cursor_read_vector(&c, 1, &ignored)    // legacy session id
+      || !cursor_read_vector(&c, 2, &ignored)    // cipher suites
+      || !cursor_read_vector(&c, 1, &ignored)) {  // legacy compression methods
+    return SNI_MALFORMED;
+  }
+  if (c.pos == c.end) {
+    // no extensions at all
+    return SNI_NOT_FOUND;
+  }
+  if (!cursor_read_vector(&c, 2, &extensions)) {
+    return SNI_MALFORMED;
+  }
+
+  while (extensions.pos < extensions.end) {
+    uint32_t extension_type;
+    struct cursor extension;
+    if (!cursor_read_uint(&extensions, 2, &extension_type) || !cursor_read_vector(&extensions, 2, &extension)) {
+      return SNI_MALFORMED;
+    }
+    if (extension_type == TLS_EXTENSION_SERVER_NAME) {
+      return parse_server_name_extension(&extension, host, host_len);
+    }
+  }
+
+  return SNI_NOT_FOUND;
+}
@@ -0,0 +1,18 @@
+#ifndef HTTPS_PROXY_SNI_H
+#define HTTPS_PROXY_SNI_H
+
+#include <stddef.h>
+
+enum sni_parse_result {
+  SNI_FOUND,
+  // the ClientHello is incomplete, read more bytes and parse again
+  SNI_NEED_MORE,
+  // a valid ClientHello without a server name
+  SNI_NOT_FOUND,
+  // not a TLS ClientHello
+  SNI_MALFORMED,
+};
+
+enum sni_parse_result parse_sni(const char* data, size_t len, const char** host, size_t* host_len);
+
+#endif  // HTTPS_PROXY_SNI_H
@@ -0,0 +1,292 @@
+#include "sockmap.h"
+#include <errno.h>
+#include <linux/bpf.h>
+#include <linux/sockios.h>
+#include <linux/tcp.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "../log.h"
+#include "../poll.h"
+#include "../util.h"
+#include "proxy_server.h"
+
+#ifndef SO_COOKIE
+#define SO_COOKIE 57  // from asm-generic/socket.h
+#endif
+
+// how often each thread adds the bytes relayed by the kernel to the stats of its tunnels
+#define SOCKMAP_SYNC_INTERVAL_US 1000000
+#define SOCKMAP_VERIFIER_LOG_SIZE 4096
+
+#define BPF_INSN(CODE, DST, SRC, OFF, IMM) \
+  ((struct bpf_insn){.code = (CODE), .dst_reg = (DST), .src_reg = (SRC), .off = (OFF), .imm = (IMM)})
+
+int sys_bpf(enum bpf_cmd cmd, union bpf_attr* attr) {
+  return syscall(SYS_bpf, cmd, attr, sizeof(union bpf_attr));
+}
+
+int create_bpf_map(enum bpf_map_type type, unsigned int key_size, unsigned int value_size, unsigned int max_entries) {
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type = type;
+  attr.key_size = key_size;
+  attr.value_size = value_size;
+  attr.max_entries = max_entries;
+  if (type == BPF_MAP_TYPE_HASH) {
+    attr.map_flags = BPF_F_NO_PREALLOC;
+  }
+  return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+/**
+ * Loads the verdict program, hand-assembled so that building it needs no BPF toolchain. In C, it reads:
+ *
+ *   // A FIN on its own: the socket knows it's closed already, and sending or queueing no bytes would count as an error
+ *   // that breaks the peer's or its own relaying.
+ *   if (skb->len == 0) return SK_DROP;
+ *   __u64 cookie = bpf_get_socket_cookie(skb);
+ *   struct sockmap_peer* peer = bpf_map_lookup_elem(&peers, &cookie);
+ *   if (peer == NULL) return SK_PASS;  // not part of a tunnel (anymore), the bytes go to the socket
+ *   __u64 peer_cookie = peer->peer_cookie;
+ *   // the peer isn't in the sockhash yet, or not anymore: pass rather than drop the bytes
+ *   if (bpf_sk_redirect_hash(skb, &sockets, &peer_cookie, 0) != SK_PASS) return SK_PASS;
+ *   __sync_fetch_and_add(&peer->n_bytes, skb->len);
+ *   return SK_PASS;
+ */
+int load_verdict_program(struct sockmap* sockmap) {
+  struct bpf_insn insns[] = {
+      BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+      BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_1, BPF_REG_6, offsetof(struct __sk_buff, len), 0),
+      BPF_INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_1, 0, 2, 0),
+      BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_DROP),
+      BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+      BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+      BPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_get_socket_cookie),
+      BPF_INSN(BPF_STX | BPF_MEM | BPF_DW, BPF_REG_10, BPF_REG_0, -8, 0),
+      BPF_INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, sockmap->peers_fd),
+      BPF_INSN(0, 0, 0, 0, 0),
+      BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+      BPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -8),
+      BPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+      // to the SK_PASS at the end
+      BPF_INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 14, 0),
+      BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_7, BPF_REG_0, 0, 0),
+      BPF_INSN(BPF_LDX | BPF_MEM | BPF_DW, BPF_REG_1, BPF_REG_7, offsetof(struct sockmap_peer, peer_cookie), 0),
+      BPF_INSN(BPF_STX | BPF_MEM | BPF_DW, BPF_REG_10, BPF_REG_1, -16, 0),
+      BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+      BPF_INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_2, BPF_PSEUDO_MAP_FD, 0, sockmap->sockets_fd),
+      BPF_INSN(0, 0, 0, 0, 0),
+      BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0),
+      BPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -16),
+      BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0),
+      BPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_redirect_hash),
+      // to the SK_PASS at the end
+      BPF_INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 3, SK_PASS),
+      BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_1, BPF_REG_6, offsetof(struct __sk_buff, len), 0),
+      BPF_INSN(BPF_STX | BPF_ATOMIC | BPF_DW, BPF_REG_7, BPF_REG_1, offsetof(struct sockmap_peer, n_bytes), BPF_ADD),
+      BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+      BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_PASS),
+      BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+  };
+
+  static char verifier_log[SOCKMAP_VERIFIER_LOG_SIZE];
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+  attr.insns = (uintptr_t)insns;
+  attr.insn_cnt = sizeof(insns) / sizeof(insns[0]);
+  attr.license = (uintptr_t) "Dual BSD/GPL";
+  attr.log_buf = (uintptr_t)verifier_log;
+  attr.log_size = sizeof(verifier_log);
+  attr.log_level = 1;
+  int prog_fd = sys_bpf(BPF_PROG_LOAD, &attr);
+  if (prog_fd < 0 && verifier_log[0] != '\0') {
+    DEBUG_LOG("BPF verifier log:\n%s", verifier_log);
+  }
+  return prog_fd;
+}
+
+void destroy_sockmap(struct sockmap* sockmap) {
+  if (sockmap->prog_fd >= 0) {
+    close(sockmap->prog_fd);
+  }
+  if (sockmap->peers_fd >= 0) {
+    close(sockmap->peers_fd);
+  }
+  if (sockmap->sockets_fd >= 0) {
+    close(sockmap->sockets_fd);
+  }
+  free(sockmap);
+}
+
+/**
+ * Sets up the maps and the verdict program.
+ * @param max_sockets how many sockets may be relayed by the kernel at once, two per tunnel
+ * @return NULL if BPF isn't available, e.g., because of a missing capability or an old kernel
+ */
+struct sockmap* create_sockmap(unsigned int max_sockets) {
+  struct sockmap* sockmap = malloc(sizeof(struct sockmap));
+  sockmap->peers_fd = -1;
+  sockmap->prog_fd = -1;
+
+  sockmap->sockets_fd =
+      create_bpf_map(BPF_MAP_TYPE_SOCKHASH, sizeof(unsigned long long), sizeof(unsigned int), max_sockets);
+  if (sockmap->sockets_fd < 0) {
+    char* error_desc = errno2s(errno);
+    LOG("failed to create sockhash: %s", error_desc);
+    free(error_desc);
+    destroy_sockmap(sockmap);
+    return NULL;
+  }
+
+  sockmap->peers_fd =
+      create_bpf_map(BPF_MAP_TYPE_HASH, sizeof(unsigned long long), sizeof(struct sockmap_peer), max_sockets);
+  if (sockmap->peers_fd < 0) {
+    char* error_desc = errno2s(errno);
+    LOG("failed to create the map of socket peers: %s", error_desc);
+    free(error_desc);
+    destroy_sockmap(sockmap);
+    return NULL;
+  }
+
+  sockmap->prog_fd = load_verdict_program(sockmap);
+  if (sockmap->prog_fd < 0) {
+    char* error_desc = errno2s(errno);
+    LOG("failed to load sk_skb verdict program: %s", error_desc);
+    free(error_desc);
+    destroy_sockmap(sockmap);
+    return NULL;
+  }
+
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.target_fd = sockmap->sockets_fd;
+  attr.attach_bpf_fd = sockmap->prog_fd;
+  attr.attach_type = BPF_SK_SKB_VERDICT;
+  if (sys_bpf(BPF_PROG_ATTACH, &attr) < 0) {
+    char* error_desc = errno2s(errno);
+    LOG("failed to attach sk_skb verdict program to sockhash: %s", error_desc);
+    free(error_desc);
+    destroy_sockmap(sockmap);
+    return NULL;
+  }
+
+  return sockmap;
+}
+
+bool get_socket_cookie(int sock, unsigned long long* cookie) {
+  socklen_t len = sizeof(*cookie);
+  return getsockopt(sock, SOL_SOCKET, SO_COOKIE, cookie, &len) == 0;
+}
+
+/**
+ * Counts the bytes written to a TCP socket so far, be it by user space or by the kernel redirecting them: those the
+ * peer acknowledged, plus those still in the send queue.
+ */
+bool get_socket_n_bytes_written(int sock, unsigned long long* n_bytes) {
+  struct tcp_info info;
+  socklen_t len = sizeof(info);
+  int n_bytes_queued;
+  if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) < 0 || ioctl(sock, SIOCOUTQ, &n_bytes_queued) < 0) {
+    return false;
+  }
+  *n_bytes = info.tcpi_bytes_acked + n_bytes_queued;
+  return true;
+}
+
+int update_bpf_map(int map_fd, const void* key, const void* value) {
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = map_fd;
+  attr.key = (uintptr_t)key;
+  attr.value = (uintptr_t)value;
+  attr.flags = BPF_ANY;
+  return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+void delete_from_bpf_map(int map_fd, const void* key) {
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = map_fd;
+  attr.key = (uintptr_t)key;
+  // the entry of a socket is gone already once it's closed
+  sys_bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+/**
+ * Has the kernel relay between the two sockets from now on, each redirecting to the other.
+ * @param socks the one that waits for the other to speak first, e.g., the target's, goes first
+ * @param cookies of the sockets, in the same order
+ * @return false if the sockets stay with user space
+ */
+bool sockmap_insert_pair(struct sockmap* sockmap, int socks[2], unsigned long long cookies[2]) {
+  // the peers go first, so that the program knows where to redirect to as soon as a socket is in the sockhash
+  for (int i = 0; i < 2; i++) {
+    struct sockmap_peer peer = {.peer_cookie = cookies[1 - i], .n_bytes = 0};
+    if (update_bpf_map(sockmap->peers_fd, &cookies[i], &peer) < 0) {
+      sockmap_remove_pair(sockmap, cookies);
+      return false;
+    }
+  }
+  // Bytes arriving at the first socket before the second one is in find no peer and are passed to user space, whereas
+  // the second socket's bytes are read by user space as usual until it's in. So the socket that speaks last goes first.
+  for (int i = 0; i < 2; i++) {
+    unsigned int sock = socks[i];
+    if (update_bpf_map(sockmap->sockets_fd, &cookies[i], &sock) < 0) {
+      sockmap_remove_pair(sockmap, cookies);
+      return false;
+    }
+  }
+  return true;
+}
+
+void sockmap_remove_pair(struct sockmap* sockmap, unsigned long long cookies[2]) {
+  // stop redirecting before the sockets leave, so that no bytes are redirected to a socket that's gone
+  for (int i = 0; i < 2; i++) {
+    delete_from_bpf_map(sockmap->peers_fd, &cookies[i]);
+  }
+  for (int i = 0; i < 2; i++) {
+    delete_from_bpf_map(sockmap->sockets_fd, &cookies[i]);
+  }
+}
+
+// Reads how many bytes the kernel redirected from the socket to its peer so far
+bool sockmap_read_n_bytes(struct sockmap* sockmap, unsigned long long cookie, unsigned long long* n_bytes) {
+  struct sockmap_peer peer;
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = sockmap->peers_fd;
+  attr.key = (uintptr_t)&cookie;
+  attr.value = (uintptr_t)&peer;
+  if (sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr) < 0) {
+    return false;
+  }
+  *n_bytes = peer.n_bytes;
+  return true;
+}
+
+// Adds the bytes the kernel relayed for the thread's tunnels to their stats, and to the thread's load
+void sync_offloaded_tunnels(struct poll* p, struct connection_thread* thread) {
+  for (struct tunnel_conn* conn = thread->relaying_tunnels; conn != NULL; conn = conn->next_relaying) {
+    if (conn->offloaded) {
+      sync_offloaded_bytes(conn);
+    }
+  }
+
+  if (poll_add_timer(p, SOCKMAP_SYNC_INTERVAL_US, thread, (poll_callback)sync_offloaded_tunnels) == NULL) {
+    LOG("failed to schedule the next sync of offloaded tunnels");
+  }
+}
+
+void start_syncing_offloaded_tunnels(struct poll* p, struct connection_thread* thread) {
+  if (poll_add_timer(p, SOCKMAP_SYNC_INTERVAL_US, thread, (poll_callback)sync_offloaded_tunnels) == NULL) {
+    LOG("failed to schedule the first sync of offloaded tunnels");
+  }
+}
@@ -0,0 +1,52 @@
+#ifndef HTTPS_PROXY_SOCKMAP_H
+#define HTTPS_PROXY_SOCKMAP_H
+
+#include <stdbool.h>
+
+struct poll;
+struct connection_thread;
+
+/**
+ * Relays the bytes of established tunnels in the kernel: both sockets of a tunnel go into a BPF sockhash, whose
+ * sk_skb verdict program redirects whatever either socket receives to the other one's send queue.
+ * The program also counts the bytes it redirects per socket, which the threads read back into their tunnels' stats.
+ * All threads share the maps; the kernel synchronises access to them.
+ */
+struct sockmap {
+  // socket cookie -> socket, for the program to redirect to
+  int sockets_fd;
+  // socket cookie -> `struct sockmap_peer` of the socket
+  int peers_fd;
+  int prog_fd;
+};
+
+// The value in the peers map, shared with the verdict program
+struct sockmap_peer {
+  // the cookie of the socket that the bytes received by this socket go to
+  unsigned long long peer_cookie;
+  // bytes redirected to the peer so far, added to by the program atomically
+  unsigned long long n_bytes;
+};
+
+// how many sockets the kernel relays at most without a limit on the tunnels, beyond which they stay in user space
+#define SOCKMAP_DEFAULT_MAX_SOCKETS 131072
+
+struct sockmap* create_sockmap(unsigned int max_sockets);
+
+void destroy_sockmap(struct sockmap* sockmap);
+
+bool get_socket_cookie(int sock, unsigned long long* cookie);
+
+bool get_socket_n_bytes_written(int sock, unsigned long long* n_bytes);
+
+bool sockmap_insert_pair(struct sockmap* sockmap, int socks[2], unsigned long long cookies[2]);
+
+void sockmap_remove_pair(struct sockmap* sockmap, unsigned long long cookies[2]);
+
+bool sockmap_read_n_bytes(struct sockmap* sockmap, unsigned long long cookie, unsigned long long* n_bytes);
+
+void start_syncing_offloaded_tunnels(struct poll* p, struct connection_thread* thread);
+
+void sync_offloaded_tunnels(struct poll* p, struct connection_thread* thread);
+
+#endif  // HTTPS_PROXY_SOCKMAP_H
@@ -0,0 +1,317 @@
+#include "target_stats.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../log.h"
+#include "../poll.h"
+#include "../util.h"
+#include "proxy_server.h"
+
+// how often threads hand over their tables, and thread 0 rewrites the report
+#define TARGET_STATS_INTERVAL_US 10000000
+// the most hosts each thread tracks per interval, and the most the totals track
+#define TARGET_STATS_THREAD_HOSTS 1024
+#define TARGET_STATS_TOTAL_HOSTS 4096
+// how many hosts the report lists
+#define TARGET_STATS_TOP 100
+
+struct target_stats_report* create_target_stats_report(const char* path) {
+  if (path == NULL) {
+    return NULL;
+  }
+
+  struct target_stats_report* report = malloc(sizeof(struct target_stats_report));
+  report->path = path;
+  atomic_init(&report->handed_over, NULL);
+  report->totals = create_target_stats_table(TARGET_STATS_TOTAL_HOSTS);
+  report->since_us = monotonic_time_us();
+  return report;
+}
+
+struct target_stats_table* create_target_stats_table(size_t max_len) {
+  struct target_stats_table* table = malloc(sizeof(struct target_stats_table));
+  // keep the load factor at or below a half, so that probe sequences stay short
+  table->capacity = 1;
+  while (table->capacity < max_len * 2) {
+    table->capacity *= 2;
+  }
+  table->slots = calloc(table->capacity, sizeof(struct target_stats));
+  table->len = 0;
+  table->max_len = max_len;
+  table->n_bytes_evicted = 0;
+  table->next = NULL;
+  return table;
+}
+
+void destroy_target_stats_table(struct target_stats_table* table) {
+  if (table == NULL) {
+    return;
+  }
+
+  for (size_t i = 0; i < table->capacity; i++) {
+    free(table->slots[i].host);
+  }
+  free(table->slots);
+  free(table);
+}
+
+// The bytes the host is ranked by, an upper bound of what it relayed
+unsigned long long target_stats_weight(const struct target_stats* stats) {
+  return stats->n_bytes_to_target + stats->n_bytes_to_client + stats->n_bytes_inherited;
+}
+
+// The slot holding the host, or the empty slot where it belongs
+struct target_stats* find_target_slot(struct target_stats_table* table, const char* host) {
+  size_t mask = table->capacity - 1;
+  for (size_t i = hash_key(host) & mask;; i = (i + 1) & mask) {
+    struct target_stats* slot = &table->slots[i];
+    if (slot->host == NULL || strcmp(slot->host, host) == 0) {
+      return slot;
+    }
+  }
+}
+
+int compare_ull_asc(const void* a, const void* b) {
+  unsigned long long x = *(const unsigned long long*)a;
+  unsigned long long y = *(const unsigned long long*)b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/**
+ * Evicts a quarter of the hosts, the ones with the fewest bytes, and moves the rest to where they belong without them.
+ * Evicting in bulk costs a sort for every `max_len / 4` new hosts, rather than a scan for each.
+ */
+void evict_light_targets(struct target_stats_table* table) {
+  unsigned long long* weights = malloc(table->len * sizeof(unsigned long long));
+  size_t weights_len = 0;
+  for (size_t i = 0; i < table->capacity; i++) {
+    if (table->slots[i].host != NULL) {
+      weights[weights_len++] = target_stats_weight(&table->slots[i]);
+    }
+  }
+  qsort(weights, weights_len, sizeof(unsigned long long), compare_ull_asc);
+  size_t n_evicted = (weights_len + 3) / 4;
+  unsigned long long threshold = weights[n_evicted - 1];
+  // of the hosts just as heavy as the threshold, only as many go as needed to make up the quarter
+  size_t n_evicted_at_threshold = 0;
+  for (size_t i = 0; i < n_evicted; i++) {
+    n_evicted_at_threshold += weights[i] == threshold;
+  }
+  free(weights);
+  if (threshold > table->n_bytes_evicted) {
+    table->n_bytes_evicted = threshold;
+  }
+
+  struct target_stats* old_slots = table->slots;
+  table->slots = calloc(table->capacity, sizeof(struct target_stats));
+  table->len = 0;
+  for (size_t i = 0; i < table->capacity; i++) {
+    struct target_stats* stats = &old_slots[i];
+    if (stats->host == NULL) {
+      continue;
+    }
+    unsigned long long weight = target_stats_weight(stats);
+    if (weight < threshold || (weight == threshold && n_evicted_at_threshold > 0)) {
+      n_evicted_at_threshold -= weight == threshold;
+      free(stats->host);
+      continue;
+    }
+    *find_target_slot(table, stats->host) = *stats;
+    table->len++;
+  }
+  free(old_slots);
+}
+
+// Returns the stats of the host, adding them if the host isn't in the table yet
+struct target_stats* count_target(struct target_stats_table* table, const char* host) {
+  struct target_stats* stats = find_target_slot(table, host);
+  if (stats->host != NULL) {
+    return stats;
+  }
+
+  if (table->len >= table->max_len) {
+    evict_light_targets(table);
+    stats = find_target_slot(table, host);
+  }
+  memset(stats, 0, sizeof(struct target_stats));
+  stats->host = strdup(host);
+  stats->n_bytes_inherited = table->n_bytes_evicted;
+  table->len++;
+  return stats;
+}
+
+// Adds the bytes the tunnel relayed since it was last counted
+void count_tunnel_bytes(struct target_stats* stats, struct tunnel_conn* conn) {
+  stats->n_bytes_to_target += conn->n_bytes_to_target - conn->n_bytes_counted_to_target;
+  stats->n_bytes_to_client += conn->n_bytes_to_client - conn->n_bytes_counted_to_client;
+  conn->n_bytes_counted_to_target = conn->n_bytes_to_target;
+  conn->n_bytes_counted_to_client = conn->n_bytes_to_client;
+}
+
+// Called as the tunnel is destroyed
+void count_finished_tunnel(struct tunnel_conn* conn) {
+  struct target_stats_table* table = conn->thread->target_stats;
+  if (table == NULL || conn->target_host == NULL) {
+    return;
+  }
+
+  struct target_stats* stats = count_target(table, conn->target_host);
+  stats->n_connections++;
+  if (conn->is_blocked) {
+    stats->n_blocked++;
+  } else if (conn->outcome == ACCESS_LOG_REJECTED) {
+    stats->n_connect_failures++;
+  }
+  count_tunnel_bytes(stats, conn);
+  stats->total_duration_us += monotonic_time_us() - conn->accepted_at_us;
+}
+
+// Counts the bytes that tunnels still relaying have relayed so far, so that long-lived tunnels show up before they end
+void count_live_tunnels(struct connection_thread* thread) {
+  for (struct tunnel_conn* conn = thread->relaying_tunnels; conn != NULL; conn = conn->next_relaying) {
+    count_tunnel_bytes(count_target(thread->target_stats, conn->target_host), conn);
+  }
+}
+
+// Adds the stats of a thread's table to the totals
+void merge_target_stats(struct target_stats_table* totals, struct target_stats_table* table) {
+  for (size_t i = 0; i < table->capacity; i++) {
+    struct target_stats* stats = &table->slots[i];
+    if (stats->host == NULL) {
+      continue;
+    }
+    struct target_stats* total = count_target(totals, stats->host);
+    total->n_connections += stats->n_connections;
+    total->n_blocked += stats->n_blocked;
+    total->n_connect_failures += stats->n_connect_failures;
+    total->n_bytes_to_target += stats->n_bytes_to_target;
+    total->n_bytes_to_client += stats->n_bytes_to_client;
+    total->total_duration_us += stats->total_duration_us;
+    total->n_bytes_inherited += stats->n_bytes_inherited;
+  }
+}
+
+/**
+ * Counts the thread's live tunnels, and hands its table over to be merged by thread 0.
+ * The thread stops counting until it's given a new table.
+ */
+void hand_over_target_stats(struct connection_thread* thread) {
+  if (thread->target_stats == NULL) {
+    return;
+  }
+
+  count_live_tunnels(thread);
+  struct target_stats_report* report = thread->server->target_stats;
+  struct target_stats_table* table = thread->target_stats;
+  // the release publishes the table's contents to thread 0
+  struct target_stats_table* head = atomic_load_explicit(&report->handed_over, memory_order_relaxed);
+  do {
+    table->next = head;
+  } while (!atomic_compare_exchange_weak_explicit(
+      &report->handed_over, &head, table, memory_order_release, memory_order_relaxed));
+  thread->target_stats = NULL;
+}
+
+// By bytes, then by connections for hosts that relayed as many bytes (e.g., none)
+int compare_weight_desc(const void* a, const void* b) {
+  const struct target_stats* x = *(const struct target_stats* const*)a;
+  const struct target_stats* y = *(const struct target_stats* const*)b;
+  unsigned long long x_weight = target_stats_weight(x);
+  unsigned long long y_weight = target_stats_weight(y);
+  if (x_weight != y_weight) {
+    return x_weight < y_weight ? 1 : -1;
+  }
+  return x->n_connections < y->n_connections ? 1 : x->n_connections > y->n_connections ? -1 : 0;
+}
+
+/**
+ * Writes the hosts with the most bytes, one per line with tab-separated columns, to a temporary file that then
+ * replaces the report. Readers never see a partially written report.
+ */
+void write_target_stats_report(struct target_stats_report* report) {
+  struct target_stats_table* totals = report->totals;
+  struct target_stats** ranked = malloc(totals->len * sizeof(struct target_stats*));
+  size_t ranked_len = 0;
+  for (size_t i = 0; i < totals->capacity; i++) {
+    if (totals->slots[i].host != NULL) {
+      ranked[ranked_len++] = &totals->slots[i];
+    }
+  }
+  qsort(ranked, ranked_len, sizeof(struct target_stats*), compare_weight_desc);
+
+  char* tmp_path = hsprintf("%s.tmp", report->path);
+  FILE* fp = fopen(tmp_path, "w");
+  if (fp == NULL) {
+    char* error_desc = errno2s(errno);
+    LOG("failed to open '%s' for the target stats report: %s", tmp_path, error_desc);
+    free(error_desc);
+    free(tmp_path);
+    free(ranked);
+    return;
+  }
+
+  fprintf(fp,
+          "# top %zu of %zu targets over %.1f s, by bytes relayed\n",
+          ranked_len < TARGET_STATS_TOP ? ranked_len : TARGET_STATS_TOP,
+          ranked_len,
+          (monotonic_time_us() - report->since_us) / 1000000.0);
+  fputs("# host\tconnections\tblocked\tconnect_failures\tbytes_to_target\tbytes_to_client\t"
+        "avg_duration_s\tbytes_overcount\n",
+        fp);
+  for (size_t i = 0; i < ranked_len && i < TARGET_STATS_TOP; i++) {
+    struct target_stats* stats = ranked[i];
+    fprintf(fp,
+            "%s\t%llu\t%llu\t%llu\t%llu\t%llu\t%.3f\t%llu\n",
+            stats->host,
+            stats->n_connections,
+            stats->n_blocked,
+            stats->n_connect_failures,
+            stats->n_bytes_to_target,
+            stats->n_bytes_to_client,
+            stats->n_connections > 0 ? stats->total_duration_us / 1000000.0 / stats->n_connections : 0,
+            stats->n_bytes_inherited);
+  }
+
+  if (fclose(fp) != 0 || rename(tmp_path, report->path) < 0) {
+    char* error_desc = errno2s(errno);
+    LOG("failed to write the target stats report to '%s': %s", report->path, error_desc);
+    free(error_desc);
+  }
+  free(tmp_path);
+  free(ranked);
+}
+
+/**
+ * Runs periodically on every thread while target stats are enabled.
+ * Each thread hands over its table and starts a new one. Thread 0 then merges the tables handed over by all threads
+ * since the last time into the totals, and rewrites the report.
+ */
+void report_target_stats(struct poll* p, struct connection_thread* thread) {
+  struct target_stats_report* report = thread->server->target_stats;
+  hand_over_target_stats(thread);
+  thread->target_stats = create_target_stats_table(TARGET_STATS_THREAD_HOSTS);
+
+  if (thread->id == 0) {
+    struct target_stats_table* table = atomic_exchange_explicit(&report->handed_over, NULL, memory_order_acquire);
+    while (table != NULL) {
+      struct target_stats_table* next = table->next;
+      merge_target_stats(report->totals, table);
+      destroy_target_stats_table(table);
+      table = next;
+    }
+    write_target_stats_report(report);
+  }
+
+  if (poll_add_timer(p, TARGET_STATS_INTERVAL_US, thread, (poll_callback)report_target_stats) == NULL) {
+    LOG("failed to schedule the next hand-over of target stats");
+  }
+}
+
+// Starts counting the traffic of the thread's tunnels per target host
+void start_reporting_target_stats(struct poll* p, struct connection_thread* thread) {
+  thread->target_stats = create_target_stats_table(TARGET_STATS_THREAD_HOSTS);
+  if (poll_add_timer(p, TARGET_STATS_INTERVAL_US, thread, (poll_callback)report_target_stats) == NULL) {
+    LOG("failed to schedule the first hand-over of target stats");
+  }
+}
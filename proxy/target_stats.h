@@ -0,0 +1,69 @@
+#ifndef HTTPS_PROXY_TARGET_STATS_H
+#define HTTPS_PROXY_TARGET_STATS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+struct poll;
+struct proxy_server;
+struct connection_thread;
+struct tunnel_conn;
+
+// Traffic to one target host, summed over its tunnels
+struct target_stats {
+  char* host;  // NULL if the slot is empty
+  unsigned long long n_connections;
+  unsigned long long n_blocked;
+  unsigned long long n_connect_failures;
+  unsigned long long n_bytes_to_target;
+  unsigned long long n_bytes_to_client;
+  // summed over the finished connections
+  unsigned long long total_duration_us;
+  // Bytes the host may have relayed before it was last evicted, see `target_stats_table`.
+  // The host relayed at least its bytes above, and at most that plus these.
+  unsigned long long n_bytes_inherited;
+};
+
+/**
+ * An open-addressing hash table of target stats, which holds at most `max_len` hosts.
+ * Once full, the quarter of the hosts with the fewest bytes is evicted, much like in the space-saving algorithm: the
+ * hosts relaying the most bytes stay in the table however many hosts pass through it. Since any new host may have been
+ * evicted before, it inherits the bytes of the heaviest host evicted so far as its possible overcount.
+ * Each thread has its own table, which it hands over to thread 0 periodically, so no synchronisation is needed.
+ */
+struct target_stats_table {
+  struct target_stats* slots;
+  size_t capacity;
+  size_t len;
+  size_t max_len;
+  // the most bytes (including inherited ones) of any evicted host
+  unsigned long long n_bytes_evicted;
+  // links the table into the server's list of tables waiting to be merged
+  struct target_stats_table* next;
+};
+
+// Collects the tables of all threads, and the totals they are merged into by thread 0
+struct target_stats_report {
+  // where the top targets are written, rewritten as a whole every time
+  const char* path;
+  // tables handed over by the threads since the last report, in a lock-free stack linked through `next`
+  _Atomic(struct target_stats_table*) handed_over;
+  // only touched by thread 0
+  struct target_stats_table* totals;
+  unsigned long long since_us;
+};
+
+struct target_stats_report* create_target_stats_report(const char* path);
+
+struct target_stats_table* create_target_stats_table(size_t max_len);
+void destroy_target_stats_table(struct target_stats_table* table);
+
+void count_finished_tunnel(struct tunnel_conn* conn);
+
+void start_reporting_target_stats(struct poll* p, struct connection_thread* thread);
+
+void report_target_stats(struct poll* p, struct connection_thread* thread);
+
+void hand_over_target_stats(struct connection_thread* thread);
+
+#endif  // HTTPS_PROXY_TARGET_STATS_H
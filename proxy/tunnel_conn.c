@@ -2,50 +2,79 @@
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <string.h>
+#include <threads.h>
 #include <time.h>
 #include <unistd.h>
+#include "../http2/session.h"
+#include "../io.h"
+#include "../poll.h"
+#include "../trace.h"
+#include "../util.h"
+#include "h2_tunnel.h"
+#include "proxy_server.h"
+#include "udp_tunnel.h"
 
-struct tunnel_conn* create_tunnel_conn(bool stats_enabled, char** blocklist, int blocklist_len) {
+struct tunnel_conn* create_tunnel_conn(struct connection_thread* thread) {
+  struct proxy_server* server = thread->server;
   struct tunnel_conn* conn = calloc(1, sizeof(struct tunnel_conn));
 
+  conn->thread = thread;
+  conn->id = ((unsigned long long)thread->id << 48) | ++thread->n_conns_created;
+  atomic_fetch_add_explicit(&thread->load.active_tunnels, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&server->active_tunnels, 1, memory_order_relaxed);
+
   conn->client_socket = -1;
   conn->client_socket_dup = -1;
   conn->target_socket = -1;
   conn->target_socket_dup = -1;
+  conn->transparent = false;
+  conn->http_version = HTTP_VERSION_1_1;
+  conn->target_host = NULL;
+  conn->target_port = 0;
+  conn->egress_count = NULL;
 
-  conn->target_host = calloc(MAX_HOST_LEN, sizeof(char));
-  conn->target_port = calloc(MAX_PORT_LEN, sizeof(char));
-  conn->http_version = calloc(HTTP_VERSION_LEN, sizeof(char));
-  conn->client_hostport = calloc(HOST_PORT_BUF_SIZE, sizeof(char));
-  conn->target_hostport = calloc(HOST_PORT_BUF_SIZE, sizeof(char));
-
-  char* buffer = malloc(BUFFER_SIZE * sizeof(char));
-  conn->to_target_buffer.start = buffer;
-  conn->to_target_buffer.read_ptr = buffer;
-  conn->to_target_buffer.write_ptr = buffer;
+  // buffers are only allocated when they are needed, see `acquire_buffer`
+  conn->to_target_buffer.start = NULL;
+  conn->to_target_buffer.read_ptr = NULL;
+  conn->to_target_buffer.write_ptr = NULL;
 
-  buffer = malloc(BUFFER_SIZE * sizeof(char));
-  conn->to_client_buffer.start = buffer;
-  conn->to_client_buffer.read_ptr = buffer;
-  conn->to_client_buffer.write_ptr = buffer;
+  conn->to_client_buffer.start = NULL;
+  conn->to_client_buffer.read_ptr = NULL;
+  conn->to_client_buffer.write_ptr = NULL;
 
   conn->halves_closed = 0;
-  conn->n_bytes_transferred = 0;
+  conn->n_bytes_to_target = 0;
+  conn->n_bytes_to_client = 0;
+  conn->n_bytes_counted_to_target = 0;
+  conn->n_bytes_counted_to_client = 0;
 
-  conn->stats_enabled = stats_enabled;
-  if (stats_enabled) {
+  conn->client_bucket = NULL;
+  conn->target_bucket = NULL;
+  conn->throttled_link_timers[0] = NULL;
+  conn->throttled_link_timers[1] = NULL;
+  conn->h2_tunnel = NULL;
+  conn->udp_tunnel = NULL;
+  conn->links[0] = NULL;
+  conn->links[1] = NULL;
+  conn->prev_relaying = NULL;
+  conn->next_relaying = NULL;
+
+  if (server->stats_enabled || thread->access_log != NULL) {
     timespec_get(&conn->started_at, TIME_UTC);
   }
+  conn->accepted_at_us = monotonic_time_us();
+  conn->requested_at_us = 0;
+  conn->answered_at_us = 0;
+  conn->outcome = ACCESS_LOG_NO_REQUEST;
 
-  conn->blocklist = blocklist;
-  conn->blocklist_len = blocklist_len;
   conn->is_blocked = false;
+  conn->offloaded = false;
 
   return conn;
 }
 
 void print_stats(struct tunnel_conn* conn) {
-  if (!conn->stats_enabled || conn->target_hostport[0] == '\0') {
+  if (!conn->thread->server->stats_enabled || conn->target_host == NULL) {
     return;
   }
 
@@ -56,53 +85,238 @@ void print_stats(struct tunnel_conn* conn) {
   printf(
       "Hostname: %s, Size: %llu bytes, Time: %.3f sec%s\n",
       conn->target_host,
-      conn->n_bytes_transferred,
+      conn->n_bytes_to_target + conn->n_bytes_to_client,
       milliseconds_elapsed / 1000.0,
       conn->is_blocked ? " [Blocked]" : "");
 }
 
+unsigned int elapsed_us(unsigned long long from_us, unsigned long long to_us) {
+  return from_us != 0 && to_us != 0 ? to_us - from_us : 0;
+}
+
+void log_access(struct tunnel_conn* conn) {
+  struct access_log_record record;
+  memset(&record, 0, sizeof(record));
+
+  unsigned long long now_us = monotonic_time_us();
+  record.started_at_us = conn->started_at.tv_sec * 1000000ULL + conn->started_at.tv_nsec / 1000;
+  record.duration_us = now_us - conn->accepted_at_us;
+  record.n_bytes_to_target = conn->n_bytes_to_target;
+  record.n_bytes_to_client = conn->n_bytes_to_client;
+  record.request_us = elapsed_us(conn->accepted_at_us, conn->requested_at_us);
+  record.connect_us = elapsed_us(conn->requested_at_us, conn->answered_at_us);
+  record.client_addr = conn->client_addr.sin_addr.s_addr;
+  record.client_port = ntohs(conn->client_addr.sin_port);
+  record.target_port = conn->target_port;
+  record.outcome = conn->outcome;
+
+  size_t host_len = conn->target_host != NULL ? strlen(conn->target_host) : 0;
+  if (host_len > ACCESS_LOG_HOST_LEN) {
+    host_len = ACCESS_LOG_HOST_LEN;
+    record.flags |= ACCESS_LOG_HOST_TRUNCATED;
+  }
+  memcpy(record.target_host, conn->target_host, host_len);
+  record.target_host_len = host_len;
+
+  if (conn->is_blocked) {
+    record.flags |= ACCESS_LOG_BLOCKED;
+  }
+  if (conn->transparent) {
+    record.flags |= ACCESS_LOG_TRANSPARENT;
+  }
+  if (conn->h2_tunnel != NULL) {
+    record.flags |= conn->h2_tunnel->client_on_stream ? ACCESS_LOG_CLIENT_HTTP2 : ACCESS_LOG_PARENT;
+  }
+  if (conn->udp_tunnel != NULL) {
+    record.flags |= ACCESS_LOG_UDP;
+  }
+
+  access_log_append(conn->thread->access_log, &record);
+}
+
 void destroy_tunnel_conn(struct tunnel_conn* conn) {
-  print_stats(conn);
+  // the stats below include what the kernel relayed
+  if (conn->offloaded) {
+    release_offloaded_tunnel(conn);
+  }
+  TRACE3(destroy, conn->id, conn->n_bytes_to_target, conn->n_bytes_to_client);
+  count_finished_tunnel(conn);
+  if (conn->thread->access_log != NULL) {
+    // replaces the printed stats, which would be too slow to keep on at peak load
+    log_access(conn);
+  } else {
+    print_stats(conn);
+  }
+
+  if (conn->h2_tunnel != NULL) {
+    destroy_h2_tunnel(conn);
+  }
+  if (conn->udp_tunnel != NULL) {
+    destroy_udp_tunnel(conn);
+  }
+  if (conn->links[0] != NULL) {
+    remove_relaying_tunnel(conn);
+  }
 
+  // the other link may have an event pending in the current round
   if (conn->client_socket_dup >= 0) {
-    close(conn->client_socket_dup);
+    poll_cancel(conn->thread->poll, conn->client_socket_dup);
+    io_close(conn->client_socket_dup);
   }
 
   if (conn->client_socket >= 0) {
-    shutdown(conn->client_socket, SHUT_RDWR);
-    close(conn->client_socket);
+    poll_cancel(conn->thread->poll, conn->client_socket);
+    io_shutdown(conn->client_socket, SHUT_RDWR);
+    io_close(conn->client_socket);
   }
 
   if (conn->target_socket_dup >= 0) {
-    close(conn->target_socket_dup);
+    poll_cancel(conn->thread->poll, conn->target_socket_dup);
+    io_close(conn->target_socket_dup);
   }
 
   if (conn->target_socket >= 0) {
-    shutdown(conn->target_socket, SHUT_RDWR);
-    close(conn->target_socket);
+    poll_cancel(conn->thread->poll, conn->target_socket);
+    io_shutdown(conn->target_socket, SHUT_RDWR);
+    io_close(conn->target_socket);
   }
+  release_egress_addr(conn->egress_count);
 
-  free(conn->client_hostport);
-  free(conn->target_hostport);
-  free(conn->target_host);
-  free(conn->target_port);
-  free(conn->http_version);
-  free(conn->to_target_buffer.start);
-  free(conn->to_client_buffer.start);
+  for (int i = 0; i < 2; i++) {
+    if (conn->throttled_link_timers[i] != NULL) {
+      free(poll_cancel_timer(conn->thread->poll, conn->throttled_link_timers[i]));
+    }
+  }
+  detach_rate_limits(conn);
+
+  if (conn->target_host != NULL) {
+    release_host(conn->thread->hostnames, conn->target_host);
+  }
+  release_buffer(conn, &conn->to_target_buffer);
+  release_buffer(conn, &conn->to_client_buffer);
 
+  atomic_fetch_sub_explicit(&conn->thread->load.active_tunnels, 1, memory_order_relaxed);
+  atomic_fetch_sub_explicit(&conn->thread->server->active_tunnels, 1, memory_order_relaxed);
   free(conn);
 }
 
-void set_client_hostport(struct tunnel_conn* conn, const struct sockaddr_in* client_addr) {
-  inet_ntop(AF_INET, &client_addr->sin_addr, conn->client_hostport, INET_ADDRSTRLEN);
-  strcat(conn->client_hostport, ":");
-  char client_port[MAX_PORT_LEN];
-  sprintf(client_port, "%hu", ntohs(client_addr->sin_port));
-  strcat(conn->client_hostport, client_port);
+/**
+ * Formats the client's address for logging, into a buffer of the calling thread that the next call overwrites.
+ * A client on a stream of its HTTP/2 connection is its address followed by the stream, e.g., "10.0.0.1:5000#3".
+ */
+const char* client_hostport(const struct tunnel_conn* conn) {
+  static thread_local char hostport[HOST_PORT_BUF_SIZE];
+  char ip[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &conn->client_addr.sin_addr, ip, sizeof(ip));
+  if (conn->h2_tunnel != NULL && conn->h2_tunnel->client_on_stream && conn->h2_tunnel->stream != NULL) {
+    snprintf(hostport,
+             sizeof(hostport),
+             "%s:%hu#%u",
+             ip,
+             ntohs(conn->client_addr.sin_port),
+             conn->h2_tunnel->stream->id);
+  } else {
+    snprintf(hostport, sizeof(hostport), "%s:%hu", ip, ntohs(conn->client_addr.sin_port));
+  }
+  return hostport;
+}
+
+// Like `client_hostport`, for the target, which is empty until it's known
+const char* target_hostport(const struct tunnel_conn* conn) {
+  static thread_local char hostport[HOST_PORT_BUF_SIZE];
+  if (conn->target_host == NULL) {
+    hostport[0] = '\0';
+  } else {
+    snprintf(hostport, sizeof(hostport), "%s:%hu", conn->target_host, conn->target_port);
+  }
+  return hostport;
+}
+
+const char* http_version_name(enum http_version version) {
+  switch (version) {
+    case HTTP_VERSION_1_0:
+      return "HTTP/1.0";
+    case HTTP_VERSION_2:
+      return "HTTP/2";
+    default:
+      return "HTTP/1.1";
+  }
 }
 
-void set_target_hostport(struct tunnel_conn* conn) {
-  strcpy(conn->target_hostport, conn->target_host);
-  strcat(conn->target_hostport, ":");
-  strcat(conn->target_hostport, conn->target_port);
+/**
+ * @param port the decimal port, not necessarily null-terminated
+ * @return 0 on success; -1 if it's not a port from 1 to 65535
+ */
+int parse_target_port(const char* port, size_t port_len, unsigned short* target_port) {
+  if (port_len == 0 || port_len >= MAX_PORT_LEN) {
+    return -1;
+  }
+  unsigned long value = 0;
+  for (size_t i = 0; i < port_len; i++) {
+    if (port[i] < '0' || port[i] > '9') {
+      return -1;
+    }
+    value = value * 10 + (port[i] - '0');
+  }
+  if (value == 0 || value > 65535) {
+    return -1;
+  }
+  *target_port = value;
+  return 0;
+}
+
+// Called once the target is known, which is when the client's request is complete
+void set_target(struct tunnel_conn* conn, const char* host, size_t host_len, unsigned short port) {
+  conn->target_host = intern_host(conn->thread->hostnames, host, host_len);
+  conn->target_port = port;
+  conn->requested_at_us = monotonic_time_us();
+  TRACE3(request, conn->id, conn->target_host, conn->target_port);
+}
+
+/**
+ * Hands the target host back to the thread's host table as the tunnel leaves the thread, keeping a copy of its own.
+ * `attach_target_host` interns the copy on the thread the tunnel moves to.
+ */
+void detach_target_host(struct tunnel_conn* conn) {
+  const char* host = conn->target_host;
+  conn->target_host = strdup(host);
+  release_host(conn->thread->hostnames, host);
+}
+
+void attach_target_host(struct tunnel_conn* conn) {
+  char* host = (char*)conn->target_host;
+  conn->target_host = intern_host(conn->thread->hostnames, host, strlen(host));
+  free(host);
+}
+
+// Records how we answered the client's request, i.e., whether the tunnel was set up
+void answer_client(struct tunnel_conn* conn, enum access_log_outcome outcome) {
+  conn->answered_at_us = monotonic_time_us();
+  conn->outcome = outcome;
+}
+
+// Adds a tunnel that just started relaying between its sockets to its thread's list, see `rebalance_tunnels`
+void add_relaying_tunnel(struct tunnel_conn* conn) {
+  struct connection_thread* thread = conn->thread;
+  conn->relaying_since_us = monotonic_time_us();
+  conn->n_bytes_sampled = conn->n_bytes_to_target + conn->n_bytes_to_client;
+  conn->prev_relaying = NULL;
+  conn->next_relaying = thread->relaying_tunnels;
+  if (conn->next_relaying != NULL) {
+    conn->next_relaying->prev_relaying = conn;
+  }
+  thread->relaying_tunnels = conn;
+}
+
+void remove_relaying_tunnel(struct tunnel_conn* conn) {
+  if (conn->prev_relaying != NULL) {
+    conn->prev_relaying->next_relaying = conn->next_relaying;
+  } else {
+    conn->thread->relaying_tunnels = conn->next_relaying;
+  }
+  if (conn->next_relaying != NULL) {
+    conn->next_relaying->prev_relaying = conn->prev_relaying;
+  }
+  conn->prev_relaying = NULL;
+  conn->next_relaying = NULL;
 }
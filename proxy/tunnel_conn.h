@@ -2,16 +2,27 @@
 #define HTTPS_PROXY_TUNNEL_CONN_H
 
 #include <netinet/in.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
+#include <time.h>
+#include "access_log.h"
 
 #define BUFFER_SIZE (1024 * 8)
 
 #define MAX_HOST_LEN 512
 #define MAX_PORT_LEN 6
-#define HTTP_VERSION_LEN 9  // HTTP/1.1
+#define DEFAULT_TARGET_PORT 443
 #define HOST_PORT_BUF_SIZE 1024
 
+struct connection_thread;
+struct h2_tunnel;
+struct poll_timer;
+struct token_bucket;
+struct tunneling_link;
+struct udp_tunnel;
+
 /**
  * Producers will write bytes into the buffer,
  * and consumers will read data from the buffer.
@@ -43,17 +54,29 @@
  * The boundaries should be adjusted accordingly after reading / writing.
  */
 struct tunnel_buffer {
-  char* start;
+  char* start;  // NULL while the buffer is not allocated
   char* read_ptr;
   char* write_ptr;
 };
 
+enum http_version {
+  HTTP_VERSION_1_0,
+  HTTP_VERSION_1_1,
+  HTTP_VERSION_2,
+};
+
 /**
  * Represents a tunneling connection.
  * There are two directions to this connection: client to target and target to client.
  * Each direction has its own buffer and sets of socket file descriptors.
+ *
+ * The fields used while relaying data come first, so that they share as few cache lines as possible.
+ * Addresses and ports are kept in binary, and formatted for logging only, see `client_hostport`.
  */
 struct tunnel_conn {
+  // the thread serving this connection
+  struct connection_thread* thread;
+
   // file descriptors
   // Before we start tunneling, only client_socket and target_socket are used
   // After we start tunneling, client_socket_dup is dup(client_socket) and target_socket_dup is dup(target_socket)
@@ -62,15 +85,6 @@ struct tunnel_conn {
   int target_socket;
   int target_socket_dup;
 
-  // textual representations of ip/hostname:port for printing
-  char* client_hostport;
-  char* target_hostport;
-
-  // obtained from the CONNECT HTTP message
-  char* target_host;
-  char* target_port;
-  char* http_version;
-
   /**
    * Buffer for data to be sent to the target.
    */
@@ -80,23 +94,81 @@ struct tunnel_conn {
    */
   struct tunnel_buffer to_client_buffer;
 
+  unsigned long long n_bytes_to_target;
+  unsigned long long n_bytes_to_client;
+
+  // rate limiting, NULL if not limited
+  struct token_bucket* client_bucket;
+  struct token_bucket* target_bucket;
+  // Timers resuming links that were paused by rate limiting, one per direction.
+  // A timer owns its paused link, which is freed along with it if the connection is destroyed first.
+  struct poll_timer* throttled_link_timers[2];
+
   // how many directions of this connection have been closed (0, 1, or 2)
   int halves_closed;
+  // Accepted on the transparent listener: the target comes from the TLS ClientHello instead of a CONNECT request,
+  // and the client gets no HTTP responses from us
+  bool transparent;
+  bool is_blocked;
+  // relayed by the kernel rather than by the links, see `offload_tunnel`
+  bool offloaded;
 
-  // stats
-  bool stats_enabled;
-  struct timespec started_at;
-  unsigned long long n_bytes_transferred;
+  // set if either side of the tunnel is a stream of an HTTP/2 connection: the client's, or ours to the parent proxy
+  struct h2_tunnel* h2_tunnel;
+  // set if the client asked for a UDP tunnel with a CONNECT-UDP request
+  struct udp_tunnel* udp_tunnel;
 
-  // blocklist
-  char** blocklist;
-  int blocklist_len;
-  bool is_blocked;
+  // Once tunneling between two sockets, the links of both directions (indexed like `throttled_link_timers`), and the
+  // neighbours in the thread's list of such tunnels, which may be moved to another thread while both links are open
+  struct tunneling_link* links[2];
+  struct tunnel_conn* prev_relaying;
+  struct tunnel_conn* next_relaying;
+  // when the tunnel started relaying on its current thread, and how many bytes it had relayed when last sampled
+  unsigned long long relaying_since_us;
+  unsigned long long n_bytes_sampled;
+  // links the tunnel into the migration inbox of the thread it's moving to
+  struct tunnel_conn* next_migrating;
+
+  // identifies the connection in tracepoints: the thread's id in the top 16 bits, and a per-thread sequence number
+  unsigned long long id;
+
+  struct sockaddr_in client_addr;
+  // From the CONNECT request, or the ClientHello. The host is interned in the thread's host table, or NULL until the
+  // target is known.
+  const char* target_host;
+  unsigned short target_port;
+  // of the client's CONNECT request, which our response uses too
+  enum http_version http_version;
+  // the count of connections from the target socket's egress address to the target, NULL without egress addresses
+  atomic_uint* egress_count;
+
+  // how many of the bytes relayed were already added to the thread's target stats, see `count_tunnel_bytes`
+  unsigned long long n_bytes_counted_to_target;
+  unsigned long long n_bytes_counted_to_client;
+
+  // for stats and the access log: when the client connected, only set if either is enabled
+  struct timespec started_at;
+  // for the access log: monotonic timestamps of when we accepted the connection, knew the target,
+  // and answered the client (0 if we didn't get that far), and what the answer was
+  unsigned long long accepted_at_us;
+  unsigned long long requested_at_us;
+  unsigned long long answered_at_us;
+  enum access_log_outcome outcome;
 };
 
-struct tunnel_conn* create_tunnel_conn(bool stats_enabled, char** blocklist, int blocklist_len);
+_Static_assert(offsetof(struct tunnel_conn, h2_tunnel) <= 128, "the fields used while relaying fit in 2 cache lines");
+
+struct tunnel_conn* create_tunnel_conn(struct connection_thread* thread);
 void destroy_tunnel_conn(struct tunnel_conn* conn);
-void set_client_hostport(struct tunnel_conn*, const struct sockaddr_in*);
-void set_target_hostport(struct tunnel_conn*);
+const char* client_hostport(const struct tunnel_conn* conn);
+const char* target_hostport(const struct tunnel_conn* conn);
+const char* http_version_name(enum http_version version);
+int parse_target_port(const char* port, size_t port_len, unsigned short* target_port);
+void set_target(struct tunnel_conn* conn, const char* host, size_t host_len, unsigned short port);
+void detach_target_host(struct tunnel_conn* conn);
+void attach_target_host(struct tunnel_conn* conn);
+void answer_client(struct tunnel_conn* conn, enum access_log_outcome outcome);
+void add_relaying_tunnel(struct tunnel_conn* conn);
+void remove_relaying_tunnel(struct tunnel_conn* conn);
 
 #endif  // HTTPS_PROXY_TUNNEL_CONN_H
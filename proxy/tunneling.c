@@ -5,10 +5,22 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#include "../io.h"
 #include "../log.h"
 #include "../poll.h"
+#include "../trace.h"
 #include "../util.h"
-#include "tunnel_conn.h"
+#include "h2_tunnel.h"
+#include "proxy_server.h"
+#include "udp_tunnel.h"
+
+// how long a link waits before trying again when there's no memory for its buffer
+#define MEMORY_RETRY_DELAY_US 10000
+// how long the closing link of an offloaded tunnel waits before checking again whether the kernel sent everything
+#define OFFLOADED_DRAIN_RETRY_DELAY_US 10000
+// how much a link may relay, and for how long, once woken up, before it yields to the other events of the round
+#define LINK_ROUND_MAX_BYTES (8 * BUFFER_SIZE)
+#define LINK_ROUND_MAX_US 100
 
 // Represents a (uni-directional) link between source and destination.
 // The link alternates between two states:
@@ -19,180 +31,558 @@ struct tunneling_link {
   int read_fd;
   int write_fd;
   struct tunnel_buffer* buf;
-  const char* source_hostport;
-  const char* dst_hostport;
+  // counts the bytes relayed in this direction
+  unsigned long long* n_bytes_relayed;
+  // where to keep the timer while this link is paused by rate limiting, or waits to pass on an EOF
+  struct poll_timer** throttled_timer;
+  // whether the link last waited to write rather than to read, to resume it the same way on another thread
+  bool writing;
+  // whether the last read filled the buffer, i.e. the source most likely has more
+  bool filled_buffer;
+  // the low-water mark for the unsent bytes in write_fd, see `link_wait_for_room`; 0 if there is none
+  unsigned int notsent_lowat;
+  // what the link relayed since it was last woken up, see `link_round_continues`
+  unsigned long long round_started_us;
+  size_t round_n_bytes;
+  // once the tunnel is offloaded, the cookie of the socket read from, and how many of the bytes the kernel relayed
+  // from it were counted so far
+  unsigned long long socket_cookie;
+  unsigned long long n_bytes_offloaded;
+  // what was written to the destination by then, see `offloaded_link_drained`
+  unsigned long long n_bytes_written_at_offload;
 };
 
-void link_wait_to_read(struct poll* p, struct tunneling_link* link);
-void link_wait_to_write(struct poll* p, struct tunneling_link* link);
+// Whether the link relays data from the client to the target, for tracepoints
+bool link_is_to_target(struct tunneling_link* link) {
+  return link->buf == &link->conn->to_target_buffer;
+}
+
+// Where the link reads from, for logging
+const char* link_source_hostport(struct tunneling_link* link) {
+  return link_is_to_target(link) ? client_hostport(link->conn) : target_hostport(link->conn);
+}
+
+// Where the link writes to, for logging
+const char* link_dst_hostport(struct tunneling_link* link) {
+  return link_is_to_target(link) ? target_hostport(link->conn) : client_hostport(link->conn);
+}
+
+bool link_wait_to_read(struct poll* p, struct tunneling_link* link);
+bool link_wait_to_write(struct poll* p, struct tunneling_link* link);
+bool link_send(struct poll* p, struct tunneling_link* link);
+bool link_read(struct poll* p, struct tunneling_link* link);
 void handle_link_readability(struct poll* p, struct tunneling_link* link);
 void handle_link_writability(struct poll* p, struct tunneling_link* link);
 
-void setup_tunneling_from_target_to_client(struct poll* p, struct tunnel_conn* conn) {
-  // First, send HTTP 200 to client
-  int n_bytes = sprintf(conn->to_client_buffer.start, "%s 200 Connection Established \r\n\r\n", conn->http_version);
-  conn->to_client_buffer.write_ptr += n_bytes;
-
+// Returns false if the tunnel was destroyed instead
+bool setup_tunneling_from_target_to_client(struct poll* p, struct tunnel_conn* conn) {
   struct tunneling_link* link = malloc(sizeof(struct tunneling_link));
   link->conn = conn;
   link->read_fd = conn->target_socket;
   link->write_fd = conn->client_socket_dup;
   link->buf = &conn->to_client_buffer;
-  link->source_hostport = conn->target_hostport;
-  link->dst_hostport = conn->client_hostport;
+  link->n_bytes_relayed = &conn->n_bytes_to_client;
+  link->throttled_timer = &conn->throttled_link_timers[0];
+  link->filled_buffer = false;
+  link->notsent_lowat = notsent_lowat_of(conn);
+  conn->links[0] = link;
+
+  if (conn->transparent) {
+    // the client doesn't know about us, just wait for the target's response to the ClientHello
+    return link_wait_to_read(p, link);
+  }
 
-  link_wait_to_write(p, link);
+  // First, send HTTP 200 to client
+  // The response is small and the buffer is released once it's sent, so it may exceed the memory budget
+  acquire_buffer(conn, &conn->to_client_buffer, true);
+  TRACE2(respond, conn->id, 200);
+  int n_bytes = sprintf(
+      conn->to_client_buffer.start, "%s 200 Connection Established \r\n\r\n", http_version_name(conn->http_version));
+  conn->to_client_buffer.write_ptr += n_bytes;
+
+  // the client's socket buffer is empty, so the response almost always goes out without waiting
+  return link_send(p, link);
 }
 
-void setup_tunneling_from_client_to_target(struct poll* p, struct tunnel_conn* conn) {
+// Returns false if the tunnel was destroyed instead
+bool setup_tunneling_from_client_to_target(struct poll* p, struct tunnel_conn* conn) {
   struct tunneling_link* link = malloc(sizeof(struct tunneling_link));
   link->conn = conn;
   link->read_fd = conn->client_socket;
   link->write_fd = conn->target_socket_dup;
   link->buf = &conn->to_target_buffer;
-  link->source_hostport = conn->client_hostport;
-  link->dst_hostport = conn->target_hostport;
+  link->n_bytes_relayed = &conn->n_bytes_to_target;
+  link->throttled_timer = &conn->throttled_link_timers[1];
+  link->filled_buffer = false;
+  link->notsent_lowat = notsent_lowat_of(conn);
+  conn->links[1] = link;
 
   size_t n_bytes_remaining = conn->to_target_buffer.write_ptr - conn->to_target_buffer.read_ptr;
   if (n_bytes_remaining > 0) {
     // if we received more than just the CONNECT message from the client, send the rest of the bytes to the target
     DEBUG_LOG("sending %d left over bytes after CONNECT", n_bytes_remaining);
+    conn->n_bytes_to_target += n_bytes_remaining;
 
-    link_wait_to_write(p, link);
+    return link_send(p, link);
   } else {
     // wait to read from client
 
     // reset the buffer
     conn->to_target_buffer.read_ptr = conn->to_target_buffer.start;
     conn->to_target_buffer.write_ptr = conn->to_target_buffer.start;
+    release_idle_buffer(conn, &conn->to_target_buffer);
 
-    link_wait_to_read(p, link);
+    return link_wait_to_read(p, link);
   }
 }
 
+/**
+ * Hands relaying over to the kernel, see `struct sockmap`, if the tunnel is set up: the response and any bytes the
+ * client sent along with its request are out, and both links wait to read. They keep waiting, but from now on, their
+ * sockets only become readable once a peer closes its end, or with bytes that arrived before the hand-over.
+ * Bytes that arrived before can't be overtaken by later ones as long as a peer waits for an answer before it sends
+ * more, like TLS does during its handshake, so tunnels are only offloaded when they start.
+ */
+void offload_tunnel(struct tunnel_conn* conn) {
+  struct proxy_server* server = conn->thread->server;
+  // the kernel would relay bytes past the rate limits
+  if (conn->client_bucket != NULL || conn->target_bucket != NULL || server->global_rate_limit != NULL) {
+    return;
+  }
+  if (conn->links[0]->writing || conn->links[1]->writing) {
+    return;
+  }
+
+  // the target's socket first, since links[0] reads from it
+  int socks[2];
+  unsigned long long cookies[2];
+  unsigned long long n_bytes_written[2];
+  for (int i = 0; i < 2; i++) {
+    socks[i] = conn->links[i]->read_fd;
+    if (!get_socket_cookie(socks[i], &cookies[i]) ||
+        !get_socket_n_bytes_written(conn->links[i]->write_fd, &n_bytes_written[i])) {
+      return;
+    }
+  }
+  if (!sockmap_insert_pair(server->sockmap, socks, cookies)) {
+    char* error_desc = errno2s(errno);
+    DEBUG_LOG("failed to offload tunnel (%s) -> (%s): %s", client_hostport(conn), target_hostport(conn), error_desc);
+    free(error_desc);
+    return;
+  }
+
+  for (int i = 0; i < 2; i++) {
+    conn->links[i]->socket_cookie = cookies[i];
+    conn->links[i]->n_bytes_offloaded = 0;
+    conn->links[i]->n_bytes_written_at_offload = n_bytes_written[i];
+  }
+  conn->offloaded = true;
+  DEBUG_LOG("tunnel (%s) -> (%s) is relayed by the kernel", client_hostport(conn), target_hostport(conn));
+}
+
+// Adds the bytes the kernel relayed for an offloaded tunnel since the last time to its stats
+void sync_offloaded_bytes(struct tunnel_conn* conn) {
+  for (int i = 0; i < 2; i++) {
+    struct tunneling_link* link = conn->links[i];
+    unsigned long long n_bytes;
+    if (!sockmap_read_n_bytes(conn->thread->server->sockmap, link->socket_cookie, &n_bytes)) {
+      continue;
+    }
+    unsigned long long n_bytes_new = n_bytes - link->n_bytes_offloaded;
+    link->n_bytes_offloaded = n_bytes;
+    *link->n_bytes_relayed += n_bytes_new;
+    atomic_fetch_add_explicit(&conn->thread->load.n_bytes_transferred, n_bytes_new, memory_order_relaxed);
+  }
+}
+
+// Counts the last bytes of an offloaded tunnel that's about to be destroyed, and takes it out of the kernel's maps
+void release_offloaded_tunnel(struct tunnel_conn* conn) {
+  sync_offloaded_bytes(conn);
+  unsigned long long cookies[2] = {conn->links[0]->socket_cookie, conn->links[1]->socket_cookie};
+  sockmap_remove_pair(conn->thread->server->sockmap, cookies);
+  conn->offloaded = false;
+}
+
+/**
+ * Whether the kernel sent on everything it redirected from the link's source, which the EOF must not overtake.
+ * The bytes still on their way are in neither socket, so the ones that reached the destination are counted instead.
+ */
+bool offloaded_link_drained(struct tunneling_link* link) {
+  unsigned long long n_bytes_redirected;
+  unsigned long long n_bytes_written;
+  if (!sockmap_read_n_bytes(link->conn->thread->server->sockmap, link->socket_cookie, &n_bytes_redirected) ||
+      !get_socket_n_bytes_written(link->write_fd, &n_bytes_written)) {
+    // can't tell, don't hold the EOF back
+    return true;
+  }
+  // bytes the program passed to user space instead are written on top
+  return n_bytes_written - link->n_bytes_written_at_offload >= n_bytes_redirected;
+}
+
 void start_tunneling(struct poll* p, struct tunnel_conn* conn) {
+  if (conn->h2_tunnel != NULL) {
+    // the client is on a stream of its HTTP/2 connection
+    start_h2_tunneling(p, conn->h2_tunnel);
+    return;
+  }
+  if (conn->udp_tunnel != NULL) {
+    // the target is a UDP socket, whose datagrams travel in capsules on the client's stream
+    start_udp_tunneling(p, conn->udp_tunnel);
+    return;
+  }
+  answer_client(conn, ACCESS_LOG_TUNNELED);
+
   // dup each socket to decouple read and write ends of the socket
   // this allows us to wait for its readability and writability separately
   // use the original fd for reading; use the dupped fd for writing
-  conn->client_socket_dup = dup(conn->client_socket);
-  conn->target_socket_dup = dup(conn->target_socket);
+  conn->client_socket_dup = io_dup(conn->client_socket);
+  conn->target_socket_dup = io_dup(conn->target_socket);
+  set_notsent_lowat(conn);
+
+  attach_rate_limits(conn);
+  add_relaying_tunnel(conn);
 
   // set up a tunneling link for both directions
-  setup_tunneling_from_target_to_client(p, conn);
-  setup_tunneling_from_client_to_target(p, conn);
+  if (!setup_tunneling_from_target_to_client(p, conn) || !setup_tunneling_from_client_to_target(p, conn)) {
+    return;
+  }
+
+  if (conn->thread->server->sockmap != NULL) {
+    offload_tunnel(conn);
+  }
 }
 
-void link_wait_to_read(struct poll* p, struct tunneling_link* link) {
-  if (poll_wait_for_readability(p, link->read_fd, link, true, false, (poll_callback)handle_link_readability) < 0) {
+// Returns false if the tunnel was destroyed instead
+bool link_wait_to_read(struct poll* p, struct tunneling_link* link) {
+  link->writing = false;
+  if (poll_wait_for_readability(
+          p, link->read_fd, link, true, false, POLL_PRIORITY_RELAY, (poll_callback)handle_link_readability) < 0) {
     char* error_desc = errno2s(errno);
     DEBUG_LOG(
         "failed to wait on read_fd of (%s) -> (%s) for readability: %s",
-        link->source_hostport,
-        link->dst_hostport,
+        link_source_hostport(link),
+        link_dst_hostport(link),
         error_desc);
     free(error_desc);
 
     destroy_tunnel_conn(link->conn);
     free(link);
-    return;
+    return false;
   }
+  return true;
 }
 
-void link_wait_to_write(struct poll* p, struct tunneling_link* link) {
-  if (poll_wait_for_writability(p, link->write_fd, link, true, false, (poll_callback)handle_link_writability) < 0) {
+// Returns false if the tunnel was destroyed instead
+bool link_wait_to_write(struct poll* p, struct tunneling_link* link) {
+  if (link->conn->thread->server->stats_enabled) {
+    sample_send_queue(link->conn, link->write_fd);
+  }
+  link->writing = true;
+  if (poll_wait_for_writability(
+          p, link->write_fd, link, true, false, POLL_PRIORITY_RELAY, (poll_callback)handle_link_writability) < 0) {
     char* error_desc = errno2s(errno);
     DEBUG_LOG(
         "failed to wait on write_fd of (%s) -> (%s) for writability: %s",
-        link->source_hostport,
-        link->dst_hostport,
+        link_source_hostport(link),
+        link_dst_hostport(link),
         error_desc);
     free(error_desc);
 
     destroy_tunnel_conn(link->conn);
     free(link);
-    return;
+    return false;
   }
+  return true;
+}
+
+void handle_link_room(struct poll* p, struct tunneling_link* link);
+
+/**
+ * Waits until fewer bytes than the low-water mark wait in the destination to be sent, which is when epoll reports it
+ * writable, and then reads on. Reading only then keeps the bytes queued in the kernel to about the low-water mark
+ * plus a buffer, so that the bulk of a tunnel doesn't get stale in the queue ahead of what's sent after it.
+ * @return false if the tunnel was destroyed instead
+ */
+bool link_wait_for_room(struct poll* p, struct tunneling_link* link) {
+  if (link->conn->thread->server->stats_enabled) {
+    sample_send_queue(link->conn, link->write_fd);
+  }
+  // with nothing left to write, a link moved to another thread meanwhile just waits to read there
+  link->writing = false;
+  if (poll_wait_for_writability(
+          p, link->write_fd, link, true, false, POLL_PRIORITY_RELAY, (poll_callback)handle_link_room) < 0) {
+    char* error_desc = errno2s(errno);
+    DEBUG_LOG(
+        "failed to wait on write_fd of (%s) -> (%s) for room: %s",
+        link_source_hostport(link),
+        link_dst_hostport(link),
+        error_desc);
+    free(error_desc);
+
+    destroy_tunnel_conn(link->conn);
+    free(link);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Takes both links of the tunnel off the thread's poll, so that the tunnel can move to another thread.
+ * A link paused by rate limiting reads again once resumed, which checks the limits of its new thread.
+ * Only call it from a timer, see `poll_remove`.
+ */
+void detach_tunneling_links(struct poll* p, struct tunnel_conn* conn) {
+  for (int i = 0; i < 2; i++) {
+    struct tunneling_link* link = conn->links[i];
+    // either fd may not have been waited on yet
+    poll_remove(p, link->read_fd);
+    poll_remove(p, link->write_fd);
+    if (*link->throttled_timer != NULL) {
+      poll_cancel_timer(p, *link->throttled_timer);
+      *link->throttled_timer = NULL;
+      link->writing = false;
+    }
+  }
+}
+
+/**
+ * Resumes the links of a tunnel that moved to this thread, waiting for what they waited for before.
+ * @return false if the tunnel had to be destroyed
+ */
+bool attach_tunneling_links(struct poll* p, struct tunnel_conn* conn) {
+  for (int i = 0; i < 2; i++) {
+    struct tunneling_link* link = conn->links[i];
+    int result;
+    if (link->writing) {
+      result = poll_wait_for_writability(
+          p, link->write_fd, link, true, false, POLL_PRIORITY_RELAY, (poll_callback)handle_link_writability);
+    } else {
+      result = poll_wait_for_readability(
+          p, link->read_fd, link, true, false, POLL_PRIORITY_RELAY, (poll_callback)handle_link_readability);
+    }
+    if (result < 0) {
+      char* error_desc = errno2s(errno);
+      DEBUG_LOG("failed to resume (%s) -> (%s): %s", link_source_hostport(link), link_dst_hostport(link), error_desc);
+      free(error_desc);
+
+      // closing the sockets also takes the other link off the poll, if it was already resumed
+      struct tunneling_link* links[2] = {conn->links[0], conn->links[1]};
+      destroy_tunnel_conn(conn);
+      free(links[0]);
+      free(links[1]);
+      return false;
+    }
+  }
+  return true;
+}
+
+void resume_throttled_link(struct poll* p, struct tunneling_link* link) {
+  *link->throttled_timer = NULL;
+  link_wait_to_read(p, link);
+}
+
+/**
+ * Stops reading from the source until the rate limits allow it again.
+ * @return false if the tunnel was destroyed instead
+ */
+bool throttle_link(struct poll* p, struct tunneling_link* link, unsigned long long delay_us) {
+  DEBUG_LOG("throttling (%s) -> (%s) for %llu us", link_source_hostport(link), link_dst_hostport(link), delay_us);
+  *link->throttled_timer = poll_add_timer(p, delay_us, link, (poll_callback)resume_throttled_link);
+  if (*link->throttled_timer == NULL) {
+    DEBUG_LOG("failed to add timer to resume (%s) -> (%s)", link_source_hostport(link), link_dst_hostport(link));
+
+    destroy_tunnel_conn(link->conn);
+    free(link);
+    return false;
+  }
+  return true;
+}
+
+void retry_closing_link(struct poll* p, struct tunneling_link* link);
+
+/**
+ * Passes the EOF from the link's source on to its destination, and tears down the tunnel once both halves are closed.
+ * @return false if the tunnel was destroyed
+ */
+bool close_link(struct poll* p, struct tunneling_link* link) {
+  if (link->conn->offloaded && !offloaded_link_drained(link)) {
+    *link->throttled_timer = poll_add_timer(p, OFFLOADED_DRAIN_RETRY_DELAY_US, link, (poll_callback)retry_closing_link);
+    if (*link->throttled_timer == NULL) {
+      DEBUG_LOG("failed to add timer to close (%s) -> (%s)", link_source_hostport(link), link_dst_hostport(link));
+
+      destroy_tunnel_conn(link->conn);
+      free(link);
+      return false;
+    }
+    return true;
+  }
+
+  io_shutdown(link->read_fd, SHUT_RD);
+  io_shutdown(link->write_fd, SHUT_WR);
+  if (++link->conn->halves_closed == 2) {
+    LOG("tunnel (%s) -> (%s) closed", client_hostport(link->conn), target_hostport(link->conn));
+    // both halves closed, tear down the whole connection
+    destroy_tunnel_conn(link->conn);
+    free(link);
+    return false;
+  }
+  return true;
+}
+
+void retry_closing_link(struct poll* p, struct tunneling_link* link) {
+  *link->throttled_timer = NULL;
+  close_link(p, link);
+}
+
+// Starts what the link may relay now that it was woken up
+void start_link_round(struct tunneling_link* link) {
+  link->round_started_us = monotonic_time_us();
+  link->round_n_bytes = 0;
+}
+
+/**
+ * Whether the link should read again right after sending everything, rather than wait for epoll: only if the source
+ * most likely has more, and the link is within its budget for the round, so that a heavy tunnel doesn't hold up the
+ * other events of the round for long.
+ */
+bool link_round_continues(struct tunneling_link* link) {
+  return link->filled_buffer && link->round_n_bytes < LINK_ROUND_MAX_BYTES &&
+         monotonic_time_us() - link->round_started_us < LINK_ROUND_MAX_US;
 }
 
 void handle_link_readability(struct poll* p, struct tunneling_link* link) {
+  start_link_round(link);
+  link_read(p, link);
+}
+
+/**
+ * Reads from the link's source, and sends what it read on right away.
+ * @return false if the tunnel was destroyed instead
+ */
+bool link_read(struct poll* p, struct tunneling_link* link) {
+  if (!acquire_buffer(link->conn, link->buf, false)) {
+    // stop reading until other tunnels free up some memory
+    return throttle_link(p, link, MEMORY_RETRY_DELAY_US);
+  }
+
   size_t remaining_capacity = BUFFER_SIZE - (link->buf->write_ptr - link->buf->start);
   if (remaining_capacity <= 0) {
     die(hsprintf(
         "going to read for tunnel (%s) -> (%s), but the buf is full; this should not happen",
-        link->source_hostport,
-        link->dst_hostport));
+        link_source_hostport(link),
+        link_dst_hostport(link)));
+  }
+
+  unsigned long long throttle_delay_us;
+  size_t allowance = rate_limit_allowance(link->conn, &throttle_delay_us);
+  if (allowance == 0) {
+    return throttle_link(p, link, throttle_delay_us);
+  }
+  if (remaining_capacity > allowance) {
+    remaining_capacity = allowance;
   }
 
-  ssize_t n_bytes_read = read(link->read_fd, link->buf->write_ptr, remaining_capacity);
+  ssize_t n_bytes_read = io_read(link->read_fd, link->buf->write_ptr, remaining_capacity);
 
   if (n_bytes_read == 0) {
     // peer stopped sending
-    LOG("peer (%s) -> (%s) closed connection", link->source_hostport, link->dst_hostport);
-    shutdown(link->read_fd, SHUT_RD);
-    shutdown(link->write_fd, SHUT_WR);
-    if (++link->conn->halves_closed == 2) {
-      LOG("tunnel (%s) -> (%s) closed", link->conn->client_hostport, link->conn->target_hostport);
-      // both halves closed, tear down the whole connection
-      destroy_tunnel_conn(link->conn);
-      free(link);
-    }
-    return;
+    LOG("peer (%s) -> (%s) closed connection", link_source_hostport(link), link_dst_hostport(link));
+    TRACE2(half_close, link->conn->id, link_is_to_target(link));
+    return close_link(p, link);
+  } else if (n_bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    // an offloaded tunnel's socket is woken up by the bytes the kernel redirects too, and a link that read on after
+    // filling its buffer may find nothing more
+    release_idle_buffer(link->conn, link->buf);
+    return link_wait_to_read(p, link);
   } else if (n_bytes_read < 0) {
     // read error
     char* error_desc = errno2s(errno);
-    LOG("read error from (%s) -> (%s): %s", link->source_hostport, link->dst_hostport, error_desc);
+    LOG("read error from (%s) -> (%s): %s", link_source_hostport(link), link_dst_hostport(link), error_desc);
     free(error_desc);
 
     destroy_tunnel_conn(link->conn);
     free(link);
-    return;
+    return false;
   }
 
-  DEBUG_LOG("received %zu bytes (%s) -> (%s)", n_bytes_read, link->source_hostport, link->dst_hostport);
+  DEBUG_LOG("received %zu bytes (%s) -> (%s)", n_bytes_read, link_source_hostport(link), link_dst_hostport(link));
+  TRACE3(read, link->conn->id, link_is_to_target(link), n_bytes_read);
   link->buf->write_ptr += n_bytes_read;
-  link->conn->n_bytes_transferred += n_bytes_read;
+  link->filled_buffer = (size_t)n_bytes_read == remaining_capacity;
+  link->round_n_bytes += n_bytes_read;
+  *link->n_bytes_relayed += n_bytes_read;
+  rate_limit_consume(link->conn, n_bytes_read);
+  atomic_fetch_add_explicit(&link->conn->thread->load.n_bytes_transferred, n_bytes_read, memory_order_relaxed);
 
-  // we will then write into write_fd
-  link_wait_to_write(p, link);
+  // we will then write into write_fd, which usually has room, so try right away instead of waiting for writability
+  return link_send(p, link);
 }
 
 void handle_link_writability(struct poll* p, struct tunneling_link* link) {
+  start_link_round(link);
+  link_send(p, link);
+}
+
+void handle_link_room(struct poll* p, struct tunneling_link* link) {
+  start_link_round(link);
+  link_read(p, link);
+}
+
+/**
+ * Sends what's in the link's buffer, and waits for writability only if the destination can't take all of it.
+ * @return false if the tunnel was destroyed instead
+ */
+bool link_send(struct poll* p, struct tunneling_link* link) {
   size_t n_bytes_to_send = link->buf->write_ptr - link->buf->read_ptr;
 
   if (n_bytes_to_send <= 0) {
     die(hsprintf(
         "going to write for tunnel (%s) -> (%s), but the buf is empty; this should not happen",
-        link->source_hostport,
-        link->dst_hostport));
+        link_source_hostport(link),
+        link_dst_hostport(link)));
   }
 
-  ssize_t n_bytes_sent = send(link->write_fd, link->buf->read_ptr, n_bytes_to_send, MSG_NOSIGNAL);
+  ssize_t n_bytes_sent = io_send(link->write_fd, link->buf->read_ptr, n_bytes_to_send, MSG_NOSIGNAL);
 
-  if (n_bytes_sent < 0) {
+  if (n_bytes_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    // the socket buffer is full
+    return link_wait_to_write(p, link);
+  } else if (n_bytes_sent < 0) {
     // peer refused to receive?
     // teardown the entire connection
     char* error_desc = errno2s(errno);
-    LOG("write error from (%s) -> (%s): %s", link->source_hostport, link->dst_hostport, error_desc);
+    LOG("write error from (%s) -> (%s): %s", link_source_hostport(link), link_dst_hostport(link), error_desc);
     free(error_desc);
 
     destroy_tunnel_conn(link->conn);
     free(link);
-    return;
+    return false;
   }
 
-  DEBUG_LOG("wrote %zu bytes (%s) -> (%s)", n_bytes_sent, link->source_hostport, link->dst_hostport);
+  DEBUG_LOG("wrote %zu bytes (%s) -> (%s)", n_bytes_sent, link_source_hostport(link), link_dst_hostport(link));
+  TRACE3(send, link->conn->id, link_is_to_target(link), n_bytes_sent);
 
   link->buf->read_ptr += n_bytes_sent;
 
   if (link->buf->read_ptr >= link->buf->write_ptr) {
     // sent everything, we can read again
     link->buf->read_ptr = link->buf->write_ptr = link->buf->start;
+    if (link->notsent_lowat > 0 && link->filled_buffer) {
+      // the source most likely has more, but the destination may not be ready for it yet
+      release_idle_buffer(link->conn, link->buf);
+      return link_wait_for_room(p, link);
+    }
+    if (link_round_continues(link)) {
+      // keep the buffer, which is about to be filled again
+      return link_read(p, link);
+    }
+    release_idle_buffer(link->conn, link->buf);
 
-    link_wait_to_read(p, link);
-  } else {
-    // We didn't manage to send all the bytes.
-    // This can happen when the TCP buffer is full for a slow receiver.
-    // Wait for writability to send again later.
-    link_wait_to_write(p, link);
+    return link_wait_to_read(p, link);
   }
+
+  // We didn't manage to send all the bytes.
+  // This can happen when the TCP buffer is full for a slow receiver.
+  // Wait for writability to send again later.
+  return link_wait_to_write(p, link);
 }
@@ -0,0 +1,41 @@
+#ifndef HTTPS_PROXY_UDP_TUNNEL_H
+#define HTTPS_PROXY_UDP_TUNNEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "tunnel_conn.h"
+
+struct poll;
+struct poll_timer;
+
+/**
+ * Relays the datagrams of a CONNECT-UDP request (RFC 9298) between the client's stream, on which they travel as
+ * DATAGRAM capsules (RFC 9297), and a connected UDP socket to the target.
+ * Like the links of a tunnel between two TCP sockets, each direction reads from a socket and writes to the dup of the
+ * other one. The directions are indexed like `throttled_link_timers`: 0 towards the client, 1 towards the target.
+ */
+struct udp_tunnel {
+  struct tunnel_conn* conn;
+  // Timers retrying a direction that had no memory for its buffer, or was paused by rate limiting. Unlike those of the
+  // links, they don't own what they resume, which goes away with the connection.
+  struct poll_timer* retry_timers[2];
+  // whether the last read of a direction filled what it read into, i.e. its source most likely has more
+  bool filled[2];
+  // batches a direction relayed since it was last woken up, see `udp_round_continues`
+  unsigned int round_n_batches[2];
+  // what the slots `recvmmsg` receives into are sized for: the largest datagram from the target so far
+  size_t max_datagram_len;
+  // the rest of a capsule from the client that's too large for the buffer, which is skipped as it arrives
+  unsigned long long n_bytes_to_skip;
+  // Whether the kernel splits a message of datagrams of the same size for us (UDP GSO), and the largest size it
+  // splits into: that of a datagram that fills a packet on the path to the target
+  bool gso;
+  size_t gso_max_segment_len;
+};
+
+struct udp_tunnel* create_udp_tunnel(struct tunnel_conn* conn);
+void destroy_udp_tunnel(struct tunnel_conn* conn);
+
+void start_udp_tunneling(struct poll* p, struct udp_tunnel* tunnel);
+
+#endif  // HTTPS_PROXY_UDP_TUNNEL_H
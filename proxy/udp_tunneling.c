@@ -0,0 +1,586 @@
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "../io.h"
+#include "../log.h"
+#include "../poll.h"
+#include "../trace.h"
+#include "../util.h"
+#include "proxy_server.h"
+#include "udp_tunnel.h"
+
+#define UDP_TO_CLIENT 0
+#define UDP_TO_TARGET 1
+
+// how long a direction waits before trying again when there's no memory for its buffer
+#define UDP_MEMORY_RETRY_DELAY_US 10000
+// how many batches a direction may relay once woken up before it yields to the other events of the round
+#define UDP_ROUND_MAX_BATCHES 8
+// The most datagrams a single `recvmmsg` or `sendmmsg` takes. With GSO, a message is split into at most this many
+// datagrams too, which is what any kernel with GSO supports (UDP_MAX_SEGMENTS).
+#define UDP_BATCH_LEN 64
+// how large we expect datagrams from the target to be until a larger one arrives: those filling an Ethernet frame
+#define UDP_INITIAL_MAX_DATAGRAM_LEN 1472
+// the IPv4 and UDP headers in front of each datagram on the way to the target
+#define UDP_IPV4_HEADERS_LEN 28
+
+// The capsule carrying a datagram (RFC 9297). Its value starts with the context ID, which is 0 for UDP payloads.
+#define CAPSULE_TYPE_DATAGRAM 0
+// Room for the header of a DATAGRAM capsule in front of its datagram: the type, the length (no longer than 2 bytes for
+// anything that fits into a buffer), and the context ID
+#define DATAGRAM_CAPSULE_HEADER_LEN 4
+
+#define CONNECT_UDP_RESPONSE \
+  "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: connect-udp\r\nCapsule-Protocol: ?1\r\n\r\n"
+
+_Static_assert(BUFFER_SIZE - DATAGRAM_CAPSULE_HEADER_LEN < 16384, "the length of a capsule fits into 2 bytes");
+
+struct udp_tunnel* create_udp_tunnel(struct tunnel_conn* conn) {
+  struct udp_tunnel* tunnel = calloc(1, sizeof(struct udp_tunnel));
+  tunnel->conn = conn;
+  tunnel->max_datagram_len = UDP_INITIAL_MAX_DATAGRAM_LEN;
+  return tunnel;
+}
+
+void destroy_udp_tunnel(struct tunnel_conn* conn) {
+  struct udp_tunnel* tunnel = conn->udp_tunnel;
+  for (int i = 0; i < 2; i++) {
+    if (tunnel->retry_timers[i] != NULL) {
+      poll_cancel_timer(conn->thread->poll, tunnel->retry_timers[i]);
+    }
+  }
+  free(tunnel);
+  conn->udp_tunnel = NULL;
+}
+
+/**
+ * Decodes a variable-length integer (RFC 9000 Section 16) at `*pos`, and moves `*pos` past it.
+ * @return false if it doesn't end before `end`
+ */
+bool read_varint(const char** pos, const char* end, unsigned long long* value) {
+  if (*pos >= end) {
+    return false;
+  }
+  const unsigned char* bytes = (const unsigned char*)*pos;
+  // the top 2 bits of the first byte tell the length: 1, 2, 4 or 8 bytes
+  size_t len = (size_t)1 << (bytes[0] >> 6);
+  if ((size_t)(end - *pos) < len) {
+    return false;
+  }
+
+  unsigned long long result = bytes[0] & 0x3f;
+  for (size_t i = 1; i < len; i++) {
+    result = result << 8 | bytes[i];
+  }
+  *value = result;
+  *pos += len;
+  return true;
+}
+
+/**
+ * Writes the header of a DATAGRAM capsule for a datagram of `len` bytes.
+ * @return the length of the header, at most DATAGRAM_CAPSULE_HEADER_LEN
+ */
+size_t write_datagram_capsule_header(char* dst, size_t len) {
+  unsigned char* bytes = (unsigned char*)dst;
+  // the context ID is part of the value
+  size_t value_len = len + 1;
+  bytes[0] = CAPSULE_TYPE_DATAGRAM;
+  if (value_len < 64) {
+    bytes[1] = value_len;
+    bytes[2] = 0;
+    return 3;
+  }
+  bytes[1] = 0x40 | value_len >> 8;
+  bytes[2] = value_len & 0xff;
+  bytes[3] = 0;
+  return 4;
+}
+
+/**
+ * Checks whether the kernel can segment messages to the target for us, and up to which size: beyond the path's MTU,
+ * `sendmmsg` would fail rather than fragment the datagrams.
+ */
+void detect_udp_gso(struct udp_tunnel* tunnel) {
+  int sock = tunnel->conn->target_socket;
+  int segment_len = 0;
+  int mtu;
+  socklen_t mtu_len = sizeof(mtu);
+  tunnel->gso = setsockopt(sock, SOL_UDP, UDP_SEGMENT, &segment_len, sizeof(segment_len)) == 0 &&
+                getsockopt(sock, IPPROTO_IP, IP_MTU, &mtu, &mtu_len) == 0 && mtu > UDP_IPV4_HEADERS_LEN;
+  tunnel->gso_max_segment_len = tunnel->gso ? mtu - UDP_IPV4_HEADERS_LEN : 0;
+}
+
+bool udp_read_from_target(struct poll* p, struct udp_tunnel* tunnel);
+bool udp_send_to_client(struct poll* p, struct udp_tunnel* tunnel);
+bool udp_read_from_client(struct poll* p, struct udp_tunnel* tunnel);
+bool udp_send_to_target(struct poll* p, struct udp_tunnel* tunnel);
+void handle_udp_target_readability(struct poll* p, struct udp_tunnel* tunnel);
+void handle_udp_client_writability(struct poll* p, struct udp_tunnel* tunnel);
+void handle_udp_client_readability(struct poll* p, struct udp_tunnel* tunnel);
+void handle_udp_target_writability(struct poll* p, struct udp_tunnel* tunnel);
+
+/**
+ * Waits for `fd` to become readable, or writable, to call `callback` with the tunnel.
+ * @return false if the tunnel was destroyed instead
+ */
+bool udp_tunnel_wait(struct poll* p, struct udp_tunnel* tunnel, int fd, bool writability, poll_callback callback) {
+  int result = writability
+                   ? poll_wait_for_writability(p, fd, tunnel, true, false, POLL_PRIORITY_RELAY, callback)
+                   : poll_wait_for_readability(p, fd, tunnel, true, false, POLL_PRIORITY_RELAY, callback);
+  if (result < 0) {
+    char* error_desc = errno2s(errno);
+    DEBUG_LOG(
+        "failed to wait on UDP tunnel (%s) -> (%s): %s",
+        client_hostport(tunnel->conn),
+        target_hostport(tunnel->conn),
+        error_desc);
+    free(error_desc);
+
+    destroy_tunnel_conn(tunnel->conn);
+    return false;
+  }
+  return true;
+}
+
+void retry_udp_read_from_target(struct poll* p, struct udp_tunnel* tunnel) {
+  tunnel->retry_timers[UDP_TO_CLIENT] = NULL;
+  udp_read_from_target(p, tunnel);
+}
+
+void retry_udp_read_from_client(struct poll* p, struct udp_tunnel* tunnel) {
+  tunnel->retry_timers[UDP_TO_TARGET] = NULL;
+  udp_read_from_client(p, tunnel);
+}
+
+/**
+ * Stops a direction for `delay_us`, until other tunnels free up some memory for its buffer, or the rate limits allow
+ * it to read again.
+ * @return false if the tunnel was destroyed instead
+ */
+bool udp_retry_later(struct poll* p, struct udp_tunnel* tunnel, int direction, unsigned long long delay_us) {
+  poll_callback callback = direction == UDP_TO_CLIENT ? (poll_callback)retry_udp_read_from_target
+                                                      : (poll_callback)retry_udp_read_from_client;
+  tunnel->retry_timers[direction] = poll_add_timer(p, delay_us, tunnel, callback);
+  if (tunnel->retry_timers[direction] == NULL) {
+    DEBUG_LOG(
+        "failed to add timer to resume UDP tunnel (%s) -> (%s)",
+        client_hostport(tunnel->conn),
+        target_hostport(tunnel->conn));
+
+    destroy_tunnel_conn(tunnel->conn);
+    return false;
+  }
+  return true;
+}
+
+// Whether a direction should read again right after relaying everything, like `link_round_continues`
+bool udp_round_continues(struct udp_tunnel* tunnel, int direction) {
+  return tunnel->filled[direction] && tunnel->round_n_batches[direction] < UDP_ROUND_MAX_BATCHES;
+}
+
+void start_udp_tunneling(struct poll* p, struct udp_tunnel* tunnel) {
+  struct tunnel_conn* conn = tunnel->conn;
+  answer_client(conn, ACCESS_LOG_TUNNELED);
+
+  // like for the links of a TCP tunnel, read from the original fds and write to their dups
+  conn->client_socket_dup = io_dup(conn->client_socket);
+  conn->target_socket_dup = io_dup(conn->target_socket);
+  detect_udp_gso(tunnel);
+  attach_rate_limits(conn);
+
+  // The response goes out before any datagram from the target. It's small and the buffer is released once it's sent,
+  // so it may exceed the memory budget.
+  acquire_buffer(conn, &conn->to_client_buffer, true);
+  TRACE2(respond, conn->id, 101);
+  memcpy(conn->to_client_buffer.start, CONNECT_UDP_RESPONSE, strlen(CONNECT_UDP_RESPONSE));
+  conn->to_client_buffer.write_ptr += strlen(CONNECT_UDP_RESPONSE);
+  if (!udp_send_to_client(p, tunnel)) {
+    return;
+  }
+
+  struct tunnel_buffer* buf = &conn->to_target_buffer;
+  if (buf->write_ptr > buf->read_ptr) {
+    // the client sent capsules along with its request
+    udp_send_to_target(p, tunnel);
+  } else {
+    buf->read_ptr = buf->write_ptr = buf->start;
+    release_idle_buffer(conn, buf);
+    udp_tunnel_wait(p, tunnel, conn->client_socket, false, (poll_callback)handle_udp_client_readability);
+  }
+}
+
+void handle_udp_target_readability(struct poll* p, struct udp_tunnel* tunnel) {
+  tunnel->round_n_batches[UDP_TO_CLIENT] = 0;
+  udp_read_from_target(p, tunnel);
+}
+
+/**
+ * Receives a batch of datagrams from the target into the empty buffer towards the client, and sends them on as
+ * capsules right away. Each datagram gets a slot of the buffer large enough for the largest so far, with room in front
+ * for its capsule header; a datagram larger than that is dropped, and the slots grow to fit the next one.
+ * @return false if the tunnel was destroyed instead
+ */
+bool udp_read_from_target(struct poll* p, struct udp_tunnel* tunnel) {
+  struct tunnel_conn* conn = tunnel->conn;
+  struct tunnel_buffer* buf = &conn->to_client_buffer;
+  if (!acquire_buffer(conn, buf, false)) {
+    // the datagrams wait in the socket meanwhile, or are dropped by the kernel once it's full
+    return udp_retry_later(p, tunnel, UDP_TO_CLIENT, UDP_MEMORY_RETRY_DELAY_US);
+  }
+
+  unsigned long long throttle_delay_us;
+  size_t allowance = rate_limit_allowance(conn, &throttle_delay_us);
+  if (allowance == 0) {
+    release_idle_buffer(conn, buf);
+    return udp_retry_later(p, tunnel, UDP_TO_CLIENT, throttle_delay_us);
+  }
+
+  size_t slot_len = DATAGRAM_CAPSULE_HEADER_LEN + tunnel->max_datagram_len;
+  size_t n_slots = BUFFER_SIZE / slot_len;
+  if (n_slots > UDP_BATCH_LEN) {
+    n_slots = UDP_BATCH_LEN;
+  }
+  // datagrams can't be read in part, so the last one may take more than the buckets allow, which they make up for later
+  if (n_slots > allowance / tunnel->max_datagram_len + 1) {
+    n_slots = allowance / tunnel->max_datagram_len + 1;
+  }
+  struct mmsghdr msgs[UDP_BATCH_LEN];
+  struct iovec iovs[UDP_BATCH_LEN];
+  memset(msgs, 0, n_slots * sizeof(struct mmsghdr));
+  for (size_t i = 0; i < n_slots; i++) {
+    iovs[i].iov_base = buf->start + i * slot_len + DATAGRAM_CAPSULE_HEADER_LEN;
+    iovs[i].iov_len = tunnel->max_datagram_len;
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  // with MSG_TRUNC, the lengths are those of the datagrams, even where they didn't fit
+  int n_msgs = io_recvmmsg(conn->target_socket, msgs, n_slots, MSG_TRUNC, NULL);
+  if (n_msgs < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    release_idle_buffer(conn, buf);
+    return udp_tunnel_wait(p, tunnel, conn->target_socket, false, (poll_callback)handle_udp_target_readability);
+  } else if (n_msgs < 0 && errno == ECONNREFUSED) {
+    // an earlier datagram to the target was refused, which doesn't end the tunnel
+    DEBUG_LOG("target %s refused a datagram from %s", target_hostport(conn), client_hostport(conn));
+    return udp_read_from_target(p, tunnel);
+  } else if (n_msgs < 0) {
+    char* error_desc = errno2s(errno);
+    LOG("receive error from (%s) -> (%s): %s", target_hostport(conn), client_hostport(conn), error_desc);
+    free(error_desc);
+
+    destroy_tunnel_conn(conn);
+    return false;
+  }
+
+  // move the datagrams together, each behind its capsule header
+  size_t n_bytes_received = 0;
+  for (int i = 0; i < n_msgs; i++) {
+    size_t len = msgs[i].msg_len;
+    if (len > tunnel->max_datagram_len) {
+      DEBUG_LOG("dropped a datagram of %zu bytes from %s", len, target_hostport(conn));
+      tunnel->max_datagram_len = len < BUFFER_SIZE - DATAGRAM_CAPSULE_HEADER_LEN
+                                     ? len
+                                     : BUFFER_SIZE - DATAGRAM_CAPSULE_HEADER_LEN;
+      continue;
+    }
+    buf->write_ptr += write_datagram_capsule_header(buf->write_ptr, len);
+    memmove(buf->write_ptr, iovs[i].iov_base, len);
+    buf->write_ptr += len;
+    n_bytes_received += len;
+  }
+
+  DEBUG_LOG("received %d datagrams (%s) -> (%s)", n_msgs, target_hostport(conn), client_hostport(conn));
+  TRACE3(read, conn->id, false, n_bytes_received);
+  tunnel->filled[UDP_TO_CLIENT] = (size_t)n_msgs == n_slots;
+  tunnel->round_n_batches[UDP_TO_CLIENT]++;
+  conn->n_bytes_to_client += n_bytes_received;
+  rate_limit_consume(conn, n_bytes_received);
+  atomic_fetch_add_explicit(&conn->thread->load.n_bytes_transferred, n_bytes_received, memory_order_relaxed);
+
+  if (buf->write_ptr == buf->start) {
+    // all of them were dropped
+    return udp_read_from_target(p, tunnel);
+  }
+  return udp_send_to_client(p, tunnel);
+}
+
+void handle_udp_client_writability(struct poll* p, struct udp_tunnel* tunnel) {
+  tunnel->round_n_batches[UDP_TO_CLIENT] = 0;
+  udp_send_to_client(p, tunnel);
+}
+
+/**
+ * Sends the capsules in the buffer towards the client, and waits for writability only if the client can't take all
+ * of them.
+ * @return false if the tunnel was destroyed instead
+ */
+bool udp_send_to_client(struct poll* p, struct udp_tunnel* tunnel) {
+  struct tunnel_conn* conn = tunnel->conn;
+  struct tunnel_buffer* buf = &conn->to_client_buffer;
+  ssize_t n_bytes_sent = io_send(conn->client_socket_dup, buf->read_ptr, buf->write_ptr - buf->read_ptr, MSG_NOSIGNAL);
+
+  if (n_bytes_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return udp_tunnel_wait(p, tunnel, conn->client_socket_dup, true, (poll_callback)handle_udp_client_writability);
+  } else if (n_bytes_sent < 0) {
+    char* error_desc = errno2s(errno);
+    LOG("write error from (%s) -> (%s): %s", target_hostport(conn), client_hostport(conn), error_desc);
+    free(error_desc);
+
+    destroy_tunnel_conn(conn);
+    return false;
+  }
+
+  DEBUG_LOG("wrote %zu bytes (%s) -> (%s)", n_bytes_sent, target_hostport(conn), client_hostport(conn));
+  TRACE3(send, conn->id, false, n_bytes_sent);
+  buf->read_ptr += n_bytes_sent;
+
+  if (buf->read_ptr < buf->write_ptr) {
+    return udp_tunnel_wait(p, tunnel, conn->client_socket_dup, true, (poll_callback)handle_udp_client_writability);
+  }
+
+  buf->read_ptr = buf->write_ptr = buf->start;
+  if (udp_round_continues(tunnel, UDP_TO_CLIENT)) {
+    return udp_read_from_target(p, tunnel);
+  }
+  release_idle_buffer(conn, buf);
+  return udp_tunnel_wait(p, tunnel, conn->target_socket, false, (poll_callback)handle_udp_target_readability);
+}
+
+void handle_udp_client_readability(struct poll* p, struct udp_tunnel* tunnel) {
+  tunnel->round_n_batches[UDP_TO_TARGET] = 0;
+  udp_read_from_client(p, tunnel);
+}
+
+/**
+ * Reads capsules from the client, after those that are still incomplete, and sends their datagrams on right away.
+ * @return false if the tunnel was destroyed instead
+ */
+bool udp_read_from_client(struct poll* p, struct udp_tunnel* tunnel) {
+  struct tunnel_conn* conn = tunnel->conn;
+  struct tunnel_buffer* buf = &conn->to_target_buffer;
+  if (!acquire_buffer(conn, buf, false)) {
+    return udp_retry_later(p, tunnel, UDP_TO_TARGET, UDP_MEMORY_RETRY_DELAY_US);
+  }
+
+  unsigned long long throttle_delay_us;
+  size_t allowance = rate_limit_allowance(conn, &throttle_delay_us);
+  if (allowance == 0) {
+    if (buf->read_ptr == buf->write_ptr) {
+      buf->read_ptr = buf->write_ptr = buf->start;
+      release_idle_buffer(conn, buf);
+    }
+    return udp_retry_later(p, tunnel, UDP_TO_TARGET, throttle_delay_us);
+  }
+
+  size_t remaining_capacity = BUFFER_SIZE - (buf->write_ptr - buf->start);
+  if (remaining_capacity > allowance) {
+    remaining_capacity = allowance;
+  }
+  ssize_t n_bytes_read = io_read(conn->client_socket, buf->write_ptr, remaining_capacity);
+
+  if (n_bytes_read == 0) {
+    // there's no half-closing a UDP tunnel, the stream ending ends it
+    LOG("client %s ended its UDP tunnel to %s", client_hostport(conn), target_hostport(conn));
+    TRACE2(half_close, conn->id, true);
+    destroy_tunnel_conn(conn);
+    return false;
+  } else if (n_bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    if (buf->read_ptr == buf->write_ptr) {
+      buf->read_ptr = buf->write_ptr = buf->start;
+      release_idle_buffer(conn, buf);
+    }
+    return udp_tunnel_wait(p, tunnel, conn->client_socket, false, (poll_callback)handle_udp_client_readability);
+  } else if (n_bytes_read < 0) {
+    char* error_desc = errno2s(errno);
+    LOG("read error from (%s) -> (%s): %s", client_hostport(conn), target_hostport(conn), error_desc);
+    free(error_desc);
+
+    destroy_tunnel_conn(conn);
+    return false;
+  }
+
+  DEBUG_LOG("received %zu bytes (%s) -> (%s)", n_bytes_read, client_hostport(conn), target_hostport(conn));
+  TRACE3(read, conn->id, true, n_bytes_read);
+  buf->write_ptr += n_bytes_read;
+  tunnel->filled[UDP_TO_TARGET] = (size_t)n_bytes_read == remaining_capacity;
+  tunnel->round_n_batches[UDP_TO_TARGET]++;
+  rate_limit_consume(conn, n_bytes_read);
+
+  if (tunnel->n_bytes_to_skip > 0) {
+    size_t n_bytes_skipped = buf->write_ptr - buf->read_ptr;
+    if (n_bytes_skipped > tunnel->n_bytes_to_skip) {
+      n_bytes_skipped = tunnel->n_bytes_to_skip;
+    }
+    buf->read_ptr += n_bytes_skipped;
+    tunnel->n_bytes_to_skip -= n_bytes_skipped;
+  }
+
+  return udp_send_to_target(p, tunnel);
+}
+
+void handle_udp_target_writability(struct poll* p, struct udp_tunnel* tunnel) {
+  tunnel->round_n_batches[UDP_TO_TARGET] = 0;
+  udp_send_to_target(p, tunnel);
+}
+
+/**
+ * Sends the datagrams of the complete capsules in the buffer towards the target with a single `sendmmsg`, and waits
+ * for writability only if the socket can't take all of them. With GSO, a run of datagrams of the same size (of which
+ * the last may be shorter) goes into a single message, which the kernel splits up again.
+ * Capsules other than datagrams, and datagrams of contexts other than UDP payloads, are skipped.
+ * @return false if the tunnel was destroyed instead
+ */
+bool udp_send_to_target(struct poll* p, struct udp_tunnel* tunnel) {
+  struct tunnel_conn* conn = tunnel->conn;
+  struct tunnel_buffer* buf = &conn->to_target_buffer;
+
+  struct mmsghdr msgs[UDP_BATCH_LEN];
+  struct iovec iovs[UDP_BATCH_LEN];
+  char controls[UDP_BATCH_LEN][CMSG_SPACE(sizeof(uint16_t))];
+  // where the last capsule of each message ends in the buffer, and what the message carries
+  char* msg_ends[UDP_BATCH_LEN];
+  size_t msg_n_bytes[UDP_BATCH_LEN];
+  // the datagram size of the last message, and whether a shorter one ended it
+  size_t segment_len = 0;
+  bool segments_ended = true;
+  size_t n_msgs = 0;
+  size_t n_iovs = 0;
+
+  const char* pos = buf->read_ptr;
+  while (n_iovs < UDP_BATCH_LEN) {
+    const char* capsule = pos;
+    unsigned long long type;
+    unsigned long long len;
+    if (!read_varint(&pos, buf->write_ptr, &type) || !read_varint(&pos, buf->write_ptr, &len)) {
+      pos = capsule;
+      break;
+    }
+    if (len > (unsigned long long)(buf->write_ptr - pos)) {
+      if ((unsigned long long)(pos - capsule) + len > BUFFER_SIZE) {
+        // it would never fit, so skip it instead, along with the rest of it that's still to come
+        DEBUG_LOG("skipping a capsule of %llu bytes from %s", len, client_hostport(conn));
+        tunnel->n_bytes_to_skip = len - (buf->write_ptr - pos);
+        pos = buf->write_ptr;
+      } else {
+        pos = capsule;
+      }
+      break;
+    }
+
+    const char* value_end = pos + len;
+    const char* payload = pos;
+    unsigned long long context_id;
+    pos = value_end;
+    if (type != CAPSULE_TYPE_DATAGRAM || !read_varint(&payload, value_end, &context_id) || context_id != 0) {
+      continue;
+    }
+
+    size_t payload_len = value_end - payload;
+    // a message never grows beyond the 64 KiB that GSO allows, since all of it comes from the buffer
+    if (tunnel->gso && n_msgs > 0 && !segments_ended && payload_len > 0 && payload_len <= segment_len) {
+      // another segment of the last message
+      msgs[n_msgs - 1].msg_hdr.msg_iovlen++;
+      segments_ended = payload_len < segment_len;
+    } else {
+      if (n_msgs == UDP_BATCH_LEN) {
+        pos = capsule;
+        break;
+      }
+      memset(&msgs[n_msgs], 0, sizeof(struct mmsghdr));
+      msgs[n_msgs].msg_hdr.msg_iov = &iovs[n_iovs];
+      msgs[n_msgs].msg_hdr.msg_iovlen = 1;
+      msg_n_bytes[n_msgs] = 0;
+      segment_len = payload_len;
+      segments_ended = payload_len == 0 || payload_len > tunnel->gso_max_segment_len;
+      n_msgs++;
+    }
+    iovs[n_iovs].iov_base = (void*)payload;
+    iovs[n_iovs].iov_len = payload_len;
+    n_iovs++;
+    msg_ends[n_msgs - 1] = (char*)pos;
+    msg_n_bytes[n_msgs - 1] += payload_len;
+  }
+
+  for (size_t i = 0; i < n_msgs; i++) {
+    struct msghdr* hdr = &msgs[i].msg_hdr;
+    if (hdr->msg_iovlen < 2) {
+      continue;
+    }
+    // the size to split the message into
+    hdr->msg_control = controls[i];
+    hdr->msg_controllen = sizeof(controls[i]);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(hdr);
+    cmsg->cmsg_level = SOL_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    uint16_t gso_size = hdr->msg_iov[0].iov_len;
+    memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+  }
+
+  size_t n_msgs_sent = 0;
+  if (n_msgs > 0) {
+    int result = io_sendmmsg(conn->target_socket_dup, msgs, n_msgs, MSG_NOSIGNAL);
+    if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return udp_tunnel_wait(p, tunnel, conn->target_socket_dup, true, (poll_callback)handle_udp_target_writability);
+    } else if (result < 0 && tunnel->gso && (errno == EIO || errno == EINVAL)) {
+      // the device can't offload segmentation after all, send the datagrams one by one from now on
+      DEBUG_LOG("no UDP GSO towards %s", target_hostport(conn));
+      tunnel->gso = false;
+      return udp_send_to_target(p, tunnel);
+    } else if (result < 0 && (errno == ECONNREFUSED || errno == EMSGSIZE)) {
+      // an earlier datagram was refused, or this one can't be sent, which doesn't end the tunnel
+      DEBUG_LOG("dropped a datagram from %s to %s", client_hostport(conn), target_hostport(conn));
+      if (errno == EMSGSIZE) {
+        buf->read_ptr = msg_ends[0];
+      }
+      return udp_send_to_target(p, tunnel);
+    } else if (result < 0) {
+      char* error_desc = errno2s(errno);
+      LOG("send error from (%s) -> (%s): %s", client_hostport(conn), target_hostport(conn), error_desc);
+      free(error_desc);
+
+      destroy_tunnel_conn(conn);
+      return false;
+    }
+    n_msgs_sent = result;
+
+    size_t n_bytes_sent = 0;
+    for (size_t i = 0; i < n_msgs_sent; i++) {
+      n_bytes_sent += msg_n_bytes[i];
+    }
+    DEBUG_LOG("sent %zu datagram messages (%s) -> (%s)", n_msgs_sent, client_hostport(conn), target_hostport(conn));
+    TRACE3(send, conn->id, true, n_bytes_sent);
+    conn->n_bytes_to_target += n_bytes_sent;
+    atomic_fetch_add_explicit(&conn->thread->load.n_bytes_transferred, n_bytes_sent, memory_order_relaxed);
+  }
+
+  if (n_msgs_sent < n_msgs) {
+    buf->read_ptr = msg_ends[n_msgs_sent - 1];
+    return udp_tunnel_wait(p, tunnel, conn->target_socket_dup, true, (poll_callback)handle_udp_target_writability);
+  }
+  buf->read_ptr = (char*)pos;
+  if (n_iovs == UDP_BATCH_LEN || n_msgs == UDP_BATCH_LEN) {
+    // the batch was full, there may be more complete capsules
+    return udp_send_to_target(p, tunnel);
+  }
+
+  // keep the incomplete capsule at the start of the buffer, where the rest of it is read to
+  size_t n_bytes_left = buf->write_ptr - buf->read_ptr;
+  memmove(buf->start, buf->read_ptr, n_bytes_left);
+  buf->read_ptr = buf->start;
+  buf->write_ptr = buf->start + n_bytes_left;
+
+  if (udp_round_continues(tunnel, UDP_TO_TARGET)) {
+    return udp_read_from_client(p, tunnel);
+  }
+  if (n_bytes_left == 0) {
+    release_idle_buffer(conn, buf);
+  }
+  return udp_tunnel_wait(p, tunnel, conn->client_socket, false, (poll_callback)handle_udp_client_readability);
+}
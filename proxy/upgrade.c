@@ -0,0 +1,352 @@
+#include "upgrade.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "../log.h"
+#include "../poll.h"
+#include "../util.h"
+#include "proxy_server.h"
+
+// how long the new process waits for the old one to send its listening sockets
+#define UPGRADE_OFFER_TIMEOUT_SECONDS 5
+// how often the old process checks whether its tunnels are done
+#define UPGRADE_DRAIN_WATCH_INTERVAL_US 250000
+
+void set_unix_addr(struct sockaddr_un* addr, const char* path) {
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    die(hsprintf("the upgrade socket path '%s' is too long", path));
+  }
+  memset(addr, 0, sizeof(struct sockaddr_un));
+  addr->sun_family = AF_UNIX;
+  strcpy(addr->sun_path, path);
+}
+
+/**
+ * @param fds where the listening sockets that came along are put, at most 2
+ * @return the number of listening sockets received; -1 on failure, with errno set
+ */
+int receive_upgrade_offer(int sock, struct upgrade_offer* offer, int* fds) {
+  char control[CMSG_SPACE(2 * sizeof(int))];
+  struct iovec iov = {.iov_base = offer, .iov_len = sizeof(struct upgrade_offer)};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+
+  ssize_t n_bytes = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  if (n_bytes < 0) {
+    return -1;
+  }
+  if (n_bytes != sizeof(struct upgrade_offer) || (msg.msg_flags & MSG_CTRUNC) != 0) {
+    errno = EPROTO;
+    return -1;
+  }
+
+  int n_fds = 0;
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+    n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cmsg), n_fds * sizeof(int));
+  }
+  return n_fds;
+}
+
+// Keeps a listening socket of the old process if this process listens on the same port
+void take_listening_socket(
+    int fd,
+    unsigned short port,
+    unsigned short wanted_port,
+    bool shared,
+    int* listening_socket) {
+  if (port != wanted_port) {
+    close(fd);
+    return;
+  }
+  if (!shared) {
+    // the sockets of the threads could not join it, as it's not in an SO_REUSEPORT group
+    die(hsprintf("can't take over the listening socket on port %hu shared by all threads with --cpus", port));
+  }
+  *listening_socket = fd;
+}
+
+/**
+ * Asks the process listening on the upgrade socket, if any, for its listening sockets.
+ * Each of them keeps listening throughout, so that no connection is refused while this process starts up.
+ * @param shared whether all threads share a listening socket; otherwise, each thread opens its own SO_REUSEPORT
+ * socket, which joins the group of the old process's sockets
+ * @param listening_socket set to the old process's listening socket for the port, or -1 if this process needs to open
+ * one
+ * @param transparent_listening_socket as above
+ * @return the connection to the old process, to confirm taking over once this process is ready; -1 if there's no
+ * old process
+ */
+int take_over_listening_sockets(
+    const char* path,
+    unsigned short listening_port,
+    unsigned short transparent_port,
+    bool shared,
+    int* listening_socket,
+    int* transparent_listening_socket) {
+  *listening_socket = -1;
+  *transparent_listening_socket = -1;
+
+  struct sockaddr_un addr;
+  set_unix_addr(&addr, path);
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0) {
+    die(hsprintf("failed to create upgrade socket: %s", errno2s(errno)));
+  }
+  if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    if (errno == ENOENT || errno == ECONNREFUSED) {
+      // nobody to take over from, e.g., because this is the first process
+      close(sock);
+      return -1;
+    }
+    die(hsprintf("failed to connect to the upgrade socket '%s': %s", path, errno2s(errno)));
+  }
+
+  struct timeval timeout = {.tv_sec = UPGRADE_OFFER_TIMEOUT_SECONDS};
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  struct upgrade_offer offer;
+  int fds[2];
+  int n_fds = receive_upgrade_offer(sock, &offer, fds);
+  if (n_fds < 0) {
+    die(hsprintf("failed to receive the listening sockets of the process at '%s': %s", path, errno2s(errno)));
+  }
+  if (n_fds != (offer.listening_port != 0) + (offer.transparent_port != 0)) {
+    die(hsprintf("the process at '%s' sent %d listening sockets for the wrong ports", path, n_fds));
+  }
+
+  int i = 0;
+  if (offer.listening_port != 0) {
+    take_listening_socket(fds[i++], offer.listening_port, listening_port, shared, listening_socket);
+  }
+  if (offer.transparent_port != 0) {
+    take_listening_socket(fds[i++], offer.transparent_port, transparent_port, shared, transparent_listening_socket);
+  }
+  printf("Taking over from the process at %s\n", path);
+  return sock;
+}
+
+/**
+ * Listens on the upgrade socket for the next process.
+ * The socket is bound next to the path and moved into place, so that the next process always finds one of us there.
+ */
+struct upgrade* create_upgrade(const char* path, int predecessor, unsigned long long drain_timeout_us) {
+  char* bound_path = hsprintf("%s.%d", path, getpid());
+  struct sockaddr_un addr;
+  set_unix_addr(&addr, bound_path);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (sock < 0) {
+    die(hsprintf("failed to create upgrade socket: %s", errno2s(errno)));
+  }
+  unlink(bound_path);
+  if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    die(hsprintf("failed to bind upgrade socket to '%s': %s", bound_path, errno2s(errno)));
+  }
+  if (listen(sock, 1) < 0) {
+    die(hsprintf("failed to listen on upgrade socket: %s", errno2s(errno)));
+  }
+  if (rename(bound_path, path) < 0) {
+    die(hsprintf("failed to move upgrade socket to '%s': %s", path, errno2s(errno)));
+  }
+  free(bound_path);
+
+  struct upgrade* upgrade = malloc(sizeof(struct upgrade));
+  upgrade->path = path;
+  upgrade->listening_socket = sock;
+  upgrade->successor = -1;
+  upgrade->predecessor = predecessor;
+  atomic_init(&upgrade->n_threads_listening, 0);
+  upgrade->drain_timeout_us = drain_timeout_us;
+  upgrade->drain_deadline_us = 0;
+  return upgrade;
+}
+
+unsigned short count_running_threads(struct proxy_server* server) {
+  unsigned short n_running = 0;
+  for (int i = 0; i < server->threads_len; i++) {
+    if (atomic_load(&server->threads[i].state) == THREAD_RUNNING) {
+      n_running++;
+    }
+  }
+  return n_running;
+}
+
+/**
+ * Called by each thread once it has its listening sockets. Thread 0, which starts last, tells the old process to stop
+ * accepting once all threads listen. Threads that open listening sockets of their own may still be starting up until
+ * then, and the old process would close its sockets before theirs joined the SO_REUSEPORT group.
+ */
+void notify_thread_listening(struct connection_thread* thread) {
+  struct upgrade* upgrade = thread->server->upgrade;
+  atomic_fetch_add(&upgrade->n_threads_listening, 1);
+  if (thread->id != 0 || upgrade->predecessor < 0) {
+    return;
+  }
+
+  while (atomic_load(&upgrade->n_threads_listening) < count_running_threads(thread->server)) {
+    usleep(1000);
+  }
+  char confirmation = 1;
+  if (send(upgrade->predecessor, &confirmation, sizeof(confirmation), MSG_NOSIGNAL) < 0) {
+    // the old process carries on, and both of them accept connections
+    char* error_desc = errno2s(errno);
+    printf("Failed to tell the old process to stop: %s\n", error_desc);
+    free(error_desc);
+  }
+  close(upgrade->predecessor);
+  upgrade->predecessor = -1;
+}
+
+bool upgrade_handed_over(struct upgrade* upgrade) {
+  return upgrade->drain_deadline_us > 0;
+}
+
+/**
+ * Sends the shared listening sockets to the new process.
+ * @return 0 on success; -1 on failure, with errno set
+ */
+int offer_listening_sockets(struct proxy_server* server, int successor) {
+  struct upgrade_offer offer = {0};
+  int fds[2];
+  int n_fds = 0;
+  // sockets that each thread opened for itself stay with it, see `start_draining`
+  if (server->listening_socket >= 0) {
+    offer.listening_port = server->listening_port;
+    fds[n_fds++] = server->listening_socket;
+  }
+  if (server->transparent_listening_socket >= 0) {
+    offer.transparent_port = server->transparent_port;
+    fds[n_fds++] = server->transparent_listening_socket;
+  }
+
+  char control[CMSG_SPACE(2 * sizeof(int))];
+  struct iovec iov = {.iov_base = &offer, .iov_len = sizeof(offer)};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+  if (n_fds > 0) {
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(n_fds * sizeof(int));
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(n_fds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, n_fds * sizeof(int));
+  }
+
+  // the message is tiny, so it fits into the socket buffer of the fresh connection
+  return sendmsg(successor, &msg, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+/**
+ * Runs periodically on thread 0 once the listening sockets were handed over.
+ * Exits once the tunnels of all threads are done, or at the drain deadline.
+ */
+void watch_draining_for_upgrade(struct poll* p, struct connection_thread* thread) {
+  struct proxy_server* server = thread->server;
+  bool others_stopped = true;
+  for (int i = 1; i < server->threads_len; i++) {
+    if (atomic_load(&server->threads[i].state) != THREAD_STOPPED) {
+      others_stopped = false;
+    }
+  }
+  if (others_stopped && thread_drained(p, thread)) {
+    printf("All tunnels are done, exiting\n");
+    poll_stop(p);
+    return;
+  }
+
+  if (monotonic_time_us() >= server->upgrade->drain_deadline_us) {
+    printf("Drain deadline passed with %u tunnels left, exiting\n", atomic_load(&server->active_tunnels));
+    // the tunnels still open are closed along with the process
+    exit(EXIT_SUCCESS);
+  }
+
+  if (poll_add_timer(p, UPGRADE_DRAIN_WATCH_INTERVAL_US, thread, (poll_callback)watch_draining_for_upgrade) == NULL) {
+    LOG("failed to schedule the next check of the tunnels left");
+  }
+}
+
+/**
+ * Stops accepting connections now that the new process does, and drains all threads.
+ * The other threads notice that they are retiring in `watch_thread_state`.
+ */
+void hand_over(struct poll* p, struct connection_thread* thread) {
+  struct proxy_server* server = thread->server;
+  struct upgrade* upgrade = server->upgrade;
+
+  // the upgrade socket's path belongs to the new process now
+  poll_remove(p, upgrade->listening_socket);
+  close(upgrade->listening_socket);
+  upgrade->listening_socket = -1;
+  upgrade->drain_deadline_us = monotonic_time_us() + upgrade->drain_timeout_us;
+  printf("Handed the listening sockets over to the new process, draining %u tunnels\n",
+         atomic_load(&server->active_tunnels));
+
+  for (int i = 1; i < server->threads_len; i++) {
+    int running = THREAD_RUNNING;
+    atomic_compare_exchange_strong(&server->threads[i].state, &running, THREAD_DRAINING);
+  }
+  start_draining(p, thread);
+  watch_draining_for_upgrade(p, thread);
+}
+
+void handle_successor_readability(struct poll* p, struct connection_thread* thread) {
+  struct upgrade* upgrade = thread->server->upgrade;
+  char confirmation;
+  ssize_t n_bytes = recv(upgrade->successor, &confirmation, sizeof(confirmation), 0);
+  close(upgrade->successor);
+  upgrade->successor = -1;
+
+  if (n_bytes != sizeof(confirmation)) {
+    // e.g., the new process failed to start
+    printf("The new process went away before taking over, carrying on\n");
+    return;
+  }
+  hand_over(p, thread);
+}
+
+void handle_upgrade_request(struct poll* p, struct connection_thread* thread) {
+  struct upgrade* upgrade = thread->server->upgrade;
+  int successor = accept4(upgrade->listening_socket, NULL, NULL, SOCK_CLOEXEC);
+  if (successor < 0) {
+    char* error_desc = errno2s(errno);
+    LOG("failed to accept upgrade request: %s", error_desc);
+    free(error_desc);
+    return;
+  }
+  if (upgrade->successor >= 0) {
+    LOG("another process is taking over already");
+    close(successor);
+    return;
+  }
+
+  if (offer_listening_sockets(thread->server, successor) < 0 ||
+      poll_wait_for_readability(
+          p, successor, thread, true, false, POLL_PRIORITY_SETUP, (poll_callback)handle_successor_readability) < 0) {
+    char* error_desc = errno2s(errno);
+    printf("Failed to hand the listening sockets over to the new process: %s\n", error_desc);
+    free(error_desc);
+    close(successor);
+    return;
+  }
+
+  printf("A new process is taking over the listening sockets\n");
+  upgrade->successor = successor;
+}
+
+// Runs on thread 0, which waits for the next process to take over
+void start_serving_upgrades(struct poll* p, struct connection_thread* thread) {
+  if (poll_wait_for_readability(
+          p,
+          thread->server->upgrade->listening_socket,
+          thread,
+          false,
+          false,
+          POLL_PRIORITY_SETUP,
+          (poll_callback)handle_upgrade_request) < 0) {
+    die(hsprintf("failed to register readability notification for upgrade socket: %s", errno2s(errno)));
+  }
+}
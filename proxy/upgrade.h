@@ -0,0 +1,55 @@
+#ifndef HTTPS_PROXY_UPGRADE_H
+#define HTTPS_PROXY_UPGRADE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+struct poll;
+struct connection_thread;
+
+// What the old process sends to the new one, along with the listening sockets it has in the order of the ports below
+struct upgrade_offer {
+  // the port of each listening socket passed along, 0 if there is none
+  unsigned short listening_port;
+  unsigned short transparent_port;
+};
+
+/**
+ * Lets a new process of the proxy take over the listening sockets of this one, so that the proxy can be restarted
+ * (e.g., with a new binary or other options) without a moment in which nobody listens. This process then stops
+ * accepting, and exits once its tunnels are done, or at the drain deadline.
+ * Only thread 0 touches this, other than `n_threads_listening`.
+ */
+struct upgrade {
+  // the Unix socket that the next process connects to
+  const char* path;
+  // bound to `path`; -1 once the listening sockets were handed over
+  int listening_socket;
+  // the new process while it takes over, -1 otherwise
+  int successor;
+  // the old process until all threads of this one listen, -1 otherwise
+  int predecessor;
+  // threads of this process that opened their listening sockets
+  atomic_ushort n_threads_listening;
+  unsigned long long drain_timeout_us;
+  // 0 until the listening sockets were handed over
+  unsigned long long drain_deadline_us;
+};
+
+int take_over_listening_sockets(
+    const char* path,
+    unsigned short listening_port,
+    unsigned short transparent_port,
+    bool shared,
+    int* listening_socket,
+    int* transparent_listening_socket);
+
+struct upgrade* create_upgrade(const char* path, int predecessor, unsigned long long drain_timeout_us);
+
+void notify_thread_listening(struct connection_thread* thread);
+
+void start_serving_upgrades(struct poll* p, struct connection_thread* thread);
+
+bool upgrade_handed_over(struct upgrade* upgrade);
+
+#endif  // HTTPS_PROXY_UPGRADE_H
@@ -0,0 +1,222 @@
+#include <errno.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../http2/session.h"
+#include "../log.h"
+#include "../trace.h"
+#include "../util.h"
+#include "h2_tunnel.h"
+#include "proxy_server.h"
+
+void handle_upstream_headers(
+    struct poll* p,
+    struct h2_stream* stream,
+    const struct hpack_header* headers,
+    size_t n_headers,
+    bool end_stream) {
+  struct h2_tunnel* tunnel = stream->data;
+  struct tunnel_conn* conn = tunnel->conn;
+  if (tunnel->started) {
+    // trailers carry nothing for us, but they may end the stream
+    if (end_stream) {
+      handle_h2_tunnel_data(p, stream, NULL, 0, true);
+    }
+    return;
+  }
+
+  const char* status = "";
+  size_t status_len = 0;
+  for (size_t i = 0; i < n_headers; i++) {
+    if (headers[i].name_len == strlen(":status") && memcmp(headers[i].name, ":status", headers[i].name_len) == 0) {
+      status = headers[i].value;
+      status_len = headers[i].value_len;
+    }
+  }
+
+  TRACE2(connect_done, conn->id, status_len == 3 && status[0] == '2' && !end_stream);
+  if (status_len != 3 || status[0] != '2' || end_stream) {
+    LOG("parent proxy %s refused tunnel (%s) -> (%s) with status '%.*s'",
+        stream->session->peer_hostport,
+        client_hostport(conn),
+        target_hostport(conn),
+        (int)status_len,
+        status);
+    h2_stream_close(p, stream);
+    tunnel->stream = NULL;
+    reject_client_request(p, conn);
+    return;
+  }
+
+  LOG("connected to %s through parent proxy %s", target_hostport(conn), stream->session->peer_hostport);
+  start_h2_tunneling(p, tunnel);
+}
+
+void handle_upstream_reset(struct poll* p, struct h2_stream* stream, uint32_t error_code) {
+  struct h2_tunnel* tunnel = stream->data;
+  struct tunnel_conn* conn = tunnel->conn;
+  (void)error_code;  // only logged
+  LOG("stream of tunnel (%s) -> (%s) to parent proxy %s was reset (error code %u)",
+      client_hostport(conn),
+      target_hostport(conn),
+      stream->session->peer_hostport,
+      error_code);
+
+  tunnel->stream = NULL;
+  if (tunnel->started) {
+    destroy_tunnel_conn(conn);
+  } else {
+    TRACE2(connect_done, conn->id, false);
+    reject_client_request(p, conn);
+  }
+}
+
+void handle_upstream_closed(struct poll* p, struct h2_session* session) {
+  (void)p;
+  struct connection_thread* thread = session->data;
+  for (unsigned short i = 0; i < thread->server->parent_connections; i++) {
+    if (thread->upstream_sessions[i] == session) {
+      thread->upstream_sessions[i] = NULL;
+    }
+  }
+}
+
+static const struct h2_session_callbacks upstream_callbacks = {
+    .on_headers = handle_upstream_headers,
+    .on_data = handle_h2_tunnel_data,
+    .on_send_window = handle_h2_tunnel_send_window,
+    .on_reset = handle_upstream_reset,
+    .on_closed = handle_upstream_closed,
+};
+
+struct h2_session* connect_to_parent(struct poll* p, struct connection_thread* thread) {
+  struct proxy_server* server = thread->server;
+
+  int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+  if (sock < 0) {
+    char* error_desc = errno2s(errno);
+    LOG("failed to create socket for parent proxy %s: %s", server->parent_hostport, error_desc);
+    free(error_desc);
+    return NULL;
+  }
+
+  // frames of many tunnels share the connection, don't hold back small ones
+  int enable = 1;
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+  if (server->busy_poll_us > 0) {
+    enable_socket_busy_polling(sock, server->busy_poll_us);
+  }
+
+  if (connect(sock, (struct sockaddr*)&server->parent_addr, sizeof(server->parent_addr)) != 0 &&
+      errno != EINPROGRESS) {
+    char* error_desc = errno2s(errno);
+    LOG("failed to connect to parent proxy %s: %s", server->parent_hostport, error_desc);
+    free(error_desc);
+    close(sock);
+    return NULL;
+  }
+
+  struct h2_session* session =
+      h2_session_create_client(p, sock, server->parent_hostport, H2_TUNNEL_STREAM_WINDOW, &upstream_callbacks, thread);
+  if (session == NULL) {
+    char* error_desc = errno2s(errno);
+    LOG("failed to set up HTTP/2 session with parent proxy %s: %s", server->parent_hostport, error_desc);
+    free(error_desc);
+    close(sock);
+    return NULL;
+  }
+
+  LOG("connecting to parent proxy %s", server->parent_hostport);
+  return session;
+}
+
+/**
+ * Picks the least busy connection to the parent proxy, opening another one while the thread has fewer than
+ * `parent_connections` and the existing ones are all carrying tunnels.
+ * @return the session, or NULL if there is none that can take another stream
+ */
+struct h2_session* pick_upstream_session(struct poll* p, struct connection_thread* thread) {
+  struct h2_session* best = NULL;
+  int free_slot = -1;
+
+  for (unsigned short i = 0; i < thread->server->parent_connections; i++) {
+    struct h2_session* session = thread->upstream_sessions[i];
+    if (session != NULL && session->going_away) {
+      // it stays alive until its remaining streams are done, but its slot can go to a new connection
+      thread->upstream_sessions[i] = session = NULL;
+    }
+    if (session == NULL) {
+      if (free_slot < 0) {
+        free_slot = i;
+      }
+      continue;
+    }
+    if (h2_session_can_open_stream(session) && (best == NULL || session->streams_len < best->streams_len)) {
+      best = session;
+    }
+  }
+
+  if (free_slot >= 0 && (best == NULL || best->streams_len > 0)) {
+    struct h2_session* session = connect_to_parent(p, thread);
+    if (session != NULL) {
+      thread->upstream_sessions[free_slot] = session;
+      return session;
+    }
+  }
+  return best;
+}
+
+// Opens the tunnel as a CONNECT stream (RFC 9113 Section 8.5) to the parent proxy instead of connecting ourselves
+void start_upstream_tunnel(struct poll* p, struct tunnel_conn* conn) {
+  struct h2_session* session = pick_upstream_session(p, conn->thread);
+  if (session == NULL) {
+    LOG("no connection to parent proxy %s can take tunnel (%s) -> (%s)",
+        conn->thread->server->parent_hostport,
+        client_hostport(conn),
+        target_hostport(conn));
+    reject_client_request(p, conn);
+    return;
+  }
+
+  char authority[HOST_PORT_BUF_SIZE];
+  int authority_len = snprintf(authority, sizeof(authority), "%s:%hu", conn->target_host, conn->target_port);
+  struct hpack_header headers[] = {
+      {.name = ":method", .name_len = strlen(":method"), .value = "CONNECT", .value_len = strlen("CONNECT")},
+      {.name = ":authority", .name_len = strlen(":authority"), .value = authority, .value_len = authority_len},
+  };
+
+  // the parent proxy connects for us, so there's no address to trace
+  TRACE3(connect_start, conn->id, 0, 0);
+  conn->h2_tunnel = create_client_side_h2_tunnel(conn);
+  conn->h2_tunnel->stream =
+      h2_session_open_stream(p, session, headers, sizeof(headers) / sizeof(headers[0]), conn->h2_tunnel);
+  if (conn->h2_tunnel->stream == NULL) {
+    LOG("parent proxy %s can't take tunnel (%s) -> (%s)",
+        session->peer_hostport,
+        client_hostport(conn),
+        target_hostport(conn));
+    reject_client_request(p, conn);
+    return;
+  }
+
+  LOG("requested tunnel (%s) -> (%s) on stream %u of parent proxy %s",
+      client_hostport(conn),
+      target_hostport(conn),
+      conn->h2_tunnel->stream->id,
+      session->peer_hostport);
+}
+
+// Closes the thread's connections to the parent proxy once the tunnels on them are done, e.g., since it's retiring
+void disconnect_from_parent(struct poll* p, struct connection_thread* thread) {
+  if (thread->upstream_sessions == NULL) {
+    return;
+  }
+
+  for (unsigned short i = 0; i < thread->server->parent_connections; i++) {
+    if (thread->upstream_sessions[i] != NULL) {
+      h2_session_go_away(p, thread->upstream_sessions[i]);
+    }
+  }
+}
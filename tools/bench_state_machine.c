@@ -0,0 +1,268 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../poll.h"
+#include "../proxy/loop_stats.h"
+#include "../proxy/proxy_server.h"
+#include "../util.h"
+#include "fake_io.h"
+
+/**
+ * Runs whole connection lifecycles through the state machine of one connection thread on top of fake_io.c:
+ * accept, read the CONNECT request, resolve and connect to the target, relay a payload each way, and tear down.
+ * Reports the CPU time and allocations per lifecycle, and the time per run of each callback.
+ */
+
+#define DEFAULT_CONNECTIONS 100000
+#define WARMUP_CONNECTIONS 1000
+#define CONNECT_REQUEST "CONNECT example.com:443 HTTP/1.1\r\nHost: example.com:443\r\n\r\n"
+#define RESPONSE "HTTP/1.1 200 Connection Established \r\n\r\n"
+
+// counted by wrapping the allocator with `-Wl,--wrap=malloc` and so on, see the bench target in the Makefile
+static unsigned long long n_allocations = 0;
+static unsigned long long n_bytes_allocated = 0;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+  n_allocations++;
+  n_bytes_allocated += size;
+  return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t n, size_t size) {
+  n_allocations++;
+  n_bytes_allocated += n * size;
+  return __real_calloc(n, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+  n_allocations++;
+  n_bytes_allocated += size;
+  return __real_realloc(ptr, size);
+}
+
+struct bench {
+  struct proxy_server server;
+  struct connection_thread thread;
+  struct poll* poll;
+  int listening_socket;
+  // connections per batch, i.e. how many are pending whenever the thread runs out of work
+  unsigned int batch_len;
+  unsigned long long n_started;
+  unsigned long long n_connections;
+};
+
+static struct bench bench;
+
+// `fake_io_on_idle`: the previous connections are done, so either start the next batch or stop
+void start_next_batch(void) {
+  if (bench.n_started >= bench.n_connections) {
+    poll_stop(bench.poll);
+    return;
+  }
+  unsigned long long n = bench.n_connections - bench.n_started;
+  if (n > bench.batch_len) {
+    n = bench.batch_len;
+  }
+  fake_io_add_pending_connections(bench.listening_socket, n);
+  bench.n_started += n;
+}
+
+/**
+ * Runs `n_connections` lifecycles on a fresh event loop.
+ * @return the elapsed time in nanoseconds
+ */
+unsigned long long run_connections(unsigned long long n_connections, bool with_loop_stats) {
+  bench.n_started = 0;
+  bench.n_connections = n_connections;
+  bench.poll = poll_create();
+  if (bench.poll == NULL) {
+    die("failed to create poll instance");
+  }
+  bench.thread.poll = bench.poll;
+  if (with_loop_stats) {
+    poll_enable_stats(bench.poll, 1000000);
+  }
+  if (poll_wait_for_readability(
+          bench.poll,
+          bench.listening_socket,
+          &bench.thread,
+          false,
+          true,
+          POLL_PRIORITY_SETUP,
+          (poll_callback)accept_incoming_connections) < 0) {
+    die("failed to wait for connections");
+  }
+
+  unsigned long long started_at_ns = monotonic_time_ns();
+  if (poll_run(bench.poll) < 0) {
+    die("poll_run failed");
+  }
+  return monotonic_time_ns() - started_at_ns;
+}
+
+void finish_run(void) {
+  poll_destroy(bench.poll);
+  bench.poll = NULL;
+  bench.thread.poll = NULL;
+}
+
+// Checks that every connection was tunneled in full and torn down, so that the numbers mean something
+void check_run(unsigned long long n_connections, size_t from_client_len, size_t from_target_len) {
+  size_t request_len = strlen(CONNECT_REQUEST);
+  unsigned long long expected_to_targets = n_connections * (from_client_len - request_len);
+  unsigned long long expected_to_clients = n_connections * (strlen(RESPONSE) + from_target_len);
+  if (fake_io_counters.n_bytes_to_targets != expected_to_targets ||
+      fake_io_counters.n_bytes_to_clients != expected_to_clients) {
+    die(hsprintf(
+        "expected %llu bytes to targets and %llu to clients, got %llu and %llu",
+        expected_to_targets,
+        expected_to_clients,
+        fake_io_counters.n_bytes_to_targets,
+        fake_io_counters.n_bytes_to_clients));
+  }
+  if (atomic_load(&bench.thread.load.active_tunnels) != 0) {
+    die(hsprintf("%u connections were not torn down", atomic_load(&bench.thread.load.active_tunnels)));
+  }
+}
+
+void print_callback_times(struct poll_stats* stats, unsigned long long n_connections) {
+  for (int i = 0; i < POLL_MAX_CALLBACK_TYPES; i++) {
+    struct poll_callback_stats* callback = &stats->callbacks[i];
+    if (callback->n_runs == 0) {
+      continue;
+    }
+    fputs("  ", stdout);
+    print_callback_name(callback->callback);
+    printf(": %.2f runs/connection, %.0f ns/run\n",
+           (double)callback->n_runs / n_connections,
+           (double)callback->total_ns / callback->n_runs);
+  }
+}
+
+char* make_payload(size_t len) {
+  char* payload = malloc(len);
+  for (size_t i = 0; i < len; i++) {
+    payload[i] = 'a' + i % 26;
+  }
+  return payload;
+}
+
+int main(int argc, char** argv) {
+  static const struct option long_options[] = {
+      {"connections", required_argument, NULL, 'n'},
+      {"batch", required_argument, NULL, 'b'},
+      {"payload", required_argument, NULL, 'p'},
+      {"chunk", required_argument, NULL, 'c'},
+      {"max-send", required_argument, NULL, 's'},
+      {NULL, 0, NULL, 0},
+  };
+  const char* usage =
+      "Usage: %s [--connections=N] [--batch=N] [--payload=BYTES] [--chunk=BYTES] [--max-send=BYTES]";
+
+  unsigned long long n_connections = DEFAULT_CONNECTIONS;
+  unsigned int batch_len = 1;
+  size_t payload_len = 4096;
+  struct fake_io_script script = {.chunk_len = 0, .max_send_len = 0};
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+    char* endptr;
+    unsigned long long value = strtoull(optarg, &endptr, 10);
+    if (*optarg == '\0' || *endptr != '\0') {
+      die(hsprintf(usage, argv[0]));
+    }
+    switch (opt) {
+      case 'n':
+        n_connections = value;
+        break;
+      case 'b':
+        batch_len = value;
+        break;
+      case 'p':
+        payload_len = value;
+        break;
+      case 'c':
+        script.chunk_len = value;
+        break;
+      case 's':
+        script.max_send_len = value;
+        break;
+      default:
+        die(hsprintf(usage, argv[0]));
+    }
+  }
+  if (n_connections == 0 || batch_len == 0) {
+    die(hsprintf(usage, argv[0]));
+  }
+
+  // the client sends its payload right after the request, the target sends the same amount back
+  size_t request_len = strlen(CONNECT_REQUEST);
+  char* from_client = make_payload(request_len + payload_len);
+  memcpy(from_client, CONNECT_REQUEST, request_len);
+  script.from_client = from_client;
+  script.from_client_len = request_len + payload_len;
+  script.from_target = make_payload(payload_len);
+  script.from_target_len = payload_len;
+
+  bench.batch_len = batch_len;
+  bench.server = (struct proxy_server){
+      .listening_socket = -1,
+      .transparent_listening_socket = -1,
+      .threads = &bench.thread,
+      .threads_len = 1,
+  };
+  bench.thread.id = 0;
+  bench.thread.server = &bench.server;
+  bench.thread.cpu = -1;
+  bench.thread.transparent_listening_socket = -1;
+  bench.thread.hostnames = create_host_table();
+  atomic_init(&bench.thread.state, THREAD_RUNNING);
+  handoff_init(&bench.server);
+  migration_init(&bench.server);
+  prepare_accepting(&bench.thread);
+  fake_io_on_idle = start_next_batch;
+
+  printf("%llu connections in batches of %u, %zu bytes each way, chunks of %zu bytes, sends of at most %zu bytes\n",
+         n_connections,
+         batch_len,
+         payload_len,
+         script.chunk_len,
+         script.max_send_len);
+
+  // warm up the caches and the allocator, then time the lifecycles on their own
+  fake_io_init(&script);
+  bench.listening_socket = bench.thread.listening_socket = fake_io_listen();
+  run_connections(WARMUP_CONNECTIONS, false);
+  finish_run();
+
+  fake_io_init(&script);
+  bench.listening_socket = bench.thread.listening_socket = fake_io_listen();
+  unsigned long long allocations_before = n_allocations;
+  unsigned long long bytes_allocated_before = n_bytes_allocated;
+  unsigned long long elapsed_ns = run_connections(n_connections, false);
+  check_run(n_connections, script.from_client_len, script.from_target_len);
+  // the fake's own allocations stand in for the kernel's and getaddrinfo's
+  unsigned long long n_proxy_allocations = n_allocations - allocations_before - fake_io_counters.n_allocations;
+  printf("%.0f ns/connection, %.1f allocations/connection (%.0f bytes), %.1f wakeups/connection\n",
+         (double)elapsed_ns / n_connections,
+         (double)n_proxy_allocations / n_connections,
+         (double)(n_bytes_allocated - bytes_allocated_before) / n_connections,
+         (double)fake_io_counters.n_wakeups / n_connections);
+  finish_run();
+
+  // timing each callback slows them down a little, so this is a separate run
+  fake_io_init(&script);
+  bench.listening_socket = bench.thread.listening_socket = fake_io_listen();
+  run_connections(n_connections, true);
+  check_run(n_connections, script.from_client_len, script.from_target_len);
+  print_callback_times(poll_get_stats(bench.poll), n_connections);
+  finish_run();
+
+  free(from_client);
+  free((char*)script.from_target);
+  return 0;
+}
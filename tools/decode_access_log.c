@@ -0,0 +1,180 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "../proxy/access_log.h"
+#include "../util.h"
+
+static const char* outcome_names[] = {
+    [ACCESS_LOG_NO_REQUEST] = "no-request",
+    [ACCESS_LOG_REJECTED] = "rejected",
+    [ACCESS_LOG_TUNNELED] = "tunneled",
+    [ACCESS_LOG_HTTP2_CONNECTION] = "http2-connection",
+};
+
+static const struct {
+  enum access_log_flag flag;
+  const char* name;
+} flag_names[] = {
+    {ACCESS_LOG_BLOCKED, "blocked"},
+    {ACCESS_LOG_TRANSPARENT, "transparent"},
+    {ACCESS_LOG_CLIENT_HTTP2, "client-http2"},
+    {ACCESS_LOG_PARENT, "parent"},
+    {ACCESS_LOG_HOST_TRUNCATED, "host-truncated"},
+    {ACCESS_LOG_UDP, "udp"},
+};
+
+const char* outcome_name(uint8_t outcome) {
+  if (outcome >= sizeof(outcome_names) / sizeof(outcome_names[0]) || outcome_names[outcome] == NULL) {
+    return "unknown";
+  }
+  return outcome_names[outcome];
+}
+
+// Writes the names of the flags separated by `separator`
+void print_flags(uint8_t flags, char separator) {
+  bool first = true;
+  for (size_t i = 0; i < sizeof(flag_names) / sizeof(flag_names[0]); i++) {
+    if (flags & flag_names[i].flag) {
+      if (!first) {
+        putchar(separator);
+      }
+      fputs(flag_names[i].name, stdout);
+      first = false;
+    }
+  }
+}
+
+// ISO 8601 in UTC, with microseconds
+void format_timestamp(uint64_t us, char* out, size_t out_len) {
+  time_t seconds = us / 1000000;
+  struct tm tm;
+  gmtime_r(&seconds, &tm);
+  size_t len = strftime(out, out_len, "%Y-%m-%dT%H:%M:%S", &tm);
+  snprintf(out + len, out_len - len, ".%06uZ", (unsigned int)(us % 1000000));
+}
+
+void print_record(const struct access_log_record* record, unsigned short thread_id, bool csv) {
+  char started_at[64];
+  format_timestamp(record->started_at_us, started_at, sizeof(started_at));
+  char client_ip[INET_ADDRSTRLEN];
+  struct in_addr client_addr = {.s_addr = record->client_addr};
+  inet_ntop(AF_INET, &client_addr, client_ip, sizeof(client_ip));
+  int host_len = record->target_host_len <= ACCESS_LOG_HOST_LEN ? record->target_host_len : ACCESS_LOG_HOST_LEN;
+  const char* host = record->target_host;
+  if (host_len == 0) {
+    // the client never told us
+    host = "-";
+    host_len = 1;
+  }
+
+  if (csv) {
+    // hostnames contain neither commas nor quotes, so nothing needs quoting
+    printf("%s,%hu,%s,%hu,%.*s,%hu,%s,",
+           started_at,
+           thread_id,
+           client_ip,
+           record->client_port,
+           host_len,
+           host,
+           record->target_port,
+           outcome_name(record->outcome));
+    print_flags(record->flags, '|');
+    printf(",%llu,%llu,%u,%u,%llu\n",
+           (unsigned long long)record->n_bytes_to_target,
+           (unsigned long long)record->n_bytes_to_client,
+           record->request_us,
+           record->connect_us,
+           (unsigned long long)record->duration_us);
+    return;
+  }
+
+  printf("%s [%hu] %s:%hu -> %.*s:%hu %s, %llu bytes up, %llu bytes down, request %.3f ms, connect %.3f ms, "
+         "total %.3f s",
+         started_at,
+         thread_id,
+         client_ip,
+         record->client_port,
+         host_len,
+         host,
+         record->target_port,
+         outcome_name(record->outcome),
+         (unsigned long long)record->n_bytes_to_target,
+         (unsigned long long)record->n_bytes_to_client,
+         record->request_us / 1000.0,
+         record->connect_us / 1000.0,
+         record->duration_us / 1000000.0);
+  if (record->flags != 0) {
+    fputs(" [", stdout);
+    print_flags(record->flags, ' ');
+    putchar(']');
+  }
+  putchar('\n');
+}
+
+/**
+ * Prints all complete records of a segment, including one that is still being written to.
+ * @return 0 on success; -1 if the file could not be read or is not a segment
+ */
+int decode_segment(const char* path, bool csv) {
+  FILE* fp = fopen(path, "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "could not open '%s': %s\n", path, errno2s(errno));
+    return -1;
+  }
+
+  struct access_log_segment_header header;
+  if (fread(&header, sizeof(header), 1, fp) != 1 ||
+      memcmp(header.magic, ACCESS_LOG_MAGIC, sizeof(header.magic)) != 0 ||
+      header.record_size != ACCESS_LOG_RECORD_SIZE) {
+    fprintf(stderr, "'%s' is not an access log segment\n", path);
+    fclose(fp);
+    return -1;
+  }
+
+  struct access_log_record record;
+  for (uint64_t i = 0; i < header.n_records && fread(&record, sizeof(record), 1, fp) == 1; i++) {
+    print_record(&record, header.thread_id, csv);
+  }
+
+  fclose(fp);
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  static const struct option long_options[] = {
+      {"csv", no_argument, NULL, 'c'},
+      {NULL, 0, NULL, 0},
+  };
+
+  bool csv = false;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 'c':
+        csv = true;
+        break;
+      default:
+        die(hsprintf("Usage: %s [--csv] segment...", argv[0]));
+    }
+  }
+  if (optind == argc) {
+    die(hsprintf("Usage: %s [--csv] segment...", argv[0]));
+  }
+
+  if (csv) {
+    printf("started_at,thread,client_ip,client_port,target_host,target_port,outcome,flags,"
+           "bytes_to_target,bytes_to_client,request_us,connect_us,duration_us\n");
+  }
+
+  int status = 0;
+  for (int i = optind; i < argc; i++) {
+    if (decode_segment(argv[i], csv) < 0) {
+      status = 1;
+    }
+  }
+  return status;
+}
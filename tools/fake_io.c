@@ -0,0 +1,461 @@
+#include "fake_io.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../io.h"
+
+// enough for a few thousand connections in flight
+#define FAKE_MAX_FDS 16384
+// fds below this are left alone, like stdin, stdout and stderr
+#define FAKE_FIRST_FD 3
+
+enum fake_file_kind {
+  FAKE_FILE_FREE = 0,
+  FAKE_FILE_EPOLL,
+  FAKE_FILE_LISTENER,
+  FAKE_FILE_SOCKET,
+  FAKE_FILE_RESOLVER,
+};
+
+// What an fd refers to; shared by dupped fds
+struct fake_file {
+  enum fake_file_kind kind;
+  unsigned int n_refs;
+
+  // for listeners
+  unsigned int n_pending;
+
+  // for sockets: what the peer sends, how much of it has arrived and has been read so far
+  bool is_client;
+  bool connected;
+  const char* incoming;
+  size_t incoming_len;
+  size_t n_arrived;
+  size_t n_read;
+  // a capped send blocks the socket until the next wakeup
+  bool send_blocked;
+
+  // in the free list
+  struct fake_file* next_free;
+};
+
+struct fake_fd {
+  // NULL if the fd is closed
+  struct fake_file* file;
+  // the epoll registration of the fd
+  bool registered;
+  bool armed;
+  uint32_t events;
+  epoll_data_t data;
+};
+
+struct fake_io_counters fake_io_counters;
+void (*fake_io_on_idle)(void) = NULL;
+
+static struct fake_io_script script;
+static struct fake_fd fds[FAKE_MAX_FDS];
+// one past the highest fd in use
+static int fds_len = FAKE_FIRST_FD;
+static struct fake_file files[FAKE_MAX_FDS];
+static struct fake_file* free_files = NULL;
+static unsigned short next_client_port = 1024;
+
+void fake_io_init(const struct fake_io_script* s) {
+  script = *s;
+  memset(&fake_io_counters, 0, sizeof(fake_io_counters));
+  memset(fds, 0, sizeof(fds));
+  memset(files, 0, sizeof(files));
+  fds_len = FAKE_FIRST_FD;
+  free_files = NULL;
+  for (int i = FAKE_MAX_FDS - 1; i >= 0; i--) {
+    files[i].next_free = free_files;
+    free_files = &files[i];
+  }
+}
+
+// Opens the lowest free fd, like the kernel does
+int open_fake_fd(struct fake_file* file) {
+  for (int fd = FAKE_FIRST_FD; fd < FAKE_MAX_FDS; fd++) {
+    if (fds[fd].file == NULL) {
+      memset(&fds[fd], 0, sizeof(fds[fd]));
+      fds[fd].file = file;
+      file->n_refs++;
+      if (fd >= fds_len) {
+        fds_len = fd + 1;
+      }
+      fake_io_counters.n_open_fds++;
+      return fd;
+    }
+  }
+  errno = EMFILE;
+  return -1;
+}
+
+// @return the new fd, or -1 with errno set
+int open_fake_file(enum fake_file_kind kind) {
+  if (free_files == NULL) {
+    errno = ENFILE;
+    return -1;
+  }
+  struct fake_file* file = free_files;
+  free_files = file->next_free;
+  memset(file, 0, sizeof(struct fake_file));
+  file->kind = kind;
+
+  int fd = open_fake_fd(file);
+  if (fd < 0) {
+    file->kind = FAKE_FILE_FREE;
+    file->next_free = free_files;
+    free_files = file;
+  }
+  return fd;
+}
+
+// @return the file the fd refers to, or NULL with errno set if it isn't of the given kind
+struct fake_file* fake_file_of(int fd, enum fake_file_kind kind) {
+  if (fd < FAKE_FIRST_FD || fd >= fds_len || fds[fd].file == NULL) {
+    errno = EBADF;
+    return NULL;
+  }
+  if (fds[fd].file->kind != kind) {
+    errno = kind == FAKE_FILE_SOCKET ? ENOTSOCK : EINVAL;
+    return NULL;
+  }
+  return fds[fd].file;
+}
+
+// @return whether the fd is open
+bool fake_fd_is_open(int fd) {
+  if (fd < FAKE_FIRST_FD || fd >= fds_len || fds[fd].file == NULL) {
+    errno = EBADF;
+    return false;
+  }
+  return true;
+}
+
+int fake_io_listen(void) {
+  return open_fake_file(FAKE_FILE_LISTENER);
+}
+
+void fake_io_add_pending_connections(int listening_socket, unsigned int n) {
+  fake_file_of(listening_socket, FAKE_FILE_LISTENER)->n_pending += n;
+}
+
+int io_accept4(int listening_socket, struct sockaddr* addr, socklen_t* addrlen, int flags) {
+  (void)flags;
+  struct fake_file* listener = fake_file_of(listening_socket, FAKE_FILE_LISTENER);
+  if (listener == NULL) {
+    return -1;
+  }
+  if (listener->n_pending == 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  int fd = open_fake_file(FAKE_FILE_SOCKET);
+  if (fd < 0) {
+    return -1;
+  }
+  listener->n_pending--;
+  struct fake_file* client = fds[fd].file;
+  client->is_client = true;
+  client->connected = true;
+  client->incoming = script.from_client;
+  client->incoming_len = script.from_client_len;
+  // the listener defers accepting until the client has sent something, see TCP_DEFER_ACCEPT
+  client->n_arrived = script.chunk_len == 0 || client->incoming_len <= script.chunk_len ? client->incoming_len
+                                                                                          : script.chunk_len;
+  fake_io_counters.n_accepted++;
+
+  if (addr != NULL) {
+    struct sockaddr_in* client_addr = (struct sockaddr_in*)addr;
+    memset(client_addr, 0, sizeof(struct sockaddr_in));
+    client_addr->sin_family = AF_INET;
+    client_addr->sin_addr.s_addr = htonl(0x0a000001);  // 10.0.0.1
+    client_addr->sin_port = htons(next_client_port++);
+    *addrlen = sizeof(struct sockaddr_in);
+  }
+  return fd;
+}
+
+int io_socket(int domain, int type, int protocol) {
+  (void)domain;
+  (void)type;
+  (void)protocol;
+  int fd = open_fake_file(FAKE_FILE_SOCKET);
+  if (fd >= 0) {
+    fds[fd].file->incoming = script.from_target;
+    fds[fd].file->incoming_len = script.from_target_len;
+  }
+  return fd;
+}
+
+// Connects right away, but like a non-blocking socket, the caller learns of it by waiting for writability
+int io_connect(int sock, const struct sockaddr* addr, socklen_t addrlen) {
+  (void)addr;
+  (void)addrlen;
+  struct fake_file* file = fake_file_of(sock, FAKE_FILE_SOCKET);
+  if (file == NULL) {
+    return -1;
+  }
+  file->connected = true;
+  fake_io_counters.n_connected++;
+  errno = EINPROGRESS;
+  return -1;
+}
+
+int io_getpeername(int sock, struct sockaddr* addr, socklen_t* addrlen) {
+  struct fake_file* file = fake_file_of(sock, FAKE_FILE_SOCKET);
+  if (file == NULL) {
+    return -1;
+  }
+  if (!file->connected) {
+    errno = ENOTCONN;
+    return -1;
+  }
+  struct sockaddr_in* peer_addr = (struct sockaddr_in*)addr;
+  memset(peer_addr, 0, sizeof(struct sockaddr_in));
+  peer_addr->sin_family = AF_INET;
+  peer_addr->sin_addr.s_addr = htonl(0x0a000002);  // 10.0.0.2
+  peer_addr->sin_port = htons(443);
+  *addrlen = sizeof(struct sockaddr_in);
+  return 0;
+}
+
+// Reads what has arrived so far, or 0 once the peer sent everything and closed its end
+ssize_t io_read(int fd, void* buf, size_t len) {
+  struct fake_file* file = fake_file_of(fd, FAKE_FILE_SOCKET);
+  if (file == NULL) {
+    return -1;
+  }
+  size_t n_available = file->n_arrived - file->n_read;
+  if (n_available == 0) {
+    if (file->n_read == file->incoming_len) {
+      return 0;
+    }
+    errno = EAGAIN;
+    return -1;
+  }
+
+  if (len > n_available) {
+    len = n_available;
+  }
+  memcpy(buf, file->incoming + file->n_read, len);
+  file->n_read += len;
+  return len;
+}
+
+ssize_t io_send(int sock, const void* buf, size_t len, int flags) {
+  (void)buf;
+  (void)flags;
+  struct fake_file* file = fake_file_of(sock, FAKE_FILE_SOCKET);
+  if (file == NULL) {
+    return -1;
+  }
+  if (file->send_blocked) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  if (script.max_send_len > 0 && len > script.max_send_len) {
+    len = script.max_send_len;
+    file->send_blocked = true;
+  }
+  if (file->is_client) {
+    fake_io_counters.n_bytes_to_clients += len;
+  } else {
+    fake_io_counters.n_bytes_to_targets += len;
+  }
+  return len;
+}
+
+// The benchmark only tunnels TCP
+int io_recvmmsg(int sock, struct mmsghdr* msgs, unsigned int vlen, int flags, struct timespec* timeout) {
+  (void)sock;
+  (void)msgs;
+  (void)vlen;
+  (void)flags;
+  (void)timeout;
+  errno = EOPNOTSUPP;
+  return -1;
+}
+
+int io_sendmmsg(int sock, struct mmsghdr* msgs, unsigned int vlen, int flags) {
+  (void)sock;
+  (void)msgs;
+  (void)vlen;
+  (void)flags;
+  errno = EOPNOTSUPP;
+  return -1;
+}
+
+int io_shutdown(int sock, int how) {
+  (void)how;
+  return fake_file_of(sock, FAKE_FILE_SOCKET) == NULL ? -1 : 0;
+}
+
+int io_dup(int fd) {
+  if (!fake_fd_is_open(fd)) {
+    return -1;
+  }
+  return open_fake_fd(fds[fd].file);
+}
+
+int io_close(int fd) {
+  if (!fake_fd_is_open(fd)) {
+    return -1;
+  }
+  struct fake_file* file = fds[fd].file;
+  memset(&fds[fd], 0, sizeof(fds[fd]));
+  while (fds_len > FAKE_FIRST_FD && fds[fds_len - 1].file == NULL) {
+    fds_len--;
+  }
+  fake_io_counters.n_open_fds--;
+
+  if (--file->n_refs == 0) {
+    file->kind = FAKE_FILE_FREE;
+    file->next_free = free_files;
+    free_files = file;
+  }
+  return 0;
+}
+
+int io_epoll_create1(int flags) {
+  (void)flags;
+  return open_fake_file(FAKE_FILE_EPOLL);
+}
+
+int io_epoll_ctl(int epoll_fd, int op, int fd, struct epoll_event* event) {
+  if (fake_file_of(epoll_fd, FAKE_FILE_EPOLL) == NULL || !fake_fd_is_open(fd)) {
+    return -1;
+  }
+  struct fake_fd* registration = &fds[fd];
+  if (op == EPOLL_CTL_DEL) {
+    registration->registered = false;
+    return 0;
+  }
+  if (op == EPOLL_CTL_ADD && registration->registered) {
+    errno = EEXIST;
+    return -1;
+  }
+  if (op == EPOLL_CTL_MOD && !registration->registered) {
+    errno = ENOENT;
+    return -1;
+  }
+  registration->registered = true;
+  registration->armed = true;
+  registration->events = event->events;
+  registration->data = event->data;
+  return 0;
+}
+
+// The readiness of the fd, as epoll would report it
+uint32_t fake_fd_ready_events(struct fake_file* file) {
+  switch (file->kind) {
+    case FAKE_FILE_LISTENER:
+      return file->n_pending > 0 ? EPOLLIN : 0;
+    case FAKE_FILE_RESOLVER:
+      return EPOLLIN;
+    case FAKE_FILE_SOCKET: {
+      uint32_t events = 0;
+      if (file->n_read < file->n_arrived || (file->connected && file->n_read == file->incoming_len)) {
+        events |= EPOLLIN;
+      }
+      if (file->connected && !file->send_blocked) {
+        events |= EPOLLOUT;
+      }
+      return events;
+    }
+    default:
+      return 0;
+  }
+}
+
+/**
+ * Lets the next chunk of data arrive on every connected socket, and unblocks sockets for sending.
+ * @return whether any data is still on its way
+ */
+bool deliver_next_chunks(void) {
+  bool in_flight = false;
+  for (int fd = FAKE_FIRST_FD; fd < fds_len; fd++) {
+    struct fake_file* file = fds[fd].file;
+    if (file == NULL || file->kind != FAKE_FILE_SOCKET || !file->connected) {
+      continue;
+    }
+    file->send_blocked = false;
+    if (script.chunk_len == 0 || file->incoming_len - file->n_arrived <= script.chunk_len) {
+      file->n_arrived = file->incoming_len;
+    } else {
+      file->n_arrived += script.chunk_len;
+      in_flight = true;
+    }
+  }
+  return in_flight;
+}
+
+int collect_ready_events(struct epoll_event* events, int max_events) {
+  int n_events = 0;
+  for (int fd = FAKE_FIRST_FD; fd < fds_len && n_events < max_events; fd++) {
+    struct fake_fd* registration = &fds[fd];
+    if (registration->file == NULL || !registration->registered || !registration->armed) {
+      continue;
+    }
+    uint32_t ready = fake_fd_ready_events(registration->file) & registration->events;
+    if (ready == 0) {
+      continue;
+    }
+    events[n_events].events = ready;
+    events[n_events].data = registration->data;
+    n_events++;
+    if (registration->events & EPOLLONESHOT) {
+      registration->armed = false;
+    }
+  }
+  return n_events;
+}
+
+// Never blocks: once nothing is ready, `fake_io_on_idle` decides what happens next
+int io_epoll_wait(int epoll_fd, struct epoll_event* events, int max_events, int timeout_ms) {
+  (void)timeout_ms;
+  if (fake_file_of(epoll_fd, FAKE_FILE_EPOLL) == NULL) {
+    return -1;
+  }
+  fake_io_counters.n_wakeups++;
+
+  bool in_flight = deliver_next_chunks();
+  int n_events = collect_ready_events(events, max_events);
+  if (n_events == 0 && !in_flight && fake_io_on_idle != NULL) {
+    fake_io_on_idle();
+    n_events = collect_ready_events(events, max_events);
+  }
+  return n_events;
+}
+
+// Resolves any name to 10.0.0.2 right away
+int io_resolve(const char* node, const char* service, const struct addrinfo* hints) {
+  (void)node;
+  (void)service;
+  (void)hints;
+  return open_fake_file(FAKE_FILE_RESOLVER);
+}
+
+// Allocates the result the way getaddrinfo does, so that freeaddrinfo can release it
+int io_resolve_result(int fd, struct addrinfo** addrs) {
+  io_close(fd);
+
+  struct addrinfo* addr = calloc(1, sizeof(struct addrinfo) + sizeof(struct sockaddr_in));
+  struct sockaddr_in* sockaddr = (struct sockaddr_in*)(addr + 1);
+  sockaddr->sin_family = AF_INET;
+  sockaddr->sin_addr.s_addr = htonl(0x0a000002);
+  sockaddr->sin_port = htons(443);
+  addr->ai_family = AF_INET;
+  addr->ai_socktype = SOCK_STREAM;
+  addr->ai_protocol = IPPROTO_TCP;
+  addr->ai_addrlen = sizeof(struct sockaddr_in);
+  addr->ai_addr = (struct sockaddr*)sockaddr;
+  fake_io_counters.n_allocations++;
+
+  *addrs = addr;
+  return 0;
+}
@@ -0,0 +1,49 @@
+#ifndef HTTPS_PROXY_FAKE_IO_H
+#define HTTPS_PROXY_FAKE_IO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * An in-memory stand-in for the calls in io.h, to run the connection state machine of a single thread without the
+ * kernel: a listening socket with scripted pending connections, clients and targets that send a scripted payload and
+ * then close their end, DNS lookups that resolve right away, and a single epoll instance over all of them.
+ *
+ * Data arrives in chunks, one per socket and wakeup, so reads can be partial, and each send can be capped, after which
+ * the socket isn't writable until the next wakeup.
+ */
+struct fake_io_script {
+  // what each client sends after connecting, including its CONNECT request; and what its target sends back
+  const char* from_client;
+  size_t from_client_len;
+  const char* from_target;
+  size_t from_target_len;
+  // how many bytes arrive per wakeup, and the most a send takes; 0 for no limit
+  size_t chunk_len;
+  size_t max_send_len;
+};
+
+// What the fake kernel saw, summed over all sockets
+struct fake_io_counters {
+  unsigned long long n_wakeups;
+  unsigned long long n_accepted;
+  unsigned long long n_connected;
+  unsigned long long n_bytes_to_clients;
+  unsigned long long n_bytes_to_targets;
+  // made by the fake itself, for DNS results
+  unsigned long long n_allocations;
+  unsigned int n_open_fds;
+};
+
+extern struct fake_io_counters fake_io_counters;
+
+// Called by `io_epoll_wait` once nothing is ready and no data is on its way, e.g. to add connections or stop the loop
+extern void (*fake_io_on_idle)(void);
+
+void fake_io_init(const struct fake_io_script* script);
+
+int fake_io_listen(void);
+
+void fake_io_add_pending_connections(int listening_socket, unsigned int n);
+
+#endif  // HTTPS_PROXY_FAKE_IO_H
@@ -0,0 +1,80 @@
+#ifndef HTTPS_PROXY_TRACE_H
+#define HTTPS_PROXY_TRACE_H
+
+/**
+ * Static tracepoints (USDT probes) of the provider `proxy`, for bpftrace, perf and the like to attach to.
+ * Until something attaches, a probe is a single nop; its arguments are merely made available in registers or memory,
+ * so they should be cheap to compute.
+ *
+ * We use <sys/sdt.h> where it's installed. Otherwise, on x86-64, we emit the same ELF notes ourselves, and elsewhere or
+ * with NO_TRACE the probes compile to nothing.
+ * All arguments are passed as unsigned 64-bit integers; strings are passed as pointers.
+ */
+
+#if !defined(NO_TRACE) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define TRACE_WITH_SYS_SDT
+#endif
+#endif
+
+#if defined(NO_TRACE)
+
+#define TRACE1(name, a1) (void)0
+#define TRACE2(name, a1, a2) (void)0
+#define TRACE3(name, a1, a2, a3) (void)0
+
+#elif defined(TRACE_WITH_SYS_SDT)
+
+#include <sys/sdt.h>
+
+#define TRACE1(name, a1) DTRACE_PROBE1(proxy, name, (unsigned long long)(a1))
+#define TRACE2(name, a1, a2) DTRACE_PROBE2(proxy, name, (unsigned long long)(a1), (unsigned long long)(a2))
+#define TRACE3(name, a1, a2, a3) \
+  DTRACE_PROBE3(proxy, name, (unsigned long long)(a1), (unsigned long long)(a2), (unsigned long long)(a3))
+
+#elif defined(__x86_64__)
+
+// A note in the format of <sys/sdt.h>: the address of the nop, the base to find out where the binary was loaded,
+// no semaphore, and the provider, name and arguments of the probe, e.g., "8@%rax 8@-24(%rbp)"
+#define TRACE_NOTE_(name, args)                                               \
+  "990: nop\n"                                                                \
+  ".pushsection .note.stapsdt,\"?\",\"note\"\n"                               \
+  ".balign 4\n"                                                               \
+  ".4byte 992f-991f, 994f-993f, 3\n"                                          \
+  "991: .asciz \"stapsdt\"\n"                                                 \
+  "992: .balign 4\n"                                                          \
+  "993: .8byte 990b\n"                                                        \
+  ".8byte _.stapsdt.base\n"                                                   \
+  ".8byte 0\n"                                                                \
+  ".asciz \"proxy\"\n"                                                        \
+  ".asciz \"" #name "\"\n"                                                    \
+  ".asciz \"" args "\"\n"                                                     \
+  "994: .balign 4\n"                                                          \
+  ".popsection\n"                                                             \
+  ".ifndef _.stapsdt.base\n"                                                  \
+  ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"     \
+  ".weak _.stapsdt.base\n"                                                    \
+  ".hidden _.stapsdt.base\n"                                                  \
+  "_.stapsdt.base: .space 1\n"                                                \
+  ".size _.stapsdt.base, 1\n"                                                 \
+  ".popsection\n"                                                             \
+  ".endif\n"
+
+#define TRACE_ARG_(n, value) [a##n] "nor"((unsigned long long)(value))
+
+#define TRACE1(name, a1) __asm__ __volatile__(TRACE_NOTE_(name, "8@%[a1]")::TRACE_ARG_(1, a1))
+#define TRACE2(name, a1, a2) \
+  __asm__ __volatile__(TRACE_NOTE_(name, "8@%[a1] 8@%[a2]")::TRACE_ARG_(1, a1), TRACE_ARG_(2, a2))
+#define TRACE3(name, a1, a2, a3) \
+  __asm__ __volatile__(          \
+      TRACE_NOTE_(name, "8@%[a1] 8@%[a2] 8@%[a3]")::TRACE_ARG_(1, a1), TRACE_ARG_(2, a2), TRACE_ARG_(3, a3))
+
+#else
+
+#define TRACE1(name, a1) (void)0
+#define TRACE2(name, a1, a2) (void)0
+#define TRACE3(name, a1, a2, a3) (void)0
+
+#endif
+
+#endif  // HTTPS_PROXY_TRACE_H
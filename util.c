@@ -1,7 +1,10 @@
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <time.h>
 
 #define ERRNO_BUF_SIZE 1024
 
@@ -36,3 +39,45 @@ void die(const char* message) {
   fprintf(stderr, "%s\n", message);
   exit(EXIT_FAILURE);
 }
+
+// Returns the current time of the monotonic clock in microseconds.
+unsigned long long monotonic_time_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Same as above, in nanoseconds, for timing short stretches of code.
+unsigned long long monotonic_time_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Asks the kernel to busy poll the device queue of the socket for up to `busy_poll_us` when there's nothing to read,
+ * rather than to wait for an interrupt. Raising it above the net.core.busy_read sysctl needs CAP_NET_ADMIN.
+ * @return 0 on success; -1 on failure, with errno set
+ */
+int enable_socket_busy_polling(int sock, unsigned int busy_poll_us) {
+  int usecs = busy_poll_us;
+  int enable = 1;
+  if (setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) < 0) {
+    return -1;
+  }
+  return setsockopt(sock, SOL_SOCKET, SO_PREFER_BUSY_POLL, &enable, sizeof(enable));
+}
+
+// FNV-1a
+size_t hash_bytes(const char* bytes, size_t len) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+size_t hash_key(const char* key) {
+  return hash_bytes(key, strlen(key));
+}
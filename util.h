@@ -1,8 +1,15 @@
 #ifndef HTTPS_PROXY_UTIL_H
 #define HTTPS_PROXY_UTIL_H
 
+#include <stddef.h>
+
 char* hsprintf(const char* fmt, ...);
 char* errno2s(int errnum);
 __attribute__((noreturn)) void die(const char* message);
+unsigned long long monotonic_time_us(void);
+unsigned long long monotonic_time_ns(void);
+int enable_socket_busy_polling(int sock, unsigned int busy_poll_us);
+size_t hash_bytes(const char* bytes, size_t len);
+size_t hash_key(const char* key);
 
 #endif  // HTTPS_PROXY_UTIL_H